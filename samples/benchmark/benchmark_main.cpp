@@ -0,0 +1,563 @@
+﻿#include <sdkddkver.h>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <numeric>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <stdexcept>
+
+// https://think-async.com/Asio/index.html
+#define ASIO_STANDALONE
+#include <asio.hpp>
+
+#include "render_engine.h"
+#include "hdr_framebuffer.h"
+#include "striped_png.h"
+#include "image_encoder.h"
+#include "protocol.h"
+
+using hires_clock = std::chrono::high_resolution_clock;
+
+// 計測結果。時間は1回の計測単位(run)あたりの秒数。
+struct BenchmarkResult {
+    std::string name;
+    uint32_t numRepetitions;
+    double minTime;
+    double medianTime;
+    double meanTime;
+    double maxTime;
+    double stddevTime;
+    // 1回のrunで処理する量。中央値の時間で割ってスループットにする。
+    double numItemsPerRun;
+    const char* itemUnit;
+    // 出力サイズなど、時間以外に比較したい値。
+    std::vector<std::pair<std::string, double>> counters;
+};
+
+struct BenchmarkSettings {
+    uint32_t numWarmups = 2;
+    uint32_t numRepetitions = 10;
+    // 名前にこの文字列を含むケースだけを実行する。
+    std::string filter;
+    std::string outputPath = "benchmark_results.json";
+};
+
+// ケースごとにウォームアップの後で同じ処理を繰り返し、時間の分布を取る。
+// 結果はコミット間で差分を取れるよう、実行順に固定の名前でJSONに書き出す。
+class BenchmarkRunner {
+    BenchmarkSettings m_settings;
+    std::vector<BenchmarkResult> m_results;
+
+public:
+    explicit BenchmarkRunner(const BenchmarkSettings &settings) : m_settings(settings) {}
+
+    bool isEnabled(const std::string &name) const {
+        return m_settings.filter.empty() || name.find(m_settings.filter) != std::string::npos;
+    }
+
+    BenchmarkResult* run(
+        const std::string &name, double numItemsPerRun, const char* itemUnit,
+        const std::function<void()> &func) {
+        if (!isEnabled(name))
+            return nullptr;
+
+        for (uint32_t i = 0; i < m_settings.numWarmups; ++i)
+            func();
+
+        const uint32_t numRepetitions = std::max(m_settings.numRepetitions, 1u);
+        std::vector<double> times(numRepetitions);
+        for (uint32_t i = 0; i < numRepetitions; ++i) {
+            const hires_clock::time_point startTp = hires_clock::now();
+            func();
+            times[i] = std::chrono::duration<double>(hires_clock::now() - startTp).count();
+        }
+        std::sort(times.begin(), times.end());
+
+        BenchmarkResult result;
+        result.name = name;
+        result.numRepetitions = numRepetitions;
+        result.minTime = times.front();
+        result.maxTime = times.back();
+        result.medianTime = numRepetitions % 2 == 1 ?
+            times[numRepetitions / 2] :
+            0.5 * (times[numRepetitions / 2 - 1] + times[numRepetitions / 2]);
+        result.meanTime = std::accumulate(times.begin(), times.end(), 0.0) / numRepetitions;
+        double sumSqDiff = 0.0;
+        for (const double time : times)
+            sumSqDiff += (time - result.meanTime) * (time - result.meanTime);
+        result.stddevTime = std::sqrt(sumSqDiff / numRepetitions);
+        result.numItemsPerRun = numItemsPerRun;
+        result.itemUnit = itemUnit;
+
+        const double throughput = numItemsPerRun / std::max(result.medianTime, 1e-12);
+        printf(
+            "%-44s median %10.3f [ms] (min %10.3f, max %10.3f) %12.3f [M%s/s]\n",
+            name.c_str(), 1e+3 * result.medianTime, 1e+3 * result.minTime, 1e+3 * result.maxTime,
+            throughput * 1e-6, itemUnit);
+
+        m_results.push_back(std::move(result));
+        return &m_results.back();
+    }
+
+    void writeJson() const {
+        FILE* fp;
+        if (fopen_s(&fp, m_settings.outputPath.c_str(), "w") != 0) {
+            printf("Failed to open %s.\n", m_settings.outputPath.c_str());
+            return;
+        }
+        fprintf(fp, "{\n");
+        fprintf(fp, "  \"context\": {\n");
+        fprintf(fp, "    \"hardware_concurrency\": %u,\n", std::thread::hardware_concurrency());
+        fprintf(fp, "    \"protocol_version\": %u,\n", static_cast<uint32_t>(g_protocolVersion));
+        fprintf(fp, "    \"warmups\": %u,\n", m_settings.numWarmups);
+        fprintf(fp, "    \"repetitions\": %u\n", m_settings.numRepetitions);
+        fprintf(fp, "  },\n");
+        fprintf(fp, "  \"benchmarks\": [");
+        for (size_t i = 0; i < m_results.size(); ++i) {
+            const BenchmarkResult &result = m_results[i];
+            fprintf(fp, "%s\n    {\n", i > 0 ? "," : "");
+            fprintf(fp, "      \"name\": \"%s\",\n", result.name.c_str());
+            fprintf(fp, "      \"repetitions\": %u,\n", result.numRepetitions);
+            fprintf(fp, "      \"min_ms\": %.6f,\n", 1e+3 * result.minTime);
+            fprintf(fp, "      \"median_ms\": %.6f,\n", 1e+3 * result.medianTime);
+            fprintf(fp, "      \"mean_ms\": %.6f,\n", 1e+3 * result.meanTime);
+            fprintf(fp, "      \"max_ms\": %.6f,\n", 1e+3 * result.maxTime);
+            fprintf(fp, "      \"stddev_ms\": %.6f,\n", 1e+3 * result.stddevTime);
+            for (const auto &[counterName, value] : result.counters)
+                fprintf(fp, "      \"%s\": %.6f,\n", counterName.c_str(), value);
+            fprintf(fp, "      \"items_per_run\": %.0f,\n", result.numItemsPerRun);
+            fprintf(fp, "      \"item_unit\": \"%s\",\n", result.itemUnit);
+            fprintf(
+                fp, "      \"items_per_second\": %.3f\n",
+                result.numItemsPerRun / std::max(result.medianTime, 1e-12));
+            fprintf(fp, "    }");
+        }
+        fprintf(fp, "\n  ]\n}\n");
+        fclose(fp);
+        printf("Wrote %zu results to %s.\n", m_results.size(), m_settings.outputPath.c_str());
+    }
+};
+
+
+
+// usecase2/3と同じ画素の書き込み。レンダリング負荷を模したスリープは含めず、分割と書き込みの費用だけを測る。
+static void runRenderBenchmarks(BenchmarkRunner &runner) {
+    std::vector<uint32_t> threadCounts = { 1, 4, std::max(std::thread::hardware_concurrency(), 1u) };
+    std::sort(threadCounts.begin(), threadCounts.end());
+    threadCounts.erase(std::unique(threadCounts.begin(), threadCounts.end()), threadCounts.end());
+
+    constexpr uint32_t tileSize = 32;
+    for (const uint32_t numThreads : threadCounts) {
+        ThreadPool threadPool(numThreads);
+        TileRenderer renderer(threadPool, tileSize);
+        for (const uint32_t resolution : { 256u, 1024u, 2048u }) {
+            char name[128];
+            sprintf_s(name, "render/fill/%ux%u/threads:%u", resolution, resolution, numThreads);
+            std::vector<RGBA> pixels(resolution * resolution);
+            uint32_t frameIndex = 0;
+            runner.run(
+                name, static_cast<double>(resolution) * resolution, "pixel",
+                [&]() {
+                    renderer.render(
+                        0, 0, resolution, resolution,
+                        [&](const Tile &tile, uint32_t) {
+                            for (uint32_t y = tile.y; y < tile.y + tile.height; ++y) {
+                                for (uint32_t x = tile.x; x < tile.x + tile.width; ++x) {
+                                    RGBA v;
+                                    v.r = x;
+                                    v.g = y;
+                                    v.b = frameIndex;
+                                    v.a = 255;
+                                    pixels[y * resolution + x] = v;
+                                }
+                            }
+                        });
+                    ++frameIndex;
+                });
+        }
+    }
+}
+
+
+
+// 蓄積バッファからRGBA8への解決を命令セットごとに測る。スループットは読み書きするバイト数で数える。
+// 結果がスカラー版と一致しない画素の数も記録する。
+static void runResolveBenchmarks(BenchmarkRunner &runner) {
+    const SimdLevel supportedLevel = getSupportedSimdLevel();
+    printf("Supported SIMD level: %s\n", getSimdLevelName(supportedLevel));
+
+    for (const auto &[width, height] : { std::pair(1920u, 1080u), std::pair(3840u, 2160u) }) {
+        // 暗部から白飛びまで含むよう、指数分布の輝度を画素ごとに数サンプル足す。
+        HdrFramebuffer framebuffer;
+        framebuffer.resize(width, height);
+        uint32_t state = 0x9E3779B9;
+        const auto nextFloat = [&state]() {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return (state >> 8) * (1.0f / (1 << 24));
+        };
+        constexpr uint32_t numSamples = 4;
+        for (uint32_t y = 0; y < height; ++y) {
+            for (uint32_t x = 0; x < width; ++x) {
+                for (uint32_t s = 0; s < numSamples; ++s) {
+                    const float luminance = -std::log(1.0f - nextFloat());
+                    framebuffer.addSample(x, y, luminance * nextFloat(), luminance * nextFloat(), luminance);
+                }
+            }
+        }
+
+        const ResolveSettings settings;
+        std::vector<RGBA> reference(width * height);
+        framebuffer.setSimdLevel(SimdLevel::Scalar);
+        framebuffer.resolve(settings, reference.data());
+
+        std::vector<RGBA> pixels(width * height);
+        // 4平面の読み込みとRGBA8の書き込み。
+        const double numBytes = static_cast<double>(width) * height * (4 * sizeof(float) + sizeof(RGBA));
+        for (const SimdLevel level : { SimdLevel::Scalar, SimdLevel::Avx2, SimdLevel::Avx512 }) {
+            if (level > supportedLevel)
+                continue;
+            char name[128];
+            sprintf_s(name, "resolve/%s/%ux%u", getSimdLevelName(level), width, height);
+            framebuffer.setSimdLevel(level);
+            BenchmarkResult* result = runner.run(
+                name, numBytes, "B",
+                [&]() {
+                    framebuffer.resolve(settings, pixels.data());
+                });
+            if (!result)
+                continue;
+            uint32_t numMismatches = 0;
+            for (size_t i = 0; i < pixels.size(); ++i)
+                numMismatches += std::memcmp(&pixels[i], &reference[i], sizeof(RGBA)) != 0 ? 1 : 0;
+            result->counters.emplace_back("gigabytes_per_second", 1e-9 * numBytes / result->medianTime);
+            result->counters.emplace_back("mismatched_pixels", numMismatches);
+        }
+    }
+}
+
+
+
+// サンプルと同じグラデーションに弱いノイズを足し、実際のレンダリング結果に近い圧縮率にする。
+static std::vector<RGBA> createTestImage(uint32_t width, uint32_t height) {
+    std::vector<RGBA> pixels(width * height);
+    uint32_t state = 0x12345678;
+    for (uint32_t y = 0; y < height; ++y) {
+        for (uint32_t x = 0; x < width; ++x) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            const uint32_t noise = state & 0x7;
+            RGBA v;
+            v.r = (x + noise) & 0xFF;
+            v.g = (y + noise) & 0xFF;
+            v.b = ((x ^ y) >> 2) & 0xFF;
+            v.a = 255;
+            pixels[y * width + x] = v;
+        }
+    }
+    return pixels;
+}
+
+static void runEncodeBenchmarks(BenchmarkRunner &runner) {
+    ThreadPool threadPool;
+    constexpr uint32_t numRowsPerStripe = 32;
+
+    // 出力パイプラインと同じエンコーダーを測る。
+    EncoderSettings encoderSettings;
+    const std::unique_ptr<ImageEncoder> fpngEncoder = createImageEncoder(encoderSettings);
+    encoderSettings.fpngSlower = true;
+    const std::unique_ptr<ImageEncoder> fpngSlowerEncoder = createImageEncoder(encoderSettings);
+    encoderSettings.backend = EncoderBackend::StbPng;
+    const std::unique_ptr<ImageEncoder> stbPngEncoder = createImageEncoder(encoderSettings);
+    encoderSettings.backend = EncoderBackend::StbJpeg;
+    encoderSettings.jpegQuality = 90;
+    const std::unique_ptr<ImageEncoder> stbJpegEncoder = createImageEncoder(encoderSettings);
+
+    for (const uint32_t resolution : { 256u, 1024u }) {
+        const std::vector<RGBA> image = createTestImage(resolution, resolution);
+        const double numBytes = static_cast<double>(image.size() * sizeof(RGBA));
+        std::vector<uint8_t> out;
+
+        // 入力バイト数あたりのスループットと出力サイズを記録する。
+        const auto runEncoder = [&](const char* encoderName, const std::function<void()> &encode) {
+            char name[128];
+            sprintf_s(name, "encode/%s/%ux%u", encoderName, resolution, resolution);
+            BenchmarkResult* result = runner.run(name, numBytes, "B", encode);
+            if (result)
+                result->counters.emplace_back("output_bytes", static_cast<double>(out.size()));
+        };
+
+        runEncoder(
+            "fpng",
+            [&]() {
+                fpngEncoder->encode(image.data(), resolution, resolution, out);
+            });
+        runEncoder(
+            "fpng-slower",
+            [&]() {
+                fpngSlowerEncoder->encode(image.data(), resolution, resolution, out);
+            });
+        runEncoder(
+            "striped-png",
+            [&]() {
+                out.clear();
+                encodeStripedPng(
+                    threadPool, image.data(), resolution, resolution, 4, numRowsPerStripe,
+                    [&out](const uint8_t* data, size_t size) {
+                        out.insert(out.end(), data, data + size);
+                        return true;
+                    });
+            });
+        runEncoder(
+            "stb-png",
+            [&]() {
+                stbPngEncoder->encode(image.data(), resolution, resolution, out);
+            });
+        runEncoder(
+            "stb-jpeg-q90",
+            [&]() {
+                stbJpegEncoder->encode(image.data(), resolution, resolution, out);
+            });
+    }
+}
+
+
+
+// 同期読み書きで応答するループバックのサーバー。usecase3のSessionと同じメッセージを返す。
+class LoopbackServer {
+    asio::io_context m_ioContext;
+    asio::ip::tcp::acceptor m_acceptor;
+    std::thread m_thread;
+
+    void serve(asio::ip::tcp::socket &socket) {
+        MessageReader reader;
+        MessageWriter writer;
+        RenderTaskMessage renderTaskMessage;
+        while (true) {
+            MessageHeader header;
+            WireReader payload;
+            readMessage(socket, reader, header, payload);
+            if (header.type == MessageType::RenderTaskRequest) {
+                RenderTaskRequestMessage request;
+                if (!decodeMessage(header, payload, request))
+                    throw std::runtime_error("Unexpected message.");
+                renderTaskMessage.tasks.resize(std::max(request.numTasks, 1u));
+                for (RenderTask &task : renderTaskMessage.tasks) {
+                    task = RenderTask{};
+                    task.width = 64;
+                    task.height = 64;
+                    task.isValid = true;
+                }
+                writer.encode(renderTaskMessage, header.sequenceID);
+                writeMessage(socket, writer);
+            }
+            else if (header.type == MessageType::TileResult) {
+                TileResultMessage message;
+                if (!decodeMessage(header, payload, message))
+                    throw std::runtime_error("Unexpected message.");
+            }
+            else if (header.type == MessageType::ServerStateRequest) {
+                ServerStateMessage reply;
+                reply.state = ServerState::DataReady;
+                writer.encode(reply, header.sequenceID);
+                writeMessage(socket, writer);
+            }
+            else if (header.type == MessageType::FinishSignal) {
+                return;
+            }
+        }
+    }
+
+public:
+    LoopbackServer() :
+        m_acceptor(m_ioContext, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0)) {
+        m_thread = std::thread(
+            [this]() {
+                try {
+                    asio::ip::tcp::socket socket = m_acceptor.accept();
+                    socket.set_option(asio::ip::tcp::no_delay(true));
+                    serve(socket);
+                }
+                catch (std::exception &e) {
+                    printf("Loopback server: %s\n", e.what());
+                }
+            });
+    }
+    ~LoopbackServer() {
+        m_thread.join();
+    }
+
+    uint16_t getPort() const {
+        return m_acceptor.local_endpoint().port();
+    }
+};
+
+static void runProtocolBenchmarks(BenchmarkRunner &runner) {
+    // ソケットを介さないエンコードとデコードだけの費用。
+    {
+        constexpr uint32_t numMessages = 10000;
+        RenderTaskMessage message;
+        message.tasks.resize(64);
+        for (RenderTask &task : message.tasks) {
+            task = RenderTask{};
+            task.isValid = true;
+        }
+        MessageWriter writer;
+        RenderTaskMessage decoded;
+        std::vector<uint8_t> bytes;
+        runner.run(
+            "protocol/codec/render-task-x64", numMessages, "msg",
+            [&]() {
+                for (uint32_t i = 0; i < numMessages; ++i) {
+                    writer.encode(message, i);
+                    const auto buffers = writer.getBuffers();
+                    bytes.resize(writer.getMessageSize());
+                    asio::buffer_copy(asio::buffer(bytes), buffers);
+                    MessageHeader header = {};
+                    header.type = MessageType::RenderTask;
+                    WireReader payload(bytes.data() + g_messageHeaderSize, bytes.size() - g_messageHeaderSize);
+                    if (!decodeMessage(header, payload, decoded))
+                        throw std::runtime_error("Failed to decode a message.");
+                }
+            });
+    }
+
+    if (!runner.isEnabled("protocol/loopback"))
+        return;
+
+    LoopbackServer server;
+    asio::io_context ioContext;
+    asio::ip::tcp::socket socket(ioContext);
+    socket.connect(asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), server.getPort()));
+    socket.set_option(asio::ip::tcp::no_delay(true));
+    MessageReader reader;
+    MessageWriter writer;
+    uint32_t nextSequenceID = 1;
+
+    // 要求を出して応答を待つ往復を繰り返す。1往復あたりの時間が遅延になる。
+    const auto sendAndWait = [&](const auto &request, auto &reply) {
+        const uint32_t sequenceID = nextSequenceID++;
+        writer.encode(request, sequenceID);
+        writeMessage(socket, writer);
+        MessageHeader header;
+        WireReader payload;
+        readMessage(socket, reader, header, payload);
+        if (header.sequenceID != sequenceID || !decodeMessage(header, payload, reply))
+            throw std::runtime_error("Unexpected reply.");
+    };
+
+    for (const uint32_t numTasks : { 1u, 16u }) {
+        constexpr uint32_t numRoundTrips = 1000;
+        char name[128];
+        sprintf_s(name, "protocol/loopback/round-trip/render-task-x%u", numTasks);
+        RenderTaskRequestMessage request;
+        request.numTasks = numTasks;
+        request.numSamples = 0;
+        RenderTaskMessage reply;
+        BenchmarkResult* result = runner.run(
+            name, numRoundTrips, "msg",
+            [&]() {
+                for (uint32_t i = 0; i < numRoundTrips; ++i)
+                    sendAndWait(request, reply);
+            });
+        if (result)
+            result->counters.emplace_back("round_trip_us", 1e+6 * result->medianTime / numRoundTrips);
+    }
+
+    // 応答を待たずにタイルを送り続け、最後の往復で受信側が全て読み終えたことを確かめる。
+    {
+        constexpr uint32_t numTiles = 1000;
+        constexpr uint32_t tileSize = 64;
+        std::vector<RGBA> pixels(tileSize * tileSize);
+        TileResultMessage tile = {};
+        tile.width = tileSize;
+        tile.height = tileSize;
+        tile.encoding = TileEncoding::Raw;
+        tile.data = reinterpret_cast<const uint8_t*>(pixels.data());
+        tile.dataSize = static_cast<uint32_t>(pixels.size() * sizeof(RGBA));
+        ServerStateMessage state;
+        runner.run(
+            "protocol/loopback/stream/tile-64x64-raw", static_cast<double>(numTiles) * tile.dataSize, "B",
+            [&]() {
+                for (uint32_t i = 0; i < numTiles; ++i) {
+                    // クライアントと同じく画素はコピーせずに送る。pixelsはこの計測の間保持している。
+                    writer.encodeWithExternalBody(tile, 0, nullptr);
+                    writeMessage(socket, writer);
+                }
+                sendAndWait(ServerStateRequestMessage{}, state);
+            });
+    }
+
+    writer.encode(FinishSignalMessage{}, 0);
+    writeMessage(socket, writer);
+}
+
+
+
+int32_t main(int32_t argc, const char* argv[]) {
+    BenchmarkSettings settings;
+    for (int argIdx = 1; argIdx < argc; ++argIdx) {
+        std::string_view arg = argv[argIdx];
+        if (arg == "--warmup") {
+            if (argIdx + 1 >= argc) {
+                printf("--warmup requires a number of runs.\n");
+                return -1;
+            }
+            settings.numWarmups = static_cast<uint32_t>(atoi(argv[argIdx + 1]));
+            argIdx += 1;
+        }
+        else if (arg == "--repetitions") {
+            if (argIdx + 1 >= argc) {
+                printf("--repetitions requires a number of runs.\n");
+                return -1;
+            }
+            settings.numRepetitions = static_cast<uint32_t>(atoi(argv[argIdx + 1]));
+            argIdx += 1;
+        }
+        else if (arg == "--filter") {
+            if (argIdx + 1 >= argc) {
+                printf("--filter requires a part of benchmark names.\n");
+                return -1;
+            }
+            settings.filter = argv[argIdx + 1];
+            argIdx += 1;
+        }
+        else if (arg == "--output") {
+            if (argIdx + 1 >= argc) {
+                printf("--output requires a JSON filename.\n");
+                return -1;
+            }
+            settings.outputPath = argv[argIdx + 1];
+            argIdx += 1;
+        }
+        else {
+            printf("Unknown argument %s.\n", argv[argIdx]);
+            return -1;
+        }
+    }
+
+    try {
+        BenchmarkRunner runner(settings);
+        runRenderBenchmarks(runner);
+        runResolveBenchmarks(runner);
+        runEncodeBenchmarks(runner);
+        runProtocolBenchmarks(runner);
+        runner.writeJson();
+    }
+    catch (std::exception &e) {
+        printf("%s\n", e.what());
+        return -1;
+    }
+
+    return 0;
+}
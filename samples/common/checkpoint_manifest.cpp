@@ -0,0 +1,175 @@
+﻿#include "checkpoint_manifest.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+
+#if defined(_WIN32)
+#   include <io.h>
+#else
+#   include <unistd.h>
+#endif
+
+#include "content_hash.h"
+
+// 行の本体(チェックサムの直前の空白まで)のハッシュ。
+static uint64_t computeLineChecksum(const char* line, size_t length) {
+    return computeContentHash(line, length, 0x6d616e6966657374ull);
+}
+
+
+
+CheckpointManifest::CheckpointManifest() :
+    m_params{}, m_fp(nullptr), m_syncBatchSize(16), m_syncInterval(1.0), m_numUnsyncedRecords(0),
+    m_numLoadedRecords(0), m_numDiscardedLines(0), m_numAppendedRecords(0), m_numSyncs(0) {
+}
+
+CheckpointManifest::~CheckpointManifest() {
+    close();
+}
+
+uint64_t CheckpointManifest::computeParamHash(uint32_t frameIndex) const {
+    // 構造体のパディングを含めないよう、値を並べ直してからハッシュを取る。
+    const uint32_t values[] = {
+        frameIndex, m_params.width, m_params.height,
+        static_cast<uint32_t>(m_params.sceneHash), static_cast<uint32_t>(m_params.sceneHash >> 32)
+    };
+    return computeContentHash(values, sizeof(values));
+}
+
+void CheckpointManifest::load() {
+    FILE* fp;
+    if (fopen_s(&fp, m_path.c_str(), "rb") != 0)
+        return;
+
+    std::string contents;
+    char buffer[4096];
+    size_t numRead;
+    while ((numRead = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        contents.append(buffer, numRead);
+    fclose(fp);
+
+    size_t begin = 0;
+    while (begin < contents.size()) {
+        const size_t end = contents.find('\n', begin);
+        // 改行で終わっていない最後の行は書きかけ。
+        if (end == std::string::npos) {
+            ++m_numDiscardedLines;
+            break;
+        }
+        const std::string line = contents.substr(begin, end - begin);
+        begin = end + 1;
+
+        // "<frame> <param hash> <file size> <filename> <checksum>"
+        const size_t checksumPos = line.rfind(' ');
+        if (checksumPos == std::string::npos) {
+            ++m_numDiscardedLines;
+            continue;
+        }
+        char* parseEnd;
+        const uint64_t checksum = strtoull(line.c_str() + checksumPos + 1, &parseEnd, 16);
+        if (checksum != computeLineChecksum(line.c_str(), checksumPos)) {
+            ++m_numDiscardedLines;
+            continue;
+        }
+        const char* str = line.c_str();
+        const uint32_t frameIndex = static_cast<uint32_t>(strtoul(str, &parseEnd, 10));
+        Entry entry;
+        entry.paramHash = strtoull(parseEnd, &parseEnd, 16);
+        entry.fileSize = strtoull(parseEnd, &parseEnd, 10);
+        while (*parseEnd == ' ')
+            ++parseEnd;
+        const size_t filenamePos = static_cast<size_t>(parseEnd - str);
+        entry.filename = line.substr(filenamePos, checksumPos - std::min(filenamePos, checksumPos));
+        m_loadedEntries[frameIndex] = std::move(entry);
+        ++m_numLoadedRecords;
+    }
+
+    // 書きかけの行の後ろに続けて書かないよう改行を足す。次回はその行ごと捨てられる。
+    if (!contents.empty() && contents.back() != '\n')
+        fputc('\n', m_fp);
+}
+
+void CheckpointManifest::open(
+    const std::string &path, const CheckpointParams &params, uint32_t syncBatchSize, double syncInterval) {
+    close();
+    m_path = path;
+    m_params = params;
+    m_syncBatchSize = std::max(syncBatchSize, 1u);
+    m_syncInterval = syncInterval;
+    m_loadedEntries.clear();
+
+    if (fopen_s(&m_fp, path.c_str(), "ab") != 0) {
+        m_fp = nullptr;
+        char msg[512];
+        sprintf_s(msg, "Failed to open the checkpoint manifest %s.\n", path.c_str());
+        throw std::runtime_error(msg);
+    }
+    load();
+    m_lastSyncTp = clock::now();
+}
+
+void CheckpointManifest::sync() {
+    fflush(m_fp);
+#if defined(_WIN32)
+    _commit(_fileno(m_fp));
+#else
+    fdatasync(fileno(m_fp));
+#endif
+    m_numUnsyncedRecords = 0;
+    m_lastSyncTp = clock::now();
+    ++m_numSyncs;
+}
+
+void CheckpointManifest::close() {
+    std::lock_guard lock(m_mutex);
+    if (!m_fp)
+        return;
+    if (m_numUnsyncedRecords > 0)
+        sync();
+    fclose(m_fp);
+    m_fp = nullptr;
+}
+
+bool CheckpointManifest::isFrameDone(uint32_t frameIndex) const {
+    std::lock_guard lock(m_mutex);
+    const auto it = m_loadedEntries.find(frameIndex);
+    if (it == m_loadedEntries.end() || it->second.paramHash != computeParamHash(frameIndex))
+        return false;
+    std::error_code ec;
+    const uintmax_t fileSize = std::filesystem::file_size(it->second.filename, ec);
+    return !ec && fileSize == it->second.fileSize;
+}
+
+void CheckpointManifest::recordFrame(uint32_t frameIndex, const char* filename, uint64_t fileSize) {
+    std::lock_guard lock(m_mutex);
+    if (!m_fp)
+        return;
+
+    char line[512];
+    const int length = sprintf_s(
+        line, "%u %016llx %llu %s",
+        frameIndex, static_cast<unsigned long long>(computeParamHash(frameIndex)),
+        static_cast<unsigned long long>(fileSize), filename);
+    fprintf(
+        m_fp, "%s %016llx\n",
+        line, static_cast<unsigned long long>(computeLineChecksum(line, length)));
+    // プロセスが落ちても残るよう、記録ごとにOSへ渡す。
+    fflush(m_fp);
+    ++m_numAppendedRecords;
+    ++m_numUnsyncedRecords;
+
+    const double timeSinceSync = std::chrono::duration_cast<std::chrono::microseconds>(
+        clock::now() - m_lastSyncTp).count() * 1e-6;
+    if (m_numUnsyncedRecords >= m_syncBatchSize || timeSinceSync >= m_syncInterval)
+        sync();
+}
+
+void CheckpointManifest::printStats() const {
+    std::lock_guard lock(m_mutex);
+    printf(
+        "Checkpoint %s: loaded %u records (%u broken lines discarded), appended %u records in %u syncs\n",
+        m_path.c_str(), m_numLoadedRecords, m_numDiscardedLines, m_numAppendedRecords, m_numSyncs);
+}
@@ -0,0 +1,81 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <map>
+#include <mutex>
+#include <chrono>
+
+// 出力画像を決める描画条件。これが前回と変わった場合は書き出し済みの記録を使わない。
+// 記録と照合するのはフレーム番号とこの条件だけで、サンプル数やエンコーダーの設定は含めない。
+struct CheckpointParams {
+    uint32_t width;
+    uint32_t height;
+    // シーンデータの内容のハッシュ。シーンを使わない場合は0。
+    uint64_t sceneHash;
+};
+
+// 書き出し済みのフレームを追記だけで記録するファイル。途中で落ちて再起動した場合に、書き出し済みのフレームを飛ばす。
+// 記録の単位はフレーム全体で、画像ファイルを書き終えたフレームだけを記録する。
+// 組み立て中のタイルや描画中・エンコード中のフレームは記録しないので、再起動後はそれらを最初から描き直す。
+// 1行が1フレームで、フレーム番号、描画条件のハッシュ、画像ファイルの大きさ、ファイル名と行のチェックサムを持つ。
+// 記録は1件ごとにOSへ渡し、fsyncは何件かごとか一定時間ごとにまとめて行う。
+// 書きかけの最後の行やチェックサムの合わない行は読み込み時に捨てる。
+// 画像ファイル自体はfsyncしないので、電源断では記録に対して画像が欠けることがある。
+// そのため読み込んだ記録は画像ファイルが記録どおりの大きさで残っている場合だけ使う。
+class CheckpointManifest {
+    using clock = std::chrono::steady_clock;
+
+    struct Entry {
+        uint64_t paramHash;
+        uint64_t fileSize;
+        std::string filename;
+    };
+
+    std::string m_path;
+    CheckpointParams m_params;
+    // 読み込んだ記録。同じフレームが複数ある場合は後のものを使う。
+    std::map<uint32_t, Entry> m_loadedEntries;
+    FILE* m_fp;
+    uint32_t m_syncBatchSize;
+    double m_syncInterval;
+    uint32_t m_numUnsyncedRecords;
+    clock::time_point m_lastSyncTp;
+
+    uint32_t m_numLoadedRecords;
+    uint32_t m_numDiscardedLines;
+    uint32_t m_numAppendedRecords;
+    uint32_t m_numSyncs;
+    mutable std::mutex m_mutex;
+
+    uint64_t computeParamHash(uint32_t frameIndex) const;
+    void load();
+    void sync();
+
+public:
+    CheckpointManifest();
+    ~CheckpointManifest();
+
+    CheckpointManifest(const CheckpointManifest &) = delete;
+    CheckpointManifest &operator=(const CheckpointManifest &) = delete;
+
+    // 既存の記録を読み込んで追記用に開く。開けない場合は例外を投げる。
+    // syncBatchSize件ごとか、前回からsyncInterval[s]経った後の記録でfsyncする。
+    void open(
+        const std::string &path, const CheckpointParams &params,
+        uint32_t syncBatchSize = 16, double syncInterval = 1.0);
+    // 未同期の記録をfsyncして閉じる。
+    void close();
+
+    bool isOpen() const {
+        return m_fp != nullptr;
+    }
+    // frameIndexが同じ描画条件で書き出し済みで、画像ファイルが記録どおりに残っているか。
+    bool isFrameDone(uint32_t frameIndex) const;
+    // 画像ファイルを書き終えた後に呼ぶ。どのスレッドから呼んでもよい。
+    // フレームの一部だけを記録する手段は無く、描きかけのタイルは再起動で失われる。
+    void recordFrame(uint32_t frameIndex, const char* filename, uint64_t fileSize);
+
+    void printStats() const;
+};
@@ -0,0 +1,92 @@
+﻿#include "content_hash.h"
+
+#include <cstring>
+
+static constexpr uint64_t prime1 = 0x9E3779B185EBCA87ull;
+static constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+static constexpr uint64_t prime3 = 0x165667B19E3779F9ull;
+static constexpr uint64_t prime4 = 0x85EBCA77C2B2AE63ull;
+static constexpr uint64_t prime5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64_t rotl(uint64_t v, uint32_t r) {
+    return (v << r) | (v >> (64 - r));
+}
+
+// リトルエンディアンの環境だけを想定する。
+static inline uint64_t readU64(const uint8_t* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t readU32(const uint8_t* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t round(uint64_t acc, uint64_t input) {
+    acc += input * prime2;
+    acc = rotl(acc, 31);
+    return acc * prime1;
+}
+
+static inline uint64_t mergeRound(uint64_t acc, uint64_t v) {
+    acc ^= round(0, v);
+    return acc * prime1 + prime4;
+}
+
+uint64_t computeContentHash(const void* data, size_t size, uint64_t seed) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const uint8_t* const end = p + size;
+
+    uint64_t h;
+    if (size >= 32) {
+        // 4本の独立した積算に分けて命令レベルの並列性を稼ぐ。
+        uint64_t v1 = seed + prime1 + prime2;
+        uint64_t v2 = seed + prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - prime1;
+        const uint8_t* const limit = end - 32;
+        do {
+            v1 = round(v1, readU64(p));
+            v2 = round(v2, readU64(p + 8));
+            v3 = round(v3, readU64(p + 16));
+            v4 = round(v4, readU64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = mergeRound(h, v1);
+        h = mergeRound(h, v2);
+        h = mergeRound(h, v3);
+        h = mergeRound(h, v4);
+    }
+    else {
+        h = seed + prime5;
+    }
+    h += static_cast<uint64_t>(size);
+
+    while (end - p >= 8) {
+        h ^= round(0, readU64(p));
+        h = rotl(h, 27) * prime1 + prime4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        h ^= static_cast<uint64_t>(readU32(p)) * prime1;
+        h = rotl(h, 23) * prime2 + prime3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= static_cast<uint64_t>(*p) * prime5;
+        h = rotl(h, 11) * prime1;
+        ++p;
+    }
+
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,8 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// xxHash64 (https://github.com/Cyan4973/xxHash) 互換の64bitハッシュ。
+// 暗号学的な強度は無いので、転送エラーや内容の同一性の確認にだけ使う。
+uint64_t computeContentHash(const void* data, size_t size, uint64_t seed = 0);
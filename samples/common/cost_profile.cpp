@@ -0,0 +1,147 @@
+﻿#include "cost_profile.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <numeric>
+
+bool loadFrameCostProfile(const char* path, uint32_t numFrames, std::vector<double> &costs) {
+    FILE* fp;
+    if (fopen_s(&fp, path, "r") != 0) {
+        printf("Failed to open the cost profile %s.\n", path);
+        return false;
+    }
+
+    costs.assign(numFrames, -1.0);
+    double sumCosts = 0.0;
+    uint32_t numEntries = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        char* end;
+        const unsigned long frameIndex = strtoul(line, &end, 10);
+        if (end == line || *end != ',')
+            continue;
+        const char* costStr = end + 1;
+        const double cost = strtod(costStr, &end);
+        if (end == costStr || cost < 0.0 || frameIndex >= numFrames)
+            continue;
+        if (costs[frameIndex] < 0.0) {
+            sumCosts += cost;
+            ++numEntries;
+        }
+        else {
+            sumCosts += cost - costs[frameIndex];
+        }
+        costs[frameIndex] = cost;
+    }
+    fclose(fp);
+
+    if (numEntries == 0) {
+        printf("No frame costs in %s.\n", path);
+        return false;
+    }
+    const double meanCost = sumCosts / numEntries;
+    for (double &cost : costs) {
+        if (cost < 0.0)
+            cost = meanCost;
+    }
+    if (numEntries < numFrames)
+        printf("The cost profile %s lacks %u frames, use the mean cost.\n", path, numFrames - numEntries);
+
+    return true;
+}
+
+bool writeFrameCostProfile(const char* path, const std::vector<double> &costs) {
+    FILE* fp;
+    if (fopen_s(&fp, path, "w") != 0) {
+        printf("Failed to open %s.\n", path);
+        return false;
+    }
+    fprintf(fp, "frame,cost\n");
+    for (uint32_t frameIdx = 0; frameIdx < costs.size(); ++frameIdx) {
+        if (costs[frameIdx] >= 0.0)
+            fprintf(fp, "%u,%.6f\n", frameIdx, costs[frameIdx]);
+    }
+    fclose(fp);
+    return true;
+}
+
+std::vector<std::vector<uint32_t>> partitionFrames(
+    const std::vector<uint32_t> &frames, const std::vector<double> &costs, uint32_t numPartitions) {
+    numPartitions = std::max(numPartitions, 1u);
+    std::vector<uint32_t> sortedFrames = frames;
+    // 同じコストのフレームは番号順に並べて結果を決定的にする。
+    std::stable_sort(
+        sortedFrames.begin(), sortedFrames.end(),
+        [&costs](uint32_t a, uint32_t b) {
+            return costs[a] > costs[b];
+        });
+
+    std::vector<std::vector<uint32_t>> partitions(numPartitions);
+    std::vector<double> loads(numPartitions, 0.0);
+    for (const uint32_t frameIndex : sortedFrames) {
+        const uint32_t partIdx = static_cast<uint32_t>(
+            std::min_element(loads.begin(), loads.end()) - loads.begin());
+        partitions[partIdx].push_back(frameIndex);
+        loads[partIdx] += costs[frameIndex];
+    }
+    for (std::vector<uint32_t> &partition : partitions)
+        std::sort(partition.begin(), partition.end());
+
+    return partitions;
+}
+
+double computeImbalance(const std::vector<double> &loads) {
+    if (loads.empty())
+        return 0.0;
+    const double meanLoad = std::accumulate(loads.begin(), loads.end(), 0.0) / loads.size();
+    if (meanLoad <= 0.0)
+        return 0.0;
+    return *std::max_element(loads.begin(), loads.end()) / meanLoad - 1.0;
+}
+
+bool parseFrameList(std::string_view str, std::vector<uint32_t> &frames) {
+    frames.clear();
+    while (!str.empty()) {
+        const size_t commaPos = str.find(',');
+        const std::string item(str.substr(0, commaPos));
+        str = commaPos == std::string_view::npos ? std::string_view() : str.substr(commaPos + 1);
+
+        char* end;
+        const unsigned long first = strtoul(item.c_str(), &end, 10);
+        if (end == item.c_str())
+            return false;
+        unsigned long last = first;
+        if (*end == '-') {
+            const char* lastStr = end + 1;
+            last = strtoul(lastStr, &end, 10);
+            if (end == lastStr || last < first)
+                return false;
+        }
+        if (*end != '\0')
+            return false;
+        for (unsigned long frameIndex = first; frameIndex <= last; ++frameIndex)
+            frames.push_back(static_cast<uint32_t>(frameIndex));
+    }
+    return !frames.empty();
+}
+
+std::string formatFrameList(const std::vector<uint32_t> &frames) {
+    std::string str;
+    char item[32];
+    for (size_t i = 0; i < frames.size();) {
+        // 連続する番号は範囲にまとめる。
+        size_t j = i;
+        while (j + 1 < frames.size() && frames[j + 1] == frames[j] + 1)
+            ++j;
+        if (j > i)
+            sprintf_s(item, "%u-%u", frames[i], frames[j]);
+        else
+            sprintf_s(item, "%u", frames[i]);
+        if (!str.empty())
+            str += ',';
+        str += item;
+        i = j + 1;
+    }
+    return str;
+}
@@ -0,0 +1,29 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <string_view>
+
+// フレームごとの相対的な描画コスト。
+// ファイルは"frame,cost"の行を並べたCSVで、見出しなど数値で始まらない行は読み飛ばす。
+// 前回の実行の所要時間を記録したものでも、低解像度の下見で測ったものでもよく、単位は問わない。
+
+// numFrames個のコストを読む。記載の無いフレームは記載されたフレームの平均とする。
+// ファイルが開けないか有効な行が無い場合はfalseを返す。
+// 複数のノードが書いたプロファイルを連結したファイルも読める。同じフレームが複数ある場合は後の行を使う。
+bool loadFrameCostProfile(const char* path, uint32_t numFrames, std::vector<double> &costs);
+// フレーム番号で引くコストを書き出す。負の値のフレームは書かない。
+bool writeFrameCostProfile(const char* path, const std::vector<double> &costs);
+
+// framesをnumPartitions個に分ける。コストの高いフレームから順に、その時点で合計の最も小さいパーティションに割り当てる。
+// 同じ入力からは常に同じ結果になるので、各ノードが通信せずに計算しても重複や欠けが出ない。
+// 各パーティションのフレームは番号順に並べて返す。
+std::vector<std::vector<uint32_t>> partitionFrames(
+    const std::vector<uint32_t> &frames, const std::vector<double> &costs, uint32_t numPartitions);
+// 最大の負荷が平均をどれだけ上回るか。0なら完全に均等。
+double computeImbalance(const std::vector<double> &loads);
+
+// "0-3,8,10-12"の形式。空白は許さない。
+bool parseFrameList(std::string_view str, std::vector<uint32_t> &frames);
+std::string formatFrameList(const std::vector<uint32_t> &frames);
@@ -0,0 +1,109 @@
+﻿#include "deadline_scheduler.h"
+
+#include <cstdio>
+#include <algorithm>
+
+static double toSeconds(std::chrono::high_resolution_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count() * 1e-6;
+}
+
+DeadlineScheduler::DeadlineScheduler(clock::time_point appStartTp, const Settings &settings, uint32_t numSlots) :
+    m_appStartTp(appStartTp), m_settings(settings),
+    m_timePerSample(0.0), m_overheadPerFrame(0.0), m_hasMeasurement(false),
+    m_numSlots(std::max(numSlots, 1u)), m_lastReportTps(m_numSlots), m_hasLastReports(m_numSlots, false),
+    m_lastNumSamples(0) {
+    m_settings.minNumSamples = std::max(m_settings.minNumSamples, 1u);
+    m_settings.maxNumSamples = std::max(m_settings.maxNumSamples, m_settings.minNumSamples);
+}
+
+uint32_t DeadlineScheduler::decideNumSamples(uint32_t frameIndex, uint32_t numRemainingFrames) {
+    std::lock_guard lock(m_mutex);
+
+    const double elapsedTime = toSeconds(clock::now() - m_appStartTp);
+    const double remainingBudget = m_settings.timeLimit - m_settings.safetyMargin - elapsedTime;
+    numRemainingFrames = std::max(numRemainingFrames, 1u);
+    // 各スロットが順に描くフレーム数。残りがスロット数より少なければ空くスロットが出る。
+    const double numFramesPerSlot =
+        static_cast<double>(numRemainingFrames) / std::min(m_numSlots, numRemainingFrames);
+
+    // 実測が無いうちは最大品質で始める。
+    uint32_t numSamples = m_settings.maxNumSamples;
+    if (m_hasMeasurement) {
+        const double budgetPerFrame = remainingBudget / numFramesPerSlot - m_overheadPerFrame;
+        const double affordable = m_timePerSample > 0 ? budgetPerFrame / m_timePerSample : m_settings.maxNumSamples;
+        numSamples = static_cast<uint32_t>(std::clamp(
+            affordable,
+            static_cast<double>(m_settings.minNumSamples), static_cast<double>(m_settings.maxNumSamples)));
+    }
+
+    Decision decision;
+    decision.frameIndex = frameIndex;
+    decision.elapsedTime = elapsedTime;
+    decision.numRemainingFrames = numRemainingFrames;
+    decision.remainingBudget = remainingBudget;
+    decision.timePerSample = m_timePerSample;
+    decision.overheadPerFrame = m_overheadPerFrame;
+    decision.numSamples = numSamples;
+    decision.predictedFinishTime =
+        elapsedTime + numFramesPerSlot * (m_overheadPerFrame + numSamples * m_timePerSample);
+    m_decisions.push_back(decision);
+
+    if (numSamples != m_lastNumSamples) {
+        printf(
+            "Scheduler: frame %u -> %u spp (remaining %u frames, budget %.3f [s], predicted finish %.3f [s])\n",
+            frameIndex, numSamples, numRemainingFrames, remainingBudget,
+            m_hasMeasurement ? decision.predictedFinishTime : 0.0);
+        m_lastNumSamples = numSamples;
+    }
+
+    return numSamples;
+}
+
+void DeadlineScheduler::reportFrameTime(uint32_t numSamples, clock::duration renderTime, uint32_t slotIndex) {
+    std::lock_guard lock(m_mutex);
+
+    slotIndex = std::min(slotIndex, m_numSlots - 1);
+    const clock::time_point now = clock::now();
+    const double renderTimeInSec = toSeconds(renderTime);
+    // 同じスロットの前回報告からの間隔のうちレンダリング以外の時間(エンコード待ちや通信)をオーバーヘッドとみなす。
+    // 他のスロットの報告と混ぜると間隔が重なり、オーバーヘッドを過小に見積もる。
+    const double interval =
+        m_hasLastReports[slotIndex] ? toSeconds(now - m_lastReportTps[slotIndex]) : renderTimeInSec;
+    const double timePerSample = renderTimeInSec / std::max(numSamples, 1u);
+    const double overhead = std::max(interval - renderTimeInSec, 0.0);
+
+    constexpr double alpha = 0.3;
+    if (m_hasMeasurement) {
+        m_timePerSample += alpha * (timePerSample - m_timePerSample);
+        m_overheadPerFrame += alpha * (overhead - m_overheadPerFrame);
+    }
+    else {
+        m_timePerSample = timePerSample;
+        m_overheadPerFrame = overhead;
+        m_hasMeasurement = true;
+    }
+
+    m_lastReportTps[slotIndex] = now;
+    m_hasLastReports[slotIndex] = true;
+}
+
+void DeadlineScheduler::writeLog(const char* filename) const {
+    std::lock_guard lock(m_mutex);
+
+    FILE* fp;
+    if (fopen_s(&fp, filename, "w") != 0) {
+        printf("Failed to open %s.\n", filename);
+        return;
+    }
+    fprintf(
+        fp,
+        "frame,elapsed_s,remaining_frames,remaining_budget_s,"
+        "time_per_sample_s,overhead_per_frame_s,spp,predicted_finish_s\n");
+    for (const Decision &decision : m_decisions) {
+        fprintf(
+            fp, "%u,%.6f,%u,%.6f,%.6f,%.6f,%u,%.6f\n",
+            decision.frameIndex, decision.elapsedTime, decision.numRemainingFrames, decision.remainingBudget,
+            decision.timePerSample, decision.overheadPerFrame, decision.numSamples, decision.predictedFinishTime);
+    }
+    fclose(fp);
+}
@@ -0,0 +1,59 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <chrono>
+#include <mutex>
+
+// 制限時間(300秒)内に全フレームを出し切るためにフレームごとのサンプル数を調整する。
+// フレーム間隔を「サンプル数に比例するレンダリング時間 + それ以外のオーバーヘッド」としてモデル化し、
+// 実測値の指数移動平均から残りフレームを締め切りまでに終えられる最大のサンプル数を選ぶ。
+// 複数のスロットが同時に描く場合は、報告の間隔をスロットごとに測り、残りフレームをスロット数で分けて見積もる。
+class DeadlineScheduler {
+public:
+    using clock = std::chrono::high_resolution_clock;
+
+    struct Settings {
+        double timeLimit = 300.0; // [s]
+        double safetyMargin = 20.0; // [s]
+        uint32_t minNumSamples = 1;
+        uint32_t maxNumSamples = 16;
+    };
+
+private:
+    struct Decision {
+        uint32_t frameIndex;
+        double elapsedTime;
+        uint32_t numRemainingFrames;
+        double remainingBudget;
+        double timePerSample;
+        double overheadPerFrame;
+        uint32_t numSamples;
+        double predictedFinishTime;
+    };
+
+    clock::time_point m_appStartTp;
+    Settings m_settings;
+    double m_timePerSample;
+    double m_overheadPerFrame;
+    bool m_hasMeasurement;
+    uint32_t m_numSlots;
+    // スロットごとの前回報告の時刻。
+    std::vector<clock::time_point> m_lastReportTps;
+    std::vector<bool> m_hasLastReports;
+    uint32_t m_lastNumSamples;
+    std::vector<Decision> m_decisions;
+    mutable std::mutex m_mutex;
+
+public:
+    // numSlotsは同時にフレーム(タスク)を描くスロットの数。
+    DeadlineScheduler(clock::time_point appStartTp, const Settings &settings, uint32_t numSlots = 1);
+
+    // numRemainingFramesはこれから描くフレームを含む残りフレーム数で、全スロットの合計。
+    uint32_t decideNumSamples(uint32_t frameIndex, uint32_t numRemainingFrames);
+    // renderTimeはそのスロットで1フレームを描いた時間で、他のスロットと重なっていてもよい。
+    void reportFrameTime(uint32_t numSamples, clock::duration renderTime, uint32_t slotIndex = 0);
+
+    // 判断の履歴をCSVで書き出す。
+    void writeLog(const char* filename) const;
+};
@@ -0,0 +1,450 @@
+﻿#include "frame_pipeline.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+#include "striped_png.h"
+#include "trace.h"
+
+static void getOutputFilename(uint32_t frameIndex, const char* extension, char (&filename)[256]) {
+    // 3桁連番で画像出力。
+    sprintf_s(filename, "%03u.%s", frameIndex, extension);
+}
+
+FramePipeline::FramePipeline(uint32_t numFramebuffers, uint32_t numEncoderThreads) :
+    m_maxNumEncodedFrames(std::max(numFramebuffers, 1u)), m_numEncodingFrames(0),
+    m_stripeThreadPool(nullptr), m_numRowsPerStripe(0), m_deferFirstTouch(false), m_quit(false),
+    m_encoder(createImageEncoder(EncoderSettings{})), m_encodeTimeBudget(0.0), m_isSelectingEncoder(false),
+    m_checkpoint(nullptr), m_crashAfterNumFrames(0),
+    m_renderStats{}, m_encodeStats{}, m_writeStats{} {
+    numFramebuffers = std::max(numFramebuffers, 1u);
+    m_frames.resize(numFramebuffers);
+    for (uint32_t i = 0; i < numFramebuffers; ++i) {
+        m_frames[i] = std::make_unique<Frame>();
+        m_freeFrames.push_back(m_frames[i].get());
+    }
+
+    m_startTp = clock::now();
+    numEncoderThreads = std::max(numEncoderThreads, 1u);
+    for (uint32_t i = 0; i < numEncoderThreads; ++i)
+        m_encoderThreads.emplace_back(&FramePipeline::encoderLoop, this);
+    m_writerThread = std::thread(&FramePipeline::writerLoop, this);
+}
+
+FramePipeline::~FramePipeline() {
+    finish();
+}
+
+void FramePipeline::setStripedPngEncoding(ThreadPool* threadPool, uint32_t numRowsPerStripe) {
+    std::lock_guard lock(m_mutex);
+    m_stripeThreadPool = threadPool;
+    m_numRowsPerStripe = numRowsPerStripe;
+}
+
+void FramePipeline::setDeferFirstTouch(bool enabled) {
+    std::lock_guard lock(m_mutex);
+    m_deferFirstTouch = enabled;
+}
+
+void FramePipeline::setEncoder(std::unique_ptr<ImageEncoder> encoder) {
+    std::lock_guard lock(m_mutex);
+    m_encoder = std::move(encoder);
+    m_encoderCandidates.clear();
+}
+
+void FramePipeline::setStreamOutput(std::unique_ptr<FrameStreamWriter> stream) {
+    std::lock_guard lock(m_mutex);
+    m_stream = std::move(stream);
+}
+
+void FramePipeline::setCheckpointManifest(CheckpointManifest* checkpoint) {
+    std::lock_guard lock(m_mutex);
+    m_checkpoint = checkpoint;
+}
+
+void FramePipeline::setCrashAfterNumFrames(uint32_t numFrames) {
+    std::lock_guard lock(m_mutex);
+    m_crashAfterNumFrames = numFrames;
+}
+
+void FramePipeline::setEncoderCandidates(
+    std::vector<std::unique_ptr<ImageEncoder>> candidates, double timeBudgetPerFrame) {
+    std::lock_guard lock(m_mutex);
+    m_encoderCandidates = std::move(candidates);
+    m_encodeTimeBudget = timeBudgetPerFrame;
+}
+
+FramePipeline::Frame &FramePipeline::acquireFrame(uint32_t frameIndex, uint32_t width, uint32_t height) {
+    const clock::time_point stallStartTp = clock::now();
+    std::unique_lock lock(m_mutex);
+    {
+        TraceScope traceScope("idle", "wait for framebuffer", frameIndex);
+        m_freeFrameCondVar.wait(
+            lock,
+            [this]() {
+                return !m_freeFrames.empty();
+            });
+    }
+    Frame* frame = m_freeFrames.back();
+    m_freeFrames.pop_back();
+    const clock::time_point now = clock::now();
+    m_renderStats.stallTime += now - stallStartTp;
+    const bool deferFirstTouch = m_deferFirstTouch;
+    lock.unlock();
+
+    frame->frameIndex = frameIndex;
+    frame->width = width;
+    frame->height = height;
+    if (deferFirstTouch)
+        frame->pixels.resize(width * height);
+    else
+        frame->pixels.resize(width * height, RGBA{});
+    frame->acquiredTp = now;
+
+    return *frame;
+}
+
+void FramePipeline::submitFrame(Frame &frame) {
+    const clock::time_point now = clock::now();
+    {
+        std::lock_guard lock(m_mutex);
+        ++m_renderStats.numFrames;
+        m_renderStats.busyTime += now - frame.acquiredTp;
+        m_encodeQueue.push_back(&frame);
+        if (m_crashAfterNumFrames > 0 && m_renderStats.numFrames >= m_crashAfterNumFrames) {
+            printf("Inject a fault: kill the process after %u frames.\n", m_crashAfterNumFrames);
+            fflush(stdout);
+            std::_Exit(1);
+        }
+    }
+    m_encodeCondVar.notify_one();
+}
+
+// 候補ごとにframeをエンコードして時間を測り、選んだエンコーダーの出力をそのままencodedに使う。
+void FramePipeline::selectEncoder(const Frame &frame, EncodedFrame &encoded) {
+    TraceScope traceScope("encode", "select encoder", frame.frameIndex);
+    const uint32_t numEncoderThreads = static_cast<uint32_t>(m_encoderThreads.size());
+    printf(
+        "Select an encoder on frame %u (budget %.3f [ms]/frame with %u encoder threads):\n",
+        frame.frameIndex, m_encodeTimeBudget * 1e+3, numEncoderThreads);
+
+    const uint32_t numCandidates = static_cast<uint32_t>(m_encoderCandidates.size());
+    std::vector<std::vector<uint8_t>> outputs(numCandidates);
+    std::vector<double> encodeTimes(numCandidates, -1.0);
+    uint32_t fastestIdx = UINT32_MAX;
+    uint32_t bestIdx = UINT32_MAX;
+    for (uint32_t i = 0; i < numCandidates; ++i) {
+        const ImageEncoder &encoder = *m_encoderCandidates[i];
+        const clock::time_point startTp = clock::now();
+        const bool succeeded = encoder.encode(frame.pixels.data(), frame.width, frame.height, outputs[i]);
+        const double encodeTime = std::chrono::duration<double>(clock::now() - startTp).count();
+        printf(
+            "  %s: %.3f [ms], %.1f [KB]%s\n",
+            encoder.getDescription(), encodeTime * 1e+3, outputs[i].size() / 1024.0,
+            succeeded ? "" : " (failed)");
+        if (!succeeded)
+            continue;
+        encodeTimes[i] = encodeTime;
+        if (fastestIdx == UINT32_MAX || encodeTime < encodeTimes[fastestIdx])
+            fastestIdx = i;
+        // エンコードスレッドが並行して処理するので、スレッド数で割った時間が1フレームあたりの負荷になる。
+        if (encodeTime / numEncoderThreads <= m_encodeTimeBudget &&
+            (bestIdx == UINT32_MAX || encodeTime < encodeTimes[bestIdx]))
+            bestIdx = i;
+    }
+
+    std::unique_ptr<ImageEncoder> selected;
+    if (bestIdx != UINT32_MAX) {
+        printf(
+            "Selected %s: the fastest of the backends within the budget.\n",
+            m_encoderCandidates[bestIdx]->getDescription());
+    }
+    else if (fastestIdx != UINT32_MAX) {
+        printf(
+            "Selected %s: no backend fits the budget, use the fastest one.\n",
+            m_encoderCandidates[fastestIdx]->getDescription());
+        bestIdx = fastestIdx;
+    }
+    else {
+        printf("All encoders failed, keep %s.\n", m_encoder->getDescription());
+    }
+
+    if (bestIdx != UINT32_MAX) {
+        encoded.data = std::move(outputs[bestIdx]);
+        encoded.extension = m_encoderCandidates[bestIdx]->getExtension();
+        selected = std::move(m_encoderCandidates[bestIdx]);
+    }
+    else {
+        m_encoder->encode(frame.pixels.data(), frame.width, frame.height, encoded.data);
+        encoded.extension = m_encoder->getExtension();
+    }
+
+    std::lock_guard lock(m_mutex);
+    if (selected)
+        m_encoder = std::move(selected);
+    m_encoderCandidates.clear();
+    m_isSelectingEncoder = false;
+    m_encodeCondVar.notify_all();
+}
+
+void FramePipeline::encoderLoop() {
+    setTraceThreadName("encoder");
+
+    while (true) {
+        Frame* frame;
+        const ImageEncoder* encoder;
+        const FrameStreamWriter* stream;
+        bool selectsEncoder;
+        {
+            std::unique_lock lock(m_mutex);
+            m_encodeCondVar.wait(
+                lock,
+                [this]() {
+                    return (!m_encodeQueue.empty() && !m_isSelectingEncoder) || (m_quit && m_encodeQueue.empty());
+                });
+            if (m_encodeQueue.empty())
+                return;
+            frame = m_encodeQueue.front();
+            m_encodeQueue.pop_front();
+            ++m_numEncodingFrames;
+            encoder = m_encoder.get();
+            stream = m_stream.get();
+            selectsEncoder = !stream && !m_stripeThreadPool && !m_encoderCandidates.empty();
+            m_isSelectingEncoder = selectsEncoder;
+        }
+
+        const clock::time_point encodeStartTp = clock::now();
+
+        if (m_stripeThreadPool && !stream) {
+            // 帯ごとに圧縮しながらファイルへ書き出すので、圧縮済みの画像全体をメモリに持たない。
+            char filename[256];
+            getOutputFilename(frame->frameIndex, "png", filename);
+            uint64_t numBytes = 0;
+            TraceScope traceScope("encode", "striped png", frame->frameIndex);
+            if (encodeStripedPngToFile(
+                *m_stripeThreadPool, filename,
+                frame->pixels.data(), frame->width, frame->height, 4, m_numRowsPerStripe,
+                &numBytes)) {
+                if (m_checkpoint)
+                    m_checkpoint->recordFrame(frame->frameIndex, filename, numBytes);
+            }
+            else {
+                printf("Failed to write %s.\n", filename);
+            }
+            const clock::time_point encodeEndTp = clock::now();
+
+            std::lock_guard lock(m_mutex);
+            m_freeFrames.push_back(frame);
+            m_freeFrameCondVar.notify_one();
+
+            ++m_encodeStats.numFrames;
+            m_encodeStats.numBytes += numBytes;
+            m_encodeStats.busyTime += encodeEndTp - encodeStartTp;
+            ++m_writeStats.numFrames;
+            m_writeStats.numBytes += numBytes;
+            --m_numEncodingFrames;
+            m_writeCondVar.notify_one();
+            continue;
+        }
+
+        EncodedFrame encoded;
+        encoded.frameIndex = frame->frameIndex;
+        encoded.width = frame->width;
+        encoded.height = frame->height;
+        if (stream) {
+            TraceScope traceScope("encode", "stream", frame->frameIndex);
+            encoded.extension = nullptr;
+            stream->encodeFrame(frame->pixels.data(), frame->width, frame->height, encoded.data);
+        }
+        else if (selectsEncoder) {
+            selectEncoder(*frame, encoded);
+        }
+        else {
+            TraceScope traceScope("encode", encoder->getExtension(), frame->frameIndex);
+            encoded.extension = encoder->getExtension();
+            if (!encoder->encode(frame->pixels.data(), frame->width, frame->height, encoded.data))
+                printf("Failed to encode the frame %u.\n", frame->frameIndex);
+        }
+        const clock::time_point encodeEndTp = clock::now();
+
+        std::unique_lock lock(m_mutex);
+        // エンコードが終わった時点でフレームバッファをレンダリング側に返す。
+        m_freeFrames.push_back(frame);
+        m_freeFrameCondVar.notify_one();
+
+        ++m_encodeStats.numFrames;
+        m_encodeStats.numBytes += encoded.data.size();
+        m_encodeStats.busyTime += encodeEndTp - encodeStartTp;
+
+        // 書き出し待ちのフレーム数を制限してメモリ使用量を抑える。
+        {
+            TraceScope traceScope("idle", "wait for write queue", encoded.frameIndex);
+            m_writeSpaceCondVar.wait(
+                lock,
+                [this]() {
+                    return m_writeQueue.size() < m_maxNumEncodedFrames;
+                });
+        }
+        m_encodeStats.stallTime += clock::now() - encodeEndTp;
+        m_writeQueue.push_back(std::move(encoded));
+        --m_numEncodingFrames;
+        m_writeCondVar.notify_one();
+    }
+}
+
+void FramePipeline::writerLoop() {
+    setTraceThreadName("writer");
+
+    while (true) {
+        EncodedFrame encoded;
+        {
+            std::unique_lock lock(m_mutex);
+            m_writeCondVar.wait(
+                lock,
+                [this]() {
+                    return !m_writeQueue.empty() ||
+                        (m_quit && m_encodeQueue.empty() && m_numEncodingFrames == 0);
+                });
+            if (m_writeQueue.empty())
+                return;
+            encoded = std::move(m_writeQueue.front());
+            m_writeQueue.pop_front();
+        }
+        m_writeSpaceCondVar.notify_one();
+
+        const clock::time_point writeStartTp = clock::now();
+
+        if (m_stream) {
+            TraceScope traceScope("io", "write stream", encoded.frameIndex);
+            const uint64_t numBytes = encoded.data.size();
+            m_stream->pushFrame(encoded.frameIndex, encoded.width, encoded.height, std::move(encoded.data));
+
+            std::lock_guard lock(m_mutex);
+            ++m_writeStats.numFrames;
+            m_writeStats.numBytes += numBytes;
+            m_writeStats.busyTime += clock::now() - writeStartTp;
+            continue;
+        }
+
+        char filename[256];
+        getOutputFilename(encoded.frameIndex, encoded.extension, filename);
+        TraceScope traceScope("io", "write file", encoded.frameIndex);
+        FILE* fp;
+        if (fopen_s(&fp, filename, "wb") == 0) {
+            const bool written = fwrite(encoded.data.data(), 1, encoded.data.size(), fp) == encoded.data.size();
+            // 閉じて書き込みを終えてから記録する。
+            if (fclose(fp) == 0 && written && m_checkpoint)
+                m_checkpoint->recordFrame(encoded.frameIndex, filename, encoded.data.size());
+        }
+        else {
+            printf("Failed to open %s.\n", filename);
+        }
+
+        std::lock_guard lock(m_mutex);
+        ++m_writeStats.numFrames;
+        m_writeStats.numBytes += encoded.data.size();
+        m_writeStats.busyTime += clock::now() - writeStartTp;
+    }
+}
+
+void FramePipeline::finish() {
+    {
+        std::lock_guard lock(m_mutex);
+        if (m_quit)
+            return;
+        m_quit = true;
+    }
+    m_encodeCondVar.notify_all();
+    m_writeCondVar.notify_all();
+    for (std::thread &thread : m_encoderThreads)
+        thread.join();
+    m_writerThread.join();
+
+    // 窓に残っているフレームを書き出して閉じる。
+    if (m_stream) {
+        const clock::time_point writeStartTp = clock::now();
+        m_stream->finish();
+        std::lock_guard lock(m_mutex);
+        m_writeStats.busyTime += clock::now() - writeStartTp;
+    }
+}
+
+void FramePipeline::printStats() const {
+    std::lock_guard lock(m_mutex);
+
+    const auto toSeconds = [](clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count() * 1e-6;
+    };
+    const auto toCapacity = [&toSeconds](const StageStats &stats, uint32_t numThreads) {
+        const double busyTime = toSeconds(stats.busyTime);
+        return busyTime > 0 ? stats.numFrames * numThreads / busyTime : 0.0;
+    };
+
+    const uint32_t numEncoderThreads = static_cast<uint32_t>(m_encoderThreads.size());
+    const double renderCapacity = toCapacity(m_renderStats, 1);
+    const double encodeCapacity = toCapacity(m_encodeStats, numEncoderThreads);
+    const double writeCapacity = toCapacity(m_writeStats, 1);
+
+    // capacityはステージが休みなく動いた場合に捌けるフレームレート。最も低いステージがボトルネック。
+    const char* outputDescription = m_encoder->getDescription();
+    if (m_stream)
+        outputDescription = m_stream->getFormat() == FrameStreamFormat::Y4m ? "y4m stream" : "raw rgba stream";
+    else if (m_stripeThreadPool)
+        outputDescription = "striped PNG";
+    printf(
+        "Pipeline (%zu framebuffers, %u encoder threads, %s):\n",
+        m_frames.size(), numEncoderThreads, outputDescription);
+    printf(
+        "  Render: %u frames, busy %.3f [s], stalled %.3f [s], capacity %.2f [fps]\n",
+        m_renderStats.numFrames, toSeconds(m_renderStats.busyTime), toSeconds(m_renderStats.stallTime),
+        renderCapacity);
+    printf(
+        "  Encode: %u frames, busy %.3f [s], stalled %.3f [s], capacity %.2f [fps]\n",
+        m_encodeStats.numFrames, toSeconds(m_encodeStats.busyTime), toSeconds(m_encodeStats.stallTime),
+        encodeCapacity);
+    if (m_stripeThreadPool && !m_stream) {
+        // 帯分割エンコードでは書き出しがエンコードステージに含まれる。
+        printf(
+            "  Write: %u frames, %.3f [MB], included in Encode\n",
+            m_writeStats.numFrames, m_writeStats.numBytes / (1024.0 * 1024.0));
+    }
+    else {
+        printf(
+            "  Write: %u frames, %.3f [MB], busy %.3f [s], capacity %.2f [fps]\n",
+            m_writeStats.numFrames, m_writeStats.numBytes / (1024.0 * 1024.0), toSeconds(m_writeStats.busyTime),
+            writeCapacity);
+    }
+
+    const char* bottleneck = "Render";
+    double minCapacity = renderCapacity;
+    if (encodeCapacity < minCapacity) {
+        bottleneck = "Encode";
+        minCapacity = encodeCapacity;
+    }
+    if ((!m_stripeThreadPool || m_stream) && writeCapacity < minCapacity)
+        bottleneck = "Write";
+    printf(
+        "  Bottleneck: %s (wall %.3f [s])\n",
+        bottleneck, toSeconds(clock::now() - m_startTp));
+    if (m_stream)
+        m_stream->printStats();
+}
+
+void FramePipeline::printPagePlacement(const NumaTopology &topology) const {
+    std::lock_guard lock(m_mutex);
+    uint64_t numLocalPages = 0;
+    uint64_t numRemotePages = 0;
+    uint64_t numUntouchedPages = 0;
+    for (const std::unique_ptr<Frame> &frame : m_frames) {
+        if (frame->pixels.empty())
+            continue;
+        topology.countPagePlacement(
+            frame->pixels.data(), frame->pixels.size() * sizeof(RGBA),
+            &numLocalPages, &numRemotePages, &numUntouchedPages);
+    }
+    printf(
+        "Framebuffer pages: %llu local, %llu remote, %llu untouched (%u NUMA nodes)\n",
+        static_cast<unsigned long long>(numLocalPages), static_cast<unsigned long long>(numRemotePages),
+        static_cast<unsigned long long>(numUntouchedPages), topology.getNumNodes());
+}
@@ -0,0 +1,132 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "render_engine.h"
+#include "image_encoder.h"
+#include "frame_stream.h"
+#include "checkpoint_manifest.h"
+#include "numa.h"
+
+// レンダリング → PNGエンコード → ファイル書き出しをステージに分けたパイプライン。
+// フレームバッファは固定数を使い回し、空きが無い間はacquireFrame()がブロックする(バックプレッシャー)。
+// これによりフレームN+1のレンダリング中にフレームNのエンコードと書き出しが進む。
+class FramePipeline {
+public:
+    using clock = std::chrono::high_resolution_clock;
+
+    struct Frame {
+        uint32_t frameIndex;
+        uint32_t width;
+        uint32_t height;
+        PageVector<RGBA> pixels;
+        clock::time_point acquiredTp;
+    };
+
+private:
+    struct EncodedFrame {
+        uint32_t frameIndex;
+        uint32_t width;
+        uint32_t height;
+        const char* extension;
+        std::vector<uint8_t> data;
+    };
+
+    struct StageStats {
+        uint32_t numFrames;
+        uint64_t numBytes;
+        clock::duration busyTime;
+        clock::duration stallTime;
+    };
+
+    std::vector<std::unique_ptr<Frame>> m_frames;
+    std::vector<Frame*> m_freeFrames;
+    std::deque<Frame*> m_encodeQueue;
+    std::deque<EncodedFrame> m_writeQueue;
+    uint32_t m_maxNumEncodedFrames;
+    uint32_t m_numEncodingFrames;
+    ThreadPool* m_stripeThreadPool;
+    uint32_t m_numRowsPerStripe;
+    bool m_deferFirstTouch;
+    bool m_quit;
+
+    std::unique_ptr<ImageEncoder> m_encoder;
+    // 最初のフレームで試すエンコーダーの候補と、1フレームあたりのエンコード時間の予算[s]。
+    std::vector<std::unique_ptr<ImageEncoder>> m_encoderCandidates;
+    double m_encodeTimeBudget;
+    // 選択中は他のエンコードスレッドはフレームを取らずに待つ。
+    bool m_isSelectingEncoder;
+    // 設定されている場合は画像ファイルの代わりにこのストリームに書く。
+    std::unique_ptr<FrameStreamWriter> m_stream;
+    // 書き出した画像ファイルを記録する先。
+    CheckpointManifest* m_checkpoint;
+    // 障害の注入。0でなければこの数のフレームを受け取った時点でプロセスを落とす。
+    uint32_t m_crashAfterNumFrames;
+
+    std::vector<std::thread> m_encoderThreads;
+    std::thread m_writerThread;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_freeFrameCondVar;
+    std::condition_variable m_encodeCondVar;
+    std::condition_variable m_writeCondVar;
+    std::condition_variable m_writeSpaceCondVar;
+
+    clock::time_point m_startTp;
+    StageStats m_renderStats;
+    StageStats m_encodeStats;
+    StageStats m_writeStats;
+
+    void selectEncoder(const Frame &frame, EncodedFrame &encoded);
+    void encoderLoop();
+    void writerLoop();
+
+public:
+    // numFramebuffers: 2でダブルバッファ、3でトリプルバッファ。
+    // numEncoderThreads: 画像のエンコードを行うスレッド数。
+    FramePipeline(uint32_t numFramebuffers, uint32_t numEncoderThreads);
+    ~FramePipeline();
+
+    FramePipeline(const FramePipeline &) = delete;
+    FramePipeline &operator=(const FramePipeline &) = delete;
+
+    // 大きな画像向けに帯分割の並列PNGエンコードを使う。エンコードと書き出しは帯単位で一体に行う。
+    // 最初のフレームを投入する前に呼ぶこと。
+    void setStripedPngEncoding(ThreadPool* threadPool, uint32_t numRowsPerStripe);
+    // フレームバッファを確保時にゼロ埋めせず、レンダリングスレッドが最初に書いた時点でそのノードにページを置く。
+    // 全画素を毎フレーム書くレンダラーで使う。最初のフレームを投入する前に呼ぶこと。
+    void setDeferFirstTouch(bool enabled);
+    // 既定ではfpngを使う。最初のフレームを投入する前に呼ぶこと。
+    void setEncoder(std::unique_ptr<ImageEncoder> encoder);
+    // 最初のフレームを各候補でエンコードして時間を測り、エンコードスレッド数を考慮して
+    // 1フレームあたりtimeBudgetPerFrame[s]に収まるものの中で最も速いものを以降のフレームに使う。
+    // 収まるものが無い場合は最も速いものを使う。選択の結果と理由は標準出力に出す。
+    void setEncoderCandidates(std::vector<std::unique_ptr<ImageEncoder>> candidates, double timeBudgetPerFrame);
+    // フレームごとの画像ファイルの代わりに1つのストリームに書き出す。エンコーダーと帯分割の設定は使わない。
+    // 最初のフレームを投入する前に呼ぶこと。
+    void setStreamOutput(std::unique_ptr<FrameStreamWriter> stream);
+    // 画像ファイルを書き終えるごとにcheckpointへ記録する。ストリームに書く場合は記録しない。
+    // 最初のフレームを投入する前に呼ぶこと。
+    void setCheckpointManifest(CheckpointManifest* checkpoint);
+    // 再起動からの再開を確かめるため、numFrames個目のフレームを受け取った時点でプロセスを落とす。
+    // それ以前のフレームもエンコード中や書き出し待ちのものは失われる。
+    void setCrashAfterNumFrames(uint32_t numFrames);
+
+    // 空きフレームバッファを取得する。全て使用中の場合は空くまで待つ。
+    Frame &acquireFrame(uint32_t frameIndex, uint32_t width, uint32_t height);
+    // レンダリング済みのフレームをエンコードステージに流す。
+    void submitFrame(Frame &frame);
+    // 投入済みの全フレームの書き出しを待ち、スレッドを終了する。
+    void finish();
+
+    void printStats() const;
+    // フレームバッファのページがレンダリングを担当するノードに置かれているかを表示する。
+    void printPagePlacement(const NumaTopology &topology) const;
+};
@@ -0,0 +1,282 @@
+﻿#include "frame_stream.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include "mapped_file.h"
+#include "thread_pool.h"
+
+static bool endsWith(const std::string &str, const char* suffix) {
+    const size_t suffixLength = strlen(suffix);
+    return str.size() >= suffixLength && str.compare(str.size() - suffixLength, suffixLength, suffix) == 0;
+}
+
+static uint8_t toByte(float value) {
+    return static_cast<uint8_t>(std::clamp(value + 0.5f, 0.0f, 255.0f));
+}
+
+static std::string getFrameListPath(const std::string &path) {
+    return path + ".frames";
+}
+
+
+
+FrameStreamWriter::FrameStreamWriter(const std::string &path, uint32_t reorderWindow) :
+    m_path(path), m_reorderWindow(reorderWindow), m_width(0), m_height(0), m_isHeaderWritten(false),
+    m_nextFrameIndex(0), m_numReorderedFrames(0), m_numOutOfOrderFrames(0), m_maxNumPendingFrames(0) {
+    // 標準出力はffmpegなどに渡すことが多いので、自己記述的なY4Mにする。
+    m_format = (path == "-" || endsWith(path, ".y4m")) ? FrameStreamFormat::Y4m : FrameStreamFormat::RawRgba;
+    m_file.open(path);
+}
+
+FrameStreamWriter::~FrameStreamWriter() {
+    try {
+        finish();
+    }
+    catch (std::exception &e) {
+        printf("%s", e.what());
+    }
+}
+
+void FrameStreamWriter::encodeFrame(
+    const RGBA* pixels, uint32_t width, uint32_t height, std::vector<uint8_t> &out) const {
+    const size_t numPixels = static_cast<size_t>(width) * height;
+    if (m_format == FrameStreamFormat::RawRgba) {
+        out.resize(numPixels * sizeof(RGBA));
+        std::memcpy(out.data(), pixels, out.size());
+        return;
+    }
+
+    // BT.601フルレンジのY, Cb, Crの各プレーンを順に並べる。
+    out.resize(numPixels * 3);
+    uint8_t* planeY = out.data();
+    uint8_t* planeCb = planeY + numPixels;
+    uint8_t* planeCr = planeCb + numPixels;
+    for (size_t i = 0; i < numPixels; ++i) {
+        const float r = pixels[i].r;
+        const float g = pixels[i].g;
+        const float b = pixels[i].b;
+        planeY[i] = toByte(0.299f * r + 0.587f * g + 0.114f * b);
+        planeCb[i] = toByte(128.0f - 0.168736f * r - 0.331264f * g + 0.5f * b);
+        planeCr[i] = toByte(128.0f + 0.5f * r - 0.418688f * g - 0.081312f * b);
+    }
+}
+
+void FrameStreamWriter::writeFrame(uint32_t frameIndex, const std::vector<uint8_t> &data) {
+    if (m_format == FrameStreamFormat::Y4m) {
+        // 連番が飛ぶ場合や順番が入れ替わった場合にも元のフレーム番号がわかるように、フレームごとに番号を付ける。
+        char frameHeader[64];
+        const int length = sprintf_s(frameHeader, "FRAME Xi=%u\n", frameIndex);
+        m_file.write(frameHeader, length);
+    }
+    m_file.write(data.data(), data.size());
+    m_frameIndices.push_back(frameIndex);
+    m_nextFrameIndex = std::max(m_nextFrameIndex, frameIndex + 1);
+}
+
+void FrameStreamWriter::pushFrame(uint32_t frameIndex, uint32_t width, uint32_t height, std::vector<uint8_t> data) {
+    if (!m_isHeaderWritten) {
+        m_width = width;
+        m_height = height;
+        if (m_format == FrameStreamFormat::Y4m) {
+            char header[128];
+            const int length = sprintf_s(
+                header, "YUV4MPEG2 W%u H%u F30:1 Ip A1:1 C444 XCOLORRANGE=FULL\n", width, height);
+            m_file.write(header, length);
+        }
+        m_isHeaderWritten = true;
+    }
+    if (width != m_width || height != m_height) {
+        printf(
+            "Frame %u (%ux%u) does not match the stream size %ux%u, skipped.\n",
+            frameIndex, width, height, m_width, m_height);
+        return;
+    }
+
+    // 最初は0番から始まるとみなし、他の番号で始まる場合は窓が溢れるのを待つ。
+    if (frameIndex < m_nextFrameIndex) {
+        // 窓を越えて遅れたフレームは、番号は前後するがそのまま書く。
+        ++m_numOutOfOrderFrames;
+        writeFrame(frameIndex, data);
+        return;
+    }
+    if (frameIndex == m_nextFrameIndex)
+        writeFrame(frameIndex, data);
+    else if (m_reorderWindow == 0 && m_pendingFrames.empty())
+        writeFrame(frameIndex, data);
+    else
+        m_pendingFrames.emplace(frameIndex, std::move(data));
+
+    // 窓から溢れた分は番号の小さい方から書き、続き番号になったものも書く。
+    while (!m_pendingFrames.empty()) {
+        const auto it = m_pendingFrames.begin();
+        const bool isNext = it->first == m_nextFrameIndex;
+        if (!isNext && m_pendingFrames.size() <= m_reorderWindow)
+            break;
+        if (!isNext && !m_frameIndices.empty())
+            ++m_numReorderedFrames;
+        writeFrame(it->first, it->second);
+        m_pendingFrames.erase(it);
+    }
+    m_maxNumPendingFrames = std::max(m_maxNumPendingFrames, static_cast<uint32_t>(m_pendingFrames.size()));
+}
+
+void FrameStreamWriter::finish() {
+    if (!m_file.isOpen())
+        return;
+    for (const auto &[frameIndex, data] : m_pendingFrames)
+        writeFrame(frameIndex, data);
+    m_pendingFrames.clear();
+    m_file.close();
+
+    if (m_format == FrameStreamFormat::RawRgba && m_path != "-") {
+        const std::string listPath = getFrameListPath(m_path);
+        FILE* fp;
+        if (fopen_s(&fp, listPath.c_str(), "w") != 0) {
+            printf("Failed to open %s.\n", listPath.c_str());
+            return;
+        }
+        fprintf(fp, "rgba %u %u\n", m_width, m_height);
+        for (const uint32_t frameIndex : m_frameIndices)
+            fprintf(fp, "%u\n", frameIndex);
+        fclose(fp);
+    }
+}
+
+void FrameStreamWriter::printStats() const {
+    printf(
+        "Stream: %s (%s, %ux%u), %u frames, %.3f [MB] in %u writes via %s\n",
+        m_path.c_str(), m_format == FrameStreamFormat::Y4m ? "y4m" : "raw rgba", m_width, m_height,
+        getNumFrames(), m_file.getNumWrittenBytes() / (1024.0 * 1024.0), m_file.getNumWriteCalls(),
+        m_file.getBackendName());
+    printf(
+        "  Reorder window %u: max %u pending, %u written early, %u out of order\n",
+        m_reorderWindow, m_maxNumPendingFrames, m_numReorderedFrames, m_numOutOfOrderFrames);
+}
+
+
+
+uint32_t convertFrameStreamToImages(const std::string &path, const ImageEncoder &encoder, ThreadPool &threadPool) {
+    MappedFile file;
+    if (!file.openForRead(path))
+        throw std::runtime_error("Failed to open the stream: " + path + "\n");
+    const uint8_t* const data = file.getData();
+    const size_t size = file.getSize();
+
+    struct StreamFrame {
+        uint32_t frameIndex;
+        const uint8_t* data;
+    };
+    std::vector<StreamFrame> frames;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    bool isY4m = size >= 10 && std::memcmp(data, "YUV4MPEG2 ", 10) == 0;
+    if (isY4m) {
+        const auto readLine = [&](size_t &offset) {
+            const uint8_t* end = static_cast<const uint8_t*>(std::memchr(data + offset, '\n', size - offset));
+            if (!end)
+                throw std::runtime_error("Broken Y4M stream: " + path + "\n");
+            std::string line(reinterpret_cast<const char*>(data + offset), end - (data + offset));
+            offset = end - data + 1;
+            return line;
+        };
+
+        size_t offset = 0;
+        const std::string header = readLine(offset);
+        for (size_t pos = 0; pos != std::string::npos; pos = header.find(' ', pos + 1)) {
+            const char* param = header.c_str() + pos + 1;
+            if (param[0] == 'W')
+                width = static_cast<uint32_t>(atoi(param + 1));
+            else if (param[0] == 'H')
+                height = static_cast<uint32_t>(atoi(param + 1));
+            else if (param[0] == 'C' && strncmp(param, "C444", 4) != 0)
+                throw std::runtime_error("Only 4:4:4 Y4M streams are supported: " + path + "\n");
+        }
+        const size_t frameSize = static_cast<size_t>(width) * height * 3;
+        uint32_t frameIndex = 0;
+        while (offset < size) {
+            const std::string frameHeader = readLine(offset);
+            if (frameHeader.compare(0, 5, "FRAME") != 0 || size - offset < frameSize)
+                throw std::runtime_error("Broken Y4M stream: " + path + "\n");
+            const size_t indexPos = frameHeader.find(" Xi=");
+            if (indexPos != std::string::npos)
+                frameIndex = static_cast<uint32_t>(atoi(frameHeader.c_str() + indexPos + 4));
+            frames.push_back(StreamFrame{ frameIndex, data + offset });
+            ++frameIndex;
+            offset += frameSize;
+        }
+    }
+    else {
+        const std::string listPath = getFrameListPath(path);
+        FILE* fp;
+        if (fopen_s(&fp, listPath.c_str(), "r") != 0)
+            throw std::runtime_error("Failed to open the frame list: " + listPath + "\n");
+        char line[256];
+        char* end = nullptr;
+        if (fgets(line, sizeof(line), fp) && strncmp(line, "rgba ", 5) == 0) {
+            width = static_cast<uint32_t>(strtoul(line + 5, &end, 10));
+            height = static_cast<uint32_t>(strtoul(end, &end, 10));
+        }
+        if (width == 0 || height == 0) {
+            fclose(fp);
+            throw std::runtime_error("Broken frame list: " + listPath + "\n");
+        }
+        const size_t frameSize = static_cast<size_t>(width) * height * sizeof(RGBA);
+        while (fgets(line, sizeof(line), fp)) {
+            const uint32_t frameIndex = static_cast<uint32_t>(strtoul(line, &end, 10));
+            if (end == line)
+                continue;
+            const size_t offset = frames.size() * frameSize;
+            if (offset + frameSize > size)
+                break;
+            frames.push_back(StreamFrame{ frameIndex, data + offset });
+        }
+        fclose(fp);
+    }
+
+    const uint32_t numFrames = static_cast<uint32_t>(frames.size());
+    const size_t numPixels = static_cast<size_t>(width) * height;
+    threadPool.parallelFor(
+        numFrames,
+        [&](uint32_t itemIndex, uint32_t) {
+            const StreamFrame &frame = frames[itemIndex];
+            std::vector<RGBA> pixels(numPixels);
+            if (isY4m) {
+                const uint8_t* planeY = frame.data;
+                const uint8_t* planeCb = planeY + numPixels;
+                const uint8_t* planeCr = planeCb + numPixels;
+                for (size_t i = 0; i < numPixels; ++i) {
+                    const float y = planeY[i];
+                    const float cb = planeCb[i] - 128.0f;
+                    const float cr = planeCr[i] - 128.0f;
+                    pixels[i].r = toByte(y + 1.402f * cr);
+                    pixels[i].g = toByte(y - 0.344136f * cb - 0.714136f * cr);
+                    pixels[i].b = toByte(y + 1.772f * cb);
+                    pixels[i].a = 255;
+                }
+            }
+            else {
+                std::memcpy(pixels.data(), frame.data, numPixels * sizeof(RGBA));
+            }
+
+            std::vector<uint8_t> encoded;
+            char filename[256];
+            sprintf_s(filename, "%03u.%s", frame.frameIndex, encoder.getExtension());
+            if (!encoder.encode(pixels.data(), width, height, encoded)) {
+                printf("Failed to encode the frame %u.\n", frame.frameIndex);
+                return;
+            }
+            FILE* fp;
+            if (fopen_s(&fp, filename, "wb") != 0) {
+                printf("Failed to open %s.\n", filename);
+                return;
+            }
+            fwrite(encoded.data(), 1, encoded.size(), fp);
+            fclose(fp);
+        });
+
+    return numFrames;
+}
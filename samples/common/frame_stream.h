@@ -0,0 +1,73 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <string>
+
+#include "render_engine.h"
+#include "image_encoder.h"
+#include "sequential_writer.h"
+
+class ThreadPool;
+
+enum class FrameStreamFormat {
+    // YUV4MPEG2 (4:4:4, BT.601フルレンジ)。アルファは捨てる。
+    Y4m = 0,
+    // RGBAをそのまま並べたもの。フレーム番号などは"<path>.frames"に書く。
+    RawRgba,
+};
+
+// 全フレームを1つのファイルかパイプに順に書き出す出力先。
+// フレームごとのファイル作成や画像のエンコードを避け、大きな連続書き込みにまとめる。
+// 番号付きの画像ファイルは後からconvertFrameStreamToImages()で作る。
+class FrameStreamWriter {
+    SequentialFileWriter m_file;
+    std::string m_path;
+    FrameStreamFormat m_format;
+    uint32_t m_reorderWindow;
+    uint32_t m_width;
+    uint32_t m_height;
+    bool m_isHeaderWritten;
+    // 次に書くべきフレーム番号。
+    uint32_t m_nextFrameIndex;
+    // 順番を待っているフレーム。
+    std::map<uint32_t, std::vector<uint8_t>> m_pendingFrames;
+    std::vector<uint32_t> m_frameIndices;
+    uint32_t m_numReorderedFrames;
+    uint32_t m_numOutOfOrderFrames;
+    uint32_t m_maxNumPendingFrames;
+
+    void writeFrame(uint32_t frameIndex, const std::vector<uint8_t> &data);
+
+public:
+    // pathが"-"なら標準出力に、拡張子が".y4m"ならそのファイルにY4Mで書く。それ以外は生のRGBAで書く。
+    // reorderWindow: 順番を待つために保持するフレーム数の上限。0なら届いた順に書く。
+    FrameStreamWriter(const std::string &path, uint32_t reorderWindow);
+    ~FrameStreamWriter();
+
+    FrameStreamWriter(const FrameStreamWriter &) = delete;
+    FrameStreamWriter &operator=(const FrameStreamWriter &) = delete;
+
+    // 1フレームをストリームの形式に変換する。複数のエンコードスレッドから同時に呼ばれる。
+    void encodeFrame(const RGBA* pixels, uint32_t width, uint32_t height, std::vector<uint8_t> &out) const;
+    // 変換済みのフレームを渡す。書き出しスレッドからだけ呼ぶ。
+    void pushFrame(uint32_t frameIndex, uint32_t width, uint32_t height, std::vector<uint8_t> data);
+    // 保持しているフレームを番号順に書き出して閉じる。
+    void finish();
+
+    FrameStreamFormat getFormat() const {
+        return m_format;
+    }
+    const std::string &getPath() const {
+        return m_path;
+    }
+    uint32_t getNumFrames() const {
+        return static_cast<uint32_t>(m_frameIndices.size());
+    }
+    void printStats() const;
+};
+
+// FrameStreamWriterで書いたストリームを読み、フレームごとに"%03u.<ext>"の画像ファイルを作る。
+// 変換したフレーム数を返す。読めない場合は例外を投げる。
+uint32_t convertFrameStreamToImages(const std::string &path, const ImageEncoder &encoder, ThreadPool &threadPool);
@@ -0,0 +1,369 @@
+﻿#include "hdr_framebuffer.h"
+
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#   define HDR_FRAMEBUFFER_X64
+#   include <immintrin.h>
+#   if defined(_MSC_VER)
+#       include <intrin.h>
+#       define TARGET_AVX2
+#       define TARGET_AVX512
+#   else
+#       include <cpuid.h>
+#       define TARGET_AVX2 __attribute__((target("avx2")))
+// AVX-512FではFMAも使えるようになり、GCCは乗算と加算をまとめてスカラー版と結果がずれるので止める。
+#       if defined(__clang__)
+#           define TARGET_AVX512 __attribute__((target("avx512f")))
+#       else
+#           define TARGET_AVX512 __attribute__((target("avx512f"), optimize("fp-contract=off")))
+#       endif
+#   endif
+#endif
+
+namespace {
+
+struct ResolveConstants {
+    float exposure;
+    ToneMapOperator toneMapOperator;
+    bool encodeSrgb;
+    // この行のディザのオフセット[量子化幅]。4画素周期のパターンを16画素分並べる。
+    float ditherOffsets[16];
+};
+
+using ResolveRowFunc = void (*)(
+    const float* const planes[4], uint32_t width, const ResolveConstants &constants, RGBA* dst);
+
+constexpr float srgbLinearThreshold = 0.0031308f;
+constexpr uint8_t bayerMatrix[4][4] = {
+    { 0, 8, 2, 10 },
+    { 12, 4, 14, 6 },
+    { 3, 11, 1, 9 },
+    { 15, 7, 13, 5 },
+};
+
+
+
+// SIMD版とスカラー版で結果を一致させるため、以下の演算はどれも同じ順に行い、FMAも使わない。
+// NaNは0に丸める(maxps/minpsの2番目の引数が返る挙動に合わせる)。
+
+inline float toneMap(float v, ToneMapOperator op) {
+    if (op == ToneMapOperator::Reinhard)
+        return v / (1.0f + v);
+    if (op == ToneMapOperator::AcesFitted)
+        return v * (2.51f * v + 0.03f) / (v * (2.43f * v + 0.59f) + 0.14f);
+    return v;
+}
+
+// 1.055 * v^(1/2.4) - 0.055を平方根の組み合わせで近似する。
+inline float encodeSrgb(float v) {
+    if (v <= srgbLinearThreshold)
+        return 12.92f * v;
+    const float s1 = std::sqrt(v);
+    const float s2 = std::sqrt(s1);
+    const float s3 = std::sqrt(s2);
+    return 0.662002687f * s1 + 0.684122060f * s2 - 0.323583601f * s3 - 0.0225411470f * v;
+}
+
+inline uint32_t resolveChannel(float sum, float scale, float dither, const ResolveConstants &constants) {
+    float v = toneMap(sum * scale, constants.toneMapOperator);
+    v = v > 0.0f ? v : 0.0f;
+    v = v < 1.0f ? v : 1.0f;
+    if (constants.encodeSrgb)
+        v = encodeSrgb(v);
+    float q = v * 255.0f + dither + 0.5f;
+    q = q > 0.0f ? q : 0.0f;
+    q = q < 255.0f ? q : 255.0f;
+    return static_cast<uint32_t>(q);
+}
+
+void resolvePixelsScalar(
+    const float* const planes[4], uint32_t beginX, uint32_t endX, const ResolveConstants &constants, RGBA* dst) {
+    for (uint32_t x = beginX; x < endX; ++x) {
+        const float weight = planes[3][x];
+        const float scale = weight > 0.0f ? constants.exposure / std::max(weight, FLT_MIN) : 0.0f;
+        const float dither = constants.ditherOffsets[x & 15];
+        RGBA v;
+        v.r = resolveChannel(planes[0][x], scale, dither, constants);
+        v.g = resolveChannel(planes[1][x], scale, dither, constants);
+        v.b = resolveChannel(planes[2][x], scale, dither, constants);
+        v.a = 255;
+        dst[x] = v;
+    }
+}
+
+void resolveRowScalar(
+    const float* const planes[4], uint32_t width, const ResolveConstants &constants, RGBA* dst) {
+    resolvePixelsScalar(planes, 0, width, constants, dst);
+}
+
+
+
+#if defined(HDR_FRAMEBUFFER_X64)
+
+TARGET_AVX2 inline __m256 resolveChannelAvx2(
+    __m256 sum, __m256 scale, __m256 dither, const ResolveConstants &constants) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 v = _mm256_mul_ps(sum, scale);
+    if (constants.toneMapOperator == ToneMapOperator::Reinhard) {
+        v = _mm256_div_ps(v, _mm256_add_ps(one, v));
+    }
+    else if (constants.toneMapOperator == ToneMapOperator::AcesFitted) {
+        const __m256 num = _mm256_mul_ps(
+            v, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.51f), v), _mm256_set1_ps(0.03f)));
+        const __m256 den = _mm256_add_ps(
+            _mm256_mul_ps(v, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.43f), v), _mm256_set1_ps(0.59f))),
+            _mm256_set1_ps(0.14f));
+        v = _mm256_div_ps(num, den);
+    }
+    v = _mm256_min_ps(_mm256_max_ps(v, zero), one);
+    if (constants.encodeSrgb) {
+        const __m256 s1 = _mm256_sqrt_ps(v);
+        const __m256 s2 = _mm256_sqrt_ps(s1);
+        const __m256 s3 = _mm256_sqrt_ps(s2);
+        __m256 curve = _mm256_add_ps(
+            _mm256_mul_ps(_mm256_set1_ps(0.662002687f), s1), _mm256_mul_ps(_mm256_set1_ps(0.684122060f), s2));
+        curve = _mm256_sub_ps(curve, _mm256_mul_ps(_mm256_set1_ps(0.323583601f), s3));
+        curve = _mm256_sub_ps(curve, _mm256_mul_ps(_mm256_set1_ps(0.0225411470f), v));
+        const __m256 linear = _mm256_mul_ps(_mm256_set1_ps(12.92f), v);
+        const __m256 isLinear = _mm256_cmp_ps(v, _mm256_set1_ps(srgbLinearThreshold), _CMP_LE_OQ);
+        v = _mm256_blendv_ps(curve, linear, isLinear);
+    }
+    __m256 q = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(255.0f)), dither), _mm256_set1_ps(0.5f));
+    q = _mm256_min_ps(_mm256_max_ps(q, zero), _mm256_set1_ps(255.0f));
+    return q;
+}
+
+TARGET_AVX2 void resolveRowAvx2(
+    const float* const planes[4], uint32_t width, const ResolveConstants &constants, RGBA* dst) {
+    const __m256 exposure = _mm256_set1_ps(constants.exposure);
+    const __m256 minWeight = _mm256_set1_ps(FLT_MIN);
+    // 8画素単位で進むので、4画素周期のパターンは常に先頭から読めばよい。
+    const __m256 dither = _mm256_loadu_ps(constants.ditherOffsets);
+    const __m256i alpha = _mm256_set1_epi32(static_cast<int32_t>(0xFF000000));
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m256 weight = _mm256_loadu_ps(planes[3] + x);
+        const __m256 scale = _mm256_and_ps(
+            _mm256_cmp_ps(weight, _mm256_setzero_ps(), _CMP_GT_OQ),
+            _mm256_div_ps(exposure, _mm256_max_ps(weight, minWeight)));
+        const __m256i r = _mm256_cvttps_epi32(
+            resolveChannelAvx2(_mm256_loadu_ps(planes[0] + x), scale, dither, constants));
+        const __m256i g = _mm256_cvttps_epi32(
+            resolveChannelAvx2(_mm256_loadu_ps(planes[1] + x), scale, dither, constants));
+        const __m256i b = _mm256_cvttps_epi32(
+            resolveChannelAvx2(_mm256_loadu_ps(planes[2] + x), scale, dither, constants));
+        const __m256i rgba = _mm256_or_si256(
+            _mm256_or_si256(r, _mm256_slli_epi32(g, 8)),
+            _mm256_or_si256(_mm256_slli_epi32(b, 16), alpha));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), rgba);
+    }
+    resolvePixelsScalar(planes, x, width, constants, dst);
+}
+
+
+
+TARGET_AVX512 inline __m512 resolveChannelAvx512(
+    __m512 sum, __m512 scale, __m512 dither, const ResolveConstants &constants) {
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 one = _mm512_set1_ps(1.0f);
+    __m512 v = _mm512_mul_ps(sum, scale);
+    if (constants.toneMapOperator == ToneMapOperator::Reinhard) {
+        v = _mm512_div_ps(v, _mm512_add_ps(one, v));
+    }
+    else if (constants.toneMapOperator == ToneMapOperator::AcesFitted) {
+        const __m512 num = _mm512_mul_ps(
+            v, _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(2.51f), v), _mm512_set1_ps(0.03f)));
+        const __m512 den = _mm512_add_ps(
+            _mm512_mul_ps(v, _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(2.43f), v), _mm512_set1_ps(0.59f))),
+            _mm512_set1_ps(0.14f));
+        v = _mm512_div_ps(num, den);
+    }
+    v = _mm512_min_ps(_mm512_max_ps(v, zero), one);
+    if (constants.encodeSrgb) {
+        const __m512 s1 = _mm512_sqrt_ps(v);
+        const __m512 s2 = _mm512_sqrt_ps(s1);
+        const __m512 s3 = _mm512_sqrt_ps(s2);
+        __m512 curve = _mm512_add_ps(
+            _mm512_mul_ps(_mm512_set1_ps(0.662002687f), s1), _mm512_mul_ps(_mm512_set1_ps(0.684122060f), s2));
+        curve = _mm512_sub_ps(curve, _mm512_mul_ps(_mm512_set1_ps(0.323583601f), s3));
+        curve = _mm512_sub_ps(curve, _mm512_mul_ps(_mm512_set1_ps(0.0225411470f), v));
+        const __m512 linear = _mm512_mul_ps(_mm512_set1_ps(12.92f), v);
+        const __mmask16 isLinear = _mm512_cmp_ps_mask(v, _mm512_set1_ps(srgbLinearThreshold), _CMP_LE_OQ);
+        v = _mm512_mask_blend_ps(isLinear, curve, linear);
+    }
+    __m512 q = _mm512_add_ps(
+        _mm512_add_ps(_mm512_mul_ps(v, _mm512_set1_ps(255.0f)), dither), _mm512_set1_ps(0.5f));
+    q = _mm512_min_ps(_mm512_max_ps(q, zero), _mm512_set1_ps(255.0f));
+    return q;
+}
+
+TARGET_AVX512 void resolveRowAvx512(
+    const float* const planes[4], uint32_t width, const ResolveConstants &constants, RGBA* dst) {
+    const __m512 exposure = _mm512_set1_ps(constants.exposure);
+    const __m512 minWeight = _mm512_set1_ps(FLT_MIN);
+    const __m512 dither = _mm512_loadu_ps(constants.ditherOffsets);
+    const __m512i alpha = _mm512_set1_epi32(static_cast<int32_t>(0xFF000000));
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m512 weight = _mm512_loadu_ps(planes[3] + x);
+        const __mmask16 hasWeight = _mm512_cmp_ps_mask(weight, _mm512_setzero_ps(), _CMP_GT_OQ);
+        const __m512 scale = _mm512_maskz_div_ps(hasWeight, exposure, _mm512_max_ps(weight, minWeight));
+        const __m512i r = _mm512_cvttps_epi32(
+            resolveChannelAvx512(_mm512_loadu_ps(planes[0] + x), scale, dither, constants));
+        const __m512i g = _mm512_cvttps_epi32(
+            resolveChannelAvx512(_mm512_loadu_ps(planes[1] + x), scale, dither, constants));
+        const __m512i b = _mm512_cvttps_epi32(
+            resolveChannelAvx512(_mm512_loadu_ps(planes[2] + x), scale, dither, constants));
+        const __m512i rgba = _mm512_or_si512(
+            _mm512_or_si512(r, _mm512_slli_epi32(g, 8)),
+            _mm512_or_si512(_mm512_slli_epi32(b, 16), alpha));
+        _mm512_storeu_si512(dst + x, rgba);
+    }
+    resolvePixelsScalar(planes, x, width, constants, dst);
+}
+
+
+
+void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, static_cast<int>(leaf), static_cast<int>(subleaf));
+    for (int i = 0; i < 4; ++i)
+        regs[i] = static_cast<uint32_t>(info[i]);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+uint64_t getXcr0() {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+#endif // HDR_FRAMEBUFFER_X64
+
+// CPUが命令に対応していても、OSがコンテキスト切り替えでYMM/ZMMレジスタを保存しない場合は使えない。
+SimdLevel detectSimdLevel() {
+#if defined(HDR_FRAMEBUFFER_X64)
+    uint32_t regs[4];
+    cpuid(0, 0, regs);
+    if (regs[0] < 7)
+        return SimdLevel::Scalar;
+    cpuid(1, 0, regs);
+    const bool hasOsxsave = (regs[2] >> 27) & 1;
+    const bool hasAvx = (regs[2] >> 28) & 1;
+    if (!hasOsxsave || !hasAvx)
+        return SimdLevel::Scalar;
+    const uint64_t xcr0 = getXcr0();
+    // XMM, YMMの状態。
+    if ((xcr0 & 0x06) != 0x06)
+        return SimdLevel::Scalar;
+    cpuid(7, 0, regs);
+    const bool hasAvx2 = (regs[1] >> 5) & 1;
+    const bool hasAvx512f = (regs[1] >> 16) & 1;
+    // 加えてopmask, ZMMの上位256ビット, ZMM16-31の状態。
+    if (hasAvx512f && (xcr0 & 0xE6) == 0xE6)
+        return SimdLevel::Avx512;
+    if (hasAvx2)
+        return SimdLevel::Avx2;
+#endif
+    return SimdLevel::Scalar;
+}
+
+} // namespace
+
+SimdLevel getSupportedSimdLevel() {
+    static const SimdLevel level = detectSimdLevel();
+    return level;
+}
+
+const char* getSimdLevelName(SimdLevel level) {
+    if (level == SimdLevel::Avx512)
+        return "avx512";
+    if (level == SimdLevel::Avx2)
+        return "avx2";
+    return "scalar";
+}
+
+
+
+HdrFramebuffer::HdrFramebuffer() :
+    m_width(0), m_height(0), m_stride(0),
+    m_simdLevel(getSupportedSimdLevel()), m_deferFirstTouch(false) {
+}
+
+void HdrFramebuffer::setDeferFirstTouch(bool enabled) {
+    m_deferFirstTouch = enabled;
+}
+
+void HdrFramebuffer::resize(uint32_t width, uint32_t height) {
+    m_width = width;
+    m_height = height;
+    m_stride = (width + 15) & ~15u;
+    const size_t size = static_cast<size_t>(m_stride) * height;
+    for (PageVector<float> &plane : m_planes) {
+        if (m_deferFirstTouch) {
+            // 既存の要素を移すと触れてしまうので、作り直してから要素に触れずに広げる。
+            plane = PageVector<float>();
+            plane.resize(size);
+        }
+        else {
+            plane.assign(size, 0.0f);
+        }
+    }
+}
+
+void HdrFramebuffer::clear() {
+    clear(0, m_height);
+}
+
+void HdrFramebuffer::clear(uint32_t beginRow, uint32_t endRow) {
+    const size_t begin = static_cast<size_t>(beginRow) * m_stride;
+    const size_t end = static_cast<size_t>(endRow) * m_stride;
+    for (PageVector<float> &plane : m_planes)
+        std::fill(plane.begin() + begin, plane.begin() + end, 0.0f);
+}
+
+void HdrFramebuffer::setSimdLevel(SimdLevel level) {
+    m_simdLevel = std::min(level, getSupportedSimdLevel());
+}
+
+void HdrFramebuffer::resolve(const ResolveSettings &settings, RGBA* pixels, uint32_t beginRow, uint32_t endRow) const {
+    ResolveRowFunc resolveRow = resolveRowScalar;
+#if defined(HDR_FRAMEBUFFER_X64)
+    if (m_simdLevel == SimdLevel::Avx512)
+        resolveRow = resolveRowAvx512;
+    else if (m_simdLevel == SimdLevel::Avx2)
+        resolveRow = resolveRowAvx2;
+#endif
+
+    ResolveConstants constants;
+    constants.exposure = settings.exposure;
+    constants.toneMapOperator = settings.toneMapOperator;
+    constants.encodeSrgb = settings.encodeSrgb;
+    endRow = std::min(endRow, m_height);
+    for (uint32_t y = beginRow; y < endRow; ++y) {
+        for (uint32_t i = 0; i < 16; ++i) {
+            constants.ditherOffsets[i] = settings.dither ?
+                (bayerMatrix[y & 3][i & 3] + 0.5f) / 16.0f - 0.5f : 0.0f;
+        }
+        const size_t offset = static_cast<size_t>(y) * m_stride;
+        const float* const planes[4] = {
+            m_planes[0].data() + offset,
+            m_planes[1].data() + offset,
+            m_planes[2].data() + offset,
+            m_planes[3].data() + offset,
+        };
+        resolveRow(planes, m_width, constants, pixels + static_cast<size_t>(y) * m_width);
+    }
+}
@@ -0,0 +1,91 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "render_engine.h"
+#include "numa.h"
+
+// 解決(resolve)カーネルの命令セット。
+enum class SimdLevel {
+    Scalar = 0,
+    Avx2,
+    Avx512,
+};
+
+// CPUIDとOSのレジスタ保存の対応から、このマシンで使える最も広い命令セットを返す。
+SimdLevel getSupportedSimdLevel();
+const char* getSimdLevelName(SimdLevel level);
+
+enum class ToneMapOperator {
+    Clamp = 0,
+    Reinhard,
+    // Narkowiczによる近似のACES filmic。
+    AcesFitted,
+};
+
+struct ResolveSettings {
+    float exposure = 1.0f;
+    ToneMapOperator toneMapOperator = ToneMapOperator::AcesFitted;
+    // sRGBのガンマで符号化する。符号化は平方根の組み合わせによる近似で、誤差は量子化幅の1/4以内。
+    bool encodeSrgb = true;
+    // 4x4のBayer行列で量子化前に揺らし、グラデーションの縞を目立たなくする。
+    bool dither = true;
+};
+
+// プログレッシブなサンプリングのための浮動小数点の蓄積バッファ。
+// R, G, Bとサンプルの重みを別々の平面(SoA)に持ち、解決時にまとめてSIMDで処理する。
+// 解決ではexposure、トーンマップ、sRGB符号化、ディザを順に適用してRGBA8に量子化する。
+// どの命令セットでも同じ演算を同じ順で行うので、スカラー版と結果は一致する。
+class HdrFramebuffer {
+    uint32_t m_width;
+    uint32_t m_height;
+    // 行の先頭を揃えるため、各平面の行の長さは16画素の倍数にする。
+    uint32_t m_stride;
+    // 大きなページやNUMAノードへの配置が効くよう、allocatePages()で確保する。
+    PageVector<float> m_planes[4];
+    SimdLevel m_simdLevel;
+    bool m_deferFirstTouch;
+
+public:
+    HdrFramebuffer();
+
+    // trueにするとresize()で平面をゼロ埋めせず、ページに最初に触れるのを描画するスレッドに任せる。
+    // その場合はサンプルを足す前に、各スレッドが自分の行をclear(beginRow, endRow)で初期化する。
+    void setDeferFirstTouch(bool enabled);
+
+    void resize(uint32_t width, uint32_t height);
+    void clear();
+    // [beginRow, endRow)の行をゼロにする。行の範囲ごとに別のスレッドから呼んでよい。
+    void clear(uint32_t beginRow, uint32_t endRow);
+
+    uint32_t getWidth() const {
+        return m_width;
+    }
+    uint32_t getHeight() const {
+        return m_height;
+    }
+
+    // 既定では対応する最も広い命令セットを使う。計測のために狭いものを選べる。
+    // 対応していない命令セットを指定した場合は対応する範囲に下げる。
+    void setSimdLevel(SimdLevel level);
+    SimdLevel getSimdLevel() const {
+        return m_simdLevel;
+    }
+
+    // 画素(x, y)に重みweightのサンプルを足す。
+    void addSample(uint32_t x, uint32_t y, float r, float g, float b, float weight = 1.0f) {
+        const size_t index = static_cast<size_t>(y) * m_stride + x;
+        m_planes[0][index] += weight * r;
+        m_planes[1][index] += weight * g;
+        m_planes[2][index] += weight * b;
+        m_planes[3][index] += weight;
+    }
+
+    // [beginRow, endRow)の行を解決してpixelsに書く。pixelsは幅width、フレーム全体の先頭を指す。
+    // 行の範囲ごとに別のスレッドから呼んでよい。
+    void resolve(const ResolveSettings &settings, RGBA* pixels, uint32_t beginRow, uint32_t endRow) const;
+    void resolve(const ResolveSettings &settings, RGBA* pixels) const {
+        resolve(settings, pixels, 0, m_height);
+    }
+};
@@ -0,0 +1,170 @@
+﻿#include "image_encoder.h"
+
+#include <cstdio>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+
+// https://github.com/richgel999/fpng
+#include "fpng.h"
+
+// https://github.com/nothings/stb
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+namespace {
+
+void appendToVector(void* context, void* data, int size) {
+    std::vector<uint8_t> &out = *static_cast<std::vector<uint8_t>*>(context);
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    out.insert(out.end(), bytes, bytes + size);
+}
+
+class FpngEncoder : public ImageEncoder {
+    uint32_t m_flags;
+    char m_description[64];
+
+public:
+    explicit FpngEncoder(bool slower) : m_flags(slower ? fpng::FPNG_ENCODE_SLOWER : 0) {
+        fpng::fpng_init();
+        sprintf_s(m_description, "fpng%s", slower ? " (slower)" : "");
+    }
+
+    EncoderBackend getBackend() const override {
+        return EncoderBackend::Fpng;
+    }
+    const char* getExtension() const override {
+        return "png";
+    }
+    const char* getDescription() const override {
+        return m_description;
+    }
+    bool encode(const RGBA* pixels, uint32_t width, uint32_t height, std::vector<uint8_t> &out) const override {
+        return fpng::fpng_encode_image_to_memory(pixels, width, height, 4, out, m_flags);
+    }
+};
+
+// stbi_write_png_compression_levelはプロセスで共通の変数なので、エンコード中は他の値に変えさせない。
+// 同じレベルのエンコードは同時に走らせ、異なるレベルのエンコードは走っているものが終わるまで待つ。
+class StbPngCompressionLevelGuard {
+    static std::mutex s_mutex;
+    static std::condition_variable s_condVar;
+    static uint32_t s_numActiveEncodes;
+
+public:
+    explicit StbPngCompressionLevelGuard(int32_t compressionLevel) {
+        std::unique_lock lock(s_mutex);
+        s_condVar.wait(
+            lock,
+            [compressionLevel]() {
+                return s_numActiveEncodes == 0 || stbi_write_png_compression_level == compressionLevel;
+            });
+        stbi_write_png_compression_level = compressionLevel;
+        ++s_numActiveEncodes;
+    }
+    ~StbPngCompressionLevelGuard() {
+        {
+            std::lock_guard lock(s_mutex);
+            --s_numActiveEncodes;
+        }
+        s_condVar.notify_all();
+    }
+
+    StbPngCompressionLevelGuard(const StbPngCompressionLevelGuard &) = delete;
+    StbPngCompressionLevelGuard &operator=(const StbPngCompressionLevelGuard &) = delete;
+};
+
+std::mutex StbPngCompressionLevelGuard::s_mutex;
+std::condition_variable StbPngCompressionLevelGuard::s_condVar;
+uint32_t StbPngCompressionLevelGuard::s_numActiveEncodes = 0;
+
+class StbPngEncoder : public ImageEncoder {
+    int32_t m_compressionLevel;
+    char m_description[64];
+
+public:
+    explicit StbPngEncoder(int32_t compressionLevel) : m_compressionLevel(std::clamp(compressionLevel, 0, 9)) {
+        sprintf_s(m_description, "stb-png (level %d)", m_compressionLevel);
+    }
+
+    EncoderBackend getBackend() const override {
+        return EncoderBackend::StbPng;
+    }
+    const char* getExtension() const override {
+        return "png";
+    }
+    const char* getDescription() const override {
+        return m_description;
+    }
+    bool encode(const RGBA* pixels, uint32_t width, uint32_t height, std::vector<uint8_t> &out) const override {
+        out.clear();
+        StbPngCompressionLevelGuard levelGuard(m_compressionLevel);
+        return stbi_write_png_to_func(
+            appendToVector, &out, static_cast<int>(width), static_cast<int>(height), 4,
+            pixels, static_cast<int>(width * sizeof(RGBA))) != 0;
+    }
+};
+
+class StbJpegEncoder : public ImageEncoder {
+    int32_t m_quality;
+    char m_description[64];
+
+public:
+    explicit StbJpegEncoder(int32_t quality) : m_quality(std::clamp(quality, 1, 100)) {
+        sprintf_s(m_description, "stb-jpeg (quality %d)", m_quality);
+    }
+
+    EncoderBackend getBackend() const override {
+        return EncoderBackend::StbJpeg;
+    }
+    const char* getExtension() const override {
+        return "jpg";
+    }
+    const char* getDescription() const override {
+        return m_description;
+    }
+    bool encode(const RGBA* pixels, uint32_t width, uint32_t height, std::vector<uint8_t> &out) const override {
+        out.clear();
+        return stbi_write_jpg_to_func(
+            appendToVector, &out, static_cast<int>(width), static_cast<int>(height), 4,
+            pixels, m_quality) != 0;
+    }
+};
+
+} // namespace
+
+std::unique_ptr<ImageEncoder> createImageEncoder(const EncoderSettings &settings) {
+    if (settings.backend == EncoderBackend::StbPng)
+        return std::make_unique<StbPngEncoder>(settings.pngCompressionLevel);
+    if (settings.backend == EncoderBackend::StbJpeg)
+        return std::make_unique<StbJpegEncoder>(settings.jpegQuality);
+    return std::make_unique<FpngEncoder>(settings.fpngSlower);
+}
+
+std::vector<std::unique_ptr<ImageEncoder>> createImageEncodersOfAllBackends(const EncoderSettings &settings) {
+    std::vector<std::unique_ptr<ImageEncoder>> encoders;
+    for (const EncoderBackend backend : { EncoderBackend::Fpng, EncoderBackend::StbPng, EncoderBackend::StbJpeg }) {
+        EncoderSettings backendSettings = settings;
+        backendSettings.backend = backend;
+        encoders.push_back(createImageEncoder(backendSettings));
+    }
+    return encoders;
+}
+
+const char* getEncoderBackendName(EncoderBackend backend) {
+    if (backend == EncoderBackend::StbPng)
+        return "stb-png";
+    if (backend == EncoderBackend::StbJpeg)
+        return "stb-jpeg";
+    return "fpng";
+}
+
+bool parseEncoderBackend(std::string_view name, EncoderBackend* backend) {
+    for (const EncoderBackend candidate : { EncoderBackend::Fpng, EncoderBackend::StbPng, EncoderBackend::StbJpeg }) {
+        if (name == getEncoderBackendName(candidate)) {
+            *backend = candidate;
+            return true;
+        }
+    }
+    return false;
+}
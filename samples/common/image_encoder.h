@@ -0,0 +1,45 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <string_view>
+
+#include "render_engine.h"
+
+enum class EncoderBackend {
+    Fpng = 0,
+    StbPng,
+    StbJpeg,
+};
+
+struct EncoderSettings {
+    EncoderBackend backend = EncoderBackend::Fpng;
+    // fpngで圧縮率を優先するモードを使う。
+    bool fpngSlower = false;
+    // stb PNGのzlib圧縮レベル(0-9)。stb_image_writeの設定はプロセスで共通なので、エンコードのたびに設定する。
+    int32_t pngCompressionLevel = 8;
+    // stb JPEGの品質(1-100)。アルファは捨てる。
+    int32_t jpegQuality = 90;
+};
+
+// フレームを画像ファイルの形式にエンコードする。複数のエンコードスレッドから同時に呼ばれる。
+class ImageEncoder {
+public:
+    virtual ~ImageEncoder() = default;
+
+    virtual EncoderBackend getBackend() const = 0;
+    // 出力ファイルの拡張子("png"など)。
+    virtual const char* getExtension() const = 0;
+    // 設定を含めた表示名。
+    virtual const char* getDescription() const = 0;
+    virtual bool encode(const RGBA* pixels, uint32_t width, uint32_t height, std::vector<uint8_t> &out) const = 0;
+};
+
+std::unique_ptr<ImageEncoder> createImageEncoder(const EncoderSettings &settings);
+// 全バックエンドのエンコーダーを作る。backend以外の設定はsettingsに従う。
+std::vector<std::unique_ptr<ImageEncoder>> createImageEncodersOfAllBackends(const EncoderSettings &settings);
+
+const char* getEncoderBackendName(EncoderBackend backend);
+// "fpng", "stb-png", "stb-jpeg"のいずれか。
+bool parseEncoderBackend(std::string_view name, EncoderBackend* backend);
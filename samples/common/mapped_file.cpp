@@ -0,0 +1,178 @@
+﻿#include "mapped_file.h"
+
+#include <cstdio>
+#include <stdexcept>
+
+#if defined(_WIN32)
+#   define NOMINMAX
+#   include <Windows.h>
+#else
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#endif
+
+static void throwError(const char* what, const std::string &path) {
+    char msg[512];
+    sprintf_s(msg, "%s: %s\n", what, path.c_str());
+    throw std::runtime_error(msg);
+}
+
+
+
+#if defined(_WIN32)
+
+MappedFile::MappedFile() :
+    m_data(nullptr), m_size(0), m_isWritable(false),
+    m_fileHandle(nullptr), m_mappingHandle(nullptr) {
+}
+
+bool MappedFile::openForRead(const std::string &path) {
+    close();
+
+    const HANDLE file = CreateFileA(
+        path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        return false;
+    }
+    m_fileHandle = file;
+    m_size = static_cast<size_t>(size.QuadPart);
+    m_isWritable = false;
+
+    // 空のファイルはマップできないので、大きさ0のまま開いた扱いにする。
+    if (m_size == 0)
+        return true;
+    m_mappingHandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mappingHandle)
+        m_data = static_cast<uint8_t*>(MapViewOfFile(m_mappingHandle, FILE_MAP_READ, 0, 0, 0));
+    if (!m_data) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::create(const std::string &path, size_t size) {
+    close();
+
+    const HANDLE file = CreateFileA(
+        path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        throwError("Failed to create a file", path);
+    m_fileHandle = file;
+    m_size = size;
+    m_isWritable = true;
+
+    if (m_size == 0)
+        return;
+    const DWORD sizeHigh = static_cast<DWORD>(static_cast<uint64_t>(size) >> 32);
+    const DWORD sizeLow = static_cast<DWORD>(size);
+    m_mappingHandle = CreateFileMappingA(file, nullptr, PAGE_READWRITE, sizeHigh, sizeLow, nullptr);
+    if (m_mappingHandle)
+        m_data = static_cast<uint8_t*>(MapViewOfFile(m_mappingHandle, FILE_MAP_WRITE, 0, 0, 0));
+    if (!m_data) {
+        close();
+        throwError("Failed to map a file", path);
+    }
+}
+
+void MappedFile::close() {
+    if (m_data) {
+        if (m_isWritable)
+            FlushViewOfFile(m_data, 0);
+        UnmapViewOfFile(m_data);
+    }
+    if (m_mappingHandle)
+        CloseHandle(m_mappingHandle);
+    if (m_fileHandle)
+        CloseHandle(m_fileHandle);
+    m_data = nullptr;
+    m_size = 0;
+    m_isWritable = false;
+    m_mappingHandle = nullptr;
+    m_fileHandle = nullptr;
+}
+
+#else
+
+MappedFile::MappedFile() :
+    m_data(nullptr), m_size(0), m_isWritable(false), m_fd(-1) {
+}
+
+bool MappedFile::openForRead(const std::string &path) {
+    close();
+
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    m_fd = fd;
+    m_size = static_cast<size_t>(st.st_size);
+    m_isWritable = false;
+
+    if (m_size == 0)
+        return true;
+    void* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close();
+        return false;
+    }
+    m_data = static_cast<uint8_t*>(data);
+    madvise(m_data, m_size, MADV_SEQUENTIAL);
+    return true;
+}
+
+void MappedFile::create(const std::string &path, size_t size) {
+    close();
+
+    const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throwError("Failed to create a file", path);
+    m_fd = fd;
+    m_size = size;
+    m_isWritable = true;
+
+    if (m_size == 0)
+        return;
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        close();
+        throwError("Failed to allocate a file", path);
+    }
+    void* data = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close();
+        throwError("Failed to map a file", path);
+    }
+    m_data = static_cast<uint8_t*>(data);
+}
+
+void MappedFile::close() {
+    if (m_data) {
+        if (m_isWritable)
+            msync(m_data, m_size, MS_ASYNC);
+        munmap(m_data, m_size);
+    }
+    if (m_fd >= 0)
+        ::close(m_fd);
+    m_data = nullptr;
+    m_size = 0;
+    m_isWritable = false;
+    m_fd = -1;
+}
+
+#endif
+
+MappedFile::~MappedFile() {
+    close();
+}
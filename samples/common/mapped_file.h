@@ -0,0 +1,49 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// ファイル全体をメモリにマップする。大きなデータを中間バッファを介さずに読み書きするのに使う。
+class MappedFile {
+    uint8_t* m_data;
+    size_t m_size;
+    bool m_isWritable;
+#if defined(_WIN32)
+    void* m_fileHandle;
+    void* m_mappingHandle;
+#else
+    int m_fd;
+#endif
+
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // 既存のファイルを読み取り専用でマップする。存在しない場合はfalseを返す。
+    bool openForRead(const std::string &path);
+    // sizeバイトのファイルを作り直して読み書き可能でマップする。失敗した場合は例外を投げる。
+    void create(const std::string &path, size_t size);
+    // 書き込んだ内容をファイルに反映してマップを解除する。
+    void close();
+
+    bool isOpen() const {
+#if defined(_WIN32)
+        return m_fileHandle != nullptr;
+#else
+        return m_fd >= 0;
+#endif
+    }
+    const uint8_t* getData() const {
+        return m_data;
+    }
+    uint8_t* getWritableData() const {
+        return m_isWritable ? m_data : nullptr;
+    }
+    size_t getSize() const {
+        return m_size;
+    }
+};
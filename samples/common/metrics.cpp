@@ -0,0 +1,114 @@
+﻿#include "metrics.h"
+
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+
+LatencyHistogram::LatencyHistogram(std::vector<double> upperBounds) :
+    m_upperBounds(std::move(upperBounds)), m_sumNanoseconds(0) {
+    std::sort(m_upperBounds.begin(), m_upperBounds.end());
+    m_counts = std::make_unique<std::atomic<uint64_t>[]>(m_upperBounds.size() + 1);
+    for (size_t i = 0; i <= m_upperBounds.size(); ++i)
+        m_counts[i].store(0, std::memory_order_relaxed);
+}
+
+std::vector<double> LatencyHistogram::makeExponentialBounds(double first, double factor, uint32_t count) {
+    std::vector<double> bounds(count);
+    double bound = first;
+    for (uint32_t i = 0; i < count; ++i) {
+        bounds[i] = bound;
+        bound *= factor;
+    }
+    return bounds;
+}
+
+void LatencyHistogram::observe(double seconds) {
+    // バケット数は十数個なので線形探索で足りる。
+    size_t bucketIndex = 0;
+    while (bucketIndex < m_upperBounds.size() && seconds > m_upperBounds[bucketIndex])
+        ++bucketIndex;
+    m_counts[bucketIndex].fetch_add(1, std::memory_order_relaxed);
+    m_sumNanoseconds.fetch_add(
+        static_cast<uint64_t>(std::max(seconds, 0.0) * 1e+9), std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::getCount() const {
+    uint64_t count = 0;
+    for (size_t i = 0; i <= m_upperBounds.size(); ++i)
+        count += m_counts[i].load(std::memory_order_relaxed);
+    return count;
+}
+
+double LatencyHistogram::getSum() const {
+    return m_sumNanoseconds.load(std::memory_order_relaxed) * 1e-9;
+}
+
+double LatencyHistogram::estimateQuantile(double q) const {
+    const size_t numBuckets = m_upperBounds.size() + 1;
+    std::vector<uint64_t> counts(numBuckets);
+    uint64_t totalCount = 0;
+    for (size_t i = 0; i < numBuckets; ++i) {
+        counts[i] = m_counts[i].load(std::memory_order_relaxed);
+        totalCount += counts[i];
+    }
+    if (totalCount == 0)
+        return 0.0;
+
+    const double rank = std::clamp(q, 0.0, 1.0) * totalCount;
+    uint64_t cumulativeCount = 0;
+    for (size_t i = 0; i < numBuckets; ++i) {
+        if (counts[i] == 0 || cumulativeCount + counts[i] < rank) {
+            cumulativeCount += counts[i];
+            continue;
+        }
+        // 上限を超えたバケットは幅がわからないので最後の上限値を返す。
+        if (i == m_upperBounds.size())
+            return m_upperBounds.empty() ? 0.0 : m_upperBounds.back();
+        const double lower = i > 0 ? m_upperBounds[i - 1] : 0.0;
+        const double upper = m_upperBounds[i];
+        return lower + (upper - lower) * (rank - cumulativeCount) / counts[i];
+    }
+    return m_upperBounds.empty() ? 0.0 : m_upperBounds.back();
+}
+
+void LatencyHistogram::appendPrometheus(std::string &out, const char* name, const char* help, const char* labels) const {
+    appendMetricHeader(out, name, "histogram", help);
+    const char* separator = labels[0] != '\0' ? "," : "";
+    char line[256];
+    uint64_t cumulativeCount = 0;
+    for (size_t i = 0; i <= m_upperBounds.size(); ++i) {
+        cumulativeCount += m_counts[i].load(std::memory_order_relaxed);
+        if (i < m_upperBounds.size()) {
+            sprintf_s(
+                line, "%s_bucket{%s%sle=\"%g\"} %llu\n",
+                name, labels, separator, m_upperBounds[i], static_cast<unsigned long long>(cumulativeCount));
+        }
+        else {
+            sprintf_s(
+                line, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+                name, labels, separator, static_cast<unsigned long long>(cumulativeCount));
+        }
+        out += line;
+    }
+    char sumName[128];
+    sprintf_s(sumName, "%s_sum", name);
+    appendMetricValue(out, sumName, labels, getSum());
+    char countName[128];
+    sprintf_s(countName, "%s_count", name);
+    appendMetricValue(out, countName, labels, static_cast<double>(cumulativeCount));
+}
+
+void appendMetricHeader(std::string &out, const char* name, const char* type, const char* help) {
+    char line[512];
+    sprintf_s(line, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    out += line;
+}
+
+void appendMetricValue(std::string &out, const char* name, const char* labels, double value) {
+    char line[256];
+    if (labels[0] != '\0')
+        sprintf_s(line, "%s{%s} %.9g\n", name, labels, value);
+    else
+        sprintf_s(line, "%s %.9g\n", name, value);
+    out += line;
+}
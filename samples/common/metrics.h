@@ -0,0 +1,37 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+
+// 固定の上限値ごとに数えるヒストグラム。観測はロックを取らないのでどのスレッドからでも呼べる。
+// 読み出しは観測と並行してよいが、各バケットを別々に読むので合計がわずかにずれることがある。
+class LatencyHistogram {
+    std::vector<double> m_upperBounds;
+    // 最後の要素は上限を超えた分。
+    std::unique_ptr<std::atomic<uint64_t>[]> m_counts;
+    std::atomic<uint64_t> m_sumNanoseconds;
+
+public:
+    // upperBoundsは昇順の上限値[s]。
+    explicit LatencyHistogram(std::vector<double> upperBounds);
+    // firstから始めてfactor倍ずつcount個の上限値を作る。
+    static std::vector<double> makeExponentialBounds(double first, double factor, uint32_t count);
+
+    void observe(double seconds);
+
+    uint64_t getCount() const;
+    double getSum() const;
+    // q(0-1)の分位点をバケット内の線形補間で見積もる。観測が無い場合は0。
+    double estimateQuantile(double q) const;
+
+    // Prometheusのテキスト形式でhistogramとして追記する。labelsは"session=\"1\""のような追加のラベル。
+    void appendPrometheus(std::string &out, const char* name, const char* help, const char* labels = "") const;
+};
+
+// Prometheusのテキスト形式の"# HELP"と"# TYPE"の行を追記する。typeは"counter", "gauge"など。
+void appendMetricHeader(std::string &out, const char* name, const char* type, const char* help);
+// labelsが空でなければ{}で囲んで付ける。
+void appendMetricValue(std::string &out, const char* name, const char* labels, double value);
@@ -0,0 +1,267 @@
+﻿#include "numa.h"
+
+#include <cstdio>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#if defined(_WIN32)
+#   define NOMINMAX
+#   include <Windows.h>
+#   include <Psapi.h>
+#else
+#   include <cerrno>
+#   include <fstream>
+#   include <filesystem>
+#   include <pthread.h>
+#   include <sched.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#endif
+
+static std::atomic<bool> s_hugePagesEnabled(false);
+
+static size_t getPageSize() {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+#if !defined(_WIN32)
+// "0-63,128-191"の形式のCPUリストを読む。
+static std::vector<uint32_t> parseCpuList(const std::string &str) {
+    std::vector<uint32_t> cpus;
+    size_t pos = 0;
+    while (pos < str.size()) {
+        size_t end = str.find(',', pos);
+        if (end == std::string::npos)
+            end = str.size();
+        const std::string range = str.substr(pos, end - pos);
+        const size_t dash = range.find('-');
+        try {
+            const uint32_t first = static_cast<uint32_t>(std::stoul(range.substr(0, dash)));
+            const uint32_t last = dash == std::string::npos ?
+                first : static_cast<uint32_t>(std::stoul(range.substr(dash + 1)));
+            for (uint32_t cpu = first; cpu <= last; ++cpu)
+                cpus.push_back(cpu);
+        }
+        catch (const std::exception &) {
+        }
+        pos = end + 1;
+    }
+    return cpus;
+}
+#endif
+
+
+
+NumaTopology::NumaTopology() {
+#if defined(_WIN32)
+    ULONG highestNodeNumber;
+    if (GetNumaHighestNodeNumber(&highestNodeNumber)) {
+        for (ULONG nodeID = 0; nodeID <= highestNodeNumber; ++nodeID) {
+            GROUP_AFFINITY affinity;
+            if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(nodeID), &affinity) || affinity.Mask == 0)
+                continue;
+            NumaNode node;
+            node.id = nodeID;
+            for (uint32_t bit = 0; bit < 64; ++bit) {
+                if ((affinity.Mask >> bit) & 1)
+                    node.cpus.push_back(affinity.Group * 64 + bit);
+            }
+            m_nodes.push_back(std::move(node));
+        }
+    }
+#else
+    // コンテナやtasksetで使えるCPUが絞られている場合はその範囲に限る。
+    cpu_set_t allowedCpus;
+    const bool hasAllowedCpus = sched_getaffinity(0, sizeof(allowedCpus), &allowedCpus) == 0;
+
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+        const std::string name = entry.path().filename().string();
+        if (name.size() <= 4 || name.compare(0, 4, "node") != 0 ||
+            name.find_first_not_of("0123456789", 4) != std::string::npos)
+            continue;
+        std::ifstream file(entry.path() / "cpulist");
+        std::string cpuList;
+        if (!std::getline(file, cpuList))
+            continue;
+
+        NumaNode node;
+        node.id = static_cast<uint32_t>(std::stoul(name.substr(4)));
+        for (const uint32_t cpu : parseCpuList(cpuList)) {
+            if (!hasAllowedCpus || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowedCpus)))
+                node.cpus.push_back(cpu);
+        }
+        if (!node.cpus.empty())
+            m_nodes.push_back(std::move(node));
+    }
+    std::sort(
+        m_nodes.begin(), m_nodes.end(),
+        [](const NumaNode &a, const NumaNode &b) {
+            return a.id < b.id;
+        });
+#endif
+
+    if (m_nodes.empty()) {
+        NumaNode node;
+        node.id = 0;
+        for (uint32_t cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); ++cpu)
+            node.cpus.push_back(cpu);
+        m_nodes.push_back(std::move(node));
+    }
+}
+
+uint32_t NumaTopology::getNodeIndexOfItem(uint32_t itemIndex, uint32_t numItems) const {
+    uint64_t numCpus = 0;
+    for (const NumaNode &node : m_nodes)
+        numCpus += node.cpus.size();
+    // 要素の中心がどのノードの区間に入るかで決める。
+    const uint64_t position = (2 * static_cast<uint64_t>(itemIndex) + 1) * numCpus;
+    uint64_t nodeEnd = 0;
+    for (uint32_t nodeIdx = 0; nodeIdx < m_nodes.size(); ++nodeIdx) {
+        nodeEnd += m_nodes[nodeIdx].cpus.size();
+        if (position < 2 * nodeEnd * numItems)
+            return nodeIdx;
+    }
+    return getNumNodes() - 1;
+}
+
+bool NumaTopology::pinCurrentThread(uint32_t nodeIndex) const {
+    const NumaNode &node = m_nodes[nodeIndex];
+#if defined(_WIN32)
+    // ノードはプロセッサグループをまたがないので、先頭のCPUのグループに揃える。
+    GROUP_AFFINITY affinity = {};
+    affinity.Group = static_cast<WORD>(node.cpus.front() / 64);
+    for (const uint32_t cpu : node.cpus) {
+        if (cpu / 64 == affinity.Group)
+            affinity.Mask |= static_cast<KAFFINITY>(1) << (cpu % 64);
+    }
+    return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#else
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    for (const uint32_t cpu : node.cpus) {
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &cpuSet);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet) == 0;
+#endif
+}
+
+void NumaTopology::countPagePlacement(
+    const void* data, size_t size,
+    uint64_t* numLocalPages, uint64_t* numRemotePages, uint64_t* numUntouchedPages) const {
+    const size_t pageSize = getPageSize();
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(data) / pageSize * pageSize;
+    const uintptr_t end = (reinterpret_cast<uintptr_t>(data) + size + pageSize - 1) / pageSize * pageSize;
+    const uint32_t numPages = static_cast<uint32_t>((end - begin) / pageSize);
+
+    // 一度に問い合わせるページ数。
+    constexpr uint32_t batchSize = 1024;
+    std::vector<int32_t> pageNodes(batchSize);
+#if defined(_WIN32)
+    std::vector<PSAPI_WORKING_SET_EX_INFORMATION> infos(batchSize);
+#else
+    std::vector<void*> pages(batchSize);
+    std::vector<int> status(batchSize);
+#endif
+    for (uint32_t batchStart = 0; batchStart < numPages; batchStart += batchSize) {
+        const uint32_t numBatchPages = std::min(batchSize, numPages - batchStart);
+#if defined(_WIN32)
+        for (uint32_t i = 0; i < numBatchPages; ++i)
+            infos[i].VirtualAddress = reinterpret_cast<void*>(begin + (batchStart + i) * pageSize);
+        const bool succeeded = QueryWorkingSetEx(
+            GetCurrentProcess(), infos.data(),
+            static_cast<DWORD>(numBatchPages * sizeof(PSAPI_WORKING_SET_EX_INFORMATION))) != 0;
+        for (uint32_t i = 0; i < numBatchPages; ++i) {
+            pageNodes[i] = succeeded && infos[i].VirtualAttributes.Valid ?
+                static_cast<int32_t>(infos[i].VirtualAttributes.Node) : -1;
+        }
+#else
+        // nodesにnullptrを渡すとページを移動せず、現在のノードをstatusに返す。
+        for (uint32_t i = 0; i < numBatchPages; ++i)
+            pages[i] = reinterpret_cast<void*>(begin + (batchStart + i) * pageSize);
+        const bool succeeded = syscall(
+            SYS_move_pages, 0, numBatchPages, pages.data(), nullptr, status.data(), 0) == 0;
+        for (uint32_t i = 0; i < numBatchPages; ++i)
+            pageNodes[i] = succeeded ? status[i] : -1;
+#endif
+
+        for (uint32_t i = 0; i < numBatchPages; ++i) {
+            if (pageNodes[i] < 0) {
+                ++*numUntouchedPages;
+                continue;
+            }
+            const uint32_t expectedNodeID = m_nodes[getNodeIndexOfItem(batchStart + i, numPages)].id;
+            if (static_cast<uint32_t>(pageNodes[i]) == expectedNodeID)
+                ++*numLocalPages;
+            else
+                ++*numRemotePages;
+        }
+    }
+}
+
+void NumaTopology::print() const {
+    printf("NUMA: %u nodes (", getNumNodes());
+    for (uint32_t nodeIdx = 0; nodeIdx < m_nodes.size(); ++nodeIdx) {
+        printf(
+            "%snode %u: %zu CPUs", nodeIdx > 0 ? ", " : "",
+            m_nodes[nodeIdx].id, m_nodes[nodeIdx].cpus.size());
+    }
+    printf(")\n");
+}
+
+const NumaTopology &getNumaTopology() {
+    static const NumaTopology topology;
+    return topology;
+}
+
+
+
+void setHugePagesEnabled(bool enabled) {
+    s_hugePagesEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+void* allocatePages(size_t size) {
+    if (size == 0)
+        size = 1;
+    const bool useHugePages = s_hugePagesEnabled.load(std::memory_order_relaxed);
+#if defined(_WIN32)
+    if (useHugePages) {
+        const size_t largePageSize = GetLargePageMinimum();
+        if (largePageSize > 0) {
+            void* data = VirtualAlloc(
+                nullptr, (size + largePageSize - 1) / largePageSize * largePageSize,
+                MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (data)
+                return data;
+        }
+    }
+    return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+        return nullptr;
+    if (useHugePages)
+        madvise(data, size, MADV_HUGEPAGE);
+    return data;
+#endif
+}
+
+void freePages(void* data, size_t size) {
+    if (!data)
+        return;
+#if defined(_WIN32)
+    VirtualFree(data, 0, MEM_RELEASE);
+#else
+    munmap(data, size == 0 ? 1 : size);
+#endif
+}
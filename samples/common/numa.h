@@ -0,0 +1,103 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <new>
+#include <utility>
+
+// NUMAノードとそこに属する論理CPU。
+struct NumaNode {
+    // OS上のノード番号。
+    uint32_t id;
+    std::vector<uint32_t> cpus;
+};
+
+// マシンのNUMA構成。Linuxでは/sys/devices/system/node、WindowsではGetNumaNodeProcessorMaskEx()から読む。
+// 取得できない場合は全CPUをひとつのノードとみなす。CPUを持たないメモリだけのノードは含めない。
+class NumaTopology {
+    std::vector<NumaNode> m_nodes;
+
+public:
+    NumaTopology();
+
+    uint32_t getNumNodes() const {
+        return static_cast<uint32_t>(m_nodes.size());
+    }
+    const NumaNode &getNode(uint32_t nodeIndex) const {
+        return m_nodes[nodeIndex];
+    }
+
+    // numItems個の連続した要素を各ノードのCPU数に比例した区間に分けた場合の、itemIndexが属するノードの番号(0から)。
+    // ワーカーの割り当てとメモリの配置の両方をこの分け方に揃える。
+    uint32_t getNodeIndexOfItem(uint32_t itemIndex, uint32_t numItems) const;
+
+    // 呼び出したスレッドをノードのCPUに固定する。
+    bool pinCurrentThread(uint32_t nodeIndex) const;
+
+    // [data, data + size)の各ページが置かれたノードを調べる。
+    // 先頭から各ノードのCPU数に比例して分けた区間のノードに置かれていればlocal、それ以外はremoteとして数える。
+    // まだ一度も触れていないページはnumUntouchedPagesに数える。
+    void countPagePlacement(
+        const void* data, size_t size,
+        uint64_t* numLocalPages, uint64_t* numRemotePages, uint64_t* numUntouchedPages) const;
+
+    void print() const;
+};
+
+// プロセスで共有するNUMA構成。最初の呼び出しで調べる。
+const NumaTopology &getNumaTopology();
+
+// 以降のallocatePages()で大きなページを使う。
+// Linuxでは透過的ヒュージページを要求する(2MBに満たない領域には効かない)。
+// WindowsではSeLockMemoryPrivilegeが必要で、無い場合は通常のページに戻す。
+// Windowsのラージページは確保時に物理メモリが割り当たるので、first touchによる配置は効かない。
+void setHugePagesEnabled(bool enabled);
+
+// ページ単位で確保し、中身はゼロ。確保時には物理ページを割り当てず、最初に書き込んだスレッドのノードに置かれる(first touch)。
+void* allocatePages(size_t size);
+void freePages(void* data, size_t size);
+
+// allocatePages()で確保するアロケーター。
+// 引数無しの構築では要素に触れない。ゼロ埋めすると確保したスレッドのノードにページが置かれてしまうため。
+template <typename T>
+class PageAllocator {
+public:
+    using value_type = T;
+
+    PageAllocator() = default;
+    template <typename U>
+    PageAllocator(const PageAllocator<U> &) {}
+
+    T* allocate(size_t n) {
+        void* data = allocatePages(n * sizeof(T));
+        if (!data)
+            throw std::bad_alloc();
+        return static_cast<T*>(data);
+    }
+    void deallocate(T* data, size_t n) {
+        freePages(data, n * sizeof(T));
+    }
+
+    template <typename U>
+    void construct(U* p) {
+        ::new (static_cast<void*>(p)) U;
+    }
+    template <typename U, typename... Args>
+    void construct(U* p, Args &&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const PageAllocator<T> &, const PageAllocator<U> &) {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const PageAllocator<T> &, const PageAllocator<U> &) {
+    return false;
+}
+
+template <typename T>
+using PageVector = std::vector<T, PageAllocator<T>>;
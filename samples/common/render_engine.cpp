@@ -0,0 +1,31 @@
+﻿#include "render_engine.h"
+
+#include <algorithm>
+
+#include "trace.h"
+
+std::chrono::high_resolution_clock::duration TileRenderer::render(
+    uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+    const TileKernel &kernel) const {
+    using clock = std::chrono::high_resolution_clock;
+
+    const uint32_t numTilesX = (width + m_tileSize - 1) / m_tileSize;
+    const uint32_t numTilesY = (height + m_tileSize - 1) / m_tileSize;
+
+    const clock::time_point startTp = clock::now();
+    m_threadPool.parallelFor(
+        numTilesX * numTilesY,
+        [&](uint32_t tileIdx, uint32_t threadIndex) {
+            const uint32_t tileX = tileIdx % numTilesX;
+            const uint32_t tileY = tileIdx / numTilesX;
+            Tile tile;
+            tile.x = x + tileX * m_tileSize;
+            tile.y = y + tileY * m_tileSize;
+            tile.width = std::min(m_tileSize, x + width - tile.x);
+            tile.height = std::min(m_tileSize, y + height - tile.y);
+            TraceScope traceScope("render", "tile", tileIdx);
+            kernel(tile, threadIndex);
+        });
+
+    return clock::now() - startTp;
+}
@@ -0,0 +1,50 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <functional>
+
+#include "thread_pool.h"
+
+struct RGBA {
+    uint32_t r : 8;
+    uint32_t g : 8;
+    uint32_t b : 8;
+    uint32_t a : 8;
+};
+
+struct Tile {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+// フレームをタイルに分割し、スレッドプール上で並列に描画する。
+class TileRenderer {
+public:
+    using TileKernel = std::function<void(const Tile &tile, uint32_t threadIndex)>;
+
+private:
+    ThreadPool &m_threadPool;
+    uint32_t m_tileSize;
+
+public:
+    TileRenderer(ThreadPool &threadPool, uint32_t tileSize) :
+        m_threadPool(threadPool), m_tileSize(tileSize) {
+    }
+
+    uint32_t getNumThreads() const {
+        return m_threadPool.getNumThreads();
+    }
+
+    uint32_t getTileSize() const {
+        return m_tileSize;
+    }
+
+    // 領域(x, y, width, height)をタイルに分割してkernelを並列に呼び出す。
+    // 戻り値は並列区間の所要時間。
+    std::chrono::high_resolution_clock::duration render(
+        uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+        const TileKernel &kernel) const;
+};
@@ -0,0 +1,382 @@
+﻿#include "sequential_writer.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+
+#if defined(_WIN32)
+#   define NOMINMAX
+#   include <Windows.h>
+#   include <io.h>
+#else
+#   include <cerrno>
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <sys/syscall.h>
+#   if __has_include(<linux/io_uring.h>)
+#       include <linux/io_uring.h>
+#       define USE_IO_URING
+#   endif
+#endif
+
+static void throwError(const char* what, const std::string &path) {
+    char msg[512];
+    sprintf_s(msg, "%s: %s\n", what, path.c_str());
+    throw std::runtime_error(msg);
+}
+
+
+
+#if defined(_WIN32)
+
+struct SequentialFileWriter::AsyncState {
+    OVERLAPPED overlapped;
+};
+
+SequentialFileWriter::SequentialFileWriter() :
+    m_currentBufferIndex(0), m_offset(0), m_isWriting(false), m_numWritingBytes(0),
+    m_backendName("buffered"), m_numWrittenBytes(0), m_numWriteCalls(0),
+    m_fileHandle(nullptr), m_ownsHandle(false), m_stdoutFd(-1) {
+}
+
+void SequentialFileWriter::open(const std::string &path) {
+    close();
+
+    if (path == "-") {
+        fflush(stdout);
+        m_stdoutFd = _dup(_fileno(stdout));
+        if (m_stdoutFd < 0 || _dup2(_fileno(stderr), _fileno(stdout)) != 0)
+            throwError("Failed to redirect", path);
+        m_fileHandle = reinterpret_cast<HANDLE>(_get_osfhandle(m_stdoutFd));
+        m_ownsHandle = false;
+        m_backendName = "buffered";
+    }
+    else {
+        // 名前付きパイプ(\\.\pipe\...)もオーバーラップI/Oで書ける。パイプではオフセットは無視される。
+        const HANDLE file = CreateFileA(
+            path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            throwError("Failed to create a file", path);
+        m_fileHandle = file;
+        m_ownsHandle = true;
+        m_asyncState = std::make_unique<AsyncState>();
+        std::memset(&m_asyncState->overlapped, 0, sizeof(OVERLAPPED));
+        m_asyncState->overlapped.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        m_backendName = "overlapped";
+    }
+    m_offset = 0;
+    m_numWrittenBytes = 0;
+    m_numWriteCalls = 0;
+}
+
+void SequentialFileWriter::writeSync(const uint8_t* data, size_t size) {
+    while (size > 0) {
+        DWORD numWritten = 0;
+        const DWORD numBytes = static_cast<DWORD>(std::min<size_t>(size, 1u << 30));
+        if (!WriteFile(m_fileHandle, data, numBytes, &numWritten, nullptr) || numWritten == 0)
+            throw std::runtime_error("Failed to write a stream.\n");
+        data += numWritten;
+        size -= numWritten;
+    }
+}
+
+void SequentialFileWriter::submitBuffer(const uint8_t* data, size_t size) {
+    if (!m_asyncState) {
+        writeSync(data, size);
+        return;
+    }
+    OVERLAPPED &overlapped = m_asyncState->overlapped;
+    overlapped.Offset = static_cast<DWORD>(m_offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(m_offset >> 32);
+    ResetEvent(overlapped.hEvent);
+    if (!WriteFile(m_fileHandle, data, static_cast<DWORD>(size), nullptr, &overlapped) &&
+        GetLastError() != ERROR_IO_PENDING)
+        throw std::runtime_error("Failed to write a stream.\n");
+    m_isWriting = true;
+    m_numWritingBytes = size;
+}
+
+void SequentialFileWriter::waitForWrite() {
+    if (!m_isWriting)
+        return;
+    m_isWriting = false;
+    DWORD numWritten = 0;
+    if (!GetOverlappedResult(m_fileHandle, &m_asyncState->overlapped, &numWritten, TRUE) ||
+        numWritten != m_numWritingBytes)
+        throw std::runtime_error("Failed to write a stream.\n");
+}
+
+void SequentialFileWriter::close() {
+    if (!m_fileHandle)
+        return;
+    flushBuffer();
+    waitForWrite();
+    if (m_asyncState) {
+        CloseHandle(m_asyncState->overlapped.hEvent);
+        m_asyncState.reset();
+    }
+    if (m_ownsHandle)
+        CloseHandle(m_fileHandle);
+    if (m_stdoutFd >= 0) {
+        _close(m_stdoutFd);
+        m_stdoutFd = -1;
+    }
+    m_fileHandle = nullptr;
+}
+
+#else
+
+#if defined(USE_IO_URING)
+
+// liburingを使わずにシステムコールを直接呼ぶ最小限のio_uring。書き込みは常に1つだけ投入する。
+struct SequentialFileWriter::AsyncState {
+    int ringFd = -1;
+    void* sqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    void* cqRing = MAP_FAILED;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqesSize = 0;
+    uint32_t* sqTail;
+    uint32_t* sqMask;
+    uint32_t* sqArray;
+    uint32_t* cqHead;
+    uint32_t* cqTail;
+    uint32_t* cqMask;
+    io_uring_cqe* cqes;
+
+    ~AsyncState() {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+            munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+        if (ringFd >= 0)
+            ::close(ringFd);
+    }
+
+    bool setUp() {
+        io_uring_params params = {};
+        ringFd = static_cast<int>(syscall(__NR_io_uring_setup, 4, &params));
+        if (ringFd < 0)
+            return false;
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMmap)
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        sqRing = mmap(
+            nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+            return false;
+        cqRing = singleMmap ?
+            sqRing :
+            mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED)
+            return false;
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(
+            nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED)
+            return false;
+
+        uint8_t* sq = static_cast<uint8_t*>(sqRing);
+        uint8_t* cq = static_cast<uint8_t*>(cqRing);
+        sqTail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    bool submitWrite(int fd, const void* data, uint32_t size, uint64_t offset) {
+        // 投入側はこのスレッドだけなので末尾は普通に読んでよい。
+        const uint32_t tail = *sqTail;
+        const uint32_t index = tail & *sqMask;
+        io_uring_sqe &sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITE;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(data);
+        sqe.len = size;
+        sqe.off = offset;
+        sqArray[index] = index;
+        std::atomic_ref<uint32_t>(*sqTail).store(tail + 1, std::memory_order_release);
+        return syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, nullptr, 0) == 1;
+    }
+
+    // 完了を待って結果(書き込んだバイト数か負のエラー番号)を返す。
+    int32_t waitForCompletion() {
+        while (true) {
+            const uint32_t head = *cqHead;
+            if (head != std::atomic_ref<uint32_t>(*cqTail).load(std::memory_order_acquire)) {
+                const int32_t result = cqes[head & *cqMask].res;
+                std::atomic_ref<uint32_t>(*cqHead).store(head + 1, std::memory_order_release);
+                return result;
+            }
+            if (syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+                errno != EINTR)
+                return -errno;
+        }
+    }
+};
+
+#else
+
+struct SequentialFileWriter::AsyncState {};
+
+#endif
+
+SequentialFileWriter::SequentialFileWriter() :
+    m_currentBufferIndex(0), m_offset(0), m_isWriting(false), m_numWritingBytes(0),
+    m_backendName("buffered"), m_numWrittenBytes(0), m_numWriteCalls(0),
+    m_fd(-1) {
+}
+
+void SequentialFileWriter::open(const std::string &path) {
+    close();
+
+    if (path == "-") {
+        fflush(stdout);
+        m_fd = dup(STDOUT_FILENO);
+        if (m_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+            throwError("Failed to redirect", path);
+    }
+    else {
+        m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (m_fd < 0)
+            throwError("Failed to create a file", path);
+    }
+    m_backendName = "buffered";
+#if defined(USE_IO_URING)
+    // パイプにはオフセットを指定して書けないので通常のファイルだけで使う。
+    struct stat st;
+    if (fstat(m_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        m_asyncState = std::make_unique<AsyncState>();
+        if (m_asyncState->setUp())
+            m_backendName = "io_uring";
+        else
+            m_asyncState.reset();
+    }
+#endif
+    m_offset = 0;
+    m_numWrittenBytes = 0;
+    m_numWriteCalls = 0;
+}
+
+void SequentialFileWriter::writeSync(const uint8_t* data, size_t size) {
+    while (size > 0) {
+        const ssize_t numWritten = ::write(m_fd, data, size);
+        if (numWritten < 0 && errno == EINTR)
+            continue;
+        if (numWritten <= 0)
+            throw std::runtime_error("Failed to write a stream.\n");
+        data += numWritten;
+        size -= static_cast<size_t>(numWritten);
+    }
+}
+
+void SequentialFileWriter::submitBuffer(const uint8_t* data, size_t size) {
+#if defined(USE_IO_URING)
+    if (m_asyncState) {
+        if (m_asyncState->submitWrite(m_fd, data, static_cast<uint32_t>(size), m_offset)) {
+            m_isWriting = true;
+            m_numWritingBytes = size;
+            return;
+        }
+        // 投入できない環境では以降は同期で書く。
+        m_asyncState.reset();
+        m_backendName = "buffered";
+    }
+#endif
+    writeSync(data, size);
+}
+
+void SequentialFileWriter::waitForWrite() {
+    if (!m_isWriting)
+        return;
+    m_isWriting = false;
+#if defined(USE_IO_URING)
+    const int32_t result = m_asyncState->waitForCompletion();
+    if (result < 0) {
+        // IORING_OP_WRITEに対応していない古いカーネル。このバッファから同期で書き直す。
+        if (result != -EINVAL)
+            throw std::runtime_error("Failed to write a stream.\n");
+        m_asyncState.reset();
+        m_backendName = "buffered";
+        const std::vector<uint8_t> &buffer = m_buffers[m_currentBufferIndex ^ 1];
+        if (lseek(m_fd, static_cast<off_t>(m_offset - m_numWritingBytes), SEEK_SET) < 0)
+            throw std::runtime_error("Failed to write a stream.\n");
+        writeSync(buffer.data(), m_numWritingBytes);
+        return;
+    }
+    // 途中までしか書けなかった分は同期で書き足す。
+    if (static_cast<size_t>(result) < m_numWritingBytes) {
+        const std::vector<uint8_t> &buffer = m_buffers[m_currentBufferIndex ^ 1];
+        const size_t numRemainingBytes = m_numWritingBytes - result;
+        if (lseek(m_fd, static_cast<off_t>(m_offset - numRemainingBytes), SEEK_SET) < 0)
+            throw std::runtime_error("Failed to write a stream.\n");
+        writeSync(buffer.data() + result, numRemainingBytes);
+    }
+#endif
+}
+
+void SequentialFileWriter::close() {
+    if (m_fd < 0)
+        return;
+    flushBuffer();
+    waitForWrite();
+    m_asyncState.reset();
+    ::close(m_fd);
+    m_fd = -1;
+}
+
+#endif
+
+SequentialFileWriter::~SequentialFileWriter() {
+    try {
+        close();
+    }
+    catch (std::exception &e) {
+        printf("%s", e.what());
+    }
+}
+
+void SequentialFileWriter::write(const void* data, size_t size) {
+    const uint8_t* src = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        std::vector<uint8_t> &buffer = m_buffers[m_currentBufferIndex];
+        if (buffer.capacity() < bufferSize)
+            buffer.reserve(bufferSize);
+        const size_t numBytes = std::min(size, bufferSize - buffer.size());
+        buffer.insert(buffer.end(), src, src + numBytes);
+        src += numBytes;
+        size -= numBytes;
+        if (buffer.size() == bufferSize)
+            flushBuffer();
+    }
+}
+
+// 埋まったバッファを書き出しに回し、もう片方のバッファの書き出しを待ってから次の書き込み先にする。
+void SequentialFileWriter::flushBuffer() {
+    std::vector<uint8_t> &buffer = m_buffers[m_currentBufferIndex];
+    if (buffer.empty())
+        return;
+    waitForWrite();
+    submitBuffer(buffer.data(), buffer.size());
+    m_offset += buffer.size();
+    m_numWrittenBytes += buffer.size();
+    ++m_numWriteCalls;
+    m_currentBufferIndex ^= 1;
+    m_buffers[m_currentBufferIndex].clear();
+}
@@ -0,0 +1,75 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <memory>
+
+// 先頭から順に追記するだけのファイル。書き込みを大きなバッファにまとめ、
+// 片方のバッファを書き出している間にもう片方を埋める。
+// 書き出しはWindowsではオーバーラップI/O、Linuxではio_uringで非同期に行い、
+// 使えない場合やパイプ、標準出力("-")の場合は同期の書き込みにする。
+class SequentialFileWriter {
+public:
+    static constexpr size_t bufferSize = 8 * 1024 * 1024;
+
+private:
+    struct AsyncState;
+
+    std::vector<uint8_t> m_buffers[2];
+    uint32_t m_currentBufferIndex;
+    uint64_t m_offset;
+    bool m_isWriting;
+    // 書き出し中のバッファの大きさ。
+    size_t m_numWritingBytes;
+    const char* m_backendName;
+    uint64_t m_numWrittenBytes;
+    uint32_t m_numWriteCalls;
+#if defined(_WIN32)
+    void* m_fileHandle;
+    bool m_ownsHandle;
+    // 標準出力に書く場合に複製したCRTのファイル記述子。
+    int m_stdoutFd;
+#else
+    int m_fd;
+#endif
+    std::unique_ptr<AsyncState> m_asyncState;
+
+    void submitBuffer(const uint8_t* data, size_t size);
+    void waitForWrite();
+    void writeSync(const uint8_t* data, size_t size);
+    void flushBuffer();
+
+public:
+    SequentialFileWriter();
+    ~SequentialFileWriter();
+
+    SequentialFileWriter(const SequentialFileWriter &) = delete;
+    SequentialFileWriter &operator=(const SequentialFileWriter &) = delete;
+
+    // pathが"-"の場合は標準出力に書く。ログが混ざらないよう、以降のstdoutへの出力は標準エラーに向ける。
+    // 失敗した場合は例外を投げる。
+    void open(const std::string &path);
+    void write(const void* data, size_t size);
+    // 残りを書き出して閉じる。
+    void close();
+
+    bool isOpen() const {
+#if defined(_WIN32)
+        return m_fileHandle != nullptr;
+#else
+        return m_fd >= 0;
+#endif
+    }
+    // "io_uring", "overlapped"または"buffered"。
+    const char* getBackendName() const {
+        return m_backendName;
+    }
+    uint64_t getNumWrittenBytes() const {
+        return m_numWrittenBytes;
+    }
+    uint32_t getNumWriteCalls() const {
+        return m_numWriteCalls;
+    }
+};
@@ -0,0 +1,60 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <atomic>
+
+// 生産者と消費者がそれぞれ1スレッドのロックフリーなリングバッファ。
+// 生産者は要素を書いてからm_tailをreleaseで進め、消費者は読み終えてからm_headをreleaseで進める。
+template <typename T>
+class SpscQueue {
+    static constexpr size_t cacheLineSize = 64;
+
+    std::vector<T> m_items;
+    uint32_t m_mask;
+    // 消費者と生産者が別々に書き換えるのでキャッシュラインを分ける。
+    alignas(cacheLineSize) std::atomic<uint32_t> m_head;
+    alignas(cacheLineSize) std::atomic<uint32_t> m_tail;
+
+public:
+    // 容量は2のべき乗に切り上げる。
+    explicit SpscQueue(uint32_t capacity) : m_head(0), m_tail(0) {
+        uint32_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        m_items.resize(size);
+        m_mask = size - 1;
+    }
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    uint32_t getCapacity() const {
+        return m_mask + 1;
+    }
+
+    // 生産者スレッドからのみ呼ぶ。満杯の場合はfalseを返す。
+    bool tryPush(const T &item) {
+        const uint32_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) > m_mask)
+            return false;
+        m_items[tail & m_mask] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 消費者スレッドからのみ呼ぶ。空の場合はfalseを返す。
+    bool tryPop(T &item) {
+        const uint32_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+            return false;
+        item = m_items[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // どのスレッドから呼んでもよいが、相手側が動いている間は目安の値になる。
+    uint32_t size() const {
+        const uint32_t head = m_head.load(std::memory_order_acquire);
+        return m_tail.load(std::memory_order_acquire) - head;
+    }
+};
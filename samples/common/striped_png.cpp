@@ -0,0 +1,463 @@
+﻿#include "striped_png.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+// https://github.com/richgel999/fpng
+#include "fpng.h"
+
+#include "trace.h"
+
+namespace {
+
+constexpr uint32_t windowSize = 32768;
+constexpr uint32_t minMatchLength = 4;
+constexpr uint32_t maxMatchLength = 258;
+constexpr uint32_t hashBits = 15;
+constexpr uint32_t maxChainLength = 8;
+
+// deflateのビット列はLSBから詰める。
+class BitWriter {
+    std::vector<uint8_t> &m_out;
+    uint64_t m_bits;
+    uint32_t m_numBits;
+
+public:
+    BitWriter(std::vector<uint8_t> &out) :
+        m_out(out), m_bits(0), m_numBits(0) {
+    }
+
+    void write(uint32_t bits, uint32_t numBits) {
+        m_bits |= static_cast<uint64_t>(bits) << m_numBits;
+        m_numBits += numBits;
+        while (m_numBits >= 8) {
+            m_out.push_back(static_cast<uint8_t>(m_bits));
+            m_bits >>= 8;
+            m_numBits -= 8;
+        }
+    }
+
+    void alignToByte() {
+        if (m_numBits > 0)
+            write(0, 8 - m_numBits);
+    }
+};
+
+struct HuffmanCode {
+    uint16_t code;
+    uint8_t length;
+};
+
+// 固定ハフマン符号(RFC 1951 3.2.6)。符号はビット反転済みで保持する。
+struct FixedHuffmanTables {
+    HuffmanCode litLens[288];
+    HuffmanCode dists[30];
+
+    static uint16_t reverseBits(uint32_t code, uint32_t length) {
+        uint32_t ret = 0;
+        for (uint32_t i = 0; i < length; ++i)
+            ret |= ((code >> i) & 1) << (length - 1 - i);
+        return static_cast<uint16_t>(ret);
+    }
+
+    FixedHuffmanTables() {
+        for (uint32_t sym = 0; sym < 288; ++sym) {
+            uint32_t code;
+            uint32_t length;
+            if (sym < 144) {
+                code = 0x30 + sym;
+                length = 8;
+            }
+            else if (sym < 256) {
+                code = 0x190 + (sym - 144);
+                length = 9;
+            }
+            else if (sym < 280) {
+                code = sym - 256;
+                length = 7;
+            }
+            else {
+                code = 0xC0 + (sym - 280);
+                length = 8;
+            }
+            litLens[sym].code = reverseBits(code, length);
+            litLens[sym].length = static_cast<uint8_t>(length);
+        }
+        for (uint32_t sym = 0; sym < 30; ++sym) {
+            dists[sym].code = reverseBits(sym, 5);
+            dists[sym].length = 5;
+        }
+    }
+};
+
+const FixedHuffmanTables &getFixedHuffmanTables() {
+    static const FixedHuffmanTables tables;
+    return tables;
+}
+
+uint32_t floorLog2(uint32_t v) {
+    uint32_t ret = 0;
+    while (v >>= 1)
+        ++ret;
+    return ret;
+}
+
+void writeLiteral(BitWriter &writer, uint32_t value) {
+    const HuffmanCode &c = getFixedHuffmanTables().litLens[value];
+    writer.write(c.code, c.length);
+}
+
+void writeMatch(BitWriter &writer, uint32_t length, uint32_t distance) {
+    const FixedHuffmanTables &tables = getFixedHuffmanTables();
+
+    // 長さ符号: 3-10は追加ビット無し、258は285番、それ以外は2の冪ごとに4符号ずつ。
+    uint32_t lenSym;
+    uint32_t lenNumExtraBits = 0;
+    uint32_t lenExtra = 0;
+    if (length == maxMatchLength) {
+        lenSym = 285;
+    }
+    else if (length < 11) {
+        lenSym = 257 + (length - 3);
+    }
+    else {
+        const uint32_t v = length - 3;
+        const uint32_t n = floorLog2(v);
+        lenSym = 257 + 4 * (n - 1) + ((v >> (n - 2)) & 3);
+        lenNumExtraBits = n - 2;
+        lenExtra = v & ((1 << lenNumExtraBits) - 1);
+    }
+    writer.write(tables.litLens[lenSym].code, tables.litLens[lenSym].length);
+    if (lenNumExtraBits > 0)
+        writer.write(lenExtra, lenNumExtraBits);
+
+    // 距離符号: 1-4は追加ビット無し、それ以外は2の冪ごとに2符号ずつ。
+    uint32_t distSym;
+    uint32_t distNumExtraBits = 0;
+    uint32_t distExtra = 0;
+    const uint32_t d = distance - 1;
+    if (d < 4) {
+        distSym = d;
+    }
+    else {
+        const uint32_t n = floorLog2(d);
+        distSym = 2 * n + ((d >> (n - 1)) & 1);
+        distNumExtraBits = n - 1;
+        distExtra = d & ((1 << distNumExtraBits) - 1);
+    }
+    writer.write(tables.dists[distSym].code, tables.dists[distSym].length);
+    if (distNumExtraBits > 0)
+        writer.write(distExtra, distNumExtraBits);
+}
+
+uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t hash4(const uint8_t* p) {
+    return (read32(p) * 2654435761u) >> (32 - hashBits);
+}
+
+// 固定ハフマンの1ブロックとしてdataを圧縮する。
+// 最終ブロックでなければ空のstoredブロック(sync flush)を続けてバイト境界に揃え、後続の帯をそのまま連結できるようにする。
+void deflateStripe(const uint8_t* data, uint32_t size, bool isFinal, std::vector<uint8_t> &out) {
+    BitWriter writer(out);
+    writer.write(isFinal ? 1 : 0, 1);
+    writer.write(1, 2); // BTYPE = 01: 固定ハフマン
+
+    std::vector<int32_t> head(1 << hashBits, -1);
+    std::vector<int32_t> prev(size);
+
+    const auto insert = [&](uint32_t pos) {
+        const uint32_t h = hash4(data + pos);
+        prev[pos] = head[h];
+        head[h] = static_cast<int32_t>(pos);
+    };
+
+    uint32_t pos = 0;
+    while (pos + minMatchLength <= size) {
+        const uint32_t maxLength = std::min(maxMatchLength, size - pos);
+        uint32_t bestLength = 0;
+        uint32_t bestDistance = 0;
+
+        int32_t cand = head[hash4(data + pos)];
+        for (uint32_t chainIdx = 0;
+             cand >= 0 && pos - cand <= windowSize && chainIdx < maxChainLength;
+             ++chainIdx, cand = prev[cand]) {
+            const uint8_t* p = data + cand;
+            const uint8_t* q = data + pos;
+            if (p[bestLength] != q[bestLength])
+                continue;
+            uint32_t length = 0;
+            while (length < maxLength && p[length] == q[length])
+                ++length;
+            if (length > bestLength) {
+                bestLength = length;
+                bestDistance = pos - cand;
+                if (length == maxLength)
+                    break;
+            }
+        }
+
+        if (bestLength >= minMatchLength) {
+            writeMatch(writer, bestLength, bestDistance);
+            for (uint32_t i = 0; i < bestLength; ++i) {
+                if (pos + i + minMatchLength <= size)
+                    insert(pos + i);
+            }
+            pos += bestLength;
+        }
+        else {
+            writeLiteral(writer, data[pos]);
+            insert(pos);
+            ++pos;
+        }
+    }
+    for (; pos < size; ++pos)
+        writeLiteral(writer, data[pos]);
+
+    writeLiteral(writer, 256); // ブロック終端
+
+    if (!isFinal) {
+        // sync flush
+        writer.write(0, 3);
+        writer.alignToByte();
+        const uint8_t storedLength[] = { 0x00, 0x00, 0xFF, 0xFF };
+        out.insert(out.end(), storedLength, storedLength + sizeof(storedLength));
+    }
+    writer.alignToByte();
+}
+
+uint8_t paethPredictor(int32_t a, int32_t b, int32_t c) {
+    const int32_t p = a + b - c;
+    const int32_t pa = std::abs(p - a);
+    const int32_t pb = std::abs(p - b);
+    const int32_t pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return static_cast<uint8_t>(a);
+    if (pb <= pc)
+        return static_cast<uint8_t>(b);
+    return static_cast<uint8_t>(c);
+}
+
+// 行ごとにNone/Sub/Up/Paethを試し、符号付き差分の絶対値和が最小のフィルターを選ぶ。
+void filterRow(const uint8_t* row, const uint8_t* prevRow, uint32_t rowSize, uint32_t bpp, uint8_t* dst) {
+    uint32_t bestFilter = 0;
+    uint64_t bestCost = UINT64_MAX;
+    for (uint32_t filter : { 0u, 1u, 2u, 4u }) {
+        if (filter != 0 && filter != 1 && !prevRow)
+            continue;
+        uint64_t cost = 0;
+        for (uint32_t i = 0; i < rowSize; ++i) {
+            const uint8_t a = i >= bpp ? row[i - bpp] : 0;
+            const uint8_t b = prevRow ? prevRow[i] : 0;
+            const uint8_t c = (prevRow && i >= bpp) ? prevRow[i - bpp] : 0;
+            uint8_t v;
+            if (filter == 0)
+                v = row[i];
+            else if (filter == 1)
+                v = row[i] - a;
+            else if (filter == 2)
+                v = row[i] - b;
+            else
+                v = row[i] - paethPredictor(a, b, c);
+            cost += std::abs(static_cast<int8_t>(v));
+        }
+        if (cost < bestCost) {
+            bestCost = cost;
+            bestFilter = filter;
+        }
+    }
+
+    dst[0] = static_cast<uint8_t>(bestFilter);
+    for (uint32_t i = 0; i < rowSize; ++i) {
+        const uint8_t a = i >= bpp ? row[i - bpp] : 0;
+        const uint8_t b = prevRow ? prevRow[i] : 0;
+        const uint8_t c = (prevRow && i >= bpp) ? prevRow[i - bpp] : 0;
+        if (bestFilter == 0)
+            dst[1 + i] = row[i];
+        else if (bestFilter == 1)
+            dst[1 + i] = row[i] - a;
+        else if (bestFilter == 2)
+            dst[1 + i] = row[i] - b;
+        else
+            dst[1 + i] = row[i] - paethPredictor(a, b, c);
+    }
+}
+
+// zlibのadler32_combineと同じ。
+uint32_t combineAdler32(uint32_t adler1, uint32_t adler2, uint64_t length2) {
+    constexpr uint32_t base = 65521;
+    const uint32_t rem = static_cast<uint32_t>(length2 % base);
+    uint32_t sum1 = adler1 & 0xFFFF;
+    uint32_t sum2 = (rem * sum1) % base;
+    sum1 += (adler2 & 0xFFFF) + base - 1;
+    sum2 += ((adler1 >> 16) & 0xFFFF) + ((adler2 >> 16) & 0xFFFF) + base - rem;
+    if (sum1 >= base)
+        sum1 -= base;
+    if (sum1 >= base)
+        sum1 -= base;
+    if (sum2 >= (base << 1))
+        sum2 -= (base << 1);
+    if (sum2 >= base)
+        sum2 -= base;
+    return sum1 | (sum2 << 16);
+}
+
+void writeBE32(uint8_t* dst, uint32_t v) {
+    dst[0] = static_cast<uint8_t>(v >> 24);
+    dst[1] = static_cast<uint8_t>(v >> 16);
+    dst[2] = static_cast<uint8_t>(v >> 8);
+    dst[3] = static_cast<uint8_t>(v);
+}
+
+// chunkの先頭8バイト(長さと種類)は確保済みで、種類は書き込み済みとする。長さとCRCを埋める。
+void finalizeChunk(std::vector<uint8_t> &chunk) {
+    const uint32_t dataLength = static_cast<uint32_t>(chunk.size() - 8);
+    writeBE32(chunk.data(), dataLength);
+    const uint32_t crc = fpng::fpng_crc32(chunk.data() + 4, dataLength + 4, 0);
+    chunk.resize(chunk.size() + 4);
+    writeBE32(chunk.data() + chunk.size() - 4, crc);
+}
+
+void beginChunk(std::vector<uint8_t> &chunk, const char type[4]) {
+    chunk.resize(8);
+    std::memcpy(chunk.data() + 4, type, 4);
+}
+
+struct Stripe {
+    std::vector<uint8_t> chunk;
+    uint32_t adler;
+    uint64_t filteredSize;
+};
+
+} // namespace
+
+
+
+bool encodeStripedPng(
+    ThreadPool &threadPool,
+    const void* image, uint32_t width, uint32_t height, uint32_t numChannels,
+    uint32_t numRowsPerStripe,
+    const PngWriteFunc &writeFunc) {
+    if ((numChannels != 3 && numChannels != 4) || width == 0 || height == 0)
+        return false;
+    numRowsPerStripe = std::max(numRowsPerStripe, 1u);
+
+    const uint8_t* pixels = static_cast<const uint8_t*>(image);
+    const uint32_t rowSize = width * numChannels;
+
+    // シグネチャとIHDR。
+    {
+        std::vector<uint8_t> header = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+        std::vector<uint8_t> ihdr;
+        beginChunk(ihdr, "IHDR");
+        ihdr.resize(8 + 13);
+        writeBE32(ihdr.data() + 8, width);
+        writeBE32(ihdr.data() + 12, height);
+        ihdr[16] = 8; // ビット深度
+        ihdr[17] = numChannels == 4 ? 6 : 2; // カラータイプ
+        ihdr[18] = 0;
+        ihdr[19] = 0;
+        ihdr[20] = 0;
+        finalizeChunk(ihdr);
+        header.insert(header.end(), ihdr.begin(), ihdr.end());
+        if (!writeFunc(header.data(), header.size()))
+            return false;
+    }
+
+    const uint32_t numStripes = (height + numRowsPerStripe - 1) / numRowsPerStripe;
+    // 同時に処理する帯の数をスレッド数に制限してメモリ使用量を抑える。
+    const uint32_t numStripesPerBatch = std::max(threadPool.getNumThreads(), 1u);
+    std::vector<Stripe> stripes(std::min(numStripes, numStripesPerBatch));
+
+    uint32_t adler = 1;
+    for (uint32_t batchStart = 0; batchStart < numStripes; batchStart += numStripesPerBatch) {
+        const uint32_t numStripesInBatch = std::min(numStripesPerBatch, numStripes - batchStart);
+        threadPool.parallelFor(
+            numStripesInBatch,
+            [&](uint32_t itemIdx, uint32_t) {
+                const uint32_t stripeIdx = batchStart + itemIdx;
+                TraceScope traceScope("encode", "png stripe", stripeIdx);
+                const uint32_t startRow = stripeIdx * numRowsPerStripe;
+                const uint32_t numRows = std::min(numRowsPerStripe, height - startRow);
+
+                std::vector<uint8_t> filtered(numRows * (1 + rowSize));
+                for (uint32_t rowIdx = 0; rowIdx < numRows; ++rowIdx) {
+                    const uint32_t y = startRow + rowIdx;
+                    filterRow(
+                        pixels + static_cast<size_t>(y) * rowSize,
+                        y > 0 ? pixels + static_cast<size_t>(y - 1) * rowSize : nullptr,
+                        rowSize, numChannels,
+                        filtered.data() + static_cast<size_t>(rowIdx) * (1 + rowSize));
+                }
+
+                Stripe &stripe = stripes[itemIdx];
+                stripe.adler = fpng::fpng_adler32(filtered.data(), filtered.size(), 1);
+                stripe.filteredSize = filtered.size();
+
+                beginChunk(stripe.chunk, "IDAT");
+                if (stripeIdx == 0) {
+                    // zlibヘッダー: 32KBウィンドウのdeflate。
+                    stripe.chunk.push_back(0x78);
+                    stripe.chunk.push_back(0x01);
+                }
+                deflateStripe(
+                    filtered.data(), static_cast<uint32_t>(filtered.size()),
+                    stripeIdx == numStripes - 1, stripe.chunk);
+                finalizeChunk(stripe.chunk);
+            });
+
+        // 帯の順にAdler-32を結合しつつ書き出して解放する。
+        for (uint32_t itemIdx = 0; itemIdx < numStripesInBatch; ++itemIdx) {
+            Stripe &stripe = stripes[itemIdx];
+            adler = combineAdler32(adler, stripe.adler, stripe.filteredSize);
+            if (!writeFunc(stripe.chunk.data(), stripe.chunk.size()))
+                return false;
+            stripe.chunk.clear();
+        }
+    }
+
+    // Adler-32は全ての帯が揃うまで決まらないので最後に独立したIDATとして出す。
+    std::vector<uint8_t> trailer;
+    beginChunk(trailer, "IDAT");
+    trailer.resize(8 + 4);
+    writeBE32(trailer.data() + 8, adler);
+    finalizeChunk(trailer);
+
+    std::vector<uint8_t> iend;
+    beginChunk(iend, "IEND");
+    finalizeChunk(iend);
+    trailer.insert(trailer.end(), iend.begin(), iend.end());
+
+    return writeFunc(trailer.data(), trailer.size());
+}
+
+bool encodeStripedPngToFile(
+    ThreadPool &threadPool, const char* filename,
+    const void* image, uint32_t width, uint32_t height, uint32_t numChannels,
+    uint32_t numRowsPerStripe,
+    uint64_t* numWrittenBytes) {
+    FILE* fp;
+    if (fopen_s(&fp, filename, "wb") != 0)
+        return false;
+
+    uint64_t numBytes = 0;
+    const bool success = encodeStripedPng(
+        threadPool, image, width, height, numChannels, numRowsPerStripe,
+        [fp, &numBytes](const uint8_t* data, size_t size) {
+            numBytes += size;
+            return fwrite(data, 1, size, fp) == size;
+        });
+    fclose(fp);
+
+    if (numWrittenBytes)
+        *numWrittenBytes = numBytes;
+
+    return success;
+}
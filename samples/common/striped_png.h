@@ -0,0 +1,26 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <functional>
+
+#include "thread_pool.h"
+
+// PNGストリームの書き出し先。失敗時はfalseを返す。
+using PngWriteFunc = std::function<bool(const uint8_t* data, size_t size)>;
+
+// 画像を水平の帯に分割し、帯ごとのフィルタリングとdeflate圧縮をスレッドプール上で並列に行う(pigz方式)。
+// 各帯の圧縮データはsync flushでバイト境界に揃えてそのまま連結し、Adler-32は帯ごとの値を結合して求める。
+// 帯はそれぞれ独立したIDATチャンクとして順番にwriteFuncへ渡すので、
+// 同時にメモリ上にある圧縮データは並列処理中の帯の分だけで済む。
+// numChannelsは3(RGB)か4(RGBA)。
+bool encodeStripedPng(
+    ThreadPool &threadPool,
+    const void* image, uint32_t width, uint32_t height, uint32_t numChannels,
+    uint32_t numRowsPerStripe,
+    const PngWriteFunc &writeFunc);
+
+bool encodeStripedPngToFile(
+    ThreadPool &threadPool, const char* filename,
+    const void* image, uint32_t width, uint32_t height, uint32_t numChannels,
+    uint32_t numRowsPerStripe,
+    uint64_t* numWrittenBytes = nullptr);
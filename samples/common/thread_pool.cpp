@@ -0,0 +1,152 @@
+﻿#include "thread_pool.h"
+
+#include <cstdio>
+#include <algorithm>
+
+#include "trace.h"
+#include "numa.h"
+
+ThreadPool::ThreadPool(uint32_t numThreads, const NumaTopology* topology) :
+    m_topology(topology), m_numQueuedJobs(0), m_nextWorkerIndex(0), m_quit(false) {
+    if (numThreads == 0)
+        numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    m_workers.resize(numThreads);
+    m_workerNodes.resize(numThreads, 0);
+    for (uint32_t i = 0; i < numThreads; ++i) {
+        m_workers[i] = std::make_unique<Worker>();
+        if (m_topology)
+            m_workerNodes[i] = m_topology->getNodeIndexOfItem(i, numThreads);
+    }
+    m_threads.reserve(numThreads);
+    for (uint32_t i = 0; i < numThreads; ++i)
+        m_threads.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(m_sleepMutex);
+        m_quit = true;
+    }
+    m_sleepCondVar.notify_all();
+    for (std::thread &thread : m_threads)
+        thread.join();
+}
+
+void ThreadPool::pushJob(uint32_t workerIndex, Job &&job) {
+    {
+        Worker &worker = *m_workers[workerIndex];
+        std::lock_guard lock(worker.mutex);
+        worker.jobs.push_back(std::move(job));
+    }
+    m_numQueuedJobs.fetch_add(1);
+}
+
+bool ThreadPool::popJob(uint32_t threadIndex, Job &job) {
+    const uint32_t numWorkers = static_cast<uint32_t>(m_workers.size());
+
+    // 自分のキューは先頭から取り出す。
+    {
+        Worker &worker = *m_workers[threadIndex];
+        std::lock_guard lock(worker.mutex);
+        if (!worker.jobs.empty()) {
+            job = std::move(worker.jobs.front());
+            worker.jobs.pop_front();
+            m_numQueuedJobs.fetch_sub(1);
+            return true;
+        }
+    }
+
+    // 他のワーカーのキューは末尾から奪う。同じノードのワーカーを先に探す。
+    const uint32_t nodeIndex = m_workerNodes[threadIndex];
+    for (const bool sameNode : { true, false }) {
+        for (uint32_t i = 1; i < numWorkers; ++i) {
+            const uint32_t victimIndex = (threadIndex + i) % numWorkers;
+            if ((m_workerNodes[victimIndex] == nodeIndex) != sameNode)
+                continue;
+            Worker &victim = *m_workers[victimIndex];
+            std::lock_guard lock(victim.mutex);
+            if (!victim.jobs.empty()) {
+                job = std::move(victim.jobs.back());
+                victim.jobs.pop_back();
+                m_numQueuedJobs.fetch_sub(1);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::workerLoop(uint32_t threadIndex) {
+    if (isTracingEnabled()) {
+        char name[32];
+        sprintf_s(name, "pool %u", threadIndex);
+        setTraceThreadName(name);
+    }
+    if (m_topology && !m_topology->pinCurrentThread(m_workerNodes[threadIndex]))
+        printf("Failed to pin the worker %u to the NUMA node %u.\n", threadIndex, m_workerNodes[threadIndex]);
+
+    while (true) {
+        Job job;
+        if (popJob(threadIndex, job)) {
+            job(threadIndex);
+            continue;
+        }
+
+        TraceScope traceScope("idle", "sleep");
+        std::unique_lock lock(m_sleepMutex);
+        m_sleepCondVar.wait(
+            lock,
+            [this]() {
+                return m_quit || m_numQueuedJobs.load() > 0;
+            });
+        if (m_quit && m_numQueuedJobs.load() == 0)
+            return;
+    }
+}
+
+void ThreadPool::parallelFor(
+    uint32_t numItems, const std::function<void(uint32_t itemIndex, uint32_t threadIndex)> &func) {
+    if (numItems == 0)
+        return;
+
+    struct Group {
+        uint32_t numRemainingItems;
+        std::mutex mutex;
+        std::condition_variable condVar;
+    };
+    Group group;
+    group.numRemainingItems = numItems;
+
+    // 連続した要素をまとめて各ワーカーに配る。
+    // 呼び出しごとに起点のワーカーをずらして、少数要素の呼び出しが特定ワーカーに偏らないようにする。
+    // NUMAを考慮する場合は要素とノードの対応を保つため、起点は固定する。
+    const uint32_t numWorkers = static_cast<uint32_t>(m_workers.size());
+    const uint32_t baseWorkerIndex = m_topology ? 0 : m_nextWorkerIndex.fetch_add(1) % numWorkers;
+    for (uint32_t itemIdx = 0; itemIdx < numItems; ++itemIdx) {
+        const uint32_t workerIdx =
+            (baseWorkerIndex + static_cast<uint32_t>(static_cast<uint64_t>(itemIdx) * numWorkers / numItems)) %
+            numWorkers;
+        pushJob(
+            workerIdx,
+            [&func, &group, itemIdx](uint32_t threadIndex) {
+                func(itemIdx, threadIndex);
+                // 待機側がgroupを破棄するのは最後の通知の後になるようロック下で減算する。
+                std::lock_guard lock(group.mutex);
+                if (--group.numRemainingItems == 0)
+                    group.condVar.notify_all();
+            });
+    }
+    {
+        std::lock_guard lock(m_sleepMutex);
+    }
+    m_sleepCondVar.notify_all();
+
+    std::unique_lock lock(group.mutex);
+    group.condVar.wait(
+        lock,
+        [&group]() {
+            return group.numRemainingItems == 0;
+        });
+}
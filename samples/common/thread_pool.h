@@ -0,0 +1,66 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+class NumaTopology;
+
+// ワークスティーリング型のスレッドプール。
+// ワーカーごとにジョブキューを持ち、自分のキューが空になると他のワーカーのキューの末尾からジョブを奪う。
+// スレッドはプールの寿命の間使い回される。
+class ThreadPool {
+public:
+    using Job = std::function<void(uint32_t threadIndex)>;
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::vector<std::thread> m_threads;
+    // NUMAを考慮しない場合はnullptrで、全ワーカーをノード0とみなす。
+    const NumaTopology* m_topology;
+    std::vector<uint32_t> m_workerNodes;
+    std::atomic<uint32_t> m_numQueuedJobs;
+    std::atomic<uint32_t> m_nextWorkerIndex;
+    std::mutex m_sleepMutex;
+    std::condition_variable m_sleepCondVar;
+    bool m_quit;
+
+    void pushJob(uint32_t workerIndex, Job &&job);
+    bool popJob(uint32_t threadIndex, Job &job);
+    void workerLoop(uint32_t threadIndex);
+
+public:
+    // numThreadsが0の場合はstd::thread::hardware_concurrency()を使う。
+    // topologyを渡すと、ワーカーを連続した番号ごとに各ノードのCPU数に比例して割り当ててそのノードに固定する。
+    // スティールは同じノードのワーカーから先に行い、parallelFor()の要素とワーカーの対応を呼び出しごとに変えない。
+    // これにより同じ範囲を描くフレームでは同じノードが同じ領域を書き、ページがノードに留まる。
+    explicit ThreadPool(uint32_t numThreads = 0, const NumaTopology* topology = nullptr);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    uint32_t getNumThreads() const {
+        return static_cast<uint32_t>(m_threads.size());
+    }
+
+    // ワーカーを固定したノードの番号(NumaTopology::getNode()の引数)。
+    uint32_t getNodeIndex(uint32_t threadIndex) const {
+        return m_workerNodes[threadIndex];
+    }
+
+    // [0, numItems)の各要素に対してfuncを並列に呼び出し、全て終わるまで待つ。
+    // 要素は連続したまとまりごとに各ワーカーへ初期配分され、偏りはスティールで均される。
+    void parallelFor(uint32_t numItems, const std::function<void(uint32_t itemIndex, uint32_t threadIndex)> &func);
+};
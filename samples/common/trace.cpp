@@ -0,0 +1,164 @@
+﻿#include "trace.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+
+std::atomic<bool> g_isTracingEnabled(false);
+
+namespace {
+
+using trace_clock = std::chrono::steady_clock;
+
+struct TraceEvent {
+    const char* category;
+    const char* name;
+    int64_t beginTime;
+    int64_t endTime;
+    int64_t arg;
+};
+
+// 書き込むのは持ち主のスレッドだけ。イベントを書いてからnumEventsをreleaseで進める。
+struct ThreadTraceBuffer {
+    uint32_t threadID;
+    char name[64];
+    std::vector<TraceEvent> events;
+    std::atomic<uint64_t> numEvents;
+};
+
+const trace_clock::time_point s_epoch = trace_clock::now();
+uint32_t s_numEventsPerThread = 1 << 16;
+// スレッドが終わっても書き出しまでバッファを残すので、所有はここで持つ。
+std::mutex s_buffersMutex;
+std::vector<std::unique_ptr<ThreadTraceBuffer>> s_buffers;
+thread_local ThreadTraceBuffer* s_threadBuffer = nullptr;
+
+ThreadTraceBuffer &getThreadBuffer() {
+    if (!s_threadBuffer) {
+        std::lock_guard lock(s_buffersMutex);
+        auto buffer = std::make_unique<ThreadTraceBuffer>();
+        buffer->threadID = static_cast<uint32_t>(s_buffers.size());
+        sprintf_s(buffer->name, "thread %u", buffer->threadID);
+        buffer->events.resize(s_numEventsPerThread);
+        buffer->numEvents.store(0, std::memory_order_relaxed);
+        s_threadBuffer = buffer.get();
+        s_buffers.push_back(std::move(buffer));
+    }
+    return *s_threadBuffer;
+}
+
+// JSONの文字列に入れる。名前は全てこのリポジトリ内の定数なのでエスケープは引用符と円記号だけ扱う。
+void writeJsonString(FILE* fp, const char* str) {
+    fputc('"', fp);
+    for (const char* c = str; *c; ++c) {
+        if (*c == '"' || *c == '\\')
+            fputc('\\', fp);
+        fputc(*c, fp);
+    }
+    fputc('"', fp);
+}
+
+} // namespace
+
+void enableTracing(uint32_t numEventsPerThread) {
+    {
+        std::lock_guard lock(s_buffersMutex);
+        s_numEventsPerThread = std::max(numEventsPerThread, 1u);
+    }
+    g_isTracingEnabled.store(true, std::memory_order_relaxed);
+}
+
+int64_t getTraceTime() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(trace_clock::now() - s_epoch).count();
+}
+
+void setTraceThreadName(const char* name) {
+    if (!isTracingEnabled())
+        return;
+    ThreadTraceBuffer &buffer = getThreadBuffer();
+    std::lock_guard lock(s_buffersMutex);
+    sprintf_s(buffer.name, "%s", name);
+}
+
+void recordTraceEvent(const char* category, const char* name, int64_t beginTime, int64_t endTime, int64_t arg) {
+    if (!isTracingEnabled() || beginTime < 0)
+        return;
+    ThreadTraceBuffer &buffer = getThreadBuffer();
+    const uint64_t index = buffer.numEvents.load(std::memory_order_relaxed);
+    TraceEvent &event = buffer.events[index % buffer.events.size()];
+    event.category = category;
+    event.name = name;
+    event.beginTime = beginTime;
+    event.endTime = endTime;
+    event.arg = arg;
+    buffer.numEvents.store(index + 1, std::memory_order_release);
+}
+
+bool writeTrace(const char* filename, uint32_t processID, const char* processName, int64_t clockOffset) {
+    FILE* fp;
+    if (fopen_s(&fp, filename, "w") != 0) {
+        printf("Failed to open %s.\n", filename);
+        return false;
+    }
+
+    std::lock_guard lock(s_buffersMutex);
+
+    uint64_t numEvents = 0;
+    uint64_t numDroppedEvents = 0;
+    for (const std::unique_ptr<ThreadTraceBuffer> &buffer : s_buffers) {
+        const uint64_t numRecorded = buffer->numEvents.load(std::memory_order_acquire);
+        const uint64_t capacity = buffer->events.size();
+        numEvents += std::min(numRecorded, capacity);
+        numDroppedEvents += numRecorded > capacity ? numRecorded - capacity : 0;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"node\":");
+    writeJsonString(fp, processName);
+    fprintf(
+        fp, ",\"clockOffsetNs\":%lld,\"droppedEvents\":%llu},\n\"traceEvents\":[\n",
+        static_cast<long long>(clockOffset), static_cast<unsigned long long>(numDroppedEvents));
+
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":0,\"args\":{\"name\":", processID);
+    writeJsonString(fp, processName);
+    fprintf(fp, "}}");
+    for (const std::unique_ptr<ThreadTraceBuffer> &buffer : s_buffers) {
+        fprintf(
+            fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":",
+            processID, buffer->threadID);
+        writeJsonString(fp, buffer->name);
+        fprintf(fp, "}}");
+    }
+
+    // 時刻はマイクロ秒単位。
+    for (const std::unique_ptr<ThreadTraceBuffer> &buffer : s_buffers) {
+        const uint64_t numRecorded = buffer->numEvents.load(std::memory_order_acquire);
+        const uint64_t capacity = buffer->events.size();
+        const uint64_t first = numRecorded > capacity ? numRecorded - capacity : 0;
+        for (uint64_t i = first; i < numRecorded; ++i) {
+            const TraceEvent &event = buffer->events[i % capacity];
+            fprintf(fp, ",\n{\"name\":");
+            writeJsonString(fp, event.name);
+            fprintf(fp, ",\"cat\":");
+            writeJsonString(fp, event.category);
+            fprintf(
+                fp, ",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                processID, buffer->threadID,
+                (event.beginTime + clockOffset) * 1e-3, (event.endTime - event.beginTime) * 1e-3);
+            if (event.arg >= 0)
+                fprintf(fp, ",\"args\":{\"value\":%lld}", static_cast<long long>(event.arg));
+            fprintf(fp, "}");
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+
+    printf(
+        "Wrote %llu trace events to %s (%llu dropped).\n",
+        static_cast<unsigned long long>(numEvents), filename,
+        static_cast<unsigned long long>(numDroppedEvents));
+    return true;
+}
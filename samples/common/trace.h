@@ -0,0 +1,60 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <atomic>
+
+// スレッドをまたいだ処理の流れを見るためのタイムライン記録。
+// イベントはスレッドごとのリングバッファに書き、終了時にChrome trace形式(chrome://tracing, Perfetto)で書き出す。
+// 記録側はロックを取らず、無効の間は時刻も取らない。満杯になると古いイベントから上書きする。
+// categoryとnameは文字列リテラルなど、書き出しまで有効なものを渡すこと。
+
+extern std::atomic<bool> g_isTracingEnabled;
+
+inline bool isTracingEnabled() {
+    return g_isTracingEnabled.load(std::memory_order_relaxed);
+}
+
+// numEventsPerThreadはスレッドごとのリングバッファの容量。
+void enableTracing(uint32_t numEventsPerThread = 1 << 16);
+// 記録の起点からの時刻[ns]。プロセスごとに起点が異なるので、ノード間ではclockOffsetで合わせる。
+int64_t getTraceTime();
+// 呼び出したスレッドの表示名。
+void setTraceThreadName(const char* name);
+// [beginTime, endTime]の区間イベントを記録する。非同期処理のように開始と終了が別の場所になる場合に使う。
+// argは区間に添える値(フレーム番号など)で、負の場合は書き出さない。
+void recordTraceEvent(const char* category, const char* name, int64_t beginTime, int64_t endTime, int64_t arg = -1);
+
+// 非同期処理の開始時刻。無効の場合は-1を返し、endTraceEvent()は何も記録しない。
+inline int64_t beginTraceEvent() {
+    return isTracingEnabled() ? getTraceTime() : -1;
+}
+// beginTraceEvent()から現在までを記録する。
+inline void endTraceEvent(const char* category, const char* name, int64_t beginTime, int64_t arg = -1) {
+    if (beginTime >= 0)
+        recordTraceEvent(category, name, beginTime, getTraceTime(), arg);
+}
+
+// 全スレッドのイベントを書き出す。記録中のスレッドが無くなってから呼ぶこと。
+// clockOffsetをこのノードの時刻に足すと主ノードの時刻になる。これで書き出した時刻は主ノードの時計に揃うので、
+// 各ノードのtraceEventsを連結すれば一つのタイムラインとして見られる。
+bool writeTrace(const char* filename, uint32_t processID, const char* processName, int64_t clockOffset);
+
+// スコープの開始から終了までを区間イベントとして記録する。
+class TraceScope {
+    const char* m_category;
+    const char* m_name;
+    int64_t m_arg;
+    int64_t m_beginTime;
+
+public:
+    TraceScope(const char* category, const char* name, int64_t arg = -1) :
+        m_category(category), m_name(name), m_arg(arg),
+        m_beginTime(beginTraceEvent()) {
+    }
+    ~TraceScope() {
+        endTraceEvent(m_category, m_name, m_beginTime, m_arg);
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+};
@@ -0,0 +1,111 @@
+﻿#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include "thread_pool.h"
+#include "striped_png.h"
+
+// 乱数の区間と繰り返しの区間を混ぜ、deflateのリテラルと長さ/距離の符号の両方を通す画像を作る。
+static std::vector<uint8_t> makeTestImage(uint32_t width, uint32_t height, uint32_t numChannels) {
+    std::vector<uint8_t> image(static_cast<size_t>(width) * height * numChannels);
+    uint32_t state = 0x12345678u ^ (width * 31 + height * 17 + numChannels);
+    for (uint32_t y = 0; y < height; ++y) {
+        for (uint32_t x = 0; x < width; ++x) {
+            uint8_t* pixel = image.data() + (static_cast<size_t>(y) * width + x) * numChannels;
+            const uint32_t region = (x / 16 + y / 8) % 3;
+            for (uint32_t c = 0; c < numChannels; ++c) {
+                if (region == 0) {
+                    state = state * 1664525u + 1013904223u;
+                    pixel[c] = static_cast<uint8_t>(state >> 24);
+                }
+                else if (region == 1) {
+                    pixel[c] = static_cast<uint8_t>((x % 5) * 40 + c);
+                }
+                else {
+                    pixel[c] = static_cast<uint8_t>(x + 2 * y + 60 * c);
+                }
+            }
+        }
+    }
+    return image;
+}
+
+// エンコードした結果をstb_imageでデコードし、元の画素とビット単位で一致するか確かめる。
+static bool testRoundTrip(
+    ThreadPool &threadPool, uint32_t width, uint32_t height, uint32_t numChannels, uint32_t numRowsPerStripe) {
+    const std::vector<uint8_t> image = makeTestImage(width, height, numChannels);
+    std::vector<uint8_t> png;
+    const bool encoded = encodeStripedPng(
+        threadPool, image.data(), width, height, numChannels, numRowsPerStripe,
+        [&png](const uint8_t* data, size_t size) {
+            png.insert(png.end(), data, data + size);
+            return true;
+        });
+    if (!encoded) {
+        printf(
+            "FAIL %ux%u, %u channels, %u rows/stripe: encode failed\n",
+            width, height, numChannels, numRowsPerStripe);
+        return false;
+    }
+
+    int decodedWidth, decodedHeight, numFileChannels;
+    uint8_t* decoded = stbi_load_from_memory(
+        png.data(), static_cast<int>(png.size()),
+        &decodedWidth, &decodedHeight, &numFileChannels, static_cast<int>(numChannels));
+    if (!decoded) {
+        printf(
+            "FAIL %ux%u, %u channels, %u rows/stripe: decode failed\n",
+            width, height, numChannels, numRowsPerStripe);
+        return false;
+    }
+    const bool match =
+        static_cast<uint32_t>(decodedWidth) == width && static_cast<uint32_t>(decodedHeight) == height &&
+        static_cast<uint32_t>(numFileChannels) == numChannels &&
+        std::memcmp(decoded, image.data(), image.size()) == 0;
+    stbi_image_free(decoded);
+    if (!match) {
+        printf(
+            "FAIL %ux%u, %u channels, %u rows/stripe: decoded image differs\n",
+            width, height, numChannels, numRowsPerStripe);
+        return false;
+    }
+    return true;
+}
+
+int32_t main() {
+    struct Size {
+        uint32_t width;
+        uint32_t height;
+    };
+    // 帯の高さで割り切れない幅と高さを含める。
+    constexpr Size sizes[] = {
+        { 1, 1 }, { 3, 2 }, { 17, 13 }, { 64, 64 }, { 100, 71 }, { 256, 256 }, { 1000, 9 },
+    };
+    constexpr uint32_t channelCounts[] = { 3, 4 };
+    // 帯を順に処理する1スレッドと、複数の帯を並列に処理する場合の両方で試す。
+    constexpr uint32_t threadCounts[] = { 1, 4 };
+
+    uint32_t numCases = 0;
+    uint32_t numFailures = 0;
+    for (const uint32_t numThreads : threadCounts) {
+        ThreadPool threadPool(numThreads);
+        for (const Size &size : sizes) {
+            for (const uint32_t numChannels : channelCounts) {
+                // 0は画像全体を1つの帯にする。
+                for (const uint32_t stripeHeight : { 1u, 7u, 0u }) {
+                    const uint32_t numRowsPerStripe = stripeHeight > 0 ? stripeHeight : size.height;
+                    ++numCases;
+                    if (!testRoundTrip(threadPool, size.width, size.height, numChannels, numRowsPerStripe))
+                        ++numFailures;
+                }
+            }
+        }
+    }
+
+    printf("Striped PNG round trip: %u/%u cases passed.\n", numCases - numFailures, numCases);
+    return numFailures == 0 ? 0 : 1;
+}
@@ -1,13 +1,43 @@
 ﻿#include <cstdio>
 #include <cstdint>
 #include <cstdlib>
+#include <cmath>
 #include <vector>
+#include <algorithm>
+#include <string>
 #include <string_view>
 #include <chrono>
 #include <thread>
 
-// https://github.com/richgel999/fpng
-#include "fpng.h"
+#include "render_engine.h"
+#include "frame_pipeline.h"
+#include "deadline_scheduler.h"
+#include "cost_profile.h"
+#include "checkpoint_manifest.h"
+#include "numa.h"
+#include "trace.h"
+
+// --vary-frame-costで使う、シーンの複雑さがフレームごとに変わるアニメーションを模した負荷の倍率。
+// 192フレーム目付近が最も重く、フレーム範囲を前後半で単純に分けると片方に偏る。
+static double getSimulatedFrameCostScale(uint32_t frameIndex) {
+    const double d = (static_cast<double>(frameIndex) - 192.0) / 40.0;
+    return 0.5 + 2.5 * std::exp(-d * d);
+}
+
+// "i/N"の形式。
+static bool parsePartition(const char* str, uint32_t* partitionIndex, uint32_t* numPartitions) {
+    char* end;
+    const unsigned long index = strtoul(str, &end, 10);
+    if (end == str || *end != '/')
+        return false;
+    const char* countStr = end + 1;
+    const unsigned long count = strtoul(countStr, &end, 10);
+    if (end == countStr || *end != '\0' || count == 0 || index >= count)
+        return false;
+    *partitionIndex = static_cast<uint32_t>(index);
+    *numPartitions = static_cast<uint32_t>(count);
+    return true;
+}
 
 int32_t main(int32_t argc, const char* argv[]) {
     // レンダラー起動時間を取得。
@@ -16,6 +46,36 @@ int32_t main(int32_t argc, const char* argv[]) {
 
     uint32_t startFrameIndex = 0;
     uint32_t endFrameIndex = 0;
+    // 飛び飛びのフレームを描く場合のリスト。--partitionの場合はコストのプロファイルから決める。
+    std::string frameListStr;
+    uint32_t partitionIndex = 0;
+    uint32_t numPartitions = 0;
+    std::string costProfilePath;
+    // --plan-partitionsで分割を計画し、実行後のプロファイルがあれば実際の偏りと比べる。
+    uint32_t numPlannedPartitions = 0;
+    std::string actualProfilePath;
+    // 低解像度の下見でコストを測ってプロファイルを書き出す。
+    std::string prepassProfilePath;
+    bool varyFrameCost = false;
+    uint32_t numThreads = 0;
+    uint32_t numFramebuffers = 3;
+    uint32_t numEncoderThreads = 2;
+    uint32_t numPngStripeRows = 0;
+    DeadlineScheduler::Settings schedulerSettings;
+    bool enableTrace = false;
+    bool enableNuma = false;
+    bool useHugePages = false;
+    // 出力画像のエンコーダー。autoは最初のフレームで各バックエンドを試して選ぶ。
+    bool autoSelectEncoder = false;
+    EncoderSettings encoderSettings;
+    // 画像ファイルの代わりに全フレームを1つのストリームに書く。変換は--convert-streamで後から行う。
+    std::string streamOutputPath;
+    uint32_t streamReorderWindow = 4;
+    std::string convertStreamPath;
+    // 書き出し済みのフレームの記録。再実行した場合は記録にあるフレームを飛ばす。
+    std::string checkpointPath;
+    // 再開を確かめるため、この数のフレームを書き出しに回した時点でプロセスを落とす。
+    uint32_t crashAfterNumFrames = 0;
     for (int argIdx = 1; argIdx < argc; ++argIdx) {
         std::string_view arg = argv[argIdx];
         if (arg == "--frame-range") {
@@ -27,6 +87,193 @@ int32_t main(int32_t argc, const char* argv[]) {
             endFrameIndex = static_cast<uint32_t>(atoi(argv[argIdx + 2]));
             argIdx += 2;
         }
+        else if (arg == "--frame-list") {
+            if (argIdx + 1 >= argc) {
+                printf("--frame-list requires a list of frames like 0-3,8,10-12.\n");
+                return -1;
+            }
+            frameListStr = argv[argIdx + 1];
+            argIdx += 1;
+        }
+        else if (arg == "--partition") {
+            if (argIdx + 1 >= argc || !parsePartition(argv[argIdx + 1], &partitionIndex, &numPartitions)) {
+                printf("--partition requires a partition index and a number of partitions like 0/2.\n");
+                return -1;
+            }
+            argIdx += 1;
+        }
+        else if (arg == "--cost-profile") {
+            if (argIdx + 1 >= argc) {
+                printf("--cost-profile requires a path to a frame cost profile.\n");
+                return -1;
+            }
+            costProfilePath = argv[argIdx + 1];
+            argIdx += 1;
+        }
+        else if (arg == "--plan-partitions") {
+            if (argIdx + 1 >= argc) {
+                printf("--plan-partitions requires a number of partitions.\n");
+                return -1;
+            }
+            numPlannedPartitions = static_cast<uint32_t>(atoi(argv[argIdx + 1]));
+            argIdx += 1;
+        }
+        else if (arg == "--actual-profile") {
+            if (argIdx + 1 >= argc) {
+                printf("--actual-profile requires a path to a frame cost profile.\n");
+                return -1;
+            }
+            actualProfilePath = argv[argIdx + 1];
+            argIdx += 1;
+        }
+        else if (arg == "--cost-prepass") {
+            if (argIdx + 1 >= argc) {
+                printf("--cost-prepass requires a path to write a frame cost profile.\n");
+                return -1;
+            }
+            prepassProfilePath = argv[argIdx + 1];
+            argIdx += 1;
+        }
+        else if (arg == "--vary-frame-cost") {
+            varyFrameCost = true;
+        }
+        else if (arg == "--trace") {
+            enableTrace = true;
+        }
+        else if (arg == "--numa") {
+            enableNuma = true;
+        }
+        else if (arg == "--huge-pages") {
+            useHugePages = true;
+        }
+        else if (arg == "--threads") {
+            if (argIdx + 1 >= argc) {
+                printf("--threads requires a number of threads.\n");
+                return -1;
+            }
+            numThreads = static_cast<uint32_t>(atoi(argv[argIdx + 1]));
+            argIdx += 1;
+        }
+        else if (arg == "--framebuffers") {
+            if (argIdx + 1 >= argc) {
+                printf("--framebuffers requires a number of framebuffers.\n");
+                return -1;
+            }
+            numFramebuffers = static_cast<uint32_t>(atoi(argv[argIdx + 1]));
+            argIdx += 1;
+        }
+        else if (arg == "--encoder-threads") {
+            if (argIdx + 1 >= argc) {
+                printf("--encoder-threads requires a number of threads.\n");
+                return -1;
+            }
+            numEncoderThreads = static_cast<uint32_t>(atoi(argv[argIdx + 1]));
+            argIdx += 1;
+        }
+        else if (arg == "--png-stripe-rows") {
+            if (argIdx + 1 >= argc) {
+                printf("--png-stripe-rows requires a number of rows per stripe.\n");
+                return -1;
+            }
+            numPngStripeRows = static_cast<uint32_t>(atoi(argv[argIdx + 1]));
+            argIdx += 1;
+        }
+        else if (arg == "--encoder") {
+            if (argIdx + 1 >= argc) {
+                printf("--encoder requires auto, fpng, stb-png or stb-jpeg.\n");
+                return -1;
+            }
+            autoSelectEncoder = std::string_view(argv[argIdx + 1]) == "auto";
+            if (!autoSelectEncoder && !parseEncoderBackend(argv[argIdx + 1], &encoderSettings.backend)) {
+                printf("Unknown encoder %s.\n", argv[argIdx + 1]);
+                return -1;
+            }
+            argIdx += 1;
+        }
+        else if (arg == "--fpng-slower") {
+            encoderSettings.fpngSlower = true;
+        }
+        else if (arg == "--png-level") {
+            if (argIdx + 1 >= argc) {
+                printf("--png-level requires a compression level (0-9).\n");
+                return -1;
+            }
+            encoderSettings.pngCompressionLevel = atoi(argv[argIdx + 1]);
+            argIdx += 1;
+        }
+        else if (arg == "--jpeg-quality") {
+            if (argIdx + 1 >= argc) {
+                printf("--jpeg-quality requires a quality (1-100).\n");
+                return -1;
+            }
+            encoderSettings.jpegQuality = atoi(argv[argIdx + 1]);
+            argIdx += 1;
+        }
+        else if (arg == "--stream-output") {
+            if (argIdx + 1 >= argc) {
+                printf("--stream-output requires a path (.y4m for Y4M, - for stdout).\n");
+                return -1;
+            }
+            streamOutputPath = argv[argIdx + 1];
+            argIdx += 1;
+        }
+        else if (arg == "--reorder-window") {
+            if (argIdx + 1 >= argc) {
+                printf("--reorder-window requires a number of frames.\n");
+                return -1;
+            }
+            streamReorderWindow = static_cast<uint32_t>(atoi(argv[argIdx + 1]));
+            argIdx += 1;
+        }
+        else if (arg == "--checkpoint") {
+            if (argIdx + 1 >= argc) {
+                printf("--checkpoint requires a manifest path.\n");
+                return -1;
+            }
+            checkpointPath = argv[argIdx + 1];
+            argIdx += 1;
+        }
+        else if (arg == "--crash-after-frames") {
+            if (argIdx + 1 >= argc) {
+                printf("--crash-after-frames requires a number of frames.\n");
+                return -1;
+            }
+            crashAfterNumFrames = static_cast<uint32_t>(atoi(argv[argIdx + 1]));
+            argIdx += 1;
+        }
+        else if (arg == "--convert-stream") {
+            if (argIdx + 1 >= argc) {
+                printf("--convert-stream requires a stream path.\n");
+                return -1;
+            }
+            convertStreamPath = argv[argIdx + 1];
+            argIdx += 1;
+        }
+        else if (arg == "--time-limit") {
+            if (argIdx + 1 >= argc) {
+                printf("--time-limit requires a time in seconds.\n");
+                return -1;
+            }
+            schedulerSettings.timeLimit = atof(argv[argIdx + 1]);
+            argIdx += 1;
+        }
+        else if (arg == "--safety-margin") {
+            if (argIdx + 1 >= argc) {
+                printf("--safety-margin requires a time in seconds.\n");
+                return -1;
+            }
+            schedulerSettings.safetyMargin = atof(argv[argIdx + 1]);
+            argIdx += 1;
+        }
+        else if (arg == "--spp-range") {
+            if (argIdx + 2 >= argc) {
+                printf("--spp-range requires a pair of minimum and maximum sample counts.\n");
+                return -1;
+            }
+            schedulerSettings.minNumSamples = static_cast<uint32_t>(atoi(argv[argIdx + 1]));
+            schedulerSettings.maxNumSamples = static_cast<uint32_t>(atoi(argv[argIdx + 2]));
+            argIdx += 2;
+        }
         else {
             printf("Unknown argument %s.\n", argv[argIdx]);
             return -1;
@@ -38,53 +285,288 @@ int32_t main(int32_t argc, const char* argv[]) {
         return -1;
     }
 
+    // --frame-rangeはアニメーション全体の範囲で、分割する場合もこの範囲を分ける。
+    std::vector<uint32_t> allFrames;
+    for (uint32_t frameIndex = startFrameIndex; frameIndex <= endFrameIndex; ++frameIndex)
+        allFrames.push_back(frameIndex);
 
+    if (numPlannedPartitions > 0) {
+        // 各ノードに渡す--frame-listと、予測した偏りを表示する。
+        std::vector<double> costs;
+        if (costProfilePath.empty() || !loadFrameCostProfile(costProfilePath.c_str(), endFrameIndex + 1, costs)) {
+            printf("--plan-partitions requires a valid --cost-profile.\n");
+            return -1;
+        }
+        std::vector<double> actualCosts;
+        if (!actualProfilePath.empty() &&
+            !loadFrameCostProfile(actualProfilePath.c_str(), endFrameIndex + 1, actualCosts))
+            return -1;
 
-    using namespace fpng;
-    fpng_init();
+        const std::vector<std::vector<uint32_t>> partitions =
+            partitionFrames(allFrames, costs, numPlannedPartitions);
+        std::vector<double> predictedLoads(numPlannedPartitions, 0.0);
+        std::vector<double> actualLoads(numPlannedPartitions, 0.0);
+        std::vector<double> contiguousLoads(numPlannedPartitions, 0.0);
+        for (uint32_t partIdx = 0; partIdx < numPlannedPartitions; ++partIdx) {
+            for (const uint32_t frameIndex : partitions[partIdx]) {
+                predictedLoads[partIdx] += costs[frameIndex];
+                if (!actualCosts.empty())
+                    actualLoads[partIdx] += actualCosts[frameIndex];
+            }
+            printf(
+                "Partition %u/%u: %zu frames, predicted cost %.3f\n  --frame-list %s\n",
+                partIdx, numPlannedPartitions, partitions[partIdx].size(), predictedLoads[partIdx],
+                formatFrameList(partitions[partIdx]).c_str());
+        }
+        // 比較のため、範囲を連続したまとまりに等分した場合の偏りも出す。
+        for (uint32_t i = 0; i < allFrames.size(); ++i)
+            contiguousLoads[static_cast<uint64_t>(i) * numPlannedPartitions / allFrames.size()] += costs[allFrames[i]];
+        printf(
+            "Predicted imbalance: %.1f%% (contiguous split: %.1f%%)\n",
+            100.0 * computeImbalance(predictedLoads), 100.0 * computeImbalance(contiguousLoads));
+        if (!actualCosts.empty()) {
+            for (uint32_t partIdx = 0; partIdx < numPlannedPartitions; ++partIdx)
+                printf("Partition %u/%u: actual cost %.3f\n", partIdx, numPlannedPartitions, actualLoads[partIdx]);
+            printf("Actual imbalance: %.1f%%\n", 100.0 * computeImbalance(actualLoads));
+        }
+        return 0;
+    }
+
+    std::vector<uint32_t> frames = allFrames;
+    double predictedShare = 0.0;
+    double predictedImbalance = 0.0;
+    if (!frameListStr.empty()) {
+        if (!parseFrameList(frameListStr, frames)) {
+            printf("Invalid frame list %s.\n", frameListStr.c_str());
+            return -1;
+        }
+    }
+    else if (numPartitions > 0) {
+        // 全ノードが同じプロファイルから同じ分割を計算し、自分の分だけを描く。
+        std::vector<double> costs;
+        if (costProfilePath.empty() || !loadFrameCostProfile(costProfilePath.c_str(), endFrameIndex + 1, costs)) {
+            printf("--partition requires a valid --cost-profile.\n");
+            return -1;
+        }
+        const std::vector<std::vector<uint32_t>> partitions = partitionFrames(allFrames, costs, numPartitions);
+        std::vector<double> loads(numPartitions, 0.0);
+        for (uint32_t partIdx = 0; partIdx < numPartitions; ++partIdx) {
+            for (const uint32_t frameIndex : partitions[partIdx])
+                loads[partIdx] += costs[frameIndex];
+        }
+        frames = partitions[partitionIndex];
+        double totalCost = 0.0;
+        for (const double load : loads)
+            totalCost += load;
+        predictedShare = totalCost > 0.0 ? loads[partitionIndex] / totalCost : 0.0;
+        predictedImbalance = computeImbalance(loads);
+    }
+    if (frames.empty()) {
+        printf("No frames to render.\n");
+        return 0;
+    }
+
+    // ストリームは開いた時点で既存のファイルを切り詰めるので、検証を終えてから描画する場合にだけ開く。
+    // 標準出力に書く場合にログが混ざらないよう、描画のログを表示する前に開く。
+    std::unique_ptr<FrameStreamWriter> streamWriter;
+    if (!streamOutputPath.empty()) {
+        if (convertStreamPath.empty() && prepassProfilePath.empty())
+            streamWriter = std::make_unique<FrameStreamWriter>(streamOutputPath, streamReorderWindow);
+        else
+            printf("Ignore --stream-output: nothing is rendered in this mode.\n");
+    }
+
+    if (numPartitions > 0 && frameListStr.empty()) {
+        printf(
+            "Partition %u/%u: %zu frames, %.1f%% of the predicted cost (imbalance %.1f%%)\n",
+            partitionIndex, numPartitions, frames.size(), 100.0 * predictedShare, 100.0 * predictedImbalance);
+    }
+
+    if (enableTrace) {
+        enableTracing();
+        setTraceThreadName("main");
+    }
+
+
+
+    // NUMAを考慮する場合はワーカーをノードごとに固定し、フレームバッファは描いたワーカーのノードに置く。
+    const NumaTopology &topology = getNumaTopology();
+    topology.print();
+    setHugePagesEnabled(useHugePages);
+
+    // 0の場合は全コアを使う。
+    ThreadPool threadPool(numThreads, enableNuma ? &topology : nullptr);
+    constexpr uint32_t tileSize = 32;
+    TileRenderer renderer(threadPool, tileSize);
+    printf("Render with %u threads%s.\n", renderer.getNumThreads(), enableNuma ? " pinned per NUMA node" : "");
+
+    if (!convertStreamPath.empty()) {
+        // --encoderの設定で番号付きの画像ファイルを作る。autoの場合は既定のエンコーダーを使う。
+        const clock::time_point convertStartTp = clock::now();
+        const std::unique_ptr<ImageEncoder> encoder = createImageEncoder(encoderSettings);
+        const uint32_t numFrames = convertFrameStreamToImages(convertStreamPath, *encoder, threadPool);
+        printf(
+            "Converted %u frames of %s with %s in %.3f [s]\n",
+            numFrames, convertStreamPath.c_str(), encoder->getDescription(),
+            std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - convertStartTp).count() * 1e-6);
+        return 0;
+    }
 
-    struct RGBA {
-        uint32_t r : 8;
-        uint32_t g : 8;
-        uint32_t b : 8;
-        uint32_t a : 8;
-    };
     constexpr uint32_t width = 256;
     constexpr uint32_t height = 256;
-    std::vector<RGBA> pixels(height * width);
+    // 16sppでフレーム全体200ms相当の負荷とする。
+    constexpr uint32_t referenceNumSamples = 16;
 
-    for (uint32_t frameIndex = startFrameIndex; frameIndex <= endFrameIndex; ++frameIndex) {
-        const clock::time_point frameStartTp = clock::now();
-        printf("Frame %u ... ", frameIndex);
+    // imageWidth x imageHeightの画像を描く。負荷は解像度に比例させ、フル解像度の画像を基準とする。
+    const auto renderImage = [&](
+        uint32_t frameIndex, uint32_t numSamples, uint32_t imageWidth, uint32_t imageHeight, RGBA* pixels) {
+        const double costScale = varyFrameCost ? getSimulatedFrameCostScale(frameIndex) : 1.0;
+        return renderer.render(
+            0, 0, imageWidth, imageHeight,
+            [&](const Tile &tile, uint32_t) {
+                // 高度なレンダリング...
+                // フレーム全体の負荷をタイル面積で按分する。
+                std::this_thread::sleep_for(
+                    std::chrono::microseconds(
+                        static_cast<uint64_t>(
+                            costScale * (200000ull * numSamples / referenceNumSamples *
+                                         tile.width * tile.height / (width * height)))));
+                for (uint32_t y = tile.y; y < tile.y + tile.height; ++y) {
+                    for (uint32_t x = tile.x; x < tile.x + tile.width; ++x) {
+                        RGBA v;
+                        v.r = x;
+                        v.g = y;
+                        v.b = frameIndex;
+                        v.a = 255;
+                        const int32_t idx = y * imageWidth + x;
+                        pixels[idx] = v;
+                    }
+                }
+            });
+    };
 
-        // 高度なレンダリング...
-        std::this_thread::sleep_for(std::chrono::milliseconds(200));
-        for (int y = 0; y < height; ++y) {
-            for (int x = 0; x < width; ++x) {
-                RGBA v;
-                v.r = x;
-                v.g = y;
-                v.b = frameIndex;
-                v.a = 255;
-                const int32_t idx = y * width + x;
-                pixels[idx] = v;
-            }
+    if (!prepassProfilePath.empty()) {
+        // 縦横1/4の解像度、少ないサンプル数で各フレームを描いた時間をコストとする。
+        constexpr uint32_t prepassDownscale = 4;
+        constexpr uint32_t prepassNumSamples = 4;
+        constexpr uint32_t prepassWidth = width / prepassDownscale;
+        constexpr uint32_t prepassHeight = height / prepassDownscale;
+        std::vector<RGBA> prepassPixels(prepassWidth * prepassHeight);
+        std::vector<double> costs(*std::max_element(frames.begin(), frames.end()) + 1, -1.0);
+        const clock::time_point prepassStartTp = clock::now();
+        for (const uint32_t frameIndex : frames) {
+            const clock::time_point frameStartTp = clock::now();
+            renderImage(frameIndex, prepassNumSamples, prepassWidth, prepassHeight, prepassPixels.data());
+            costs[frameIndex] =
+                std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - frameStartTp).count() * 1e-3;
         }
+        printf(
+            "Cost pre-pass: %zu frames in %.3f [s]\n", frames.size(),
+            std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - prepassStartTp).count() * 1e-6);
+        return writeFrameCostProfile(prepassProfilePath.c_str(), costs) ? 0 : -1;
+    }
+
+    // パイプラインより先に作り、後に破棄する。
+    // ストリームは書き出したフレームの続きから書き足せないので、ストリーム出力の場合は記録しない。
+    CheckpointManifest checkpoint;
+    if (!checkpointPath.empty() && streamWriter)
+        printf("Ignore --checkpoint: a stream output cannot be resumed.\n");
+    if (!checkpointPath.empty() && !streamWriter) {
+        checkpoint.open(checkpointPath, CheckpointParams{ width, height, 0 });
+        const size_t numRequestedFrames = frames.size();
+        frames.erase(
+            std::remove_if(
+                frames.begin(), frames.end(),
+                [&](uint32_t frameIndex) { return checkpoint.isFrameDone(frameIndex); }),
+            frames.end());
+        printf(
+            "Checkpoint: %zu/%zu frames already written, %zu frames left.\n",
+            numRequestedFrames - frames.size(), numRequestedFrames, frames.size());
+        if (frames.empty()) {
+            printf("All frames are already written.\n");
+            return 0;
+        }
+    }
+
+    // 画像のエンコードと書き出しは次のフレームのレンダリングと並行して行う。
+    FramePipeline pipeline(numFramebuffers, numEncoderThreads);
+    pipeline.setCrashAfterNumFrames(crashAfterNumFrames);
+    if (checkpoint.isOpen())
+        pipeline.setCheckpointManifest(&checkpoint);
+    if (numPngStripeRows > 0)
+        pipeline.setStripedPngEncoding(&threadPool, numPngStripeRows);
+    pipeline.setDeferFirstTouch(enableNuma);
+    if (autoSelectEncoder) {
+        // 制限時間を全フレームで等分した時間を1フレームあたりのエンコードの予算にする。
+        const uint32_t numFrames = static_cast<uint32_t>(frames.size());
+        pipeline.setEncoderCandidates(
+            createImageEncodersOfAllBackends(encoderSettings),
+            (schedulerSettings.timeLimit - schedulerSettings.safetyMargin) / numFrames);
+    }
+    else {
+        pipeline.setEncoder(createImageEncoder(encoderSettings));
+    }
+    if (streamWriter)
+        pipeline.setStreamOutput(std::move(streamWriter));
+
+    // 制限時間内に全フレームを終えられるようフレームごとのサンプル数を決める。
+    DeadlineScheduler scheduler(appStartTp, schedulerSettings);
+
+    // 次回の分割に使えるよう、描いたフレームの1サンプルあたりの時間[ms]をコストとして記録する。
+    std::vector<double> recordedCosts(*std::max_element(frames.begin(), frames.end()) + 1, -1.0);
+    const clock::time_point renderStartTp = clock::now();
+
+    for (uint32_t i = 0; i < frames.size(); ++i) {
+        const uint32_t frameIndex = frames[i];
+        FramePipeline::Frame &frame = pipeline.acquireFrame(frameIndex, width, height);
+        PageVector<RGBA> &pixels = frame.pixels;
+
+        const uint32_t numSamples = scheduler.decideNumSamples(
+            frameIndex, static_cast<uint32_t>(frames.size()) - i);
+
+        const clock::time_point frameStartTp = clock::now();
+        const int64_t traceBeginTime = beginTraceEvent();
+        printf("Frame %u (%u spp) ... ", frameIndex, numSamples);
+
+        const clock::duration parallelTime = renderImage(frameIndex, numSamples, width, height, pixels.data());
+
+        endTraceEvent("render", "frame", traceBeginTime, frameIndex);
 
         // 起動からの時刻とフレーム時間を計算。
         const clock::time_point now = clock::now();
         const clock::duration frameTime = now - frameStartTp;
         const clock::duration totalTime = now - appStartTp;
+        scheduler.reportFrameTime(numSamples, frameTime);
+        recordedCosts[frameIndex] =
+            std::chrono::duration_cast<std::chrono::microseconds>(frameTime).count() * 1e-3 / numSamples;
         printf(
-            "Done: %.3f [ms] (total: %.3f [s])\n",
+            "Done: %.3f [ms] (parallel: %.3f [ms], total: %.3f [s])\n",
             std::chrono::duration_cast<std::chrono::microseconds>(frameTime).count() * 1e-3f,
+            std::chrono::duration_cast<std::chrono::microseconds>(parallelTime).count() * 1e-3f,
             std::chrono::duration_cast<std::chrono::milliseconds>(totalTime).count() * 1e-3f);
 
-        // 3桁連番で画像出力。
-        char filename[256];
-        sprintf_s(filename, "%03u.png", frameIndex);
-        fpng_encode_image_to_file(filename, pixels.data(), width, height, 4, 0);
+        pipeline.submitFrame(frame);
+    }
+
+    const double renderTime =
+        std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - renderStartTp).count() * 1e-6;
+    pipeline.finish();
+    pipeline.printStats();
+    if (checkpoint.isOpen()) {
+        checkpoint.close();
+        checkpoint.printStats();
+    }
+    if (numPartitions > 0) {
+        // 実際の偏りは各ノードのcost_profile.csvを連結して--plan-partitionsの--actual-profileに渡して確かめる。
+        printf(
+            "Partition %u/%u: rendered %zu frames in %.3f [s], predicted %.1f%% of the total cost\n",
+            partitionIndex, numPartitions, frames.size(), renderTime, 100.0 * predictedShare);
     }
+    writeFrameCostProfile("cost_profile.csv", recordedCosts);
+    pipeline.printPagePlacement(topology);
+    scheduler.writeLog("scheduler_log.csv");
+    if (enableTrace)
+        writeTrace("trace.json", 0, "usecase2", 0);
 
     return 0;
 }
@@ -0,0 +1,567 @@
+﻿#include <sdkddkver.h>
+#include "client.h"
+
+#include <cstdio>
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+
+#include "content_hash.h"
+#include "trace.h"
+
+// https://github.com/richgel999/fpng
+#include "fpng.h"
+
+void Client::injectFault() {
+    if (m_faultMode == FaultMode::Kill) {
+        printf("Inject a fault: kill the client after %u tiles.\n", m_faultAfterNumTasks);
+        fflush(stdout);
+        std::_Exit(1);
+    }
+    if (m_faultMode == FaultMode::Disconnect) {
+        // 通信スレッドで接続を閉じる。読み込みが失敗してio_contextのrun()が例外で抜ける。
+        if (m_isFaultInjected.exchange(true, std::memory_order_acq_rel))
+            return;
+        printf("Inject a fault: disconnect the client after %u tiles.\n", m_faultAfterNumTasks);
+        asio::post(
+            m_socket.get_executor(),
+            [this]() {
+                asio::error_code ignored;
+                m_socket.close(ignored);
+            });
+        return;
+    }
+    // 接続を保ったまま応答しなくなったノードを模す。
+    printf("Inject a fault: stall the client after %u tiles.\n", m_faultAfterNumTasks);
+    while (!m_worker.isStopping())
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+}
+
+template <typename Message>
+uint32_t Client::send(const Message &message) {
+    const uint32_t sequenceID = m_nextSequenceID++;
+    std::unique_ptr<MessageWriter> writer = m_sendQueue.acquire();
+    writer->encode(message, sequenceID);
+    m_sendQueue.push(std::move(writer));
+    return sequenceID;
+}
+
+std::shared_ptr<Client::PendingReply> Client::expectReply(
+    uint32_t sequenceID,
+    std::function<bool(const MessageHeader &header, const WireReader &payload)> onReply) {
+    auto pending = std::make_shared<PendingReply>(m_socket.get_executor());
+    pending->onReply = std::move(onReply);
+    m_pendingReplies[sequenceID] = pending;
+    return pending;
+}
+
+asio::awaitable<bool> Client::awaitReply(std::shared_ptr<PendingReply> pending) {
+    while (!pending->isReceived) {
+        if (m_isDisconnected)
+            co_return false;
+        co_await pending->signal.wait();
+    }
+    if (!pending->isValid)
+        throw std::runtime_error("Received an unexpected reply from the server.\n");
+    co_return true;
+}
+
+template <typename Request, typename Reply>
+asio::awaitable<bool> Client::request(const Request &message, Reply &reply) {
+    co_return co_await awaitReply(sendRequest(
+        message,
+        [&reply](const MessageHeader &header, const WireReader &payload) {
+            return decodeMessage(header, payload, reply);
+        }));
+}
+
+void Client::sendTile(
+    uint32_t slotIndex, const RenderTask &task, uint32_t numSamples, const RenderWorker::TilePixels &pixels) {
+    // 停止の場合は他のスロットも閾値を越えた時点で止める。
+    if (m_isFaultInjected.load(std::memory_order_acquire))
+        return;
+    if (m_faultMode != FaultMode::None && m_numRenderedTiles.fetch_add(1) >= m_faultAfterNumTasks) {
+        injectFault();
+        return;
+    }
+
+    TileResultMessage message;
+    message.taskID = task.taskID;
+    message.frameIndex = task.frameIndex;
+    message.x = task.x;
+    message.y = task.y;
+    message.width = task.width;
+    message.height = task.height;
+    message.numSamples = numSamples;
+    const uint64_t numRawBytes = static_cast<uint64_t>(task.width) * task.height * sizeof(RGBA);
+    TraceScope traceScope("encode", "pack tile", task.frameIndex);
+    // 画素や圧縮結果はペイロードにコピーせず、書き込みが終わるまでwriterに保持させて直接送る。
+    std::shared_ptr<const void> body;
+    std::shared_ptr<std::vector<uint8_t>> &compressedTile = m_compressedTiles[slotIndex];
+    if (m_compressTiles &&
+        fpng::fpng_encode_image_to_memory(
+            pixels->data(), task.width, task.height, 4, acquireUnsharedBuffer(compressedTile))) {
+        message.encoding = TileEncoding::Png;
+        message.data = compressedTile->data();
+        message.dataSize = static_cast<uint32_t>(compressedTile->size());
+        body = compressedTile;
+    }
+    else {
+        message.encoding = TileEncoding::Raw;
+        message.data = reinterpret_cast<const uint8_t*>(pixels->data());
+        message.dataSize = static_cast<uint32_t>(numRawBytes);
+        body = pixels;
+    }
+
+    std::unique_ptr<MessageWriter> writer = m_sendQueue.acquire();
+    writer->encodeWithExternalBody(message, 0, std::move(body));
+    asio::post(
+        m_socket.get_executor(),
+        [this, writer = std::move(writer), numRawBytes]() mutable {
+            ++m_numSentTiles;
+            m_numSentTileBytes += writer->getMessageSize();
+            m_numRawTileBytes += numRawBytes;
+            m_sendQueue.push(std::move(writer));
+        });
+}
+
+void Client::sendFinish() {
+    // 終了シグナルを送る。送信待ちのタイルを全て書き終えてから接続を閉じる。
+    m_isFinishing = true;
+    m_noMoreTasks = true;
+    m_taskRequestSignal.notify();
+    send(FinishSignalMessage{});
+    m_sendQueue.finish();
+}
+
+void Client::wakePendingReplies() {
+    std::map<uint32_t, std::shared_ptr<PendingReply>> pendingReplies;
+    pendingReplies.swap(m_pendingReplies);
+    for (auto &[sequenceID, pending] : pendingReplies)
+        pending->signal.notify();
+}
+
+asio::awaitable<void> Client::readLoop() {
+    while (true) {
+        MessageHeader header;
+        WireReader payload;
+        const asio::error_code ec = co_await coReadMessage(m_socket, m_reader, header, payload);
+        if (ec) {
+            // 終了シグナルを送った後はこちらから閉じる。
+            if (m_isFinishing && ec != asio::error::invalid_argument) {
+                m_isDisconnected = true;
+                wakePendingReplies();
+                co_return;
+            }
+            char msg[256];
+            sprintf_s(msg, "Lost the connection to the server: %s\n", ec.message().c_str());
+            throw std::runtime_error(msg);
+        }
+
+        const auto it = m_pendingReplies.find(header.sequenceID);
+        if (it == m_pendingReplies.end()) {
+            char msg[128];
+            sprintf_s(
+                msg, "Unexpected message from the server (type %u, sequence %u).\n",
+                static_cast<uint32_t>(header.type), header.sequenceID);
+            throw std::runtime_error(msg);
+        }
+        const std::shared_ptr<PendingReply> pending = std::move(it->second);
+        m_pendingReplies.erase(it);
+        pending->isValid = pending->onReply(header, payload);
+        pending->isReceived = true;
+        pending->signal.notify();
+    }
+}
+
+asio::awaitable<void> Client::writeLoop() {
+    const asio::error_code ec = co_await m_sendQueue.run();
+    if (ec) {
+        char msg[256];
+        sprintf_s(msg, "Lost the connection to the server: %s\n", ec.message().c_str());
+        throw std::runtime_error(msg);
+    }
+    // 終了シグナルまで書き終えた。
+    asio::error_code ignored;
+    m_socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+    m_socket.close(ignored);
+    m_workGuard.reset();
+}
+
+double Client::getTimeSinceAppStart() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        hires_clock::now() - g_appStartTp).count() * 1e-6;
+}
+
+asio::awaitable<void> Client::waitBeforeRetry(uint32_t numTrials) {
+    constexpr uint32_t initialRetryInterval = 20;
+    constexpr uint32_t maxRetryInterval = 1000;
+    const uint32_t interval = std::min(initialRetryInterval << std::min(numTrials, 16u), maxRetryInterval);
+    // 間隔の半分から全体までの一様乱数にする。
+    std::uniform_int_distribution<uint32_t> distribution(interval / 2, interval);
+    asio::steady_timer timer(m_socket.get_executor(), std::chrono::milliseconds(distribution(m_retryRng)));
+    co_await timer.async_wait(asio::use_awaitable);
+}
+
+asio::awaitable<void> Client::connect() {
+    using asio::ip::tcp;
+
+    const hires_clock::time_point startTp = hires_clock::now();
+    while (true) {
+        asio::error_code ec;
+        const tcp::endpoint ep = co_await asio::async_connect(
+            m_socket, m_endpoints, asio::redirect_error(asio::use_awaitable, ec));
+        if (!ec) {
+            printf(
+                "Connected to %s:%u\n",
+                ep.address().to_string().c_str(), static_cast<uint32_t>(ep.port()));
+            // 小さなメッセージの往復が多いのでNagleアルゴリズムを切る。
+            m_socket.set_option(tcp::no_delay(true));
+            co_return;
+        }
+
+        const double elapsedTime = std::chrono::duration_cast<std::chrono::microseconds>(
+            hires_clock::now() - startTp).count() * 1e-6;
+        ++m_numConnectTrials;
+        if (elapsedTime >= m_connectTimeout) {
+            char msg[128];
+            sprintf_s(msg, "Failed %u times in %.3f [s].\n", m_numConnectTrials, elapsedTime);
+            throw std::runtime_error(msg);
+        }
+        const tcp::endpoint &fep = *m_endpoints;
+        printf(
+            "Tried to connect to %s:%u (%u, %.3f [s])\n",
+            fep.address().to_string().c_str(), static_cast<uint32_t>(fep.port()),
+            m_numConnectTrials, elapsedTime);
+        co_await waitBeforeRetry(m_numConnectTrials - 1);
+    }
+}
+
+asio::awaitable<void> Client::syncClock() {
+    constexpr uint32_t numClockSyncRounds = 16;
+    for (uint32_t round = 0; round < numClockSyncRounds; ++round) {
+        const int64_t sendTime = getTraceTime();
+        ClockSyncMessage message;
+        co_await request(ClockSyncRequestMessage{}, message);
+        const int64_t receiveTime = getTraceTime();
+        const int64_t roundTripTime = receiveTime - sendTime;
+        if (round == 0 || roundTripTime < m_clockSyncRoundTripTime) {
+            m_clockSyncRoundTripTime = roundTripTime;
+            m_clockOffset = message.serverTime - (sendTime + receiveTime) / 2;
+        }
+    }
+    printf(
+        "Clock offset to the server: %.3f [ms] (round trip %.3f [ms]).\n",
+        m_clockOffset * 1e-6, m_clockSyncRoundTripTime * 1e-6);
+}
+
+std::string Client::getSceneCachePath(const char* extension) const {
+    char filename[32];
+    sprintf_s(filename, "%016llx%s", static_cast<unsigned long long>(m_sceneInfo.contentHash), extension);
+    return (std::filesystem::path(m_sceneCacheDir) / filename).string();
+}
+
+bool Client::openCachedScene() {
+    if (!m_scene.openForRead(getSceneCachePath(".bin")))
+        return false;
+    if (m_scene.getSize() != m_sceneInfo.size ||
+        computeContentHash(m_scene.getData(), m_scene.getSize()) != m_sceneInfo.contentHash) {
+        printf("Discard the cached scene that does not match the server's.\n");
+        m_scene.close();
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<Client::PendingSceneChunk> Client::requestSceneChunk(uint64_t offset, uint32_t size) {
+    auto chunk = std::make_unique<PendingSceneChunk>();
+    chunk->offset = offset;
+    chunk->size = size;
+    chunk->isCorrupted = false;
+    SceneChunkRequestMessage request;
+    request.offset = offset;
+    request.size = size;
+    chunk->reply = sendRequest(
+        request,
+        [this, chunk = chunk.get()](const MessageHeader &header, const WireReader &payload) {
+            SceneChunkMessage message;
+            if (!decodeMessage(header, payload, message) ||
+                message.offset != chunk->offset || message.dataSize != chunk->size)
+                return false;
+            if (computeContentHash(message.data, message.dataSize) != message.checksum) {
+                chunk->isCorrupted = true;
+                return true;
+            }
+            std::memcpy(m_scene.getWritableData() + message.offset, message.data, message.dataSize);
+            return true;
+        });
+    return chunk;
+}
+
+void Client::finishSceneTransfer() {
+    if (computeContentHash(m_scene.getData(), m_scene.getSize()) != m_sceneInfo.contentHash)
+        throw std::runtime_error("The received scene does not match the server's hash.\n");
+    // 揃ってから正式な名前にするので、途中で落ちても壊れたキャッシュは残らない。
+    m_scene.close();
+    const std::string path = getSceneCachePath(".bin");
+    std::filesystem::rename(getSceneCachePath(".part"), path);
+    if (!m_scene.openForRead(path))
+        throw std::runtime_error("Failed to reopen the received scene.\n");
+}
+
+asio::awaitable<void> Client::prepareScene() {
+    co_await request(SceneInfoRequestMessage{}, m_sceneInfo);
+    if (m_sceneInfo.size == 0)
+        co_return;
+    if (openCachedScene()) {
+        m_isSceneCached = true;
+        printf(
+            "Use the cached scene %016llx (%.3f [MB]).\n",
+            static_cast<unsigned long long>(m_sceneInfo.contentHash),
+            m_sceneInfo.size / (1024.0 * 1024.0));
+        co_return;
+    }
+
+    printf(
+        "Receive the scene %016llx (%.3f [MB]).\n",
+        static_cast<unsigned long long>(m_sceneInfo.contentHash),
+        m_sceneInfo.size / (1024.0 * 1024.0));
+    std::filesystem::create_directories(m_sceneCacheDir);
+    m_scene.create(getSceneCachePath(".part"), m_sceneInfo.size);
+    const hires_clock::time_point startTp = hires_clock::now();
+
+    // 応答を待たずに複数のチャンクを要求しておき、往復の待ち時間を転送に重ねる。
+    constexpr size_t maxNumChunksInFlight = 4;
+    const uint32_t chunkSize = std::clamp<uint32_t>(m_sceneInfo.chunkSize, 64 * 1024, g_maxSceneChunkSize);
+    std::deque<std::unique_ptr<PendingSceneChunk>> pendingChunks;
+    uint64_t nextChunkOffset = 0;
+    while (m_numReceivedSceneBytes < m_sceneInfo.size) {
+        while (pendingChunks.size() < maxNumChunksInFlight && nextChunkOffset < m_sceneInfo.size) {
+            const uint32_t size = static_cast<uint32_t>(
+                std::min<uint64_t>(chunkSize, m_sceneInfo.size - nextChunkOffset));
+            pendingChunks.push_back(requestSceneChunk(nextChunkOffset, size));
+            nextChunkOffset += size;
+        }
+
+        const std::unique_ptr<PendingSceneChunk> chunk = std::move(pendingChunks.front());
+        pendingChunks.pop_front();
+        co_await awaitReply(chunk->reply);
+        if (chunk->isCorrupted) {
+            // 壊れたチャンクは取り直す。何度も壊れる場合は回復できない。
+            constexpr uint32_t maxNumRetries = 8;
+            if (++m_numSceneChunkRetries > maxNumRetries)
+                throw std::runtime_error("Scene chunks are repeatedly corrupted.\n");
+            printf(
+                "Scene chunk at %llu is corrupted, request it again.\n",
+                static_cast<unsigned long long>(chunk->offset));
+            pendingChunks.push_back(requestSceneChunk(chunk->offset, chunk->size));
+            continue;
+        }
+        m_numReceivedSceneBytes += chunk->size;
+        ++m_numReceivedSceneChunks;
+    }
+    finishSceneTransfer();
+
+    m_sceneTransferTime = std::chrono::duration_cast<std::chrono::microseconds>(
+        hires_clock::now() - startTp).count() * 1e-6;
+    printf(
+        "Received the scene: %.3f [MB] in %.3f [s] (%.1f [MB/s], %u chunks, %u retries).\n",
+        m_sceneInfo.size / (1024.0 * 1024.0), m_sceneTransferTime,
+        m_sceneInfo.size / (1024.0 * 1024.0) / std::max(m_sceneTransferTime, 1e-6),
+        m_numReceivedSceneChunks, m_numSceneChunkRetries);
+}
+
+asio::awaitable<void> Client::requestTasks() {
+    // レンダータスクリクエスト。
+    RenderTaskRequestMessage taskRequest;
+    taskRequest.numTasks = m_worker.getNumTasksPerRequest();
+    taskRequest.numSamples = m_worker.proposeNumSamples();
+    RenderTaskMessage reply;
+    const bool isReceived = co_await request(taskRequest, reply);
+    --m_numTaskRequestsInFlight;
+    if (!isReceived || m_noMoreTasks)
+        co_return;
+
+    if (!reply.tasks.front().isValid) {
+        m_noMoreTasks = true;
+        m_worker.finishTasks();
+    }
+    else {
+        if (m_firstTaskTime < 0.0) {
+            m_firstTaskTime = getTimeSinceAppStart();
+            printf(
+                "Time to first task: %.3f [s] (connected %.3f, scene ready %.3f, server ready %.3f).\n",
+                m_firstTaskTime, m_connectedTime, m_sceneReadyTime, m_serverReadyTime);
+        }
+        m_worker.pushTasks(reply.tasks);
+    }
+    m_taskRequestSignal.notify();
+}
+
+asio::awaitable<void> Client::run() {
+    // レンダリングスレッドは接続を待つ間に準備を済ませている。
+    co_await connect();
+    m_connectedTime = getTimeSinceAppStart();
+
+    // セッションID受信。サーバーから一方的に送られてくるのでシーケンスIDは0。
+    SessionIDMessage sessionIDMessage;
+    const std::shared_ptr<PendingReply> sessionIDReply = expectReply(
+        0,
+        [&sessionIDMessage](const MessageHeader &header, const WireReader &payload) {
+            return decodeMessage(header, payload, sessionIDMessage);
+        });
+    asio::co_spawn(m_socket.get_executor(), readLoop(), rethrowException);
+    asio::co_spawn(m_socket.get_executor(), writeLoop(), rethrowException);
+    co_await awaitReply(sessionIDReply);
+    m_sessionID = sessionIDMessage.sessionID;
+    m_worker.setWorkerID(m_sessionID);
+
+    if (isTracingEnabled())
+        co_await syncClock();
+    co_await prepareScene();
+    m_sceneReadyTime = getTimeSinceAppStart();
+
+    // サーバー状態リクエスト。準備中の間は間隔を空けて問い合わせる。
+    ServerStateMessage serverState;
+    while (true) {
+        co_await request(ServerStateRequestMessage{}, serverState);
+        if (serverState.state != ServerState::PreparingData)
+            break;
+        co_await waitBeforeRetry(m_numServerStatePolls++);
+    }
+    m_serverReadyTime = getTimeSinceAppStart();
+    if (serverState.state == ServerState::Finishing) {
+        m_noMoreTasks = true;
+        m_worker.finishTasks();
+        co_return;
+    }
+
+    // 手元のタスクが先読み数を下回ったら、上限まで要求を重ねて出す。
+    while (!m_noMoreTasks) {
+        while (m_numTaskRequestsInFlight < m_maxNumTaskRequestsInFlight && m_worker.needsMoreTasks()) {
+            ++m_numTaskRequestsInFlight;
+            asio::co_spawn(m_socket.get_executor(), requestTasks(), rethrowException);
+        }
+        co_await m_taskRequestSignal.wait();
+    }
+}
+
+Client::Client(
+    asio::io_context &ioContext, RenderWorker &worker,
+    const std::string &host, const std::string &port,
+    double connectTimeout, uint32_t maxNumTaskRequestsInFlight,
+    bool compressTiles, const std::string &sceneCacheDir,
+    FaultMode faultMode, uint32_t faultAfterNumTasks) :
+    m_socket(ioContext), m_workGuard(asio::make_work_guard(ioContext)),
+    m_worker(worker),
+    m_connectTimeout(connectTimeout), m_numConnectTrials(0), m_numServerStatePolls(0),
+    m_retryRng(std::random_device{}()),
+    m_sessionID(0),
+    m_isFinishing(false), m_isDisconnected(false),
+    m_nextSequenceID(1),
+    m_sendQueue(m_socket),
+    m_maxNumTaskRequestsInFlight(std::max(maxNumTaskRequestsInFlight, 1u)), m_numTaskRequestsInFlight(0),
+    m_noMoreTasks(false), m_taskRequestSignal(m_socket.get_executor()),
+    m_compressTiles(compressTiles), m_compressedTiles(worker.getNumRenderSlots()),
+    m_numSentTiles(0), m_numSentTileBytes(0), m_numRawTileBytes(0),
+    m_sceneCacheDir(sceneCacheDir), m_sceneInfo{},
+    m_isSceneCached(false),
+    m_numReceivedSceneBytes(0), m_numReceivedSceneChunks(0), m_numSceneChunkRetries(0),
+    m_sceneTransferTime(0.0),
+    m_connectedTime(-1.0), m_sceneReadyTime(-1.0), m_serverReadyTime(-1.0), m_firstTaskTime(-1.0),
+    m_clockOffset(0), m_clockSyncRoundTripTime(0),
+    m_faultMode(faultMode), m_faultAfterNumTasks(faultAfterNumTasks), m_numRenderedTiles(0),
+    m_isFaultInjected(false) {
+    using asio::ip::tcp;
+
+    if (m_compressTiles)
+        fpng::fpng_init();
+
+    tcp::resolver resolver(ioContext);
+    m_endpoints = resolver.resolve(host, port);
+
+    m_worker.start(
+        [this]() {
+            asio::post(
+                m_socket.get_executor(),
+                [this]() {
+                    m_taskRequestSignal.notify();
+                });
+        },
+        [this](
+            uint32_t slotIndex, const RenderTask &task, uint32_t numSamples,
+            const RenderWorker::TilePixels &pixels) {
+            sendTile(slotIndex, task, numSamples, pixels);
+        },
+        [this]() {
+            asio::post(
+                m_socket.get_executor(),
+                [this]() {
+                    sendFinish();
+                });
+        });
+    asio::co_spawn(ioContext, run(), rethrowException);
+}
+
+void Client::printStats() const {
+    printf(
+        "Sent %llu tiles: %.3f [MB] on the wire for %.3f [MB] of pixels (%s).\n",
+        static_cast<unsigned long long>(m_numSentTiles),
+        m_numSentTileBytes / (1024.0 * 1024.0), m_numRawTileBytes / (1024.0 * 1024.0),
+        m_compressTiles ? "png" : "raw");
+    printf(
+        "Startup: connected %.3f [s] (%u trials), scene ready %.3f [s], server ready %.3f [s] (%u polls), "
+        "first task %.3f [s]\n",
+        m_connectedTime, m_numConnectTrials + 1, m_sceneReadyTime, m_serverReadyTime, m_numServerStatePolls + 1,
+        m_firstTaskTime);
+    if (m_isSceneCached) {
+        printf("Scene: %.3f [MB] from the cache.\n", m_sceneInfo.size / (1024.0 * 1024.0));
+    }
+    else if (m_sceneInfo.size > 0) {
+        printf(
+            "Scene: %.3f [MB] received in %.3f [s] (%.1f [MB/s]).\n",
+            m_sceneInfo.size / (1024.0 * 1024.0), m_sceneTransferTime,
+            m_sceneInfo.size / (1024.0 * 1024.0) / std::max(m_sceneTransferTime, 1e-6));
+    }
+}
+
+
+
+int32_t runClient(
+    const std::string &serverIP, const std::string &serverPort, const RenderSettings &settings) {
+    using asio::ip::tcp;
+
+    try {
+        printf("Start client.\n");
+        asio::io_context ioContext;
+
+        RenderWorker worker(settings);
+
+        // サーバーより先に起動しても、この時間まではサーバーの起動を待つ。
+        constexpr double connectTimeout = 30.0;
+        Client client(
+            ioContext, worker, serverIP, serverPort,
+            connectTimeout, settings.numTaskRequestsInFlight,
+            settings.compressTiles, settings.sceneCacheDir,
+            settings.faultMode, settings.faultAfterNumTasks);
+        ioContext.run();
+
+        worker.finish();
+        client.printStats();
+        if (isTracingEnabled()) {
+            // ノード0はサーバー。
+            char filename[64];
+            char nodeName[64];
+            sprintf_s(filename, "trace_node%u.json", client.getSessionID());
+            sprintf_s(nodeName, "node %u", client.getSessionID());
+            writeTrace(filename, client.getSessionID() + 1, nodeName, client.getClockOffset());
+        }
+        printf("Quit client.\n");
+    }
+    catch (std::exception& e) {
+        printf("%s\n", e.what());
+        return -1;
+    }
+
+    return 0;
+}
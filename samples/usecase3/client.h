@@ -0,0 +1,191 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <random>
+
+// https://think-async.com/Asio/index.html
+#define ASIO_STANDALONE
+#include <asio.hpp>
+
+#include "protocol.h"
+#include "mapped_file.h"
+#include "render_worker.h"
+#include "usecase3.h"
+
+// サーバーとの通信をio_contextのスレッドで行い、受け取ったタスクをRenderWorkerに渡す。
+// 受信と送信はそれぞれ専用のコルーチンが担い、要求はシーケンスIDで応答と対応させるので、
+// 描画中に複数の要求を出しておいてネットワークの往復を待たずに済む。
+class Client {
+    // 応答を待っている要求。受信コルーチンが届いた応答をonReplyに渡し、待っているコルーチンを起こす。
+    struct PendingReply {
+        AsyncSignal signal;
+        // 受信バッファが有効なうちに呼ばれる。応答が不正な場合はfalseを返す。
+        std::function<bool(const MessageHeader &header, const WireReader &payload)> onReply;
+        bool isReceived;
+        bool isValid;
+
+        explicit PendingReply(const asio::any_io_executor &executor) :
+            signal(executor), isReceived(false), isValid(false) {}
+    };
+
+    // 要求中のシーンデータのチャンク。チャンクは受信バッファから直接マップしたファイルに書き込む。
+    struct PendingSceneChunk {
+        uint64_t offset;
+        uint32_t size;
+        bool isCorrupted;
+        std::shared_ptr<PendingReply> reply;
+    };
+
+    asio::ip::tcp::socket m_socket;
+    asio::executor_work_guard<asio::io_context::executor_type> m_workGuard;
+    RenderWorker &m_worker;
+    asio::ip::tcp::resolver::results_type m_endpoints;
+    // 接続とサーバーの準備待ちの再試行。間隔は試行ごとに倍にし、同時に起動したノードが揃わないよう揺らす。
+    double m_connectTimeout;
+    uint32_t m_numConnectTrials;
+    uint32_t m_numServerStatePolls;
+    std::mt19937 m_retryRng;
+    uint32_t m_sessionID;
+    bool m_isFinishing;
+    bool m_isDisconnected;
+    uint32_t m_nextSequenceID;
+    MessageReader m_reader;
+    MessageSendQueue m_sendQueue;
+    std::map<uint32_t, std::shared_ptr<PendingReply>> m_pendingReplies;
+
+    // 同時に出しておくタスク要求の上限。
+    uint32_t m_maxNumTaskRequestsInFlight;
+    uint32_t m_numTaskRequestsInFlight;
+    bool m_noMoreTasks;
+    AsyncSignal m_taskRequestSignal;
+
+    // 描き終えたタイルの送信。圧縮先はレンダリングスレッドのスロットごとに持つ。
+    bool m_compressTiles;
+    std::vector<std::shared_ptr<std::vector<uint8_t>>> m_compressedTiles;
+    uint64_t m_numSentTiles;
+    uint64_t m_numSentTileBytes;
+    uint64_t m_numRawTileBytes;
+
+    // サーバーから受け取るシーンデータ。
+    std::string m_sceneCacheDir;
+    MappedFile m_scene;
+    SceneInfoMessage m_sceneInfo;
+    bool m_isSceneCached;
+    uint64_t m_numReceivedSceneBytes;
+    uint32_t m_numReceivedSceneChunks;
+    uint32_t m_numSceneChunkRetries;
+    double m_sceneTransferTime;
+
+    // 起動から各段階を終えるまでの時間[s]。
+    double m_connectedTime;
+    double m_sceneReadyTime;
+    double m_serverReadyTime;
+    double m_firstTaskTime;
+
+    // トレースの時刻をサーバーに揃えるためのずれ[ns]。
+    int64_t m_clockOffset;
+    int64_t m_clockSyncRoundTripTime;
+
+    // 障害の注入。m_numRenderedTilesは各スロットのレンダリングスレッドが数える。
+    FaultMode m_faultMode;
+    uint32_t m_faultAfterNumTasks;
+    std::atomic<uint32_t> m_numRenderedTiles;
+    // 接続を切った後のタイルは送らない。
+    std::atomic<bool> m_isFaultInjected;
+
+    void injectFault();
+
+    // 新しいシーケンスIDを振って送り、そのIDを返す。
+    template <typename Message>
+    uint32_t send(const Message &message);
+
+    std::shared_ptr<PendingReply> expectReply(
+        uint32_t sequenceID,
+        std::function<bool(const MessageHeader &header, const WireReader &payload)> onReply);
+
+    // 応答を待たずに要求を送る。応答はawaitReply()で待つ。
+    template <typename Message>
+    std::shared_ptr<PendingReply> sendRequest(
+        const Message &message,
+        std::function<bool(const MessageHeader &header, const WireReader &payload)> onReply) {
+        return expectReply(send(message), std::move(onReply));
+    }
+
+    // 終了処理で接続を閉じた場合はfalseを返す。
+    asio::awaitable<bool> awaitReply(std::shared_ptr<PendingReply> pending);
+
+    template <typename Request, typename Reply>
+    asio::awaitable<bool> request(const Request &message, Reply &reply);
+
+    // レンダリングスレッドから呼ばれる。画素はコピーせず、描画先ごとwriterに保持させて通信スレッドに渡す。
+    void sendTile(
+        uint32_t slotIndex, const RenderTask &task, uint32_t numSamples, const RenderWorker::TilePixels &pixels);
+
+    void sendFinish();
+
+    // 応答を待っているコルーチンを全て起こす。
+    void wakePendingReplies();
+
+    asio::awaitable<void> readLoop();
+
+    asio::awaitable<void> writeLoop();
+
+    static double getTimeSinceAppStart();
+
+    // numTrials回目の再試行の前に待つ。io_contextのスレッドは止めない。
+    asio::awaitable<void> waitBeforeRetry(uint32_t numTrials);
+
+    asio::awaitable<void> connect();
+
+    // トレースをサーバーの時計に揃えるため、往復時間が最も短かった回の中点でずれを求める。
+    asio::awaitable<void> syncClock();
+
+    std::string getSceneCachePath(const char* extension) const;
+
+    // 同じ内容のシーンデータが手元にあれば転送せずに使う。
+    bool openCachedScene();
+
+    std::unique_ptr<PendingSceneChunk> requestSceneChunk(uint64_t offset, uint32_t size);
+
+    void finishSceneTransfer();
+
+    // 準備段階。タスクを受け取る前にシーンデータを揃える。
+    asio::awaitable<void> prepareScene();
+
+    // 呼び出し側でm_numTaskRequestsInFlightを増やしておく。
+    asio::awaitable<void> requestTasks();
+
+    asio::awaitable<void> run();
+
+public:
+    Client(
+        asio::io_context &ioContext, RenderWorker &worker,
+        const std::string &host, const std::string &port,
+        double connectTimeout, uint32_t maxNumTaskRequestsInFlight,
+        bool compressTiles, const std::string &sceneCacheDir,
+        FaultMode faultMode, uint32_t faultAfterNumTasks);
+
+    ~Client() {
+        m_worker.stop();
+    }
+
+    uint32_t getSessionID() const {
+        return m_sessionID;
+    }
+
+    int64_t getClockOffset() const {
+        return m_clockOffset;
+    }
+
+    bool isFaultInjected() const {
+        return m_isFaultInjected.load(std::memory_order_acquire);
+    }
+
+    void printStats() const;
+};
@@ -0,0 +1,170 @@
+﻿#include <sdkddkver.h>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <filesystem>
+
+// https://think-async.com/Asio/index.html
+#define ASIO_STANDALONE
+#include <asio.hpp>
+
+#include "frame_pipeline.h"
+#include "frame_assembler.h"
+#include "render_worker.h"
+#include "client.h"
+#include "server.h"
+#include "usecase3.h"
+
+// dirにある番号付きの画像ファイルを調べ、空でないファイルが無いフレームの数を返す。
+static uint32_t countMissingFrames(const std::filesystem::path &dir, uint32_t numFrames) {
+    std::vector<bool> isWritten(numFrames, false);
+    for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(dir)) {
+        if (!entry.is_regular_file() || entry.file_size() == 0)
+            continue;
+        const std::string stem = entry.path().stem().string();
+        char* end;
+        const unsigned long frameIndex = strtoul(stem.c_str(), &end, 10);
+        if (end == stem.c_str() || *end != '\0' || frameIndex >= numFrames)
+            continue;
+        isWritten[frameIndex] = true;
+    }
+    return static_cast<uint32_t>(std::count(isWritten.begin(), isWritten.end(), false));
+}
+
+// 1台分のクライアントを自分のio_contextで動かす。接続が切れずに最後まで終えた場合はtrueを返す。
+static bool runFaultTestClient(
+    uint32_t clientIndex, const std::string &serverPort, const RenderSettings &settings,
+    FaultMode faultMode, uint32_t faultAfterNumTasks) {
+    asio::io_context ioContext;
+    RenderWorker worker(settings);
+    constexpr double connectTimeout = 30.0;
+    Client client(
+        ioContext, worker, "127.0.0.1", serverPort,
+        connectTimeout, settings.numTaskRequestsInFlight,
+        settings.compressTiles, settings.sceneCacheDir,
+        faultMode, faultAfterNumTasks);
+    try {
+        ioContext.run();
+    }
+    catch (std::exception &e) {
+        // 障害を起こしたクライアントは接続が切れて例外で抜ける。レンダリングスレッドはClientの破棄で止まる。
+        printf("Client %u: %s", clientIndex, e.what());
+        return false;
+    }
+    return true;
+}
+
+
+
+// サーバーとnumClients台のクライアントを1つのプロセス内でループバック接続して動かし、
+// 最初のクライアントがタイルをいくつか送った後に障害を起こしても全フレームが揃うかを確かめる。
+// 障害はsettings.faultModeがStallなら応答の停止、それ以外はプロセスを落とす代わりの切断とする。
+// 確かめる条件を満たさない場合は1を返す。
+int32_t runFaultTest(
+    const std::string &serverPort, uint32_t taskTileSize, uint32_t numClients, const RenderSettings &settings) {
+    try {
+        constexpr uint32_t numFrames = 256;
+        // 障害を起こさない側が残るように2台以上にする。
+        numClients = std::max(numClients, 2u);
+        const FaultMode faultMode = settings.faultMode == FaultMode::Stall ? FaultMode::Stall : FaultMode::Disconnect;
+        const uint32_t faultAfterNumTasks =
+            settings.faultMode != FaultMode::None ? settings.faultAfterNumTasks : 16;
+
+        printf(
+            "%u clients, client 0 %s after %u tiles\n",
+            numClients, faultMode == FaultMode::Stall ? "stalls" : "disconnects", faultAfterNumTasks);
+
+        // 前回の出力を残したまま数えないよう、空のディレクトリに書き出す。
+        const std::filesystem::path outputDir = std::filesystem::absolute("fault_test_output");
+        std::filesystem::remove_all(outputDir);
+        std::filesystem::create_directories(outputDir);
+        const std::filesystem::path prevWorkingDir = std::filesystem::current_path();
+        std::filesystem::current_path(outputDir);
+
+        uint32_t numTasks;
+        uint32_t numCompletedTasks;
+        uint32_t numExpiredLeases;
+        uint32_t numDroppedLeases;
+        uint32_t numFailedClients = 0;
+        {
+            asio::io_context ioContext;
+            FramePipeline pipeline(settings.numFramebuffers, settings.numEncoderThreads);
+            pipeline.setEncoder(createImageEncoder(settings.encoderSettings));
+            FrameAssembler assembler(pipeline, g_frameWidth, g_frameHeight, numFrames);
+            Server server(
+                ioContext, static_cast<uint32_t>(atoi(serverPort.c_str())), numFrames, taskTileSize, &assembler,
+                settings.leaseTimeout);
+            std::thread serverThread(
+                [&ioContext]() {
+                    ioContext.run();
+                });
+
+            std::vector<uint8_t> succeeded(numClients, 0);
+            std::vector<std::thread> clientThreads;
+            for (uint32_t i = 0; i < numClients; ++i) {
+                clientThreads.emplace_back(
+                    [&serverPort, &settings, &succeeded, i, faultMode, faultAfterNumTasks]() {
+                        try {
+                            succeeded[i] = runFaultTestClient(
+                                i, serverPort, settings,
+                                i == 0 ? faultMode : FaultMode::None, faultAfterNumTasks);
+                        }
+                        catch (std::exception &e) {
+                            printf("Client %u: %s\n", i, e.what());
+                        }
+                    });
+            }
+            for (std::thread &thread : clientThreads)
+                thread.join();
+            // 止まったクライアントもサーバーが終了時に切るので、サーバーのスレッドは終わる。
+            serverThread.join();
+
+            assembler.finish();
+            pipeline.finish();
+            server.printStats();
+
+            numTasks = server.getNumTasks();
+            numCompletedTasks = server.getNumCompletedTasks();
+            numExpiredLeases = server.getNumExpiredLeases();
+            numDroppedLeases = server.getNumDroppedLeases();
+            // 障害を起こしたクライアント以外は最後まで終えるはず。
+            for (uint32_t i = 1; i < numClients; ++i)
+                numFailedClients += succeeded[i] ? 0 : 1;
+        }
+
+        const uint32_t numMissingFrames = countMissingFrames(outputDir, numFrames);
+        std::filesystem::current_path(prevWorkingDir);
+
+        printf(
+            "Fault test: %u/%u tasks completed, %u expired leases, %u dropped leases, %u/%u frames written\n",
+            numCompletedTasks, numTasks, numExpiredLeases, numDroppedLeases,
+            numFrames - numMissingFrames, numFrames);
+        bool passed = true;
+        if (numCompletedTasks != numTasks) {
+            printf("FAIL: %u tasks were not completed.\n", numTasks - numCompletedTasks);
+            passed = false;
+        }
+        if (numExpiredLeases + numDroppedLeases == 0) {
+            printf("FAIL: no lease was re-issued, so the fault was not exercised.\n");
+            passed = false;
+        }
+        if (numMissingFrames > 0) {
+            printf("FAIL: %u frames were not written.\n", numMissingFrames);
+            passed = false;
+        }
+        if (numFailedClients > 0) {
+            printf("FAIL: %u clients without a fault failed.\n", numFailedClients);
+            passed = false;
+        }
+        printf(passed ? "Fault test passed.\n" : "Fault test failed.\n");
+        return passed ? 0 : 1;
+    }
+    catch (std::exception &e) {
+        printf("%s\n", e.what());
+        return -1;
+    }
+}
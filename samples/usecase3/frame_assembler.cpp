@@ -0,0 +1,236 @@
+﻿#include "frame_assembler.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "trace.h"
+
+static double toSeconds(std::chrono::high_resolution_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count() * 1e-6;
+}
+
+FrameAssembler::FrameAssembler(FramePipeline &pipeline, uint32_t width, uint32_t height, uint32_t numFrames) :
+    m_pipeline(pipeline), m_width(width), m_height(height), m_numFrames(numFrames),
+    m_isFrameSkipped(numFrames, false), m_numSkippedFrames(0),
+    m_nextFrameIndex(0), m_finishing(false),
+    m_numTiles(0), m_numLocalTiles(0), m_numDuplicateTiles(0),
+    m_numWireBytes(0), m_numRemotePixelBytes(0),
+    m_assemblyLatencyHistogram(LatencyHistogram::makeExponentialBounds(1e-3, 2.0, 16)) {
+    m_startTp = clock::now();
+    m_submitThread = std::thread(&FrameAssembler::submitLoop, this);
+}
+
+FrameAssembler::~FrameAssembler() {
+    finish();
+}
+
+bool FrameAssembler::addTile(
+    uint32_t frameIndex, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+    const void* pixels, uint64_t numWireBytes) {
+    if (frameIndex >= m_numFrames ||
+        width == 0 || height == 0 ||
+        x >= m_width || y >= m_height ||
+        width > m_width - x || height > m_height - y)
+        return false;
+
+    const clock::time_point now = clock::now();
+    std::unique_lock lock(m_mutex);
+
+    ++m_numTiles;
+    if (numWireBytes > 0) {
+        m_numWireBytes += numWireBytes;
+        m_numRemotePixelBytes += static_cast<uint64_t>(width) * height * sizeof(RGBA);
+    }
+    else {
+        ++m_numLocalTiles;
+    }
+
+    // 既にパイプラインに渡したか、前回書き出したフレームへのタイルは重複。
+    if (frameIndex < m_nextFrameIndex || m_isFrameSkipped[frameIndex]) {
+        ++m_numDuplicateTiles;
+        return true;
+    }
+
+    AssemblingFrame &frame = m_frames[frameIndex];
+    if (frame.pixels.empty()) {
+        frame.pixels.resize(m_width * m_height);
+        frame.numReceivedPixels = 0;
+        frame.numWireBytes = 0;
+        frame.firstTileTp = now;
+        frame.isComplete = false;
+    }
+    if (!frame.receivedTiles.insert((static_cast<uint64_t>(x) << 32) | y).second) {
+        ++m_numDuplicateTiles;
+        return true;
+    }
+
+    // 別々のタイルは重ならないので、画素のコピーはロックの外で行ってよい。
+    // 受け取り済みの画素数はコピー後に数えるので、コピー中にフレームが完成扱いで取り除かれることは無い。
+    RGBA* dst = frame.pixels.data();
+    lock.unlock();
+
+    TraceScope traceScope("assemble", "copy tile", frameIndex);
+    const uint8_t* src = static_cast<const uint8_t*>(pixels);
+    for (uint32_t row = 0; row < height; ++row) {
+        std::memcpy(
+            dst + (y + row) * m_width + x,
+            src + static_cast<size_t>(row) * width * sizeof(RGBA),
+            width * sizeof(RGBA));
+    }
+
+    lock.lock();
+    frame.numReceivedPixels += width * height;
+    frame.numWireBytes += numWireBytes;
+    if (frame.numReceivedPixels == m_width * m_height) {
+        frame.isComplete = true;
+        frame.completedTp = clock::now();
+        m_assemblyLatencyHistogram.observe(toSeconds(frame.completedTp - frame.firstTileTp));
+        m_condVar.notify_all();
+    }
+
+    return true;
+}
+
+void FrameAssembler::skipFrame(uint32_t frameIndex) {
+    if (frameIndex >= m_numFrames)
+        return;
+    {
+        std::lock_guard lock(m_mutex);
+        if (m_isFrameSkipped[frameIndex])
+            return;
+        m_isFrameSkipped[frameIndex] = true;
+        ++m_numSkippedFrames;
+    }
+    m_condVar.notify_all();
+}
+
+// m_mutexを取った状態で呼ぶ。
+void FrameAssembler::advancePastSkippedFrames() {
+    while (m_nextFrameIndex < m_numFrames && m_isFrameSkipped[m_nextFrameIndex])
+        ++m_nextFrameIndex;
+}
+
+void FrameAssembler::submitLoop() {
+    setTraceThreadName("assembler");
+
+    std::unique_lock lock(m_mutex);
+    while (true) {
+        m_condVar.wait(
+            lock,
+            [this]() {
+                advancePastSkippedFrames();
+                if (m_finishing || m_nextFrameIndex >= m_numFrames)
+                    return true;
+                const auto it = m_frames.find(m_nextFrameIndex);
+                return it != m_frames.end() && it->second.isComplete;
+            });
+        if (m_nextFrameIndex >= m_numFrames)
+            break;
+
+        auto it = m_frames.find(m_nextFrameIndex);
+        if (it == m_frames.end() || !it->second.isComplete) {
+            // 終了時に欠けているフレームは飛ばし、それ以降の揃ったフレームを書き出す。
+            const auto nextIt = std::find_if(
+                m_frames.lower_bound(m_nextFrameIndex), m_frames.end(),
+                [](const auto &entry) {
+                    return entry.second.isComplete;
+                });
+            if (nextIt == m_frames.end())
+                break;
+            for (uint32_t frameIndex = m_nextFrameIndex; frameIndex < nextIt->first; ++frameIndex) {
+                if (!m_isFrameSkipped[frameIndex])
+                    printf("Frame %u is incomplete and skipped.\n", frameIndex);
+            }
+            m_nextFrameIndex = nextIt->first;
+            it = nextIt;
+        }
+
+        const uint32_t frameIndex = m_nextFrameIndex++;
+        AssemblingFrame frame = std::move(it->second);
+        m_frames.erase(it);
+        lock.unlock();
+
+        FramePipeline::Frame &dstFrame = m_pipeline.acquireFrame(frameIndex, m_width, m_height);
+        std::copy(frame.pixels.begin(), frame.pixels.end(), dstFrame.pixels.begin());
+        m_pipeline.submitFrame(dstFrame);
+        const clock::time_point submittedTp = clock::now();
+
+        lock.lock();
+        FrameRecord record;
+        record.frameIndex = frameIndex;
+        record.numTiles = static_cast<uint32_t>(frame.receivedTiles.size());
+        record.numWireBytes = frame.numWireBytes;
+        record.firstTileTime = toSeconds(frame.firstTileTp - m_startTp);
+        record.assemblyLatency = toSeconds(frame.completedTp - frame.firstTileTp);
+        record.reorderWaitTime = toSeconds(submittedTp - frame.completedTp);
+        m_records.push_back(record);
+    }
+}
+
+void FrameAssembler::finish() {
+    {
+        std::lock_guard lock(m_mutex);
+        if (m_finishing)
+            return;
+        m_finishing = true;
+    }
+    m_condVar.notify_all();
+    m_submitThread.join();
+
+    std::lock_guard lock(m_mutex);
+    for (const auto &[frameIndex, frame] : m_frames) {
+        printf(
+            "Frame %u is incomplete (%u/%u pixels).\n",
+            frameIndex, frame.numReceivedPixels, m_width * m_height);
+    }
+}
+
+void FrameAssembler::printStats() const {
+    std::lock_guard lock(m_mutex);
+
+    double sumLatency = 0.0;
+    double maxLatency = 0.0;
+    double sumReorderWaitTime = 0.0;
+    for (const FrameRecord &record : m_records) {
+        sumLatency += record.assemblyLatency;
+        maxLatency = std::max(maxLatency, record.assemblyLatency);
+        sumReorderWaitTime += record.reorderWaitTime;
+    }
+    const double numRecords = std::max<double>(static_cast<double>(m_records.size()), 1.0);
+
+    printf("Frame assembly:\n");
+    printf(
+        "  %zu/%u frames, %llu tiles (%llu local, %llu duplicates)\n",
+        m_records.size(), m_numFrames,
+        static_cast<unsigned long long>(m_numTiles),
+        static_cast<unsigned long long>(m_numLocalTiles),
+        static_cast<unsigned long long>(m_numDuplicateTiles));
+    if (m_numSkippedFrames > 0)
+        printf("  %u frames skipped as already written\n", m_numSkippedFrames);
+    printf(
+        "  Wire: %.3f [MB] for %.3f [MB] of remote pixels (%.1f%%)\n",
+        m_numWireBytes / (1024.0 * 1024.0), m_numRemotePixelBytes / (1024.0 * 1024.0),
+        m_numRemotePixelBytes > 0 ? 100.0 * m_numWireBytes / m_numRemotePixelBytes : 0.0);
+    printf(
+        "  Latency: avg %.3f [ms], max %.3f [ms], reorder wait avg %.3f [ms]\n",
+        1e+3 * sumLatency / numRecords, 1e+3 * maxLatency, 1e+3 * sumReorderWaitTime / numRecords);
+}
+
+void FrameAssembler::writeLog(const char* filename) const {
+    std::lock_guard lock(m_mutex);
+
+    FILE* fp;
+    if (fopen_s(&fp, filename, "w") != 0) {
+        printf("Failed to open %s.\n", filename);
+        return;
+    }
+    fprintf(fp, "frame,tiles,wire_bytes,first_tile_s,assembly_latency_s,reorder_wait_s\n");
+    for (const FrameRecord &record : m_records) {
+        fprintf(
+            fp, "%u,%u,%llu,%.6f,%.6f,%.6f\n",
+            record.frameIndex, record.numTiles, static_cast<unsigned long long>(record.numWireBytes),
+            record.firstTileTime, record.assemblyLatency, record.reorderWaitTime);
+    }
+    fclose(fp);
+}
@@ -0,0 +1,96 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <set>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "frame_pipeline.h"
+#include "metrics.h"
+
+// 各ノードから届いたタイルをフレームごとに組み立て、揃ったフレームを番号順にパイプラインへ流す。
+// 同じタイルが重複して届いた場合は最初のものだけを使う。
+class FrameAssembler {
+public:
+    using clock = std::chrono::high_resolution_clock;
+
+private:
+    struct AssemblingFrame {
+        std::vector<RGBA> pixels;
+        // 受け取り済みタイルの左上座標。重複の検出に使う。
+        std::set<uint64_t> receivedTiles;
+        uint32_t numReceivedPixels;
+        uint64_t numWireBytes;
+        clock::time_point firstTileTp;
+        clock::time_point completedTp;
+        bool isComplete;
+    };
+
+    struct FrameRecord {
+        uint32_t frameIndex;
+        uint32_t numTiles;
+        uint64_t numWireBytes;
+        double firstTileTime;
+        // 最初のタイルが届いてから揃うまで。
+        double assemblyLatency;
+        // 揃ってから番号順を待ってパイプラインに渡すまで。
+        double reorderWaitTime;
+    };
+
+    FramePipeline &m_pipeline;
+    uint32_t m_width;
+    uint32_t m_height;
+    uint32_t m_numFrames;
+    std::map<uint32_t, AssemblingFrame> m_frames;
+    // 前回の実行で書き出し済みで、組み立てずに飛ばすフレーム。
+    std::vector<bool> m_isFrameSkipped;
+    uint32_t m_numSkippedFrames;
+    uint32_t m_nextFrameIndex;
+    bool m_finishing;
+    std::thread m_submitThread;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condVar;
+
+    clock::time_point m_startTp;
+    uint64_t m_numTiles;
+    uint64_t m_numLocalTiles;
+    uint64_t m_numDuplicateTiles;
+    uint64_t m_numWireBytes;
+    uint64_t m_numRemotePixelBytes;
+    std::vector<FrameRecord> m_records;
+    // 最初のタイルが届いてから揃うまでの時間。実行中にも読めるようロックを取らずに数える。
+    LatencyHistogram m_assemblyLatencyHistogram;
+
+    void submitLoop();
+    void advancePastSkippedFrames();
+
+public:
+    FrameAssembler(FramePipeline &pipeline, uint32_t width, uint32_t height, uint32_t numFrames);
+    ~FrameAssembler();
+
+    FrameAssembler(const FrameAssembler &) = delete;
+    FrameAssembler &operator=(const FrameAssembler &) = delete;
+
+    // RGBA8のタイルをフレームに書き込む。pixelsのアラインメントは問わない。
+    // numWireBytesは通信で受け取ったバイト数で、同じプロセス内のタイルの場合は0。
+    // フレームの範囲外のタイルはfalseを返す。どのスレッドから呼んでもよい。
+    bool addTile(
+        uint32_t frameIndex, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+        const void* pixels, uint64_t numWireBytes);
+    // 書き出し済みのフレームを待たずに飛ばす。そのフレームに届いたタイルは重複として捨てる。
+    void skipFrame(uint32_t frameIndex);
+    // 揃ったフレームを全てパイプラインに渡して終了する。欠けたフレームは報告して飛ばす。
+    void finish();
+
+    const LatencyHistogram &getAssemblyLatencyHistogram() const {
+        return m_assemblyLatencyHistogram;
+    }
+
+    void printStats() const;
+    // フレームごとの組み立て記録をCSVで書き出す。
+    void writeLog(const char* filename) const;
+};
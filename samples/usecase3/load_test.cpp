@@ -0,0 +1,303 @@
+﻿#include <sdkddkver.h>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+// https://think-async.com/Asio/index.html
+#define ASIO_STANDALONE
+#include <asio.hpp>
+
+#if defined(_WIN32)
+#   include <Windows.h>
+#else
+#   include <time.h>
+#endif
+
+#include "protocol.h"
+#include "server.h"
+#include "usecase3.h"
+
+// レンダリングせずにタスクを受け取り続ける同期クライアント。受け取ったタスク数を返す。
+// 応答を待たずに最大numRequestsInFlight個の要求を重ねて出し、応答はシーケンスIDで対応させる。
+static uint32_t runDispatchBenchmarkClient(
+    const std::string &serverPort, uint32_t numTasksPerRequest, uint32_t numRequestsInFlight) {
+    using asio::ip::tcp;
+
+    asio::io_context ioContext;
+    tcp::socket socket(ioContext);
+    tcp::resolver resolver(ioContext);
+    asio::connect(socket, resolver.resolve("127.0.0.1", serverPort));
+    socket.set_option(tcp::no_delay(true));
+
+    MessageWriter writer;
+    MessageReader reader;
+    MessageHeader header;
+    WireReader payload;
+
+    // セッションID受信。
+    SessionIDMessage sessionIDMessage;
+    readMessage(socket, reader, header, payload);
+    if (!decodeMessage(header, payload, sessionIDMessage))
+        throw std::runtime_error("Failed to receive the session ID.");
+
+    uint32_t numReceivedTasks = 0;
+    uint32_t nextSequenceID = 1;
+    RenderTaskRequestMessage request;
+    request.numTasks = numTasksPerRequest;
+    request.numSamples = 0;
+    RenderTaskMessage reply;
+    std::vector<uint32_t> sequenceIDsInFlight;
+    bool noMoreTasks = false;
+    while (true) {
+        // レンダータスクリクエスト。
+        while (!noMoreTasks && sequenceIDsInFlight.size() < numRequestsInFlight) {
+            const uint32_t sequenceID = nextSequenceID++;
+            writer.encode(request, sequenceID);
+            writeMessage(socket, writer);
+            sequenceIDsInFlight.push_back(sequenceID);
+        }
+        if (sequenceIDsInFlight.empty())
+            break;
+
+        // レンダータスク受信。
+        readMessage(socket, reader, header, payload);
+        const auto it = std::find(sequenceIDsInFlight.begin(), sequenceIDsInFlight.end(), header.sequenceID);
+        if (it == sequenceIDsInFlight.end() || !decodeMessage(header, payload, reply))
+            throw std::runtime_error("Received an unexpected reply.");
+        sequenceIDsInFlight.erase(it);
+        if (!reply.tasks.front().isValid)
+            noMoreTasks = true;
+        else
+            numReceivedTasks += static_cast<uint32_t>(reply.tasks.size());
+    }
+
+    // 終了シグナルを送る。
+    writer.encode(FinishSignalMessage{}, nextSequenceID++);
+    writeMessage(socket, writer);
+
+    return numReceivedTasks;
+}
+
+
+
+// ループバック上でタスク配布のスループットを、重ねて出す要求の数と1リクエストあたりのタスク数ごとに測る。
+int32_t runDispatchBenchmark(const std::string &serverPort, uint32_t taskTileSize) {
+    try {
+        constexpr uint32_t numFrames = 256;
+        if (taskTileSize == 0)
+            taskTileSize = 32;
+
+        for (const uint32_t numRequestsInFlight : { 1u, 4u, 16u }) {
+            for (const uint32_t numTasksPerRequest : { 1u, 4u, 16u, 64u }) {
+                asio::io_context ioContext;
+                Server server(
+                    ioContext, static_cast<uint32_t>(atoi(serverPort.c_str())), numFrames, taskTileSize, nullptr);
+                std::thread serverThread(
+                    [&ioContext]() {
+                        ioContext.run();
+                    });
+
+                const hires_clock::time_point startTp = hires_clock::now();
+                const uint32_t numTasks =
+                    runDispatchBenchmarkClient(serverPort, numTasksPerRequest, numRequestsInFlight);
+                const hires_clock::duration elapsed = hires_clock::now() - startTp;
+                serverThread.join();
+
+                const double elapsedInSec =
+                    std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() * 1e-6;
+                printf(
+                    "%2u in flight, %2u tasks/request: %u tasks in %.3f [s], %.0f [tasks/s], %.0f [requests/s]\n",
+                    numRequestsInFlight, numTasksPerRequest, numTasks, elapsedInSec,
+                    numTasks / elapsedInSec,
+                    (numTasks + numTasksPerRequest - 1) / numTasksPerRequest / elapsedInSec);
+            }
+        }
+    }
+    catch (std::exception &e) {
+        printf("%s\n", e.what());
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// 呼び出したスレッドがこれまでに使ったCPU時間[s]。
+static double getThreadCpuTime() {
+#if defined(_WIN32)
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (!GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime))
+        return 0.0;
+    const auto toSeconds = [](const FILETIME &time) {
+        return ((static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) * 1e-7;
+    };
+    return toSeconds(kernelTime) + toSeconds(userTime);
+#else
+    timespec time;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0)
+        return 0.0;
+    return time.tv_sec + time.tv_nsec * 1e-9;
+#endif
+}
+
+struct LoadTestClientResult {
+    uint32_t numReceivedTasks = 0;
+    uint32_t numRequests = 0;
+    // リクエストを送ってからタスクを受け取るまでの時間[us]。
+    std::vector<uint32_t> grantLatencies;
+    bool succeeded = false;
+};
+
+// タスクを受け取るたびに模擬レンダリング時間だけ待つ同期クライアント。
+static void runLoadTestClient(
+    const std::string &serverPort, const LoadTestSettings &settings, LoadTestClientResult &result) {
+    using asio::ip::tcp;
+
+    asio::io_context ioContext;
+    tcp::socket socket(ioContext);
+    tcp::resolver resolver(ioContext);
+    asio::connect(socket, resolver.resolve("127.0.0.1", serverPort));
+    socket.set_option(tcp::no_delay(true));
+
+    MessageWriter writer;
+    MessageReader reader;
+    MessageHeader header;
+    WireReader payload;
+
+    // セッションID受信。
+    SessionIDMessage sessionIDMessage;
+    readMessage(socket, reader, header, payload);
+    if (!decodeMessage(header, payload, sessionIDMessage))
+        throw std::runtime_error("Failed to receive the session ID.");
+
+    const auto sleepFor = [](double timeInMs) {
+        if (timeInMs > 0)
+            std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(timeInMs));
+    };
+
+    uint32_t nextSequenceID = 1;
+    RenderTaskRequestMessage request;
+    request.numTasks = settings.numTasksPerRequest;
+    request.numSamples = 0;
+    RenderTaskMessage reply;
+    while (true) {
+        sleepFor(settings.injectedLatency);
+
+        // レンダータスクリクエスト。
+        const uint32_t sequenceID = nextSequenceID++;
+        const hires_clock::time_point requestTp = hires_clock::now();
+        writer.encode(request, sequenceID);
+        writeMessage(socket, writer);
+
+        // レンダータスク受信。
+        readMessage(socket, reader, header, payload);
+        if (header.sequenceID != sequenceID || !decodeMessage(header, payload, reply))
+            throw std::runtime_error("Received an unexpected reply.");
+        result.grantLatencies.push_back(static_cast<uint32_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(hires_clock::now() - requestTp).count()));
+        ++result.numRequests;
+        if (!reply.tasks.front().isValid)
+            break;
+
+        const uint32_t numTasks = static_cast<uint32_t>(reply.tasks.size());
+        result.numReceivedTasks += numTasks;
+        sleepFor(settings.renderTimePerTask * numTasks);
+    }
+
+    // 終了シグナルを送る。
+    writer.encode(FinishSignalMessage{}, nextSequenceID++);
+    writeMessage(socket, writer);
+    result.succeeded = true;
+}
+
+
+
+// 多数のクライアントが同時に接続した場合のセッション処理とタスク配布の限界を、1台のマシン上で調べる。
+// サーバーは結果を受け取らない配布のみの構成で動かし、io_contextのスレッドが使ったCPU時間をサーバーの負荷とする。
+int32_t runLoadTest(const std::string &serverPort, uint32_t taskTileSize, const LoadTestSettings &settings) {
+    try {
+        constexpr uint32_t numFrames = 256;
+        if (taskTileSize == 0)
+            taskTileSize = 32;
+
+        printf(
+            "%u clients, %u tasks/request, render %.3f [ms]/task, latency %.3f [ms]\n",
+            settings.numClients, settings.numTasksPerRequest,
+            settings.renderTimePerTask, settings.injectedLatency);
+
+        asio::io_context ioContext;
+        Server server(
+            ioContext, static_cast<uint32_t>(atoi(serverPort.c_str())), numFrames, taskTileSize, nullptr);
+        double serverCpuTime = 0.0;
+        std::thread serverThread(
+            [&ioContext, &serverCpuTime]() {
+                const double startCpuTime = getThreadCpuTime();
+                ioContext.run();
+                serverCpuTime = getThreadCpuTime() - startCpuTime;
+            });
+
+        const hires_clock::time_point startTp = hires_clock::now();
+        std::vector<LoadTestClientResult> results(settings.numClients);
+        std::vector<std::thread> clientThreads;
+        for (uint32_t i = 0; i < settings.numClients; ++i) {
+            clientThreads.emplace_back(
+                [&serverPort, &settings, &result = results[i], i]() {
+                    try {
+                        runLoadTestClient(serverPort, settings, result);
+                    }
+                    catch (std::exception &e) {
+                        printf("Client %u: %s\n", i, e.what());
+                    }
+                });
+        }
+        for (std::thread &thread : clientThreads)
+            thread.join();
+        const hires_clock::duration elapsed = hires_clock::now() - startTp;
+        // 失敗したクライアントがいてもセッションは切断で閉じるので、サーバーのスレッドは終わる。
+        serverThread.join();
+
+        uint32_t numTasks = 0;
+        uint32_t numRequests = 0;
+        uint32_t numFailedClients = 0;
+        std::vector<uint32_t> grantLatencies;
+        for (const LoadTestClientResult &result : results) {
+            numTasks += result.numReceivedTasks;
+            numRequests += result.numRequests;
+            numFailedClients += result.succeeded ? 0 : 1;
+            grantLatencies.insert(grantLatencies.end(), result.grantLatencies.begin(), result.grantLatencies.end());
+        }
+        std::sort(grantLatencies.begin(), grantLatencies.end());
+        const auto getPercentile = [&grantLatencies](double p) {
+            if (grantLatencies.empty())
+                return 0u;
+            const size_t index = static_cast<size_t>(std::ceil(p * grantLatencies.size()));
+            return grantLatencies[std::clamp<size_t>(index, 1, grantLatencies.size()) - 1];
+        };
+
+        const double elapsedInSec =
+            std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() * 1e-6;
+        printf(
+            "Dispatch: %u tasks in %u requests, %.3f [s], %.0f [tasks/s], %.0f [requests/s]\n",
+            numTasks, numRequests, elapsedInSec, numTasks / elapsedInSec, numRequests / elapsedInSec);
+        printf(
+            "Grant latency: p50 %u [us], p99 %u [us], max %u [us]\n",
+            getPercentile(0.50), getPercentile(0.99), grantLatencies.empty() ? 0 : grantLatencies.back());
+        printf(
+            "Server CPU time: %.3f [s] (%.1f%% of a core), %.2f [us]/request\n",
+            serverCpuTime, 100 * serverCpuTime / elapsedInSec,
+            numRequests > 0 ? 1e+6 * serverCpuTime / numRequests : 0.0);
+        if (numFailedClients > 0)
+            printf("%u clients failed.\n", numFailedClients);
+    }
+    catch (std::exception &e) {
+        printf("%s\n", e.what());
+        return -1;
+    }
+
+    return 0;
+}
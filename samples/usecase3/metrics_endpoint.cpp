@@ -0,0 +1,61 @@
+﻿#include "metrics_endpoint.h"
+
+#include <cstdio>
+
+#include "protocol.h"
+
+MetricsEndpoint::MetricsEndpoint(
+    asio::io_context &ioContext, uint16_t port, std::function<std::string()> producer) :
+    m_acceptor(ioContext, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), port)),
+    m_producer(std::move(producer)), m_numScrapes(0) {
+}
+
+void MetricsEndpoint::start() {
+    printf("Serve metrics on http://127.0.0.1:%u/metrics.\n", static_cast<uint32_t>(m_acceptor.local_endpoint().port()));
+    asio::co_spawn(m_acceptor.get_executor(), acceptLoop(), rethrowException);
+}
+
+void MetricsEndpoint::stop() {
+    asio::error_code ec;
+    m_acceptor.close(ec);
+}
+
+asio::awaitable<void> MetricsEndpoint::acceptLoop() {
+    while (m_acceptor.is_open()) {
+        asio::error_code ec;
+        asio::ip::tcp::socket socket = co_await m_acceptor.async_accept(
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) {
+            if (ec == asio::error::operation_aborted || ec == asio::error::bad_descriptor)
+                break;
+            continue;
+        }
+        asio::co_spawn(m_acceptor.get_executor(), serve(std::move(socket)), rethrowException);
+    }
+}
+
+asio::awaitable<void> MetricsEndpoint::serve(asio::ip::tcp::socket socket) {
+    // 要求のヘッダーの終わりまで読み捨てる。大き過ぎる要求は応答せずに閉じる。
+    constexpr size_t maxRequestSize = 8 * 1024;
+    std::string request;
+    asio::error_code ec;
+    co_await asio::async_read_until(
+        socket, asio::dynamic_buffer(request, maxRequestSize), "\r\n\r\n",
+        asio::redirect_error(asio::use_awaitable, ec));
+    if (ec)
+        co_return;
+
+    ++m_numScrapes;
+    const std::string body = m_producer();
+    char header[256];
+    sprintf_s(
+        header,
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n\r\n",
+        body.size());
+    const std::array<asio::const_buffer, 2> buffers = { asio::buffer(header, strlen(header)), asio::buffer(body) };
+    co_await asio::async_write(socket, buffers, asio::redirect_error(asio::use_awaitable, ec));
+    socket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+}
@@ -0,0 +1,36 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string>
+#include <functional>
+
+// https://think-async.com/Asio/index.html
+#define ASIO_STANDALONE
+#include <asio.hpp>
+
+// 実行中の状態をPrometheusのテキスト形式で返す最小限のHTTPサーバー。
+// パスは見ずにどの要求にも同じページを返し、1回返したら接続を閉じる。
+// 与えたio_contextのスレッドでページを作るので、producerはそのスレッドが持つ状態をそのまま読んでよい。
+class MetricsEndpoint {
+    asio::ip::tcp::acceptor m_acceptor;
+    std::function<std::string()> m_producer;
+    uint32_t m_numScrapes;
+
+    asio::awaitable<void> acceptLoop();
+    asio::awaitable<void> serve(asio::ip::tcp::socket socket);
+
+public:
+    // 外から読まれないよう127.0.0.1で待ち受ける。
+    MetricsEndpoint(asio::io_context &ioContext, uint16_t port, std::function<std::string()> producer);
+
+    MetricsEndpoint(const MetricsEndpoint &) = delete;
+    MetricsEndpoint &operator=(const MetricsEndpoint &) = delete;
+
+    void start();
+    // 待ち受けをやめる。io_contextが終われるよう、サーバーの終了時に呼ぶ。
+    void stop();
+
+    uint32_t getNumScrapes() const {
+        return m_numScrapes;
+    }
+};
@@ -0,0 +1,327 @@
+﻿#include <sdkddkver.h>
+#include "protocol.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+void encodePayload(WireWriter &writer, const SessionIDMessage &message) {
+    writer.writeU32(message.sessionID);
+}
+
+void encodePayload(WireWriter &, const ServerStateRequestMessage &) {
+}
+
+void encodePayload(WireWriter &writer, const ServerStateMessage &message) {
+    writer.writeU32(static_cast<uint32_t>(message.state));
+}
+
+void encodePayload(WireWriter &writer, const RenderTaskRequestMessage &message) {
+    writer.writeU32(message.numTasks);
+    writer.writeU32(message.numSamples);
+}
+
+void encodePayload(WireWriter &writer, const RenderTaskMessage &message) {
+    writer.writeU32(static_cast<uint32_t>(message.tasks.size()));
+    for (const RenderTask &task : message.tasks) {
+        writer.writeU32(task.taskID);
+        writer.writeU32(task.frameIndex);
+        writer.writeU32(task.x);
+        writer.writeU32(task.y);
+        writer.writeU32(task.width);
+        writer.writeU32(task.height);
+        writer.writeU32(task.numRemainingTasks);
+        writer.writeU32(task.numSessions);
+        writer.writeU32(task.numSamples);
+        writer.writeU32(task.isValid);
+    }
+}
+
+void encodePayload(WireWriter &, const FinishSignalMessage &) {
+}
+
+void encodePayload(WireWriter &writer, const TileResultMessage &message) {
+    encodePayloadFields(writer, message);
+    writer.writeBytes(message.data, message.dataSize);
+}
+
+void encodePayloadFields(WireWriter &writer, const TileResultMessage &message) {
+    writer.writeU32(message.taskID);
+    writer.writeU32(message.frameIndex);
+    writer.writeU32(message.x);
+    writer.writeU32(message.y);
+    writer.writeU32(message.width);
+    writer.writeU32(message.height);
+    writer.writeU32(message.numSamples);
+    writer.writeU32(static_cast<uint32_t>(message.encoding));
+    writer.writeU32(message.dataSize);
+}
+
+void encodePayload(WireWriter &, const SceneInfoRequestMessage &) {
+}
+
+void encodePayload(WireWriter &writer, const SceneInfoMessage &message) {
+    writer.writeU64(message.size);
+    writer.writeU64(message.contentHash);
+    writer.writeU32(message.chunkSize);
+}
+
+void encodePayload(WireWriter &writer, const SceneChunkRequestMessage &message) {
+    writer.writeU64(message.offset);
+    writer.writeU32(message.size);
+}
+
+void encodePayload(WireWriter &writer, const SceneChunkMessage &message) {
+    writer.writeU64(message.offset);
+    writer.writeU64(message.checksum);
+    writer.writeU32(message.dataSize);
+    writer.writeBytes(message.data, message.dataSize);
+}
+
+void encodePayload(WireWriter &, const ClockSyncRequestMessage &) {
+}
+
+void encodePayload(WireWriter &writer, const ClockSyncMessage &message) {
+    writer.writeU64(static_cast<uint64_t>(message.serverTime));
+}
+
+
+
+void decodePayload(WireReader &reader, SessionIDMessage &message) {
+    message.sessionID = reader.readU32();
+}
+
+void decodePayload(WireReader &, ServerStateRequestMessage &) {
+}
+
+void decodePayload(WireReader &reader, ServerStateMessage &message) {
+    const uint32_t state = reader.readU32();
+    if (state > static_cast<uint32_t>(ServerState::Unknown)) {
+        message.state = ServerState::Unknown;
+        return;
+    }
+    message.state = static_cast<ServerState>(state);
+}
+
+void decodePayload(WireReader &reader, RenderTaskRequestMessage &message) {
+    message.numTasks = reader.readU32();
+    message.numSamples = reader.readU32();
+}
+
+void decodePayload(WireReader &reader, RenderTaskMessage &message) {
+    constexpr size_t encodedTaskSize = 10 * sizeof(uint32_t);
+    const uint32_t numTasks = reader.readU32();
+    // 件数がペイロードの長さと矛盾する場合は確保する前に失敗させる。
+    if (numTasks == 0 || reader.getNumRemainingBytes() != numTasks * encodedTaskSize) {
+        reader.setFailed();
+        return;
+    }
+    message.tasks.resize(numTasks);
+    for (RenderTask &task : message.tasks) {
+        task.taskID = reader.readU32();
+        task.frameIndex = reader.readU32();
+        task.x = reader.readU32();
+        task.y = reader.readU32();
+        task.width = reader.readU32();
+        task.height = reader.readU32();
+        task.numRemainingTasks = reader.readU32();
+        task.numSessions = reader.readU32();
+        task.numSamples = reader.readU32();
+        task.isValid = reader.readU32() & 0x1;
+    }
+}
+
+void decodePayload(WireReader &, FinishSignalMessage &) {
+}
+
+void decodePayload(WireReader &reader, TileResultMessage &message) {
+    message.taskID = reader.readU32();
+    message.frameIndex = reader.readU32();
+    message.x = reader.readU32();
+    message.y = reader.readU32();
+    message.width = reader.readU32();
+    message.height = reader.readU32();
+    message.numSamples = reader.readU32();
+    const uint32_t encoding = reader.readU32();
+    message.dataSize = reader.readU32();
+    message.data = reader.readView(message.dataSize);
+    if (encoding > static_cast<uint32_t>(TileEncoding::Png)) {
+        reader.setFailed();
+        return;
+    }
+    message.encoding = static_cast<TileEncoding>(encoding);
+    // 無圧縮の場合はタイルの大きさと一致しなければならない。
+    if (message.encoding == TileEncoding::Raw &&
+        static_cast<uint64_t>(message.width) * message.height * 4 != message.dataSize)
+        reader.setFailed();
+}
+
+void decodePayload(WireReader &, SceneInfoRequestMessage &) {
+}
+
+void decodePayload(WireReader &reader, SceneInfoMessage &message) {
+    message.size = reader.readU64();
+    message.contentHash = reader.readU64();
+    message.chunkSize = reader.readU32();
+}
+
+void decodePayload(WireReader &reader, SceneChunkRequestMessage &message) {
+    message.offset = reader.readU64();
+    message.size = reader.readU32();
+}
+
+void decodePayload(WireReader &reader, SceneChunkMessage &message) {
+    message.offset = reader.readU64();
+    message.checksum = reader.readU64();
+    message.dataSize = reader.readU32();
+    message.data = reader.readView(message.dataSize);
+}
+
+void decodePayload(WireReader &, ClockSyncRequestMessage &) {
+}
+
+void decodePayload(WireReader &reader, ClockSyncMessage &message) {
+    message.serverTime = static_cast<int64_t>(reader.readU64());
+}
+
+
+
+void MessageWriter::encodeHeader(MessageType type, uint32_t sequenceID) {
+    const uint32_t payloadSize = static_cast<uint32_t>(m_payload.size() + m_body.size());
+    // versionとtypeはそれぞれu16なので、ひとつのu32に詰めれば同じバイト列になる。
+    const uint32_t fields[] = {
+        g_protocolVersion | (static_cast<uint32_t>(type) << 16),
+        sequenceID,
+        payloadSize,
+    };
+    for (uint32_t i = 0; i < 3; ++i) {
+        for (uint32_t b = 0; b < 4; ++b)
+            m_header[4 * i + b] = static_cast<uint8_t>(fields[i] >> (8 * b));
+    }
+}
+
+
+
+MessageReader::Result MessageReader::tryGetMessage(MessageHeader &header, WireReader &payload) {
+    const size_t numBufferedBytes = m_end - m_begin;
+    if (numBufferedBytes < g_messageHeaderSize)
+        return Result::Incomplete;
+
+    WireReader headerReader(m_buffer.data() + m_begin, g_messageHeaderSize);
+    header.version = headerReader.readU16();
+    header.type = static_cast<MessageType>(headerReader.readU16());
+    header.sequenceID = headerReader.readU32();
+    header.payloadSize = headerReader.readU32();
+    if (header.version != g_protocolVersion || header.payloadSize > g_maxMessagePayloadSize)
+        return Result::Invalid;
+
+    const size_t messageSize = g_messageHeaderSize + header.payloadSize;
+    if (numBufferedBytes < messageSize)
+        return Result::Incomplete;
+
+    payload = WireReader(m_buffer.data() + m_begin + g_messageHeaderSize, header.payloadSize);
+    m_begin += messageSize;
+    return Result::Ready;
+}
+
+size_t MessageReader::getNumMissingBytes() const {
+    const size_t numBufferedBytes = m_end - m_begin;
+    if (numBufferedBytes < g_messageHeaderSize)
+        return g_messageHeaderSize - numBufferedBytes;
+
+    WireReader headerReader(m_buffer.data() + m_begin + 8, 4);
+    const size_t messageSize = g_messageHeaderSize + headerReader.readU32();
+    return messageSize - numBufferedBytes;
+}
+
+asio::mutable_buffer MessageReader::prepare() {
+    if (m_begin > 0) {
+        std::memmove(m_buffer.data(), m_buffer.data() + m_begin, m_end - m_begin);
+        m_end -= m_begin;
+        m_begin = 0;
+    }
+    // 大きなメッセージが来た場合だけ広げ、以降はその容量を使い回す。
+    const size_t requiredSize = m_end + getNumMissingBytes();
+    if (m_buffer.size() < requiredSize)
+        m_buffer.resize(requiredSize);
+    return asio::buffer(m_buffer.data() + m_end, m_buffer.size() - m_end);
+}
+
+
+
+asio::awaitable<asio::error_code> MessageSendQueue::run() {
+    while (!m_isStopped) {
+        if (m_queue.empty()) {
+            if (m_isFinishing)
+                break;
+            co_await m_signal.wait();
+            continue;
+        }
+
+        // 書き込み中に積まれた分は次の回に回す。
+        constexpr size_t maxNumMessagesPerWrite = 64;
+        const size_t numMessages = std::min(m_queue.size(), maxNumMessagesPerWrite);
+        m_buffers.clear();
+        for (size_t i = 0; i < numMessages; ++i) {
+            for (const asio::const_buffer &buffer : m_queue[i]->getBuffers())
+                m_buffers.push_back(buffer);
+        }
+
+        const int64_t traceBeginTime = beginTraceEvent();
+        asio::error_code ec;
+        const size_t length = co_await asio::async_write(
+            m_socket, m_buffers, asio::redirect_error(asio::use_awaitable, ec));
+        endTraceEvent("net", "write", traceBeginTime, static_cast<int64_t>(length));
+        if (ec)
+            co_return ec;
+        for (size_t i = 0; i < numMessages; ++i) {
+            m_writerPool.release(std::move(m_queue.front()));
+            m_queue.pop_front();
+        }
+    }
+    co_return asio::error_code();
+}
+
+
+
+asio::awaitable<asio::error_code> coReadMessage(
+    asio::ip::tcp::socket &socket, MessageReader &reader, MessageHeader &header, WireReader &payload) {
+    const int64_t traceBeginTime = beginTraceEvent();
+    while (true) {
+        const MessageReader::Result result = reader.tryGetMessage(header, payload);
+        if (result == MessageReader::Result::Ready) {
+            endTraceEvent("net", "read", traceBeginTime, static_cast<int64_t>(header.type));
+            co_return asio::error_code();
+        }
+        if (result == MessageReader::Result::Invalid) {
+            endTraceEvent("net", "read", traceBeginTime);
+            co_return asio::error::invalid_argument;
+        }
+
+        const size_t numMissingBytes = reader.getNumMissingBytes();
+        asio::error_code ec;
+        const size_t length = co_await asio::async_read(
+            socket, reader.prepare(), asio::transfer_at_least(numMissingBytes),
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) {
+            endTraceEvent("net", "read", traceBeginTime);
+            co_return ec;
+        }
+        reader.commit(length);
+    }
+}
+
+void readMessage(asio::ip::tcp::socket &socket, MessageReader &reader, MessageHeader &header, WireReader &payload) {
+    while (true) {
+        const MessageReader::Result result = reader.tryGetMessage(header, payload);
+        if (result == MessageReader::Result::Ready)
+            return;
+        if (result == MessageReader::Result::Invalid)
+            throw std::runtime_error("Received a malformed message.");
+        const size_t numMissingBytes = reader.getNumMissingBytes();
+        reader.commit(asio::read(socket, reader.prepare(), asio::transfer_at_least(numMissingBytes)));
+    }
+}
+
+void writeMessage(asio::ip::tcp::socket &socket, const MessageWriter &writer) {
+    asio::write(socket, writer.getBuffers());
+}
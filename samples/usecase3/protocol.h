@@ -0,0 +1,495 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <array>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <exception>
+
+// https://think-async.com/Asio/index.html
+#define ASIO_STANDALONE
+#include <asio.hpp>
+
+#include "trace.h"
+
+// ノード間のメッセージ形式。
+// 各メッセージは固定長のヘッダーとペイロードからなり、数値は全てリトルエンディアンで送る。
+// ヘッダー: プロトコルバージョン(u16), メッセージ種別(u16), シーケンスID(u32), ペイロードのバイト数(u32)
+// 応答のシーケンスIDは要求と同じ値にするので、要求を複数出しておいても対応が取れる。
+
+static constexpr uint16_t g_protocolVersion = 6;
+static constexpr uint32_t g_messageHeaderSize = 12;
+// 壊れたヘッダーで巨大な確保をしないための上限。
+static constexpr uint32_t g_maxMessagePayloadSize = 64 * 1024 * 1024;
+// シーンのチャンク1個の上限。ヘッダー分を残してペイロードの上限に収める。
+static constexpr uint32_t g_maxSceneChunkSize = 32 * 1024 * 1024;
+
+enum class MessageType : uint16_t {
+    SessionID = 0,
+    ServerStateRequest,
+    ServerState,
+    RenderTaskRequest,
+    RenderTask,
+    FinishSignal,
+    TileResult,
+    SceneInfoRequest,
+    SceneInfo,
+    SceneChunkRequest,
+    SceneChunk,
+    ClockSyncRequest,
+    ClockSync,
+};
+
+enum class ServerState : uint32_t {
+    PreparingData = 0,
+    DataReady,
+    Finishing,
+    Unknown,
+};
+
+struct MessageHeader {
+    uint16_t version;
+    MessageType type;
+    uint32_t sequenceID;
+    uint32_t payloadSize;
+};
+
+struct RenderTask {
+    // サーバーがタスクを識別する番号。結果を返す際にそのまま付ける。
+    uint32_t taskID;
+    uint32_t frameIndex;
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    // このタスクを含むサーバー上の残りタスク数と接続済みセッション数。
+    // クライアントはここから自分の残りフレーム数を見積もる。
+    uint32_t numRemainingTasks;
+    uint32_t numSessions;
+    // フレームごとにサーバーが決めたサンプル数。同じフレームのタスクは全て同じ値で描き、タイルの境目を出さない。
+    // 0の場合はクライアントが決める。
+    uint32_t numSamples;
+    uint32_t isValid : 1;
+};
+
+
+
+// バッファの末尾にリトルエンディアンで値を追記する。
+class WireWriter {
+    std::vector<uint8_t> &m_buffer;
+
+public:
+    explicit WireWriter(std::vector<uint8_t> &buffer) : m_buffer(buffer) {}
+
+    void writeU16(uint16_t value) {
+        m_buffer.push_back(static_cast<uint8_t>(value));
+        m_buffer.push_back(static_cast<uint8_t>(value >> 8));
+    }
+    void writeU32(uint32_t value) {
+        for (uint32_t i = 0; i < 4; ++i)
+            m_buffer.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+    void writeU64(uint64_t value) {
+        for (uint32_t i = 0; i < 8; ++i)
+            m_buffer.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+    void writeBytes(const void* data, size_t size) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        m_buffer.insert(m_buffer.end(), bytes, bytes + size);
+    }
+};
+
+// 受信したペイロードから値を読む。範囲外を読もうとした時点で以降は失敗扱いになる。
+class WireReader {
+    const uint8_t* m_data;
+    size_t m_size;
+    size_t m_position;
+    bool m_isGood;
+
+    bool require(size_t size) {
+        if (!m_isGood || m_size - m_position < size) {
+            m_isGood = false;
+            return false;
+        }
+        return true;
+    }
+
+public:
+    WireReader() : m_data(nullptr), m_size(0), m_position(0), m_isGood(true) {}
+    WireReader(const uint8_t* data, size_t size) : m_data(data), m_size(size), m_position(0), m_isGood(true) {}
+
+    bool isGood() const {
+        return m_isGood;
+    }
+    // 内容の矛盾を見つけた場合に以降を失敗扱いにする。
+    void setFailed() {
+        m_isGood = false;
+    }
+    // 全て読み切っていて途中で失敗していない。
+    bool isComplete() const {
+        return m_isGood && m_position == m_size;
+    }
+    size_t getNumRemainingBytes() const {
+        return m_size - m_position;
+    }
+
+    uint16_t readU16() {
+        if (!require(2))
+            return 0;
+        const uint8_t* p = m_data + m_position;
+        m_position += 2;
+        return static_cast<uint16_t>(p[0] | (p[1] << 8));
+    }
+    uint32_t readU32() {
+        if (!require(4))
+            return 0;
+        const uint8_t* p = m_data + m_position;
+        m_position += 4;
+        return
+            static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+            (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+    }
+    uint64_t readU64() {
+        const uint64_t lo = readU32();
+        const uint64_t hi = readU32();
+        return lo | (hi << 32);
+    }
+    // コピーせずにペイロード内を指すポインタを返す。
+    const uint8_t* readView(size_t size) {
+        if (!require(size))
+            return nullptr;
+        const uint8_t* data = m_data + m_position;
+        m_position += size;
+        return data;
+    }
+    bool readBytes(void* data, size_t size) {
+        if (!require(size))
+            return false;
+        std::memcpy(data, m_data + m_position, size);
+        m_position += size;
+        return true;
+    }
+};
+
+
+
+// メッセージごとのペイロード。typeでヘッダーのメッセージ種別と対応させる。
+
+struct SessionIDMessage {
+    static constexpr MessageType type = MessageType::SessionID;
+    uint32_t sessionID;
+};
+
+struct ServerStateRequestMessage {
+    static constexpr MessageType type = MessageType::ServerStateRequest;
+};
+
+struct ServerStateMessage {
+    static constexpr MessageType type = MessageType::ServerState;
+    ServerState state;
+};
+
+struct RenderTaskRequestMessage {
+    static constexpr MessageType type = MessageType::RenderTaskRequest;
+    uint32_t numTasks;
+    // 要求元が今描くならこのサンプル数、という提案。サーバーはまだ値の決まっていないフレームにこれを使う。
+    // 0の場合は提案しない。
+    uint32_t numSamples;
+};
+
+// 1個以上のタスク。タスクが残っていない場合は無効なタスクをひとつだけ送る。
+struct RenderTaskMessage {
+    static constexpr MessageType type = MessageType::RenderTask;
+    std::vector<RenderTask> tasks;
+};
+
+struct FinishSignalMessage {
+    static constexpr MessageType type = MessageType::FinishSignal;
+};
+
+enum class TileEncoding : uint32_t {
+    Raw = 0, // RGBA8の画素をそのまま並べる。
+    Png, // fpngでエンコードしたPNG。
+};
+
+// クライアントが描き終えたタイル。要求への応答ではなく一方的に送る。
+// dataはエンコード時は送信元の画素、デコード時は受信バッファ内を指すので、次の受信までに使い終えること。
+struct TileResultMessage {
+    static constexpr MessageType type = MessageType::TileResult;
+    uint32_t taskID;
+    uint32_t frameIndex;
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint32_t numSamples;
+    TileEncoding encoding;
+    const uint8_t* data;
+    uint32_t dataSize;
+};
+
+struct SceneInfoRequestMessage {
+    static constexpr MessageType type = MessageType::SceneInfoRequest;
+};
+
+// サーバーが配るシーンデータの大きさと内容のハッシュ。シーンが無い場合は大きさ0。
+// クライアントは同じハッシュのデータを持っていれば転送を省く。
+struct SceneInfoMessage {
+    static constexpr MessageType type = MessageType::SceneInfo;
+    uint64_t size;
+    uint64_t contentHash;
+    // サーバーが推奨するチャンクの大きさ。
+    uint32_t chunkSize;
+};
+
+struct SceneChunkRequestMessage {
+    static constexpr MessageType type = MessageType::SceneChunkRequest;
+    uint64_t offset;
+    uint32_t size;
+};
+
+// シーンデータの一部。checksumはdataのcomputeContentHash()。
+// dataはTileResultMessageと同様にエンコード時は送信元、デコード時は受信バッファ内を指す。
+struct SceneChunkMessage {
+    static constexpr MessageType type = MessageType::SceneChunk;
+    uint64_t offset;
+    uint64_t checksum;
+    const uint8_t* data;
+    uint32_t dataSize;
+};
+
+struct ClockSyncRequestMessage {
+    static constexpr MessageType type = MessageType::ClockSyncRequest;
+};
+
+// 応答を作った時点のサーバーのgetTraceTime()。クライアントは往復時間の中点と比べて時計のずれを求める。
+struct ClockSyncMessage {
+    static constexpr MessageType type = MessageType::ClockSync;
+    int64_t serverTime;
+};
+
+void encodePayload(WireWriter &writer, const SessionIDMessage &message);
+void encodePayload(WireWriter &writer, const ServerStateRequestMessage &message);
+void encodePayload(WireWriter &writer, const ServerStateMessage &message);
+void encodePayload(WireWriter &writer, const RenderTaskRequestMessage &message);
+void encodePayload(WireWriter &writer, const RenderTaskMessage &message);
+void encodePayload(WireWriter &writer, const FinishSignalMessage &message);
+void encodePayload(WireWriter &writer, const TileResultMessage &message);
+// dataの手前までを書く。dataはMessageWriter::encodeWithExternalBody()でコピーせずに後ろに続けて送る。
+void encodePayloadFields(WireWriter &writer, const TileResultMessage &message);
+void encodePayload(WireWriter &writer, const SceneInfoRequestMessage &message);
+void encodePayload(WireWriter &writer, const SceneInfoMessage &message);
+void encodePayload(WireWriter &writer, const SceneChunkRequestMessage &message);
+void encodePayload(WireWriter &writer, const SceneChunkMessage &message);
+void encodePayload(WireWriter &writer, const ClockSyncRequestMessage &message);
+void encodePayload(WireWriter &writer, const ClockSyncMessage &message);
+
+void decodePayload(WireReader &reader, SessionIDMessage &message);
+void decodePayload(WireReader &reader, ServerStateRequestMessage &message);
+void decodePayload(WireReader &reader, ServerStateMessage &message);
+void decodePayload(WireReader &reader, RenderTaskRequestMessage &message);
+void decodePayload(WireReader &reader, RenderTaskMessage &message);
+void decodePayload(WireReader &reader, FinishSignalMessage &message);
+void decodePayload(WireReader &reader, TileResultMessage &message);
+void decodePayload(WireReader &reader, SceneInfoRequestMessage &message);
+void decodePayload(WireReader &reader, SceneInfoMessage &message);
+void decodePayload(WireReader &reader, SceneChunkRequestMessage &message);
+void decodePayload(WireReader &reader, SceneChunkMessage &message);
+void decodePayload(WireReader &reader, ClockSyncRequestMessage &message);
+void decodePayload(WireReader &reader, ClockSyncMessage &message);
+
+// 種別が一致し、ペイロードを過不足なく読めた場合にtrueを返す。
+template <typename Message>
+bool decodeMessage(const MessageHeader &header, WireReader payload, Message &message) {
+    if (header.type != Message::type)
+        return false;
+    decodePayload(payload, message);
+    return payload.isComplete();
+}
+
+
+
+// 送信用バッファ。使い回すので、容量が足りている限りメッセージごとの確保は起きない。
+// ヘッダーとペイロードはgetBuffers()でまとめてひとつの書き込みに渡す。
+class MessageWriter {
+    std::array<uint8_t, g_messageHeaderSize> m_header;
+    std::vector<uint8_t> m_payload;
+    // ペイロードの後ろにコピーせずに続けて送る領域。m_bodyOwnerはその領域を書き込みが終わるまで保持する。
+    asio::const_buffer m_body;
+    std::shared_ptr<const void> m_bodyOwner;
+
+    void encodeHeader(MessageType type, uint32_t sequenceID);
+
+public:
+    explicit MessageWriter(size_t initialCapacity = 4096) {
+        m_payload.reserve(initialCapacity);
+    }
+
+    // 要求には接続ごとに増やすシーケンスIDを、応答には要求と同じIDを、一方的な通知には0を渡す。
+    template <typename Message>
+    void encode(const Message &message, uint32_t sequenceID) {
+        releaseBody();
+        m_payload.clear();
+        WireWriter writer(m_payload);
+        encodePayload(writer, message);
+        encodeHeader(Message::type, sequenceID);
+    }
+
+    // 後ろに大きなデータが続くメッセージを、データをペイロードにコピーせずに組み立てる。
+    // message.dataはbodyOwnerが持つ領域を指すこと。呼び出し側が領域を保持し続ける場合はbodyOwnerにnullptrを渡せる。
+    template <typename Message>
+    void encodeWithExternalBody(
+        const Message &message, uint32_t sequenceID, std::shared_ptr<const void> bodyOwner) {
+        m_payload.clear();
+        WireWriter writer(m_payload);
+        encodePayloadFields(writer, message);
+        m_body = asio::buffer(message.data, message.dataSize);
+        m_bodyOwner = std::move(bodyOwner);
+        encodeHeader(Message::type, sequenceID);
+    }
+
+    // 書き込みを終えた後に、保持していた本体の領域を手放す。
+    void releaseBody() {
+        m_body = asio::const_buffer();
+        m_bodyOwner.reset();
+    }
+
+    size_t getMessageSize() const {
+        return g_messageHeaderSize + m_payload.size() + m_body.size();
+    }
+
+    // 本体が無い場合の3つ目は空のバッファ。
+    std::array<asio::const_buffer, 3> getBuffers() const {
+        return { asio::buffer(m_header), asio::buffer(m_payload), m_body };
+    }
+};
+
+// 複数のメッセージを送信待ちにする場合にMessageWriterを使い回す。どのスレッドから呼んでもよい。
+class MessageWriterPool {
+    std::vector<std::unique_ptr<MessageWriter>> m_freeWriters;
+    std::mutex m_mutex;
+
+public:
+    std::unique_ptr<MessageWriter> acquire() {
+        std::lock_guard lock(m_mutex);
+        if (m_freeWriters.empty())
+            return std::make_unique<MessageWriter>();
+        std::unique_ptr<MessageWriter> writer = std::move(m_freeWriters.back());
+        m_freeWriters.pop_back();
+        return writer;
+    }
+
+    void release(std::unique_ptr<MessageWriter> writer) {
+        writer->releaseBody();
+        std::lock_guard lock(m_mutex);
+        m_freeWriters.push_back(std::move(writer));
+    }
+};
+
+// コルーチンを同じexecutorの他の処理から起こすための通知。
+// notify()は待っているコルーチンが無ければ何も残さないので、待つ側は条件を確かめてからwait()する。
+class AsyncSignal {
+    asio::steady_timer m_timer;
+
+public:
+    explicit AsyncSignal(const asio::any_io_executor &executor) :
+        m_timer(executor, asio::steady_timer::time_point::max()) {}
+
+    asio::awaitable<void> wait() {
+        asio::error_code ec;
+        co_await m_timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+    }
+    void notify() {
+        m_timer.cancel();
+    }
+};
+
+// 接続ごとの送信キュー。run()のコルーチンが積まれた順に書き込む。
+// 書き込み中に溜まったメッセージは次の1回の書き込みにまとめる。
+// writerは書き込みを終えるまでキューに残すので、外部の本体の領域もそれまで保持される。
+// acquire()以外はソケットのexecutorのスレッドから呼ぶ。
+class MessageSendQueue {
+    asio::ip::tcp::socket &m_socket;
+    MessageWriterPool m_writerPool;
+    std::deque<std::unique_ptr<MessageWriter>> m_queue;
+    std::vector<asio::const_buffer> m_buffers;
+    AsyncSignal m_signal;
+    bool m_isFinishing;
+    bool m_isStopped;
+
+public:
+    explicit MessageSendQueue(asio::ip::tcp::socket &socket) :
+        m_socket(socket), m_signal(socket.get_executor()), m_isFinishing(false), m_isStopped(false) {}
+
+    // どのスレッドから呼んでもよい。
+    std::unique_ptr<MessageWriter> acquire() {
+        return m_writerPool.acquire();
+    }
+    void push(std::unique_ptr<MessageWriter> writer) {
+        m_queue.push_back(std::move(writer));
+        m_signal.notify();
+    }
+    // 積まれている分を書き終えたらrun()を終える。
+    void finish() {
+        m_isFinishing = true;
+        m_signal.notify();
+    }
+    // 残りを捨ててrun()を終える。
+    void stop() {
+        m_isStopped = true;
+        m_signal.notify();
+    }
+
+    // 書き込みに失敗した場合はそのエラーを返す。finish()とstop()で終えた場合は成功を返す。
+    asio::awaitable<asio::error_code> run();
+};
+
+// 受信用バッファ。読めるだけまとめて読み込み、溜まったバイト列からメッセージを切り出すので、
+// 小さなメッセージならヘッダーとペイロードを1回の読み込みで受け取れる。
+class MessageReader {
+    std::vector<uint8_t> m_buffer;
+    size_t m_begin;
+    size_t m_end;
+
+public:
+    enum class Result {
+        Incomplete = 0,
+        Ready,
+        Invalid,
+    };
+
+    explicit MessageReader(size_t initialCapacity = 64 * 1024) : m_begin(0), m_end(0) {
+        m_buffer.resize(initialCapacity);
+    }
+
+    // バッファにメッセージが揃っていれば取り出す。
+    // payloadはバッファ内を指すので、次にprepare()を呼ぶ前にデコードを終えること。
+    Result tryGetMessage(MessageHeader &header, WireReader &payload);
+    // 次のメッセージを揃えるのに最低限必要なバイト数。
+    size_t getNumMissingBytes() const;
+    // 未処理のデータを先頭に詰め、次のメッセージが収まる空き領域を返す。
+    asio::mutable_buffer prepare();
+    void commit(size_t size) {
+        m_end += size;
+    }
+};
+
+// 1メッセージが揃うまで待つ。既にバッファに揃っている場合はソケットを読まない。
+// payloadは次にこのreaderで受信するまで有効。
+// 接続断はそのエラーを、プロトコル違反はasio::error::invalid_argumentを返す。
+asio::awaitable<asio::error_code> coReadMessage(
+    asio::ip::tcp::socket &socket, MessageReader &reader, MessageHeader &header, WireReader &payload);
+
+// co_spawn()の完了ハンドラー。コルーチンから漏れた例外をio_context::run()の呼び出し元に投げ直す。
+inline void rethrowException(std::exception_ptr e) {
+    if (e)
+        std::rethrow_exception(e);
+}
+
+// 同期版。プロトコル違反は例外を投げる。
+void readMessage(asio::ip::tcp::socket &socket, MessageReader &reader, MessageHeader &header, WireReader &payload);
+void writeMessage(asio::ip::tcp::socket &socket, const MessageWriter &writer);
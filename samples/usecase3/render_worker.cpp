@@ -0,0 +1,317 @@
+﻿#include <sdkddkver.h>
+#include "render_worker.h"
+
+#include <cstdio>
+#include <algorithm>
+#include <stdexcept>
+
+#include "trace.h"
+
+void RenderWorker::signal(RenderSlot &slot) {
+    slot.taskSignal.fetch_add(1, std::memory_order_release);
+    slot.taskSignal.notify_one();
+}
+
+void RenderWorker::signalAll() {
+    for (const std::unique_ptr<RenderSlot> &slot : m_slots)
+        signal(*slot);
+}
+
+void RenderWorker::formatLogPrefix(const RenderSlot &slot, char (&prefix)[32]) const {
+    const uint32_t workerID = m_workerID.load(std::memory_order_relaxed);
+    if (m_slots.size() > 1)
+        sprintf_s(prefix, "[%u:%u]", workerID, slot.index);
+    else
+        sprintf_s(prefix, "[%u]", workerID);
+}
+
+void RenderWorker::renderTask(RenderSlot &slot, const RenderTask &task) {
+    const uint32_t frameIndex = task.frameIndex;
+
+    // 同じフレームのタイルはサーバーが決めた同じサンプル数で描く。決まっていない場合だけ自分で決める。
+    const uint32_t numSamples = task.numSamples > 0 ? task.numSamples : decideNumSamples(task);
+
+    constexpr uint32_t width = g_frameWidth;
+    constexpr uint32_t height = g_frameHeight;
+    // 16sppでフレーム全体200ms相当の負荷とする。
+    constexpr uint32_t referenceNumSamples = 16;
+
+    PageVector<RGBA> &tilePixels = acquireUnsharedBuffer(slot.tilePixels);
+    if (m_deferFirstTouch)
+        tilePixels.resize(task.width * task.height);
+    else
+        tilePixels.resize(task.width * task.height, RGBA{});
+    RGBA* pixels = tilePixels.data();
+
+    const hires_clock::time_point frameStartTp = hires_clock::now();
+    const int64_t traceBeginTime = beginTraceEvent();
+    const hires_clock::duration parallelTime = m_renderer.render(
+        task.x, task.y, task.width, task.height,
+        [&](const Tile &tile, uint32_t) {
+            // 高度なレンダリング...
+            // フレーム全体の負荷をタイル面積で按分する。
+            std::this_thread::sleep_for(
+                std::chrono::microseconds(
+                    200000ull * numSamples / referenceNumSamples *
+                    tile.width * tile.height / (width * height)));
+            for (uint32_t y = tile.y; y < tile.y + tile.height; ++y) {
+                for (uint32_t x = tile.x; x < tile.x + tile.width; ++x) {
+                    RGBA v;
+                    v.r = x;
+                    v.g = y;
+                    v.b = frameIndex;
+                    v.a = 255;
+                    const int32_t idx = (y - task.y) * task.width + (x - task.x);
+                    pixels[idx] = v;
+                }
+            }
+        });
+
+    // 起動からの時刻とフレーム時間を計算。
+    const hires_clock::time_point now = hires_clock::now();
+    const hires_clock::duration frameTime = now - frameStartTp;
+    const hires_clock::duration totalTime = now - g_appStartTp;
+    m_scheduler.reportFrameTime(numSamples, frameTime, slot.index);
+    m_frameTimeHistogram.observe(
+        std::chrono::duration_cast<std::chrono::microseconds>(frameTime).count() * 1e-6);
+
+    // 複数のスロットの出力が混ざらないよう1行にまとめて出す。
+    char prefix[32];
+    formatLogPrefix(slot, prefix);
+    char taskDesc[64];
+    if (task.width == width && task.height == height) {
+        sprintf_s(taskDesc, "%u spp", numSamples);
+    }
+    else {
+        sprintf_s(
+            taskDesc, "%u, %u, %ux%u, %u spp",
+            task.x, task.y, task.width, task.height, numSamples);
+    }
+    printf(
+        "%s: Frame %u (%s) ... Done: %.3f [ms] (parallel: %.3f [ms], total: %.3f [s])\n",
+        prefix, frameIndex, taskDesc,
+        std::chrono::duration_cast<std::chrono::microseconds>(frameTime).count() * 1e-3f,
+        std::chrono::duration_cast<std::chrono::microseconds>(parallelTime).count() * 1e-3f,
+        std::chrono::duration_cast<std::chrono::milliseconds>(totalTime).count() * 1e-3f);
+
+    endTraceEvent("render", "task", traceBeginTime, frameIndex);
+
+    // フレームへの組み立てと書き出しはプライマリーノードが行う。
+    m_onTileRendered(slot.index, task, numSamples, slot.tilePixels);
+}
+
+uint32_t RenderWorker::decideNumSamples(const RenderTask &task) {
+    // 残りタスクをセッション間で均等に分けると仮定して自分の残りタスク数を見積もる。
+    const uint32_t numSessions = std::max(task.numSessions, 1u);
+    const uint32_t numRemainingTasks = (task.numRemainingTasks + numSessions - 1) / numSessions;
+    return m_scheduler.decideNumSamples(task.frameIndex, numRemainingTasks);
+}
+
+void RenderWorker::warmUp(RenderSlot &slot) {
+    const int64_t traceBeginTime = beginTraceEvent();
+    const hires_clock::time_point startTp = hires_clock::now();
+    m_threadPool.parallelFor(
+        4 * m_threadPool.getNumThreads(),
+        [](uint32_t, uint32_t) {});
+    PageVector<RGBA> &tilePixels = acquireUnsharedBuffer(slot.tilePixels);
+    if (m_deferFirstTouch)
+        tilePixels.reserve(g_frameWidth * g_frameHeight);
+    else
+        tilePixels.resize(g_frameWidth * g_frameHeight, RGBA{});
+    endTraceEvent("setup", "warm up", traceBeginTime);
+
+    // セッションIDはまだ決まっていないことがあるのでスロット番号だけを出す。
+    printf(
+        "Render slot %u warmed up in %.3f [ms].\n", slot.index,
+        std::chrono::duration_cast<std::chrono::microseconds>(hires_clock::now() - startTp).count() * 1e-3f);
+}
+
+void RenderWorker::renderLoop(RenderSlot &slot) {
+    char threadName[32];
+    sprintf_s(threadName, "render %u", slot.index);
+    setTraceThreadName(m_slots.size() > 1 ? threadName : "render");
+    warmUp(slot);
+
+    const hires_clock::time_point startTp = hires_clock::now();
+    hires_clock::duration busyTime = hires_clock::duration::zero();
+    hires_clock::duration idleTime = hires_clock::duration::zero();
+    hires_clock::duration initialIdleTime = hires_clock::duration::zero();
+    uint32_t numIdleWaits = 0;
+    uint32_t numRenderedTasks = 0;
+
+    while (true) {
+        RenderTask task;
+        bool hasTask = slot.taskQueue.tryPop(task);
+        if (!hasTask && !m_noMoreTasks.load(std::memory_order_acquire) &&
+            !m_quit.load(std::memory_order_acquire)) {
+            // 手元にタスクが無く、供給元からの到着を待つ時間を計測する。
+            const hires_clock::time_point waitStartTp = hires_clock::now();
+            const int64_t traceBeginTime = beginTraceEvent();
+            while (true) {
+                // カウンタを読んでから確認するので、その後の更新で必ず起こされる。
+                const uint32_t signalValue = slot.taskSignal.load(std::memory_order_acquire);
+                hasTask = slot.taskQueue.tryPop(task);
+                if (hasTask ||
+                    m_noMoreTasks.load(std::memory_order_acquire) ||
+                    m_quit.load(std::memory_order_acquire))
+                    break;
+                slot.taskSignal.wait(signalValue, std::memory_order_acquire);
+            }
+            endTraceEvent("idle", "wait for tasks", traceBeginTime);
+            const hires_clock::duration waitTime = hires_clock::now() - waitStartTp;
+            if (numRenderedTasks == 0)
+                initialIdleTime += waitTime;
+            else
+                idleTime += waitTime;
+            ++numIdleWaits;
+        }
+        // 終了通知の直前に積まれたタスクを取りこぼさない。
+        if (!hasTask)
+            hasTask = slot.taskQueue.tryPop(task);
+        if (!hasTask || m_quit.load(std::memory_order_acquire))
+            break;
+        slot.isRendering.store(true, std::memory_order_release);
+
+        // キューが減ったので供給元に先読みを促す。
+        m_onTasksConsumed();
+
+        const hires_clock::time_point renderStartTp = hires_clock::now();
+        renderTask(slot, task);
+        busyTime += hires_clock::now() - renderStartTp;
+        ++numRenderedTasks;
+
+        slot.isRendering.store(false, std::memory_order_release);
+        m_onTasksConsumed();
+    }
+
+    // 稼働率はスレッドの寿命のうちタスクを描いていた時間の割合。
+    const hires_clock::duration lifeTime = hires_clock::now() - startTp;
+    const auto toSeconds = [](hires_clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count() * 1e-6f;
+    };
+    char prefix[32];
+    formatLogPrefix(slot, prefix);
+    printf(
+        "%s: Rendered %u tasks, busy %.3f [s] (%.1f%%), idle %.3f [s] in %u waits (%.3f [s] before the first task).\n",
+        prefix, numRenderedTasks, toSeconds(busyTime),
+        lifeTime.count() > 0 ? 100.0f * toSeconds(busyTime) / toSeconds(lifeTime) : 0.0f,
+        toSeconds(idleTime + initialIdleTime), numIdleWaits, toSeconds(initialIdleTime));
+    if (m_deferFirstTouch && slot.tilePixels && !slot.tilePixels->empty()) {
+        uint64_t numLocalPages = 0;
+        uint64_t numRemotePages = 0;
+        uint64_t numUntouchedPages = 0;
+        getNumaTopology().countPagePlacement(
+            slot.tilePixels->data(), slot.tilePixels->size() * sizeof(RGBA),
+            &numLocalPages, &numRemotePages, &numUntouchedPages);
+        printf(
+            "%s: Tile buffer pages: %llu local, %llu remote, %llu untouched\n",
+            prefix, static_cast<unsigned long long>(numLocalPages),
+            static_cast<unsigned long long>(numRemotePages), static_cast<unsigned long long>(numUntouchedPages));
+    }
+
+    // 最後に抜けたスロットが供給元に終了を伝える。
+    if (m_numRunningSlots.fetch_sub(1, std::memory_order_acq_rel) == 1 &&
+        !m_quit.load(std::memory_order_acquire))
+        m_onFinished();
+}
+
+RenderWorker::RenderWorker(const RenderSettings &settings) :
+    // 0の場合は全コアを使う。
+    m_threadPool(settings.numThreads, settings.enableNuma ? &getNumaTopology() : nullptr),
+    m_renderer(m_threadPool, 32),
+    // 制限時間内に全フレームを終えられるようフレームごとのサンプル数を決める。
+    m_scheduler(g_appStartTp, settings.schedulerSettings, std::max(settings.numRenderSlots, 1u)),
+    m_numTasksPerRequest(settings.numTasksPerRequest), m_prefetchDepth(settings.prefetchDepth),
+    m_lastReceivedTask{},
+    m_numRunningSlots(0), m_workerID(0), m_noMoreTasks(false), m_quit(false),
+    m_deferFirstTouch(settings.enableNuma),
+    m_frameTimeHistogram(LatencyHistogram::makeExponentialBounds(1e-3, 2.0, 14)) {
+    // 描画中と先読み分に加え、重ねて出した要求の分の受け取りと状態確認のずれの分だけ余裕を持たせる。
+    // 手持ちの少ないスロットから積むので、1つのスロットに全体の分が偏ることはない。
+    const uint32_t queueCapacity =
+        std::max(settings.numTasksPerRequest, maxAutoNumTasksPerRequest) * settings.numTaskRequestsInFlight +
+        settings.prefetchDepth + 2;
+    const uint32_t numSlots = std::max(settings.numRenderSlots, 1u);
+    for (uint32_t slotIdx = 0; slotIdx < numSlots; ++slotIdx)
+        m_slots.push_back(std::make_unique<RenderSlot>(slotIdx, queueCapacity));
+    printf(
+        "Render with %u threads in %u render slots%s.\n",
+        m_renderer.getNumThreads(), numSlots, settings.enableNuma ? " pinned per NUMA node" : "");
+}
+
+void RenderWorker::start(
+    std::function<void()> onTasksConsumed, TileRenderedFunc onTileRendered,
+    std::function<void()> onFinished) {
+    m_onTasksConsumed = std::move(onTasksConsumed);
+    m_onTileRendered = std::move(onTileRendered);
+    m_onFinished = std::move(onFinished);
+    m_numRunningSlots.store(static_cast<uint32_t>(m_slots.size()), std::memory_order_release);
+    for (const std::unique_ptr<RenderSlot> &slot : m_slots)
+        slot->thread = std::thread(&RenderWorker::renderLoop, this, std::ref(*slot));
+}
+
+void RenderWorker::stop() {
+    m_quit.store(true, std::memory_order_release);
+    signalAll();
+    for (const std::unique_ptr<RenderSlot> &slot : m_slots) {
+        if (slot->thread.joinable())
+            slot->thread.join();
+    }
+}
+
+void RenderWorker::pushTasks(const std::vector<RenderTask> &tasks) {
+    for (const RenderTask &task : tasks) {
+        RenderSlot* target = m_slots[0].get();
+        uint32_t minNumHeldTasks = target->getNumHeldTasks();
+        for (uint32_t slotIdx = 1; slotIdx < m_slots.size(); ++slotIdx) {
+            const uint32_t numHeldTasks = m_slots[slotIdx]->getNumHeldTasks();
+            if (numHeldTasks < minNumHeldTasks) {
+                target = m_slots[slotIdx].get();
+                minNumHeldTasks = numHeldTasks;
+            }
+        }
+        if (!target->taskQueue.tryPush(task))
+            throw std::runtime_error("Render task queue overflow.");
+        signal(*target);
+    }
+    m_lastReceivedTask = tasks.back();
+}
+
+void RenderWorker::finishTasks() {
+    m_noMoreTasks.store(true, std::memory_order_release);
+    signalAll();
+}
+
+bool RenderWorker::needsMoreTasks() const {
+    if (m_noMoreTasks.load(std::memory_order_acquire))
+        return false;
+    uint32_t numHeldTasks = 0;
+    for (const std::unique_ptr<RenderSlot> &slot : m_slots)
+        numHeldTasks += slot->getNumHeldTasks();
+    return numHeldTasks < static_cast<uint32_t>(m_slots.size()) * (m_prefetchDepth + 1);
+}
+
+uint32_t RenderWorker::proposeNumSamples() {
+    RenderTask task = m_lastReceivedTask;
+    if (!task.isValid) {
+        task.frameIndex = 0;
+        task.numRemainingTasks = 1;
+        task.numSessions = 1;
+    }
+    return decideNumSamples(task);
+}
+
+uint32_t RenderWorker::getNumTasksPerRequest() const {
+    if (m_numTasksPerRequest > 0)
+        return m_numTasksPerRequest;
+
+    // 直前のタスクの大きさから、全スレッドに描画タイルが2つずつ行き渡る程度のタスク数を要求する。
+    if (!m_lastReceivedTask.isValid)
+        return 1;
+    const RenderTask &task = m_lastReceivedTask;
+    const uint64_t taskArea = static_cast<uint64_t>(task.width) * task.height;
+    const uint64_t targetArea =
+        2ull * m_renderer.getNumThreads() * m_renderer.getTileSize() * m_renderer.getTileSize();
+    return static_cast<uint32_t>(
+        std::clamp<uint64_t>((targetArea + taskArea - 1) / taskArea, 1, maxAutoNumTasksPerRequest));
+}
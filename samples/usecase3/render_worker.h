@@ -0,0 +1,162 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <thread>
+
+#include "render_engine.h"
+#include "thread_pool.h"
+#include "deadline_scheduler.h"
+#include "spsc_queue.h"
+#include "metrics.h"
+#include "numa.h"
+#include "protocol.h"
+#include "usecase3.h"
+
+// 受け取ったタスクを専用のレンダリングスレッドで描画し、描き終えたタイルを供給元に返す。
+// タスクの供給元(TCPのClientかサーバー内の直結チャネル)は通信スレッドからpushTasks()で積む。
+// レンダリングスレッドは複数持てて、それぞれ別のタスクを描きつつタスク内のタイルを共有のスレッドプールで並列に描く。
+// 小さなタスクではタイル数がスレッド数に足りないので、タスク単位でも並列にしてプールを埋める。
+// キューはスロットごとのロックフリーなSPSCリングなので、通信スレッドとレンダリングスレッドがロックを取り合わない。
+// 他に保持されていなければbufferを使い回し、保持されていれば新しく確保して返す。
+template <typename T>
+T &acquireUnsharedBuffer(std::shared_ptr<T> &buffer) {
+    if (!buffer || buffer.use_count() > 1) {
+        buffer = std::make_shared<T>();
+    }
+    else {
+        // 他の保持者が手放すまでの読み込みを、これからの書き込みより前に終えたものとする。
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return *buffer;
+}
+
+class RenderWorker {
+public:
+    // 描き終えたタイル。pixelsを誰かが保持している間、スロットは次のタスクを別の描画先に描くので、
+    // 送信が終わるまで保持してよい。
+    // slotIndexは描いたレンダリングスレッドの番号で、同じスロットからの呼び出しは重ならない。
+    using TilePixels = std::shared_ptr<const PageVector<RGBA>>;
+    using TileRenderedFunc = std::function<
+        void(uint32_t slotIndex, const RenderTask &task, uint32_t numSamples, const TilePixels &pixels)>;
+
+private:
+    // レンダリングスレッド1本分の状態。
+    struct RenderSlot {
+        uint32_t index;
+        SpscQueue<RenderTask> taskQueue;
+        std::atomic<bool> isRendering;
+        // キューや状態の更新ごとに増えるカウンタ。レンダリングスレッドはこれを待って眠る。
+        std::atomic<uint32_t> taskSignal;
+        std::thread thread;
+        // タスクの領域だけの描画先。送信などで保持されていなければ使い回す。
+        std::shared_ptr<PageVector<RGBA>> tilePixels;
+
+        RenderSlot(uint32_t _index, uint32_t queueCapacity) :
+            index(_index), taskQueue(queueCapacity), isRendering(false), taskSignal(0) {}
+
+        uint32_t getNumHeldTasks() const {
+            return taskQueue.size() + (isRendering.load(std::memory_order_acquire) ? 1 : 0);
+        }
+    };
+
+    ThreadPool m_threadPool;
+    TileRenderer m_renderer;
+    DeadlineScheduler m_scheduler;
+    uint32_t m_numTasksPerRequest;
+    uint32_t m_prefetchDepth;
+    // 通信スレッドだけが触る。
+    RenderTask m_lastReceivedTask;
+
+    std::vector<std::unique_ptr<RenderSlot>> m_slots;
+    std::atomic<uint32_t> m_numRunningSlots;
+    std::atomic<uint32_t> m_workerID;
+    std::atomic<bool> m_noMoreTasks;
+    std::atomic<bool> m_quit;
+    std::function<void()> m_onTasksConsumed;
+    TileRenderedFunc m_onTileRendered;
+    std::function<void()> m_onFinished;
+
+    // 描画先をゼロ埋めせず、各ワーカーの最初の書き込みでそのノードにページを置く。
+    bool m_deferFirstTouch;
+    // タスク1つの描画時間。各スロットからロックを取らずに数える。
+    LatencyHistogram m_frameTimeHistogram;
+
+    static void signal(RenderSlot &slot);
+
+    void signalAll();
+
+    // ログの行頭。スロットが複数ある場合はスロット番号も付ける。
+    void formatLogPrefix(const RenderSlot &slot, char (&prefix)[32]) const;
+
+    void renderTask(RenderSlot &slot, const RenderTask &task);
+
+    uint32_t decideNumSamples(const RenderTask &task);
+
+    // 最初のタスクが届くまでの間に、スレッドプールの全スレッドを一巡させ、描画先を最大のタスクの大きさで確保しておく。
+    // NUMAを考慮する場合はページを各ワーカーの書き込みで置くため、確保だけで触らない。
+    void warmUp(RenderSlot &slot);
+
+    void renderLoop(RenderSlot &slot);
+
+public:
+    explicit RenderWorker(const RenderSettings &settings);
+
+    ~RenderWorker() {
+        stop();
+    }
+
+    static constexpr uint32_t maxAutoNumTasksPerRequest = 64;
+
+    // コールバックはいずれもレンダリングスレッドから呼ばれ、onTasksConsumedとonTileRenderedは
+    // 複数のスロットから同時に呼ばれうる。通信が必要な場合は呼び出し側で自分の通信スレッドにpostする。
+    void start(
+        std::function<void()> onTasksConsumed, TileRenderedFunc onTileRendered,
+        std::function<void()> onFinished);
+
+    // 描き終えていないタスクを捨ててレンダリングスレッドを止める。
+    void stop();
+
+    void finish() {
+        m_scheduler.writeLog("scheduler_log.csv");
+    }
+
+    ThreadPool &getThreadPool() {
+        return m_threadPool;
+    }
+
+    uint32_t getNumRenderSlots() const {
+        return static_cast<uint32_t>(m_slots.size());
+    }
+
+    const LatencyHistogram &getFrameTimeHistogram() const {
+        return m_frameTimeHistogram;
+    }
+
+    void setWorkerID(uint32_t id) {
+        m_workerID.store(id, std::memory_order_relaxed);
+    }
+
+    bool isStopping() const {
+        return m_quit.load(std::memory_order_acquire);
+    }
+
+    // 以下は供給元の通信スレッドからのみ呼ぶ。
+
+    // タスクを1つずつ、その時点で手持ちの最も少ないスロットに積む。
+    void pushTasks(const std::vector<RenderTask> &tasks);
+
+    // 供給元にタスクが残っていない。レンダリングスレッドは手元のキューを描き終えたら終了する。
+    void finishTasks();
+
+    // 手元のタスクが全スロットで描画中の1つと先読み数に満たなくなったら次を受け取る。
+    bool needsMoreTasks() const;
+
+    // 次の要求に付けるサンプル数の提案。直前に受け取ったタスクの残り数から見積もる。
+    uint32_t proposeNumSamples();
+
+    uint32_t getNumTasksPerRequest() const;
+};
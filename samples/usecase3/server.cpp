@@ -0,0 +1,982 @@
+﻿#include <sdkddkver.h>
+#include "server.h"
+
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+#include "content_hash.h"
+#include "cost_profile.h"
+#include "frame_pipeline.h"
+#include "trace.h"
+
+// https://github.com/richgel999/fpng
+#include "fpng.h"
+
+void Server::registerAccept() {
+    using asio::ip::tcp;
+
+    m_acceptor.async_accept(
+        [this](asio::error_code ec, tcp::socket socket) {
+            if (!ec) {
+                const uint32_t sessionID = m_nextSessionID++;
+                auto session = std::make_shared<Session>(*this, m_traffic, sessionID, std::move(socket));
+                m_sessions[sessionID] = session;
+                session->start();
+            }
+            if (ec != asio::error::operation_aborted)
+                registerAccept();
+        });
+}
+
+double Server::getLeaseTimeout() const {
+    if (m_fixedLeaseTimeout > 0)
+        return m_fixedLeaseTimeout;
+    // 実測が無いうちは長めに取る。以降は往復時間の数倍とし、短くなり過ぎないようにする。
+    constexpr double initialLeaseTimeout = 30.0;
+    constexpr double minLeaseTimeout = 2.0;
+    if (!m_hasTurnaroundMeasurement)
+        return initialLeaseTimeout;
+    return std::max(4.0 * m_taskTurnaroundTime, minLeaseTimeout);
+}
+
+void Server::registerLeaseCheck() {
+    m_leaseTimer.expires_after(std::chrono::milliseconds(500));
+    m_leaseTimer.async_wait(
+        [this](asio::error_code ec) {
+            if (ec)
+                return;
+            const hires_clock::time_point now = hires_clock::now();
+            bool requeued = false;
+            for (auto &[taskID, lease] : m_leases) {
+                if (lease.isQueued || now < lease.deadline)
+                    continue;
+                printf(
+                    "Lease of frame %u (%u, %u) expired, re-issue it.\n",
+                    lease.task.frameIndex, lease.task.x, lease.task.y);
+                ++m_numExpiredLeases;
+                requeue(lease);
+                requeued = true;
+            }
+            if (requeued)
+                wakeTaskWaiters();
+            registerLeaseCheck();
+        });
+}
+
+void Server::requeue(Lease &lease) {
+    lease.isQueued = true;
+    lease.isReissued = true;
+    m_taskQueue.push_front(lease.task.taskID);
+    m_queuedCost += getTaskCost(lease.task);
+}
+
+double Server::estimateThroughput(const SessionThroughput &throughput, hires_clock::time_point now) {
+    const double elapsedTime = std::chrono::duration_cast<std::chrono::microseconds>(
+        now - throughput.firstGrantTp).count() * 1e-6;
+    if (throughput.numCompletedTasks == 0 || elapsedTime <= 0.0)
+        return -1.0;
+    return throughput.completedCost / elapsedTime;
+}
+
+double Server::estimateTotalThroughput(
+    uint32_t sessionID, hires_clock::time_point now, double* sessionThroughput) const {
+    double sumThroughputs = 0.0;
+    uint32_t numMeasured = 0;
+    uint32_t numActive = 0;
+    for (const auto &[id, throughput] : m_sessionThroughputs) {
+        if (!throughput.isActive)
+            continue;
+        ++numActive;
+        const double estimate = estimateThroughput(throughput, now);
+        if (estimate > 0.0) {
+            sumThroughputs += estimate;
+            ++numMeasured;
+        }
+    }
+    const double meanThroughput = numMeasured > 0 ? sumThroughputs / numMeasured : 1.0;
+    const auto it = m_sessionThroughputs.find(sessionID);
+    const double estimate = it != m_sessionThroughputs.end() ? estimateThroughput(it->second, now) : -1.0;
+    *sessionThroughput = estimate > 0.0 ? estimate : meanThroughput;
+    return sumThroughputs + (numActive - numMeasured) * meanThroughput;
+}
+
+double Server::decideMaxGrantCost(uint32_t sessionID, hires_clock::time_point now) const {
+    double sessionThroughput;
+    const double totalThroughput = estimateTotalThroughput(sessionID, now, &sessionThroughput);
+    constexpr double guidedFactor = 2.0;
+    return m_queuedCost * sessionThroughput / totalThroughput / guidedFactor;
+}
+
+void Server::registerScheduleLog() {
+    m_scheduleLogTimer.expires_after(std::chrono::seconds(1));
+    m_scheduleLogTimer.async_wait(
+        [this](asio::error_code ec) {
+            if (ec || m_state == ServerState::Finishing)
+                return;
+            const hires_clock::time_point now = hires_clock::now();
+            const double elapsedTime = std::chrono::duration_cast<std::chrono::microseconds>(
+                now - g_appStartTp).count() * 1e-6;
+            for (auto &[sessionID, throughput] : m_sessionThroughputs) {
+                if (!throughput.isActive)
+                    continue;
+                double heldCost = 0.0;
+                uint32_t numHeldTasks = 0;
+                for (const auto &[taskID, lease] : m_leases) {
+                    if (std::find(lease.holders.begin(), lease.holders.end(), sessionID) == lease.holders.end())
+                        continue;
+                    heldCost += getTaskCost(lease.task);
+                    ++numHeldTasks;
+                }
+                double sessionThroughput;
+                const double totalThroughput = estimateTotalThroughput(sessionID, now, &sessionThroughput);
+                throughput.predictedFinishTime =
+                    elapsedTime + heldCost / sessionThroughput + m_queuedCost / totalThroughput;
+                printf(
+                    "Session %u: %.2f [frames/s], %u tasks held, predicted finish %.3f [s]\n",
+                    sessionID, sessionThroughput, numHeldTasks, throughput.predictedFinishTime);
+            }
+            registerScheduleLog();
+        });
+}
+
+void Server::wakeTaskWaiters() {
+    std::vector<std::function<void()>> waiters;
+    waiters.swap(m_taskWaiters);
+    for (const std::function<void()> &waiter : waiters)
+        waiter();
+}
+
+void Server::finishIfDone() {
+    if (m_state == ServerState::Finishing || !m_taskQueue.empty() || !m_leases.empty())
+        return;
+    m_state = ServerState::Finishing;
+    m_acceptor.cancel();
+    m_leaseTimer.cancel();
+    if (m_metricsEndpoint)
+        m_metricsEndpoint->stop();
+    wakeTaskWaiters();
+    if (m_sessions.empty())
+        return;
+
+    // 終了シグナルを送らないまま止まっているクライアントは待たずに切る。
+    m_shutdownTimer.expires_after(std::chrono::seconds(5));
+    m_shutdownTimer.async_wait(
+        [this](asio::error_code ec) {
+            if (ec)
+                return;
+            for (auto &[sessionID, weakSession] : m_sessions) {
+                if (std::shared_ptr<Session> session = weakSession.lock()) {
+                    printf("Close the unresponsive session %u.\n", sessionID);
+                    session->close();
+                }
+            }
+        });
+}
+
+void Server::completeTask(uint32_t taskID, uint32_t sessionID) {
+    if (taskID >= m_allTasks.size())
+        return;
+    if (m_isTaskCompleted[taskID]) {
+        ++m_numRedundantResults;
+        return;
+    }
+    m_isTaskCompleted[taskID] = true;
+    ++m_numCompletedTasks;
+
+    // 最初に結果を返したセッションの処理速度に数える。
+    const auto throughputIt = m_sessionThroughputs.find(sessionID);
+    if (throughputIt != m_sessionThroughputs.end()) {
+        SessionThroughput &throughput = throughputIt->second;
+        throughput.completedCost += getTaskCost(m_allTasks[taskID]);
+        ++throughput.numCompletedTasks;
+        throughput.lastCompletionTime = std::chrono::duration_cast<std::chrono::microseconds>(
+            hires_clock::now() - g_appStartTp).count() * 1e-6;
+    }
+
+    const auto it = m_leases.find(taskID);
+    if (it != m_leases.end()) {
+        // 再発行していないタスクの往復時間からリースの期限を見積もる。
+        if (!it->second.isReissued) {
+            const double turnaroundTime =
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    hires_clock::now() - it->second.issuedTp).count() * 1e-6;
+            constexpr double alpha = 0.1;
+            if (m_hasTurnaroundMeasurement)
+                m_taskTurnaroundTime += alpha * (turnaroundTime - m_taskTurnaroundTime);
+            else
+                m_taskTurnaroundTime = turnaroundTime;
+            m_hasTurnaroundMeasurement = true;
+        }
+        m_leases.erase(it);
+    }
+    finishIfDone();
+}
+
+Server::Server(
+    asio::io_context &ioContext, uint32_t port, uint32_t numFrames, uint32_t taskTileSize,
+    FrameAssembler* frameAssembler, double leaseTimeout,
+    const std::vector<double> &frameCosts) :
+    m_state(ServerState::PreparingData),
+    m_acceptor(ioContext, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)),
+    m_queuedCost(0.0),
+    m_numCompletedTasks(0),
+    m_nextSessionID(0),
+    m_fixedLeaseTimeout(leaseTimeout),
+    m_taskTurnaroundTime(0.0), m_hasTurnaroundMeasurement(false),
+    m_leaseTimer(ioContext), m_shutdownTimer(ioContext),
+    m_scheduleLogTimer(ioContext), m_numShrunkGrants(0),
+    m_grantLatencyHistogram(LatencyHistogram::makeExponentialBounds(1e-5, 2.0, 22)),
+    m_numIssuedTasks(0), m_numExpiredLeases(0), m_numDroppedLeases(0),
+    m_numSpeculativeCopies(0), m_numRedundantResults(0), m_numSkippedTasks(0),
+    m_frameAssembler(frameAssembler),
+    m_localWorker(nullptr), m_localWorkerID(0), m_isLocalWorkerWaiting(false),
+    m_sceneContentHash(0), m_numSentSceneBytes(0), m_numSentSceneChunks(0) {
+    registerAccept();
+
+    const uint32_t tileWidth = taskTileSize > 0 ? std::min(taskTileSize, g_frameWidth) : g_frameWidth;
+    const uint32_t tileHeight = taskTileSize > 0 ? std::min(taskTileSize, g_frameHeight) : g_frameHeight;
+    for (uint32_t i = 0; i < numFrames; ++i) {
+        for (uint32_t y = 0; y < g_frameHeight; y += tileHeight) {
+            for (uint32_t x = 0; x < g_frameWidth; x += tileWidth) {
+                RenderTask task = {};
+                task.taskID = static_cast<uint32_t>(m_allTasks.size());
+                task.frameIndex = i;
+                task.x = x;
+                task.y = y;
+                task.width = std::min(tileWidth, g_frameWidth - x);
+                task.height = std::min(tileHeight, g_frameHeight - y);
+                task.isValid = true;
+                m_taskQueue.push_back(task.taskID);
+                m_allTasks.push_back(task);
+            }
+        }
+    }
+    m_isTaskCompleted.resize(m_allTasks.size(), false);
+
+    m_frameCosts = frameCosts;
+    m_frameCosts.resize(numFrames, 1.0);
+    m_frameNumSamples.resize(numFrames, 0);
+    if (!frameCosts.empty()) {
+        // 高価なフレームを先に配り、終盤に長いタスクが残らないようにする。同じコストの間は元の順を保つ。
+        std::stable_sort(
+            m_taskQueue.begin(), m_taskQueue.end(),
+            [this](uint32_t a, uint32_t b) {
+                return m_frameCosts[m_allTasks[a].frameIndex] > m_frameCosts[m_allTasks[b].frameIndex];
+            });
+        const auto [minCostIt, maxCostIt] = std::minmax_element(m_frameCosts.begin(), m_frameCosts.end());
+        printf(
+            "Order tasks by frame cost hints (%.3f - %.3f), frame %u first.\n",
+            *minCostIt, *maxCostIt, m_allTasks[m_taskQueue.front()].frameIndex);
+    }
+    for (const RenderTask &task : m_allTasks)
+        m_queuedCost += getTaskCost(task);
+    m_state = ServerState::DataReady;
+
+    if (m_frameAssembler) {
+        registerLeaseCheck();
+        registerScheduleLog();
+    }
+}
+
+Server::~Server() {
+    if (m_localWorker)
+        m_localWorker->stop();
+}
+
+void Server::loadScene(const std::string &path) {
+    const hires_clock::time_point startTp = hires_clock::now();
+    if (!m_scene.openForRead(path)) {
+        char msg[512];
+        sprintf_s(msg, "Failed to open the scene %s.\n", path.c_str());
+        throw std::runtime_error(msg);
+    }
+    m_sceneContentHash = computeContentHash(m_scene.getData(), m_scene.getSize());
+    const double loadTime = std::chrono::duration_cast<std::chrono::microseconds>(
+        hires_clock::now() - startTp).count() * 1e-6;
+    printf(
+        "Loaded the scene %s: %.3f [MB], hash %016llx (%.3f [s]).\n",
+        path.c_str(), m_scene.getSize() / (1024.0 * 1024.0),
+        static_cast<unsigned long long>(m_sceneContentHash), loadTime);
+}
+
+void Server::getSceneInfo(SceneInfoMessage &info) const {
+    // 大きなチャンクで往復の回数を減らしつつ、先読みする分の受信バッファが過大にならない大きさ。
+    constexpr uint32_t sceneChunkSize = 4 * 1024 * 1024;
+    info.size = m_scene.getSize();
+    info.contentHash = m_sceneContentHash;
+    info.chunkSize = sceneChunkSize;
+}
+
+bool Server::getSceneChunk(uint64_t offset, uint32_t size, SceneChunkMessage &chunk) {
+    const uint64_t sceneSize = m_scene.getSize();
+    if (size == 0 || size > g_maxSceneChunkSize || offset > sceneSize || size > sceneSize - offset)
+        return false;
+    chunk.offset = offset;
+    chunk.data = m_scene.getData() + offset;
+    chunk.dataSize = size;
+    chunk.checksum = computeContentHash(chunk.data, chunk.dataSize);
+    m_numSentSceneBytes += size;
+    ++m_numSentSceneChunks;
+    return true;
+}
+
+void Server::skipWrittenFrames(const CheckpointManifest &checkpoint) {
+    const uint32_t numFrames = static_cast<uint32_t>(m_frameCosts.size());
+    std::vector<bool> isFrameDone(numFrames, false);
+    uint32_t numDoneFrames = 0;
+    for (uint32_t frameIndex = 0; frameIndex < numFrames; ++frameIndex) {
+        if (!checkpoint.isFrameDone(frameIndex))
+            continue;
+        isFrameDone[frameIndex] = true;
+        ++numDoneFrames;
+        if (m_frameAssembler)
+            m_frameAssembler->skipFrame(frameIndex);
+    }
+    if (numDoneFrames == 0)
+        return;
+
+    std::deque<uint32_t> remainingTasks;
+    for (const uint32_t taskID : m_taskQueue) {
+        const RenderTask &task = m_allTasks[taskID];
+        if (!isFrameDone[task.frameIndex]) {
+            remainingTasks.push_back(taskID);
+            continue;
+        }
+        m_isTaskCompleted[taskID] = true;
+        ++m_numCompletedTasks;
+        ++m_numSkippedTasks;
+        m_queuedCost -= getTaskCost(task);
+    }
+    m_taskQueue.swap(remainingTasks);
+    printf(
+        "Checkpoint: %u/%u frames already written, skip %u tasks, %zu tasks left.\n",
+        numDoneFrames, numFrames, m_numSkippedTasks, m_taskQueue.size());
+}
+
+void Server::attachLocalWorker(asio::io_context &ioContext, RenderWorker &worker) {
+    m_localWorker = &worker;
+    m_localWorkGuard.emplace(asio::make_work_guard(ioContext));
+    m_localWorkerID = m_nextSessionID++;
+    printf("Start the local worker (%u).\n", m_localWorkerID);
+    worker.setWorkerID(m_localWorkerID);
+    worker.start(
+        [this]() {
+            asio::post(
+                m_acceptor.get_executor(),
+                [this]() {
+                    feedLocalWorker();
+                });
+        },
+        [this](uint32_t, const RenderTask &task, uint32_t, const RenderWorker::TilePixels &pixels) {
+            // 同じプロセス内なので画素を直接組み立て先に書き込む。
+            m_frameAssembler->addTile(
+                task.frameIndex, task.x, task.y, task.width, task.height, pixels->data(), 0);
+            const uint32_t taskID = task.taskID;
+            asio::post(
+                m_acceptor.get_executor(),
+                [this, taskID]() {
+                    completeTask(taskID, m_localWorkerID);
+                });
+        },
+        [this]() {
+            asio::post(
+                m_acceptor.get_executor(),
+                [this]() {
+                    printf("Quit the local worker.\n");
+                    m_localWorkGuard.reset();
+                });
+        });
+    asio::post(
+        m_acceptor.get_executor(),
+        [this]() {
+            feedLocalWorker();
+        });
+}
+
+Server::TaskGrant Server::popRenderTasks(
+    uint32_t sessionID, uint32_t numRequestedTasks, uint32_t proposedNumSamples, std::vector<RenderTask> &tasks) {
+    tasks.clear();
+    numRequestedTasks = std::max(numRequestedTasks, 1u);
+    const hires_clock::time_point now = hires_clock::now();
+    const hires_clock::duration leaseTimeout =
+        std::chrono::duration_cast<hires_clock::duration>(std::chrono::duration<double>(getLeaseTimeout()));
+
+    // 結果を受け取らない場合は処理速度を測れないので要求どおりに渡す。
+    double maxGrantCost = std::numeric_limits<double>::infinity();
+    if (m_frameAssembler) {
+        SessionThroughput &throughput = m_sessionThroughputs[sessionID];
+        if (!throughput.isActive && throughput.numCompletedTasks == 0) {
+            throughput = {};
+            throughput.firstGrantTp = now;
+            throughput.firstTaskTime = std::chrono::duration_cast<std::chrono::microseconds>(
+                now - g_appStartTp).count() * 1e-6;
+            throughput.isActive = true;
+            printf("Session %u: first task at %.3f [s].\n", sessionID, throughput.firstTaskTime);
+        }
+        maxGrantCost = decideMaxGrantCost(sessionID, now);
+    }
+
+    // セッションIDは切断や再接続のたびに進むので、描いているノードの数には今つながっている数を使う。
+    const uint32_t numLiveSessions = static_cast<uint32_t>(m_sessions.size()) + (m_localWorker ? 1 : 0);
+    double grantedCost = 0.0;
+    while (!m_taskQueue.empty() && tasks.size() < numRequestedTasks) {
+        const uint32_t taskID = m_taskQueue.front();
+        const double cost = getTaskCost(m_allTasks[taskID]);
+        // 少なくとも1つは渡す。
+        if (!tasks.empty() && grantedCost + cost > maxGrantCost) {
+            ++m_numShrunkGrants;
+            break;
+        }
+        m_taskQueue.pop_front();
+        m_queuedCost -= cost;
+        // 再発行待ちの間に元の結果が届いている。
+        if (m_isTaskCompleted[taskID])
+            continue;
+        grantedCost += cost;
+
+        RenderTask task = m_allTasks[taskID];
+        task.numRemainingTasks = static_cast<uint32_t>(m_taskQueue.size()) + 1;
+        task.numSessions = numLiveSessions;
+        // フレームの最初のタスクを配った時点でそのフレームのサンプル数を固定する。
+        uint32_t &frameNumSamples = m_frameNumSamples[task.frameIndex];
+        if (frameNumSamples == 0)
+            frameNumSamples = proposedNumSamples;
+        task.numSamples = frameNumSamples;
+        tasks.push_back(task);
+        ++m_numIssuedTasks;
+
+        // 結果を受け取らない場合は配った時点で完了とみなす。
+        if (!m_frameAssembler) {
+            m_isTaskCompleted[taskID] = true;
+            ++m_numCompletedTasks;
+            continue;
+        }
+
+        Lease &lease = m_leases[taskID];
+        if (!lease.isQueued) {
+            lease.task = task;
+            lease.isReissued = false;
+        }
+        lease.holders.push_back(sessionID);
+        lease.issuedTp = now;
+        lease.deadline = now + leaseTimeout;
+        lease.isQueued = false;
+    }
+
+    if (tasks.empty()) {
+        // 同じタスクを同時に描くのは元の担当を含めて2ノードまで。
+        constexpr size_t maxNumHolders = 2;
+        std::vector<Lease*> candidates;
+        for (auto &[taskID, lease] : m_leases) {
+            if (lease.isQueued || lease.holders.size() >= maxNumHolders ||
+                std::find(lease.holders.begin(), lease.holders.end(), sessionID) != lease.holders.end())
+                continue;
+            candidates.push_back(&lease);
+        }
+        // コストヒントの順や再発行があるとタスクIDの順は配った順にならないので、配った時刻の古い順に選ぶ。
+        const size_t numCopies = std::min<size_t>(candidates.size(), numRequestedTasks);
+        std::partial_sort(
+            candidates.begin(), candidates.begin() + numCopies, candidates.end(),
+            [](const Lease* a, const Lease* b) {
+                return a->issuedTp < b->issuedTp;
+            });
+        for (size_t i = 0; i < numCopies; ++i) {
+            Lease &lease = *candidates[i];
+            // 元の担当の期限は延ばさない。止まった元の担当は期限切れで他のノードに回す。
+            lease.holders.push_back(sessionID);
+            RenderTask task = lease.task;
+            task.numRemainingTasks = 0;
+            task.numSessions = numLiveSessions;
+            tasks.push_back(task);
+            ++m_numSpeculativeCopies;
+        }
+    }
+
+    if (!tasks.empty())
+        return TaskGrant::Granted;
+
+    finishIfDone();
+    if (m_state == ServerState::Finishing) {
+        tasks.push_back(RenderTask{});
+        return TaskGrant::Finished;
+    }
+    return TaskGrant::Wait;
+}
+
+void Server::releaseSession(uint32_t sessionID) {
+    if (m_sessions.erase(sessionID) == 0)
+        return;
+    const auto throughputIt = m_sessionThroughputs.find(sessionID);
+    if (throughputIt != m_sessionThroughputs.end())
+        throughputIt->second.isActive = false;
+    if (m_state == ServerState::Finishing && m_sessions.empty())
+        m_shutdownTimer.cancel();
+    bool requeued = false;
+    for (auto &[taskID, lease] : m_leases) {
+        const auto it = std::find(lease.holders.begin(), lease.holders.end(), sessionID);
+        if (it == lease.holders.end())
+            continue;
+        lease.holders.erase(it);
+        if (lease.holders.empty() && !lease.isQueued) {
+            ++m_numDroppedLeases;
+            requeue(lease);
+            requeued = true;
+        }
+    }
+    if (requeued) {
+        printf("Session %u dropped, re-issue its tasks.\n", sessionID);
+        wakeTaskWaiters();
+    }
+}
+
+void Server::feedLocalWorker() {
+    while (m_localWorker->needsMoreTasks()) {
+        const TaskGrant grant = popRenderTasks(
+            m_localWorkerID, m_localWorker->getNumTasksPerRequest(), m_localWorker->proposeNumSamples(),
+            m_localTasks);
+        if (grant == TaskGrant::Finished) {
+            m_localWorker->finishTasks();
+            return;
+        }
+        if (grant == TaskGrant::Wait) {
+            if (!m_isLocalWorkerWaiting) {
+                m_isLocalWorkerWaiting = true;
+                waitForTasks(
+                    [this]() {
+                        m_isLocalWorkerWaiting = false;
+                        feedLocalWorker();
+                    });
+            }
+            return;
+        }
+        m_localWorker->pushTasks(m_localTasks);
+    }
+}
+
+void Server::startMetricsEndpoint(asio::io_context &ioContext, uint16_t port) {
+    m_metricsEndpoint = std::make_unique<MetricsEndpoint>(
+        ioContext, port,
+        [this]() {
+            return formatMetrics();
+        });
+    m_metricsEndpoint->start();
+}
+
+void Server::recordGrantLatency(hires_clock::time_point requestTp) {
+    m_grantLatencyHistogram.observe(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(hires_clock::now() - requestTp).count() * 1e-9);
+}
+
+std::string Server::formatMetrics() const {
+    const hires_clock::time_point now = hires_clock::now();
+    std::string out;
+    const auto appendSingle = [&out](const char* name, const char* type, const char* help, double value) {
+        appendMetricHeader(out, name, type, help);
+        appendMetricValue(out, name, "", value);
+    };
+
+    appendSingle(
+        "rtcamp_elapsed_seconds", "gauge", "Time since the process started.",
+        std::chrono::duration_cast<std::chrono::microseconds>(now - g_appStartTp).count() * 1e-6);
+    appendSingle("rtcamp_tasks_total", "gauge", "Render tasks of the whole run.", m_allTasks.size());
+    appendSingle("rtcamp_tasks_completed", "gauge", "Tasks whose result has arrived.", m_numCompletedTasks);
+    appendSingle(
+        "rtcamp_tasks_remaining", "gauge", "Tasks without a result yet.",
+        m_allTasks.size() - m_numCompletedTasks);
+    appendSingle("rtcamp_tasks_queued", "gauge", "Tasks waiting in the queue.", m_taskQueue.size());
+    appendSingle(
+        "rtcamp_tasks_skipped", "gauge", "Tasks of frames written by a previous run.", m_numSkippedTasks);
+    appendSingle("rtcamp_tasks_queued_cost", "gauge", "Cost of the queued tasks in frames.", m_queuedCost);
+    appendSingle("rtcamp_tasks_issued_total", "counter", "Tasks handed out.", m_numIssuedTasks);
+    appendMetricHeader(out, "rtcamp_tasks_reissued_total", "counter", "Tasks put back to the queue.");
+    appendMetricValue(out, "rtcamp_tasks_reissued_total", "reason=\"expired\"", m_numExpiredLeases);
+    appendMetricValue(out, "rtcamp_tasks_reissued_total", "reason=\"dropped\"", m_numDroppedLeases);
+    appendSingle(
+        "rtcamp_speculative_copies_total", "counter", "Copies of unfinished tasks handed out.",
+        m_numSpeculativeCopies);
+    appendSingle(
+        "rtcamp_redundant_results_total", "counter", "Results of already completed tasks.",
+        m_numRedundantResults);
+    appendSingle("rtcamp_lease_timeout_seconds", "gauge", "Current lease timeout.", getLeaseTimeout());
+    appendSingle("rtcamp_sessions", "gauge", "Connected sessions.", m_sessions.size());
+
+    // セッションごとの値。同じ名前の行はまとめて出す必要があるので、名前ごとに全セッションを回す。
+    std::map<uint32_t, uint32_t> numTasksInFlight;
+    for (const auto &[taskID, lease] : m_leases) {
+        if (lease.isQueued)
+            continue;
+        for (const uint32_t holder : lease.holders)
+            ++numTasksInFlight[holder];
+    }
+    const auto appendPerSession = [&](const char* name, const char* type, const char* help, auto getValue) {
+        appendMetricHeader(out, name, type, help);
+        for (const auto &[sessionID, throughput] : m_sessionThroughputs) {
+            char labels[32];
+            sprintf_s(labels, "session=\"%u\"", sessionID);
+            appendMetricValue(out, name, labels, getValue(sessionID, throughput));
+        }
+    };
+    appendPerSession(
+        "rtcamp_session_tasks_in_flight", "gauge", "Tasks a session holds without a result.",
+        [&numTasksInFlight](uint32_t sessionID, const SessionThroughput &) {
+            const auto it = numTasksInFlight.find(sessionID);
+            return it != numTasksInFlight.end() ? static_cast<double>(it->second) : 0.0;
+        });
+    appendPerSession(
+        "rtcamp_session_completed_tasks_total", "counter", "Tasks a session returned first.",
+        [](uint32_t, const SessionThroughput &throughput) {
+            return static_cast<double>(throughput.numCompletedTasks);
+        });
+    appendPerSession(
+        "rtcamp_session_throughput_frames_per_second", "gauge", "Measured throughput of a session.",
+        [now](uint32_t, const SessionThroughput &throughput) {
+            return std::max(estimateThroughput(throughput, now), 0.0);
+        });
+    appendPerSession(
+        "rtcamp_session_predicted_finish_seconds", "gauge", "Last predicted finish time of a session.",
+        [](uint32_t, const SessionThroughput &throughput) {
+            return throughput.predictedFinishTime;
+        });
+
+    appendSingle(
+        "rtcamp_network_received_bytes_total", "counter", "Bytes received from clients.",
+        static_cast<double>(m_traffic.numReceivedBytes.load(std::memory_order_relaxed)));
+    appendSingle(
+        "rtcamp_network_sent_bytes_total", "counter", "Bytes sent to clients.",
+        static_cast<double>(m_traffic.numSentBytes.load(std::memory_order_relaxed)));
+    appendSingle(
+        "rtcamp_scene_sent_bytes_total", "counter", "Scene data sent to clients.",
+        static_cast<double>(m_numSentSceneBytes));
+    m_grantLatencyHistogram.appendPrometheus(
+        out, "rtcamp_grant_latency_seconds",
+        "Time from a task request to its reply, including the time held while no task is available.");
+
+    if (m_frameAssembler) {
+        m_frameAssembler->getAssemblyLatencyHistogram().appendPrometheus(
+            out, "rtcamp_frame_assembly_seconds", "Time from the first tile of a frame to its last tile.");
+    }
+    if (m_localWorker) {
+        const LatencyHistogram &histogram = m_localWorker->getFrameTimeHistogram();
+        histogram.appendPrometheus(
+            out, "rtcamp_render_frame_seconds", "Render time of a task on the local worker.");
+        appendMetricHeader(
+            out, "rtcamp_render_frame_quantile_seconds", "gauge",
+            "Render time quantiles on the local worker, interpolated in the histogram buckets.");
+        for (const double q : { 0.5, 0.9, 0.99 }) {
+            char labels[32];
+            sprintf_s(labels, "quantile=\"%g\"", q);
+            appendMetricValue(out, "rtcamp_render_frame_quantile_seconds", labels, histogram.estimateQuantile(q));
+        }
+    }
+
+    return out;
+}
+
+void Server::printStats() const {
+    printf(
+        "Tasks: %u/%zu completed, %u issued, re-issued %u (%u expired, %u dropped), "
+        "%u speculative copies, %u redundant results\n",
+        m_numCompletedTasks, m_allTasks.size(), m_numIssuedTasks,
+        m_numExpiredLeases + m_numDroppedLeases, m_numExpiredLeases, m_numDroppedLeases,
+        m_numSpeculativeCopies, m_numRedundantResults);
+    if (m_numSkippedTasks > 0)
+        printf("  %u tasks skipped as already written\n", m_numSkippedTasks);
+    if (m_frameAssembler) {
+        printf("Guided scheduling: %u grants shrunk below the request\n", m_numShrunkGrants);
+        for (const auto &[sessionID, throughput] : m_sessionThroughputs) {
+            printf(
+                "  Session %u: %u tasks (%.2f frames), first task %.3f [s], last result %.3f [s], "
+                "last predicted finish %.3f [s]\n",
+                sessionID, throughput.numCompletedTasks, throughput.completedCost, throughput.firstTaskTime,
+                throughput.lastCompletionTime, throughput.predictedFinishTime);
+        }
+    }
+    if (m_scene.getSize() > 0) {
+        printf(
+            "Scene: sent %.3f [MB] in %u chunks\n",
+            m_numSentSceneBytes / (1024.0 * 1024.0), m_numSentSceneChunks);
+    }
+    if (m_grantLatencyHistogram.getCount() > 0) {
+        printf(
+            "Grant latency: %llu grants, median %.3f [ms], p99 %.3f [ms]\n",
+            static_cast<unsigned long long>(m_grantLatencyHistogram.getCount()),
+            m_grantLatencyHistogram.estimateQuantile(0.5) * 1e+3,
+            m_grantLatencyHistogram.estimateQuantile(0.99) * 1e+3);
+    }
+    if (m_metricsEndpoint)
+        printf("Metrics: served %u scrapes\n", m_metricsEndpoint->getNumScrapes());
+}
+
+
+
+template <typename Message>
+void Session::reply(const Message &message, uint32_t sequenceID) {
+    std::unique_ptr<MessageWriter> writer = m_sendQueue.acquire();
+    writer->encode(message, sequenceID);
+    m_traffic.numSentBytes.fetch_add(writer->getMessageSize(), std::memory_order_relaxed);
+    m_sendQueue.push(std::move(writer));
+}
+
+Session::~Session() {
+    printf(
+        "Quit the session with %s:%u.\n",
+        m_clientEndpoint.address().to_string().c_str(),
+        static_cast<uint32_t>(m_clientEndpoint.port()));
+}
+
+void Session::start() {
+    using asio::ip::tcp;
+    printf(
+        "Start a session with %s:%u.\n",
+        m_clientEndpoint.address().to_string().c_str(),
+        static_cast<uint32_t>(m_clientEndpoint.port()));
+    m_socket.set_option(tcp::no_delay(true));
+
+    // セッションID送信。要求への応答ではないのでシーケンスIDは0。
+    SessionIDMessage message;
+    message.sessionID = m_ID;
+    reply(message, 0);
+
+    asio::co_spawn(m_socket.get_executor(), readLoop(shared_from_this()), rethrowException);
+    asio::co_spawn(m_socket.get_executor(), writeLoop(shared_from_this()), rethrowException);
+}
+
+void Session::close() {
+    asio::error_code ec;
+    m_socket.close(ec);
+    m_sendQueue.stop();
+}
+
+asio::awaitable<void> Session::writeLoop([[maybe_unused]] std::shared_ptr<Session> self) {
+    co_await m_sendQueue.run();
+    // 書き込みに失敗した場合は受信側も切断で終わらせる。終了後は積んであった応答を送り終えてから閉じる。
+    close();
+    end();
+}
+
+void Session::serveTaskRequest(
+    uint32_t sequenceID, const RenderTaskRequestMessage &request, hires_clock::time_point requestTp) {
+    // 保留していた間に切断している。
+    if (m_isEnded)
+        return;
+
+    RenderTaskMessage message;
+    const Server::TaskGrant grant = m_server.popRenderTasks(
+        m_ID, request.numTasks, request.numSamples, message.tasks);
+    if (grant == Server::TaskGrant::Wait) {
+        // 渡せるタスクができるまで応答を保留する。その間も他の要求やタイルは受け取り続ける。
+        auto self(shared_from_this());
+        m_server.waitForTasks(
+            [this, self, sequenceID, request, requestTp]() {
+                serveTaskRequest(sequenceID, request, requestTp);
+            });
+        return;
+    }
+
+    // レンダータスク送信。
+    m_server.recordGrantLatency(requestTp);
+    reply(message, sequenceID);
+}
+
+void Session::end() {
+    if (m_isEnded)
+        return;
+    m_isEnded = true;
+    m_sendQueue.finish();
+    m_server.releaseSession(m_ID);
+}
+
+bool Session::receiveTile(const TileResultMessage &message, uint64_t numWireBytes) {
+    FrameAssembler* assembler = m_server.getFrameAssembler();
+    if (!assembler)
+        return false;
+
+    const void* pixels = message.data;
+    if (message.encoding == TileEncoding::Png) {
+        TraceScope traceScope("encode", "tile png decode", message.frameIndex);
+        uint32_t width, height, numChannels;
+        const int ret = fpng::fpng_decode_memory(
+            message.data, message.dataSize, m_decodedTile, width, height, numChannels, 4);
+        if (ret != fpng::FPNG_DECODE_SUCCESS || width != message.width || height != message.height)
+            return false;
+        pixels = m_decodedTile.data();
+    }
+
+    if (!assembler->addTile(
+        message.frameIndex, message.x, message.y, message.width, message.height,
+        pixels, numWireBytes))
+        return false;
+    m_server.onTaskResult(message.taskID, m_ID);
+    return true;
+}
+
+// 要求には送信キューに応答を積むだけで、書き込みを待たずに次のメッセージを読む。
+bool Session::handleMessage(const MessageHeader &header, const WireReader &payload) {
+    if (header.type == MessageType::ServerStateRequest) {
+        ServerStateRequestMessage request;
+        if (!decodeMessage(header, payload, request))
+            return false;
+        // サーバー状態送信。
+        ServerStateMessage message;
+        message.state = m_server.getState();
+        reply(message, header.sequenceID);
+    }
+    else if (header.type == MessageType::ClockSyncRequest) {
+        ClockSyncRequestMessage request;
+        if (!decodeMessage(header, payload, request))
+            return false;
+        ClockSyncMessage message;
+        message.serverTime = getTraceTime();
+        reply(message, header.sequenceID);
+    }
+    else if (header.type == MessageType::SceneInfoRequest) {
+        SceneInfoRequestMessage request;
+        if (!decodeMessage(header, payload, request))
+            return false;
+        SceneInfoMessage message;
+        m_server.getSceneInfo(message);
+        reply(message, header.sequenceID);
+    }
+    else if (header.type == MessageType::SceneChunkRequest) {
+        SceneChunkRequestMessage request;
+        SceneChunkMessage message;
+        if (!decodeMessage(header, payload, request) ||
+            !m_server.getSceneChunk(request.offset, request.size, message))
+            return false;
+        reply(message, header.sequenceID);
+    }
+    else if (header.type == MessageType::RenderTaskRequest) {
+        RenderTaskRequestMessage request;
+        if (!decodeMessage(header, payload, request))
+            return false;
+        serveTaskRequest(header.sequenceID, request, hires_clock::now());
+    }
+    else if (header.type == MessageType::TileResult) {
+        // 応答は返さない。
+        TileResultMessage message;
+        if (!decodeMessage(header, payload, message) ||
+            !receiveTile(message, g_messageHeaderSize + header.payloadSize))
+            return false;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+asio::awaitable<void> Session::readLoop([[maybe_unused]] std::shared_ptr<Session> self) {
+    while (true) {
+        MessageHeader header;
+        WireReader payload;
+        const asio::error_code ec = co_await coReadMessage(m_socket, m_reader, header, payload);
+        if (ec) {
+            if (ec == asio::error::invalid_argument)
+                printf("Session %u: received a malformed message.\n", m_ID);
+            break;
+        }
+        m_traffic.numReceivedBytes.fetch_add(g_messageHeaderSize + header.payloadSize, std::memory_order_relaxed);
+
+        if (header.type == MessageType::FinishSignal) {
+            FinishSignalMessage message;
+            if (decodeMessage(header, payload, message))
+                break;
+        }
+        else if (handleMessage(header, payload)) {
+            continue;
+        }
+        printf(
+            "Session %u: unexpected message (type %u, %u bytes).\n",
+            m_ID, static_cast<uint32_t>(header.type), header.payloadSize);
+        break;
+    }
+    end();
+}
+
+
+
+int32_t runServer(
+    const std::string &serverPort, uint32_t taskTileSize, const RenderSettings &settings,
+    std::unique_ptr<FrameStreamWriter> streamWriter) {
+    using asio::ip::tcp;
+
+    try {
+        printf("Start server.\n");
+        asio::io_context ioContext;
+        constexpr uint32_t numFrames = 256;
+        RenderWorker localWorker(settings);
+        // パイプラインより先に作り、後に破棄する。
+        CheckpointManifest checkpoint;
+
+        // 全ノードのタイルをここで組み立て、フレーム番号順に書き出す。
+        FramePipeline pipeline(settings.numFramebuffers, settings.numEncoderThreads);
+        pipeline.setCrashAfterNumFrames(settings.crashAfterNumFrames);
+        if (settings.numPngStripeRows > 0)
+            pipeline.setStripedPngEncoding(&localWorker.getThreadPool(), settings.numPngStripeRows);
+        if (settings.autoSelectEncoder) {
+            const DeadlineScheduler::Settings &schedulerSettings = settings.schedulerSettings;
+            pipeline.setEncoderCandidates(
+                createImageEncodersOfAllBackends(settings.encoderSettings),
+                (schedulerSettings.timeLimit - schedulerSettings.safetyMargin) / numFrames);
+        }
+        else {
+            pipeline.setEncoder(createImageEncoder(settings.encoderSettings));
+        }
+        const bool isStreamOutput = streamWriter != nullptr;
+        if (isStreamOutput)
+            pipeline.setStreamOutput(std::move(streamWriter));
+        FrameAssembler assembler(pipeline, g_frameWidth, g_frameHeight, numFrames);
+
+        std::vector<double> frameCosts;
+        if (!settings.costHintPath.empty() &&
+            !loadFrameCostProfile(settings.costHintPath.c_str(), numFrames, frameCosts))
+            frameCosts.clear();
+
+        Server server(
+            ioContext, static_cast<uint32_t>(atoi(serverPort.c_str())), numFrames, taskTileSize, &assembler,
+            settings.leaseTimeout, frameCosts);
+        if (!settings.scenePath.empty())
+            server.loadScene(settings.scenePath);
+        // ストリームは書き出したフレームの続きから書き足せないので、ストリーム出力の場合は記録しない。
+        if (!settings.checkpointPath.empty() && isStreamOutput)
+            printf("Ignore --checkpoint: a stream output cannot be resumed.\n");
+        if (!settings.checkpointPath.empty() && !isStreamOutput) {
+            checkpoint.open(
+                settings.checkpointPath,
+                CheckpointParams{ g_frameWidth, g_frameHeight, server.getSceneContentHash() });
+            server.skipWrittenFrames(checkpoint);
+            pipeline.setCheckpointManifest(&checkpoint);
+        }
+
+        if (settings.metricsPort > 0)
+            server.startMetricsEndpoint(ioContext, static_cast<uint16_t>(settings.metricsPort));
+
+        // サーバーPCでもレンダリングする。タスクはソケットを通さずサーバーのキューから直接受け取る。
+        server.attachLocalWorker(ioContext, localWorker);
+
+        ioContext.run();
+        localWorker.stop();
+        localWorker.finish();
+
+        assembler.finish();
+        assembler.printStats();
+        assembler.writeLog("assembly_log.csv");
+        pipeline.finish();
+        pipeline.printStats();
+        server.printStats();
+        if (checkpoint.isOpen()) {
+            checkpoint.close();
+            checkpoint.printStats();
+        }
+        if (isTracingEnabled())
+            writeTrace("trace_primary.json", 0, "primary", 0);
+        printf("Quit server.\n");
+    }
+    catch (std::exception &e) {
+        printf("%s\n", e.what());
+        return -1;
+    }
+
+    return 0;
+}
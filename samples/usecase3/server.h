@@ -0,0 +1,294 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <optional>
+
+// https://think-async.com/Asio/index.html
+#define ASIO_STANDALONE
+#include <asio.hpp>
+
+#include "protocol.h"
+#include "frame_assembler.h"
+#include "mapped_file.h"
+#include "metrics.h"
+#include "metrics_endpoint.h"
+#include "checkpoint_manifest.h"
+#include "render_worker.h"
+#include "usecase3.h"
+
+class Server;
+
+// 全セッションで合計した通信量。実行中にメトリクスとして読む。
+struct TrafficCounters {
+    std::atomic<uint64_t> numReceivedBytes = 0;
+    std::atomic<uint64_t> numSentBytes = 0;
+};
+
+class Session : public std::enable_shared_from_this<Session> {
+    Server &m_server;
+    TrafficCounters &m_traffic;
+    uint32_t m_ID;
+    MessageReader m_reader;
+    std::vector<uint8_t> m_decodedTile;
+    asio::ip::tcp::socket m_socket;
+    // 受信を止めずに応答を返すため、送信は別のコルーチンが担う。
+    MessageSendQueue m_sendQueue;
+    // 切断後はremote_endpoint()が使えないので控えておく。
+    asio::ip::tcp::endpoint m_clientEndpoint;
+    bool m_isEnded;
+
+    template <typename Message>
+    void reply(const Message &message, uint32_t sequenceID);
+
+    // selfはループが終わるまでセッションを生かしておくために受け取る。
+    asio::awaitable<void> readLoop(std::shared_ptr<Session> self);
+    asio::awaitable<void> writeLoop(std::shared_ptr<Session> self);
+    bool handleMessage(const MessageHeader &header, const WireReader &payload);
+    // requestTpは要求が届いた時刻で、応答を保留した時間も含めて応答までの時間を測る。
+    void serveTaskRequest(
+        uint32_t sequenceID, const RenderTaskRequestMessage &request, hires_clock::time_point requestTp);
+    bool receiveTile(const TileResultMessage &message, uint64_t numWireBytes);
+    void end();
+
+public:
+    Session(Server &server, TrafficCounters &traffic, uint32_t id, asio::ip::tcp::socket socket) :
+        m_server(server), m_traffic(traffic), m_ID(id), m_socket(std::move(socket)), m_sendQueue(m_socket),
+        m_isEnded(false) {
+        m_clientEndpoint = m_socket.remote_endpoint();
+    }
+    ~Session();
+
+    void start();
+
+    void close();
+};
+
+
+
+class Server {
+public:
+    enum class TaskGrant {
+        Granted = 0,
+        // 今は渡せるタスクが無いが、他のノードのリースが切れれば再発行される。
+        Wait,
+        // 全てのタスクが完了した。
+        Finished,
+    };
+
+private:
+    // 配ったタスクの貸し出し状態。結果が届くまで保持し、期限切れや切断でキューに戻す。
+    struct Lease {
+        RenderTask task;
+        // このタスクを描いているセッション。投機的な複製を配った場合は複数になる。
+        std::vector<uint32_t> holders;
+        hires_clock::time_point issuedTp;
+        hires_clock::time_point deadline;
+        bool isReissued;
+        // 期限切れや切断でキューに戻っている。
+        bool isQueued;
+    };
+
+    // セッションごとの処理速度の見積もり。コストはフレーム全体を1とし、コストヒントがあればその比を掛ける。
+    struct SessionThroughput {
+        hires_clock::time_point firstGrantTp;
+        // 起動から最初のタスクを渡すまでの時間[s]。
+        double firstTaskTime;
+        double completedCost;
+        uint32_t numCompletedTasks;
+        // 最後に結果が届いた時刻と、最後に見積もった完了予定時刻。いずれも起動からの秒数。
+        double lastCompletionTime;
+        double predictedFinishTime;
+        bool isActive;
+    };
+
+    ServerState m_state;
+    asio::ip::tcp::acceptor m_acceptor;
+    std::vector<RenderTask> m_allTasks;
+    std::deque<uint32_t> m_taskQueue;
+    // フレームごとの相対コストと、キューに残っているタスクのコストの合計。
+    std::vector<double> m_frameCosts;
+    // フレームごとに固定したサンプル数。0はまだ決まっていない。
+    std::vector<uint32_t> m_frameNumSamples;
+    double m_queuedCost;
+    std::vector<bool> m_isTaskCompleted;
+    uint32_t m_numCompletedTasks;
+    std::map<uint32_t, Lease> m_leases;
+    uint32_t m_nextSessionID;
+    std::map<uint32_t, std::weak_ptr<Session>> m_sessions;
+    // タスクが無くて応答を保留しているリクエスト。状況が変わったら呼び直す。
+    std::vector<std::function<void()>> m_taskWaiters;
+
+    // リースの期限。0の場合はタスクの所要時間の実測から決める。
+    double m_fixedLeaseTimeout;
+    double m_taskTurnaroundTime;
+    bool m_hasTurnaroundMeasurement;
+    asio::steady_timer m_leaseTimer;
+    asio::steady_timer m_shutdownTimer;
+
+    std::map<uint32_t, SessionThroughput> m_sessionThroughputs;
+    asio::steady_timer m_scheduleLogTimer;
+    uint32_t m_numShrunkGrants;
+
+    // 実行中に読めるメトリクス。ページはio_contextのスレッドで作るので、サーバーの状態はそのまま読む。
+    TrafficCounters m_traffic;
+    // タスク要求が届いてから応答するまでの時間。
+    LatencyHistogram m_grantLatencyHistogram;
+    std::unique_ptr<MetricsEndpoint> m_metricsEndpoint;
+
+    uint32_t m_numIssuedTasks;
+    uint32_t m_numExpiredLeases;
+    uint32_t m_numDroppedLeases;
+    uint32_t m_numSpeculativeCopies;
+    uint32_t m_numRedundantResults;
+    // 前回の実行で書き出し済みのフレームの分。完了数に含める。
+    uint32_t m_numSkippedTasks;
+
+    // 描き終えたタイルの組み立て先。タスク配布の計測だけの場合はnullptrで、結果を待たずに配り切る。
+    FrameAssembler* m_frameAssembler;
+
+    // 同じプロセス内のレンダリングスレッド。TCPを介さずにキューから直接タスクを渡す。
+    RenderWorker* m_localWorker;
+    uint32_t m_localWorkerID;
+    bool m_isLocalWorkerWaiting;
+    std::optional<asio::executor_work_guard<asio::io_context::executor_type>> m_localWorkGuard;
+    std::vector<RenderTask> m_localTasks;
+
+    // 準備段階でクライアントに配るシーンデータ。ファイルをマップしてチャンクごとに送る。
+    MappedFile m_scene;
+    uint64_t m_sceneContentHash;
+    uint64_t m_numSentSceneBytes;
+    uint32_t m_numSentSceneChunks;
+
+    void registerAccept();
+
+    double getLeaseTimeout() const;
+
+    void registerLeaseCheck();
+
+    // 期限切れや切断で戻したタスクは他より先に配る。
+    void requeue(Lease &lease);
+
+    double getTaskCost(const RenderTask &task) const {
+        return m_frameCosts[task.frameIndex] * task.width * task.height / (g_frameWidth * g_frameHeight);
+    }
+
+    // 結果が届いたコストを最初のタスクを渡してからの時間で割った処理速度[コスト/s]。
+    // まだ結果が無いセッションは負の値を返す。
+    static double estimateThroughput(const SessionThroughput &throughput, hires_clock::time_point now);
+
+    // 稼働中の全セッションの処理速度の合計。見積もりの無いセッションは見積もりのあるセッションの平均とみなす。
+    // sessionThroughputには指定したセッションの分を返す。
+    double estimateTotalThroughput(
+        uint32_t sessionID, hires_clock::time_point now, double* sessionThroughput) const;
+
+    // ガイド付き自己スケジューリングで1回に渡すコストの上限を決める。
+    // 残りのコストを処理速度の比で按分した分の半分とし、序盤は要求どおりの大きなまとまりで、
+    // 終盤は小さく刻んで渡す。遅いノードほど小さくなるので、最後のタスクが遅いノードに残りにくい。
+    double decideMaxGrantCost(uint32_t sessionID, hires_clock::time_point now) const;
+
+    // 各セッションの手持ちを描き終え、キューの残りを全体の速度で消化し終える時刻を見積もって表示する。
+    void registerScheduleLog();
+
+    void wakeTaskWaiters();
+
+    void finishIfDone();
+
+    void completeTask(uint32_t taskID, uint32_t sessionID);
+
+public:
+    // taskTileSizeが0の場合はフレーム単位、それ以外はフレームをタイルに分割してタスクを作る。
+    // leaseTimeoutは結果を待つ期限[s]で、0の場合は実測から決める。
+    // frameCostsはフレームごとの相対コストのヒントで、空でなければコストの高いフレームから配る。
+    Server(
+        asio::io_context &ioContext, uint32_t port, uint32_t numFrames, uint32_t taskTileSize,
+        FrameAssembler* frameAssembler, double leaseTimeout = 0.0,
+        const std::vector<double> &frameCosts = {});
+
+    ~Server();
+
+    // io_contextを回す前に呼ぶ。
+    void loadScene(const std::string &path);
+
+    void getSceneInfo(SceneInfoMessage &info) const;
+
+    // シーンデータの範囲外や大き過ぎる要求はfalseを返す。
+    bool getSceneChunk(uint64_t offset, uint32_t size, SceneChunkMessage &chunk);
+
+    FrameAssembler* getFrameAssembler() const {
+        return m_frameAssembler;
+    }
+
+    uint64_t getSceneContentHash() const {
+        return m_sceneContentHash;
+    }
+
+    // 前回の実行で書き出し済みのフレームのタスクを完了扱いにしてキューから除く。io_contextを回す前に呼ぶ。
+    // 記録はフレーム単位なので、前回一部のタイルだけが届いていたフレームは全てのタイルを配り直す。
+    void skipWrittenFrames(const CheckpointManifest &checkpoint);
+
+    // ローカルワーカーにもセッションIDを割り当て、リモートのセッションと同じ条件でタスクを取り合わせる。
+    void attachLocalWorker(asio::io_context &ioContext, RenderWorker &worker);
+
+    ServerState getState() const {
+        return m_state;
+    }
+
+    uint32_t getNumTasks() const {
+        return static_cast<uint32_t>(m_allTasks.size());
+    }
+
+    uint32_t getNumCompletedTasks() const {
+        return m_numCompletedTasks;
+    }
+
+    // 期限切れで他のノードに回したタスクの数。
+    uint32_t getNumExpiredLeases() const {
+        return m_numExpiredLeases;
+    }
+
+    // 切断したセッションから他のノードに回したタスクの数。
+    uint32_t getNumDroppedLeases() const {
+        return m_numDroppedLeases;
+    }
+
+    // sessionIDのセッションに最大numRequestedTasks個のタスクを貸し出す。
+    // 渡す量はセッションの処理速度と残りのコストから決め、終盤ほど要求より少なくなる。
+    // キューが空の場合は、まだ結果の届いていない古いタスクの複製を配り、遅いノードの完了を待たずに済ませる。
+    // Finishedの場合は無効なタスクをひとつ返す。
+    TaskGrant popRenderTasks(
+        uint32_t sessionID, uint32_t numRequestedTasks, uint32_t proposedNumSamples, std::vector<RenderTask> &tasks);
+
+    // Waitだった場合に、渡せるタスクができるか全て完了した時点でwaiterを呼ぶ。
+    void waitForTasks(std::function<void()> waiter) {
+        m_taskWaiters.push_back(std::move(waiter));
+    }
+
+    // セッションが描いたタイルの結果が届いた。
+    void onTaskResult(uint32_t taskID, uint32_t sessionID) {
+        completeTask(taskID, sessionID);
+    }
+
+    // 切断したセッションの描きかけのタスクを他のノードに回す。
+    void releaseSession(uint32_t sessionID);
+
+    // リモートのクライアントがリクエストを送る条件と同じく、手元のタスクが先読み数を下回ったら補充する。
+    // セッションのリクエストと同じio_contextのスレッドで処理されるので到着順に公平に配られる。
+    void feedLocalWorker();
+
+    // 127.0.0.1のportでメトリクスを返す。io_contextを回す前に呼ぶ。
+    void startMetricsEndpoint(asio::io_context &ioContext, uint16_t port);
+
+    void recordGrantLatency(hires_clock::time_point requestTp);
+
+    // 実行中の状態をPrometheusのテキスト形式で返す。io_contextのスレッドから呼ぶ。
+    std::string formatMetrics() const;
+
+    void printStats() const;
+};
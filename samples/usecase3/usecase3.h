@@ -0,0 +1,99 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <chrono>
+
+#include "deadline_scheduler.h"
+#include "image_encoder.h"
+#include "frame_stream.h"
+
+// usecase3の各モードで共有する設定と入口。
+
+using hires_clock = std::chrono::high_resolution_clock;
+
+// レンダラーの起動時刻。main()の最初に設定する。
+extern hires_clock::time_point g_appStartTp;
+
+static constexpr uint32_t g_frameWidth = 256;
+static constexpr uint32_t g_frameHeight = 256;
+
+enum class FaultMode {
+    None = 0,
+    Kill,
+    Stall,
+    // プロセス内の試験用。プロセスを落とす代わりに接続を切り、以降のタイルを捨てる。
+    Disconnect,
+};
+
+struct RenderSettings {
+    uint32_t numThreads = 0;
+    uint32_t numFramebuffers = 3;
+    uint32_t numEncoderThreads = 2;
+    uint32_t numPngStripeRows = 0;
+    DeadlineScheduler::Settings schedulerSettings;
+    // 1回のリクエストでまとめて受け取るタスク数。0の場合はタスクの大きさとスレッド数から決める。
+    uint32_t numTasksPerRequest = 0;
+    // 描画中のタスクとは別に手元に確保しておくタスク数。0の場合は手が空いてから次を要求する。
+    uint32_t prefetchDepth = 1;
+    // 応答を待たずに重ねて出しておけるタスク要求の数。
+    uint32_t numTaskRequestsInFlight = 2;
+    // 別々のタスクを同時に描くレンダリングスレッドの数。タスク内のタイルはどれも共有のスレッドプールで描く。
+    uint32_t numRenderSlots = 1;
+    // 描き終えたタイルをPNGに圧縮してからサーバーに送る。
+    bool compressTiles = false;
+    // サーバーが結果を待つ期限[s]。過ぎたタスクは他のノードに回す。0の場合は実測から決める。
+    double leaseTimeout = 0.0;
+    // 障害時の再発行を確かめるため、クライアントがfaultAfterNumTasks個のタイルを送った後に異常終了または停止する。
+    FaultMode faultMode = FaultMode::None;
+    uint32_t faultAfterNumTasks = 0;
+    // サーバーが準備段階でクライアントに配るシーンデータのファイル。空の場合は配らない。
+    std::string scenePath;
+    // フレームごとの相対コストのCSV。指定した場合はコストの高いフレームのタスクから配る。
+    std::string costHintPath;
+    // クライアントが受け取ったシーンデータを置くディレクトリ。同じ内容なら次回以降は転送を省く。
+    std::string sceneCacheDir = "scene_cache";
+    // 各スレッドの処理をChrome trace形式で書き出す。
+    bool enableTrace = false;
+    // レンダリングのワーカーをNUMAノードごとに固定し、タイルの描画先は描いたワーカーのノードに置く。
+    bool enableNuma = false;
+    bool useHugePages = false;
+    // サーバーが出力画像に使うエンコーダー。autoSelectEncoderの場合は最初のフレームで各バックエンドを試して選ぶ。
+    bool autoSelectEncoder = false;
+    EncoderSettings encoderSettings;
+    // サーバーが画像ファイルの代わりに全フレームを書き出すストリーム。".y4m"ならY4M、"-"なら標準出力。
+    std::string streamOutputPath;
+    // ストリームで順番を待つために保持するフレーム数。
+    uint32_t streamReorderWindow = 4;
+    // サーバーが実行中の状態をPrometheus形式で返すローカルのポート。0の場合は返さない。
+    uint32_t metricsPort = 0;
+    // 書き出し済みのフレームの記録。再起動した場合は記録にあるフレームを飛ばす。空の場合は記録しない。
+    std::string checkpointPath;
+    // 再開を確かめるため、サーバーがこの数のフレームを書き出しに回した時点でプロセスを落とす。
+    uint32_t crashAfterNumFrames = 0;
+};
+
+int32_t runClient(
+    const std::string &serverIP, const std::string &serverPort, const RenderSettings &settings);
+int32_t runServer(
+    const std::string &serverPort, uint32_t taskTileSize, const RenderSettings &settings,
+    std::unique_ptr<FrameStreamWriter> streamWriter);
+int32_t runDispatchBenchmark(const std::string &serverPort, uint32_t taskTileSize);
+
+// ループバック上で多数の模擬クライアントを同時に接続する負荷試験の設定。
+struct LoadTestSettings {
+    uint32_t numClients = 0;
+    uint32_t numTasksPerRequest = 1;
+    // 受け取ったタスク1個あたりの模擬レンダリング時間[ms]。スリープで待つのでCPUは使わない。
+    double renderTimePerTask = 1.0;
+    // リクエストを送る前に待つ時間[ms]。ネットワーク越しの往復の遅れを模す。
+    double injectedLatency = 0.0;
+};
+
+int32_t runLoadTest(const std::string &serverPort, uint32_t taskTileSize, const LoadTestSettings &settings);
+
+// プロセス内のサーバーとnumClients台のクライアントで、1台が途中で障害を起こしても全フレームが揃うか確かめる。
+// 揃わなかった場合は0以外を返す。
+int32_t runFaultTest(
+    const std::string &serverPort, uint32_t taskTileSize, uint32_t numClients, const RenderSettings &settings);
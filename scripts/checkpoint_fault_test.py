@@ -0,0 +1,104 @@
+import sys
+import shutil
+import re
+import subprocess
+import tempfile
+from pathlib import Path
+
+# usecase2をチェックポイント付きで途中で落として再起動し、落ちなかった場合と比べて余分に描いたフレーム数が上限内か確かめる。
+# 使い方: python checkpoint_fault_test.py <usecase2の実行ファイル> [フレーム数] [落とすまでのフレーム数] [フレームバッファ数] [エンコードスレッド数]
+#
+# 記録はフレーム単位で、画像ファイルを書き終えたフレームだけが残る。
+# 落ちた時点でパイプラインに入っていたフレームは描き直しになり、その数は次を越えない。
+#   エンコード待ちとエンコード中(フレームバッファ数) + 書き出し待ちの列が空くのを待つエンコード済み(エンコードスレッド数)
+#   + 書き出し待ち(フレームバッファ数) + 書き出し中(1)
+# よって2回の実行で描いたフレームの合計は、落ちなかった場合のフレーム数にこの上限を足した数以下になる。
+
+def run_usecase2(exe_path, working_dir, args):
+    cmd = [str(exe_path)] + args
+    print(' '.join(cmd))
+    return subprocess.run(cmd, cwd=working_dir, capture_output=True, text=True, timeout=600)
+
+# 描画を始めたフレームの番号を返す。
+def get_rendered_frames(stdout):
+    return [int(m) for m in re.findall(r'Frame (\d+) \(', stdout)]
+
+def count_missing_frames(output_dir, num_frames):
+    missing = 0
+    for frame_index in range(num_frames):
+        path = output_dir / f'{frame_index:03}.png'
+        if not path.is_file() or path.stat().st_size == 0:
+            missing += 1
+    return missing
+
+def run():
+    exe_path = Path(sys.argv[1]).resolve()
+    num_frames = int(sys.argv[2]) if len(sys.argv) > 2 else 32
+    crash_after_frames = int(sys.argv[3]) if len(sys.argv) > 3 else num_frames // 2
+    num_framebuffers = int(sys.argv[4]) if len(sys.argv) > 4 else 3
+    num_encoder_threads = int(sys.argv[5]) if len(sys.argv) > 5 else 2
+    max_num_lost_frames = 2 * num_framebuffers + num_encoder_threads + 1
+
+    common_args = [
+        '--frame-range', '0', str(num_frames - 1),
+        '--framebuffers', str(num_framebuffers),
+        '--encoder-threads', str(num_encoder_threads),
+        '--spp-range', '1', '1']
+
+    failures = []
+    root_dir = Path(tempfile.mkdtemp(prefix='checkpoint_fault_test_'))
+    try:
+        # 落とさずに最後まで描く。
+        baseline_dir = root_dir / 'baseline'
+        baseline_dir.mkdir()
+        result = run_usecase2(exe_path, baseline_dir, common_args)
+        if result.returncode != 0:
+            failures.append(f'Crash-free run exited with {result.returncode}.')
+        num_baseline_frames = len(get_rendered_frames(result.stdout))
+
+        # crash_after_framesフレームを描き終えた時点で落とし、同じ記録で再起動する。
+        crash_dir = root_dir / 'crash'
+        crash_dir.mkdir()
+        checkpoint_args = ['--checkpoint', 'checkpoint.txt']
+        result = run_usecase2(
+            exe_path, crash_dir, common_args + checkpoint_args + ['--crash-after-frames', str(crash_after_frames)])
+        if result.returncode == 0:
+            failures.append('The run with an injected crash did not crash.')
+        crashed_frames = get_rendered_frames(result.stdout)
+
+        result = run_usecase2(exe_path, crash_dir, common_args + checkpoint_args)
+        if result.returncode != 0:
+            failures.append(f'Resumed run exited with {result.returncode}.')
+        resumed_frames = get_rendered_frames(result.stdout)
+        m = re.search(r'Checkpoint: (\d+)/(\d+) frames already written', result.stdout)
+        num_skipped_frames = int(m.group(1)) if m else 0
+
+        num_total_frames = len(crashed_frames) + len(resumed_frames)
+        num_lost_frames = num_total_frames - num_baseline_frames
+        print(f'Crash-free run: {num_baseline_frames} frames')
+        print(f'Crashed run: {len(crashed_frames)} frames, resumed run: {len(resumed_frames)} frames '
+              f'({num_skipped_frames} skipped by the checkpoint)')
+        print(f'Extra work: {num_lost_frames} frames (bound: {max_num_lost_frames})')
+
+        if num_baseline_frames != num_frames:
+            failures.append(f'Crash-free run rendered {num_baseline_frames}/{num_frames} frames.')
+        if num_skipped_frames == 0:
+            failures.append('The resumed run did not skip any frame.')
+        if num_lost_frames > max_num_lost_frames:
+            failures.append(f'Extra work {num_lost_frames} exceeds the bound {max_num_lost_frames}.')
+        # 描き直しを含めて全てのフレームを描いたか。
+        if set(crashed_frames) | set(resumed_frames) != set(range(num_frames)):
+            failures.append('Some frames were rendered in neither run.')
+        missing = count_missing_frames(crash_dir, num_frames)
+        if missing > 0:
+            failures.append(f'{missing} frames are missing after the resumed run.')
+    finally:
+        shutil.rmtree(root_dir, ignore_errors=True)
+
+    for failure in failures:
+        print('FAIL: ' + failure)
+    print('Checkpoint fault test ' + ('failed.' if failures else 'passed.'))
+    return 1 if failures else 0
+
+if __name__ == '__main__':
+    sys.exit(run())